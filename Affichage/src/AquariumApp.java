@@ -14,7 +14,11 @@ import javafx.util.Duration;
 import javafx.animation.Timeline;
 import javafx.animation.KeyFrame;
 import java.util.ArrayList;
+import java.util.HashMap;
+import java.util.HashSet;
 import java.util.List;
+import java.util.Map;
+import java.util.Set;
 import java.util.regex.Matcher;
 import java.util.regex.Pattern;
 import java.util.concurrent.Executors;
@@ -56,6 +60,9 @@ public class AquariumApp extends Application implements CustomEventListener {
     // Liste des poissons
     private List<Fish> fishes;
 
+    // Heure d'arrivée de la cible de chaque poisson lors du dernier instantané (transport "shm")
+    private final Map<String, Long> shmArrivals = new HashMap<>();
+
     // Constant update interval
     private static final int FPS = 24; // 24 FPS
 
@@ -181,6 +188,10 @@ public class AquariumApp extends Application implements CustomEventListener {
                         case "list":
                             extractFishElements(args);
                             break;
+                        case "aq":    // Datagramme renvoyé après un nack
+                        case "sync":  // État complet après un resync
+                            extractFishElements(projectToView(args));
+                            break;
                         case "bye":
                             if (args.equals("timeout")) {
                                 ConsolePrinter.println("NOK : le serveur a fermé la connexion");
@@ -191,6 +202,16 @@ public class AquariumApp extends Application implements CustomEventListener {
                             break;
                     }
                     break;
+                case "Udp":
+                    if (message.equals("aq")) {
+                        extractFishElements(projectToView(args));
+                    }
+                    break;
+                case "Shm":
+                    if (message.equals("world") && client.getWorldReader() != null) {
+                        applyWorldSnapshot(client.getWorldReader().getLatest());
+                    }
+                    break;
                 default:
                     break;
             }
@@ -198,6 +219,70 @@ public class AquariumApp extends Application implements CustomEventListener {
         });
     }
 
+    /**
+     * Projette des éléments en coordonnées de l'aquarium (canal multicast) sur notre vue
+     * @param input ["nom" at XxY,LxH,T] ... avec X et Y en pixels de l'aquarium
+     * @return Les mêmes éléments avec X et Y en pourcentage de la vue, comme dans "list"
+     */
+    private String projectToView(String input) {
+        if (viewWidth == 0 || viewHeight == 0) {
+            return ""; // Pas encore de greeting
+        }
+        Pattern pattern = Pattern.compile("\\[(\"[^\"]*\") at (-?\\d+)x(-?\\d+),");
+        Matcher matcher = pattern.matcher(input);
+        StringBuffer projected = new StringBuffer();
+        while (matcher.find()) {
+            int x = Integer.parseInt(matcher.group(2));
+            int y = Integer.parseInt(matcher.group(3));
+            int percentX = (int) ((x - viewOffsetX) * 100.0 / viewWidth);
+            int percentY = (int) ((y - viewOffsetY) * 100.0 / viewHeight);
+            matcher.appendReplacement(projected,
+                    Matcher.quoteReplacement("[" + matcher.group(1) + " at " + percentX + "x" + percentY + ","));
+        }
+        matcher.appendTail(projected);
+        return projected.toString();
+    }
+
+    /**
+     * Met à jour les poissons à partir de l'instantané en mémoire partagée
+     * <ul>
+     * <li> Un poisson dont l'heure d'arrivée a changé a reçu une nouvelle cible
+     * <li> Un poisson absent de l'instantané a été supprimé
+     * </ul>
+     * @param world Les poissons de l'aquarium, en coordonnées de l'aquarium
+     */
+    private void applyWorldSnapshot(List<ShmWorldReader.FishState> world) {
+        if (viewWidth == 0 || viewHeight == 0) {
+            return; // Pas encore de greeting
+        }
+        long nowMicros = System.currentTimeMillis() * 1000;
+        Map<String, Fish> byName = new HashMap<>();
+        for (Fish fish : fishes) {
+            byName.put(fish.getName(), fish);
+        }
+
+        Set<String> present = new HashSet<>();
+        for (ShmWorldReader.FishState state : world) {
+            present.add(state.name);
+            double targetX = (state.x - viewOffsetX) * windowWidth / viewWidth;
+            double targetY = (state.y - viewOffsetY) * windowHeight / viewHeight;
+            double secondsLeft = Math.max(0, (state.arrivalMicros - nowMicros) / 1_000_000.0);
+
+            Fish fish = byName.get(state.name);
+            if (fish == null) {
+                fish = new Fish(state.name, targetX, targetY, state.width, state.height, windowWidth, windowHeight, fishes.size());
+                fishes.add(fish);
+            } else if (Long.valueOf(state.arrivalMicros).equals(shmArrivals.get(state.name))) {
+                continue; // Même cible que lors du dernier instantané
+            }
+            shmArrivals.put(state.name, state.arrivalMicros);
+            fish.setTargetPosition(targetX, targetY, secondsLeft, FPS);
+        }
+
+        fishes.removeIf(fish -> !present.contains(fish.getName()));
+        shmArrivals.keySet().retainAll(present);
+    }
+
     private void handleGreeting(String args) {
         // Exemple d'args : "N1 0x0+600+800" ou "N1 100x200+600+800"
         try {
@@ -22,6 +22,12 @@ public class Client implements Runnable {
 
 	// Thread d'écoute des messages du serveur
 	private final CustomEventListener listener;
+
+	// Transport des mises à jour continues : "tcp" (getFishesContinuously), "multicast" (getFishesMulticast)
+	// ou "shm" (getFishesShm, mémoire partagée, affichage sur la même machine que le contrôleur)
+	private final String transport = System.getProperty("TRANSPORT", "tcp");
+	private MulticastReceiver multicastReceiver;
+	private ShmWorldReader worldReader;
 	
 	/**
 	 * Constructeur de la classe Client
@@ -67,59 +73,41 @@ public class Client implements Runnable {
 			Thread listenThread = new Thread(this::listenToServer);
 			listenThread.start();
 
-			// Envoyer les messages au serveur avec un petit délai
-			List<String> messages = Arrays.asList(
-				"getFishesContinuously\n",
-				"addFish PoissonPapillon at 9x52, 197x196, RandomWayPoint\n",
-				"addFish PoissonDiscus at 72x14, 104x103, RandomWayPoint\n",
-				"addFish PoissonClown at 87x98, 100x96, RandomWayPoint\n",
-				"addFish PoissonChirurgienJaune at 11x58, 138x138, RandomWayPoint\n",
-				"addFish PoissonFraiseVanille at 10x83, 372x361, RandomWayPoint\n",
-				"addFish PoissonBarbier at 78x43, 168x165, RandomWayPoint\n",
-				"addFish PoissonChirurgienMasque at 65x66, 166x163, RandomWayPoint\n",
-				"addFish PoissonIdoleMaure at 67x73, 160x144, RandomWayPoint\n",
-				"addFish PoissonPapillonRoyal at 65x98, 110x101, RandomWayPoint\n",
-				"addFish PoissonClown at 37x68, 55x53, RandomWayPoint\n",
-				"addFish PoissonDiscus at 43x11, 156x149, RandomWayPoint\n",
-				"addFish PoissonPapillon at 96x61, 122x118, RandomWayPoint\n",
-				"addFish PoissonBarbier at 17x65, 193x175, RandomWayPoint\n",
-				"addFish PoissonClown1 at 39x47, 72x65, RandomWayPoint\n",
-				"addFish PoissonClown2 at 84x19, 44x42, RandomWayPoint\n",
-				"addFish PoissonClown3 at 49x92, 60x56, RandomWayPoint\n",
-				"addFish PoissonClown4 at 91x13, 72x67, RandomWayPoint\n",
-				"addFish PoissonClown5 at 23x76, 43x42, RandomWayPoint\n",
-				"addFish PoissonClown6 at 45x75, 41x40, RandomWayPoint\n",
-				"addFish PoissonClown7 at 28x54, 46x43, RandomWayPoint\n",
-				"addFish PoissonClown8 at 82x38, 30x29, RandomWayPoint\n",
-				"addFish PoissonClown9 at 32x59, 36x33, RandomWayPoint\n",
-				"startFish PoissonClown1\n",
-				"startFish PoissonClown2\n",
-				"startFish PoissonClown3\n",
-				"startFish PoissonClown4\n",
-				"startFish PoissonClown5\n",
-				"startFish PoissonClown6\n",
-				"startFish PoissonClown7\n",
-				"startFish PoissonClown8\n",
-				"startFish PoissonClown9\n",
-				"startFish PoissonPapillon\n",
-				"startFish PoissonDiscus\n",
-				"startFish PoissonClown\n",
-				"startFish PoissonChirurgienJaune\n",
-				"startFish PoissonFraiseVanille\n",
-				"startFish PoissonBarbier\n",
-				"startFish PoissonChirurgienMasque\n",
-				"startFish PoissonIdoleMaure\n",
-				"startFish PoissonPapillonRoyal\n",
-				"startFish PoissonClown\n",
-				"startFish PoissonDiscus\n",
-				"startFish PoissonPapillon\n",
-				"startFish PoissonBarbier\n"
+			// Peupler l'aquarium en un seul aller-retour (addFishBatch + startAll)
+			List<String> fishes = Arrays.asList(
+				"PoissonPapillon at 9x52, 197x196, RandomWayPoint",
+				"PoissonDiscus at 72x14, 104x103, RandomWayPoint",
+				"PoissonClown at 87x98, 100x96, RandomWayPoint",
+				"PoissonChirurgienJaune at 11x58, 138x138, RandomWayPoint",
+				"PoissonFraiseVanille at 10x83, 372x361, RandomWayPoint",
+				"PoissonBarbier at 78x43, 168x165, RandomWayPoint",
+				"PoissonChirurgienMasque at 65x66, 166x163, RandomWayPoint",
+				"PoissonIdoleMaure at 67x73, 160x144, RandomWayPoint",
+				"PoissonPapillonRoyal at 65x98, 110x101, RandomWayPoint",
+				"PoissonClown at 37x68, 55x53, RandomWayPoint",
+				"PoissonDiscus at 43x11, 156x149, RandomWayPoint",
+				"PoissonPapillon at 96x61, 122x118, RandomWayPoint",
+				"PoissonBarbier at 17x65, 193x175, RandomWayPoint",
+				"PoissonClown1 at 39x47, 72x65, RandomWayPoint",
+				"PoissonClown2 at 84x19, 44x42, RandomWayPoint",
+				"PoissonClown3 at 49x92, 60x56, RandomWayPoint",
+				"PoissonClown4 at 91x13, 72x67, RandomWayPoint",
+				"PoissonClown5 at 23x76, 43x42, RandomWayPoint",
+				"PoissonClown6 at 45x75, 41x40, RandomWayPoint",
+				"PoissonClown7 at 28x54, 46x43, RandomWayPoint",
+				"PoissonClown8 at 82x38, 30x29, RandomWayPoint",
+				"PoissonClown9 at 32x59, 36x33, RandomWayPoint"
 			);
 
-			for (String message : messages) {
-				Thread.sleep(100); // Attendre 100ms entre chaque message
-				sendMessage(message);
+			if (transport.equals("multicast")) {
+				sendMessage("getFishesMulticast\n");
+			} else if (transport.equals("shm")) {
+				sendMessage("getFishesShm\n");
+			} else {
+				sendMessage("getFishesContinuously\n");
 			}
+			sendMessage("addFishBatch " + String.join("; ", fishes) + "\n");
+			sendMessage("startAll\n");
 
 			// Attendre que le thread d'écoute termine avant de fermer la connexion
 			listenThread.join(); // Cela bloque jusqu'à ce que listenToServer() soit terminé
@@ -174,7 +162,7 @@ public class Client implements Runnable {
 	 * </ul>
 	 */
 	private void listenToServer() {
-		List<String> msgs = Arrays.asList("greeting", "no", "list", "bye", "pong", "OK", "NOK");
+		List<String> msgs = Arrays.asList("greeting", "no", "list", "bye", "pong", "OK", "NOK", "aq", "sync");
 		String message;
 		try {
 			ConsolePrinter.println("Démarrage de l'écoute des messages du serveur...");
@@ -189,6 +177,24 @@ public class Client implements Runnable {
 					break;
 				}
 	
+				if (message.startsWith("OK multicast")) {
+					startMulticast(messageRest);
+					continue;
+				}
+				if (message.startsWith("OK shm")) {
+					startWorldReader(messageRest);
+					continue;
+				}
+
+				// "aq <seq> [...]" (renvoi d'un datagramme perdu) et "sync <seq> [...]" : retirer le numéro de séquence
+				if (messageFirstWord.equals("aq") || messageFirstWord.equals("sync")) {
+					String[] seqAndEntries = messageRest.split(" ", 2);
+					if (messageFirstWord.equals("sync") && multicastReceiver != null) {
+						multicastReceiver.resetSequence(Long.parseLong(seqAndEntries[0]));
+					}
+					messageRest = seqAndEntries.length > 1 ? seqAndEntries[1] : "";
+				}
+
 				if (msgs.contains(messageFirstWord)) {
 					notifyListener(new CustomEvent(messageFirstWord, messageRest, "Tcp"));
 				} else {
@@ -201,6 +207,54 @@ public class Client implements Runnable {
 		}
 	}
 
+	/**
+	 * Démarre l'écoute du canal multicast annoncé par le contrôleur
+	 * @param args "multicast &lt;groupe&gt; &lt;port&gt; &lt;seq&gt;"
+	 */
+	private void startMulticast(String args) {
+		try {
+			String[] parts = args.split(" ");
+			String group = parts[1];
+			int multicastPort = Integer.parseInt(parts[2]);
+			long seq = Long.parseLong(parts[3]);
+
+			multicastReceiver = new MulticastReceiver(group, multicastPort, seq, listener, this);
+			Thread multicastThread = new Thread(multicastReceiver);
+			multicastThread.setDaemon(true);
+			multicastThread.start();
+
+			// Récupérer l'état complet, les datagrammes suivants s'appliquent dessus
+			sendMessage("resync");
+		} catch (Exception e) {
+			ConsolePrinter.println("NOK: réponse multicast invalide " + args);
+		}
+	}
+
+	/**
+	 * Démarre la lecture de l'instantané en mémoire partagée annoncé par le contrôleur
+	 * @param args "shm &lt;nom&gt; &lt;capacité&gt;"
+	 */
+	private void startWorldReader(String args) {
+		try {
+			String[] parts = args.split(" ");
+			worldReader = new ShmWorldReader(parts[1], listener);
+			Thread readerThread = new Thread(worldReader);
+			readerThread.setDaemon(true);
+			readerThread.start();
+		} catch (Exception e) {
+			// Pas sur la même machine que le contrôleur : revenir aux mises à jour par TCP
+			ConsolePrinter.println("NOK: mémoire partagée indisponible (" + e.getMessage() + "), passage à getFishesContinuously");
+			sendMessage("getFishesContinuously");
+		}
+	}
+
+	/**
+	 * @return Le lecteur de l'instantané en mémoire partagée, null si le transport n'est pas "shm"
+	 */
+	public ShmWorldReader getWorldReader() {
+		return worldReader;
+	}
+
 	/**
 	 * Vérifie si le client est connecté au serveur
 	 * @return true si le client est connecté, false sinon
@@ -225,6 +279,10 @@ public class Client implements Runnable {
 				outputWriter.close();
 			if (socket != null)
 				socket.close();
+			if (multicastReceiver != null)
+				multicastReceiver.stop();
+			if (worldReader != null)
+				worldReader.stop();
 			ConsolePrinter.println("Client déconnecté.");
 
 			
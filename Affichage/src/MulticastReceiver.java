@@ -0,0 +1,117 @@
+import java.io.IOException;
+import java.net.DatagramPacket;
+import java.net.InetAddress;
+import java.net.InetSocketAddress;
+import java.net.MulticastSocket;
+import java.net.NetworkInterface;
+import java.nio.charset.StandardCharsets;
+
+/**
+ * La classe MulticastReceiver écoute le canal multicast du contrôleur
+ * <ul>
+ * <li> Reçoit les datagrammes "aq &lt;seq&gt; [...]" en coordonnées de l'aquarium
+ * <li> Détecte les datagrammes perdus grâce au numéro de séquence et demande
+ *      leur renvoi par TCP ("nack &lt;seq&gt;"), ou tout le monde ("resync") si trop ont été perdus
+ * <li> Notifie l'écouteur d'événements, qui projette les positions sur sa vue
+ * </ul>
+ */
+public class MulticastReceiver implements Runnable {
+
+	private static final int MAX_DATAGRAM = 65536;
+	private static final int MAX_NACKS = 16; // Au-delà, un resync coûte moins cher
+
+	private final String group;
+	private final int port;
+	private final CustomEventListener listener;
+	private final Client client;
+
+	private volatile boolean running = true;
+	private long lastSeq; // Dernier numéro de séquence appliqué
+
+	/**
+	 * Constructeur de la classe MulticastReceiver
+	 * @param group Adresse du groupe multicast
+	 * @param port Port du groupe multicast
+	 * @param firstSeq Numéro de séquence annoncé par le contrôleur lors de l'abonnement
+	 * @param listener L'écouteur d'événements
+	 * @param client Le client TCP, pour les demandes de renvoi
+	 */
+	public MulticastReceiver(String group, int port, long firstSeq, CustomEventListener listener, Client client) {
+		this.group = group;
+		this.port = port;
+		this.lastSeq = firstSeq;
+		this.listener = listener;
+		this.client = client;
+	}
+
+	/**
+	 * Une resynchronisation complète ("sync &lt;seq&gt;") remplace tout ce qui précède
+	 * @param seq Numéro de séquence de l'état reçu
+	 */
+	public synchronized void resetSequence(long seq) {
+		lastSeq = seq;
+	}
+
+	public void stop() {
+		running = false;
+	}
+
+	@Override
+	public void run() {
+		try (MulticastSocket socket = new MulticastSocket(port)) {
+			InetAddress groupAddress = InetAddress.getByName(group);
+			NetworkInterface loopback = NetworkInterface.getByInetAddress(InetAddress.getLoopbackAddress());
+			socket.joinGroup(new InetSocketAddress(groupAddress, port), loopback);
+			ConsolePrinter.println("Écoute multicast sur " + group + ":" + port);
+
+			byte[] buffer = new byte[MAX_DATAGRAM];
+			while (running) {
+				DatagramPacket packet = new DatagramPacket(buffer, buffer.length);
+				socket.receive(packet);
+				String datagram = new String(packet.getData(), 0, packet.getLength(), StandardCharsets.UTF_8).trim();
+				handleDatagram(datagram);
+			}
+		} catch (IOException e) {
+			System.err.println("Erreur multicast - " + e.getMessage());
+		}
+	}
+
+	/**
+	 * Traite un datagramme "aq &lt;seq&gt; [...]"
+	 * <ul>
+	 * <li> Ignore les doublons et les datagrammes déjà couverts par un resync
+	 * <li> Demande les datagrammes manquants avant d'appliquer celui-ci
+	 * </ul>
+	 */
+	private void handleDatagram(String datagram) {
+		String[] parts = datagram.split(" ", 3);
+		if (parts.length < 2 || !parts[0].equals("aq")) {
+			return;
+		}
+
+		long seq;
+		try {
+			seq = Long.parseLong(parts[1]);
+		} catch (NumberFormatException e) {
+			return;
+		}
+
+		synchronized (this) {
+			if (seq <= lastSeq) {
+				return; // Déjà appliqué
+			}
+			long missing = seq - lastSeq - 1;
+			if (missing > MAX_NACKS) {
+				client.sendMessage("resync");
+			} else {
+				for (long lost = lastSeq + 1; lost < seq; lost++) {
+					client.sendMessage("nack " + lost);
+				}
+			}
+			lastSeq = seq;
+		}
+
+		String entries = parts.length > 2 ? parts[2] : "";
+		listener.onCustomEvent(new CustomEvent("aq", entries, "Udp"));
+	}
+}
@@ -0,0 +1,151 @@
+import java.io.IOException;
+import java.lang.invoke.MethodHandles;
+import java.lang.invoke.VarHandle;
+import java.nio.ByteOrder;
+import java.nio.MappedByteBuffer;
+import java.nio.channels.FileChannel;
+import java.nio.charset.StandardCharsets;
+import java.nio.file.Path;
+import java.nio.file.Paths;
+import java.nio.file.StandardOpenOption;
+import java.util.ArrayList;
+import java.util.List;
+
+/**
+ * La classe ShmWorldReader lit l'instantané du monde publié par le contrôleur en mémoire partagée
+ * <ul>
+ * <li> Pour un affichage sur la même machine que le contrôleur : ni TCP, ni texte à analyser
+ * <li> La disposition de la mémoire est décrite dans Controleur/src/shm_world.h
+ * <li> Vérifie à chaque lecture que le contrôleur n'a pas réécrit la table lue (seqlock)
+ * </ul>
+ */
+public class ShmWorldReader implements Runnable {
+
+	// Disposition de la mémoire partagée (cf. shm_world.h)
+	private static final int MAGIC = 0x48535141;
+	private static final int LAYOUT_VERSION = 1;
+	private static final int HEADER_SIZE = 128;
+	private static final int OFFSET_CAPACITY = 8;
+	private static final int OFFSET_ENTRY_SIZE = 12;
+	private static final int OFFSET_SEQ = 24;
+	private static final int OFFSET_ACTIVE = 32;
+	private static final int OFFSET_TABLES = 40;
+	private static final int TABLE_INFO_SIZE = 16;
+	private static final int ENTRY_SIZE = 80;
+	private static final int NAME_OFFSET = 24;
+	private static final int NAME_LEN = 56;
+
+	private static final int POLL_MS = 10; // Une mise à jour du contrôleur
+	private static final int MAX_ATTEMPTS = 100;
+
+	private static final VarHandle LONGS = MethodHandles.byteBufferViewVarHandle(long[].class, ByteOrder.nativeOrder());
+
+	/** Un poisson de l'instantané, en coordonnées de l'aquarium */
+	public static class FishState {
+		public final String name;
+		public final int x, y, width, height;
+		public final long arrivalMicros; // Même horloge que System.currentTimeMillis()
+
+		FishState(String name, int x, int y, int width, int height, long arrivalMicros) {
+			this.name = name;
+			this.x = x;
+			this.y = y;
+			this.width = width;
+			this.height = height;
+			this.arrivalMicros = arrivalMicros;
+		}
+	}
+
+	private final MappedByteBuffer buffer;
+	private final int capacity;
+	private final CustomEventListener listener;
+	private volatile boolean running = true;
+	private volatile List<FishState> latest = new ArrayList<>();
+	private long lastSeq = 0;
+
+	/**
+	 * Constructeur de la classe ShmWorldReader
+	 * @param name Nom de la mémoire partagée annoncé par le contrôleur ("/aquarium_world")
+	 * @param listener L'écouteur d'événements, notifié à chaque nouvel instantané
+	 */
+	public ShmWorldReader(String name, CustomEventListener listener) throws IOException {
+		Path path = Paths.get("/dev/shm", name.startsWith("/") ? name.substring(1) : name);
+		try (FileChannel channel = FileChannel.open(path, StandardOpenOption.READ)) {
+			buffer = channel.map(FileChannel.MapMode.READ_ONLY, 0, channel.size());
+		}
+		buffer.order(ByteOrder.nativeOrder());
+		if (buffer.getInt(0) != MAGIC || buffer.getInt(4) != LAYOUT_VERSION || buffer.getInt(OFFSET_ENTRY_SIZE) != ENTRY_SIZE) {
+			throw new IOException("Disposition de la mémoire partagée inconnue");
+		}
+		this.capacity = buffer.getInt(OFFSET_CAPACITY);
+		this.listener = listener;
+	}
+
+	/** Dernier instantané cohérent lu */
+	public List<FishState> getLatest() {
+		return latest;
+	}
+
+	public void stop() {
+		running = false;
+	}
+
+	@Override
+	public void run() {
+		ConsolePrinter.println("Lecture de l'instantané en mémoire partagée");
+		while (running) {
+			long seq = (long) LONGS.getAcquire(buffer, OFFSET_SEQ);
+			if (seq >= 2 && seq != lastSeq) {
+				List<FishState> fishes = read();
+				if (fishes != null) {
+					latest = fishes;
+					listener.onCustomEvent(new CustomEvent("world", "", "Shm"));
+				}
+			}
+			try {
+				Thread.sleep(POLL_MS);
+			} catch (InterruptedException e) {
+				return;
+			}
+		}
+	}
+
+	/**
+	 * Lit la table active
+	 * @return Les poissons, ou null si le contrôleur a réécrit la table à chaque tentative
+	 */
+	private List<FishState> read() {
+		for (int attempt = 0; attempt < MAX_ATTEMPTS; attempt++) {
+			long seq = (long) LONGS.getAcquire(buffer, OFFSET_SEQ);
+			int active = buffer.getInt(OFFSET_ACTIVE) & 1;
+			VarHandle.acquireFence();
+			int count = Math.min(buffer.getInt(OFFSET_TABLES + active * TABLE_INFO_SIZE + 8), capacity);
+			int table = HEADER_SIZE + active * capacity * ENTRY_SIZE;
+
+			List<FishState> fishes = new ArrayList<>(count);
+			byte[] name = new byte[NAME_LEN];
+			for (int i = 0; i < count; i++) {
+				int entry = table + i * ENTRY_SIZE;
+				int len = 0;
+				while (len < NAME_LEN && buffer.get(entry + NAME_OFFSET + len) != 0) {
+					name[len] = buffer.get(entry + NAME_OFFSET + len);
+					len++;
+				}
+				fishes.add(new FishState(
+						new String(name, 0, len, StandardCharsets.UTF_8),
+						buffer.getInt(entry + 8), buffer.getInt(entry + 12),
+						buffer.getInt(entry + 16), buffer.getInt(entry + 20),
+						buffer.getLong(entry)));
+			}
+
+			// La table n'est réécrite qu'à partir de la deuxième valeur impaire qui suit
+			VarHandle.acquireFence();
+			long seqAfter = (long) LONGS.getOpaque(buffer, OFFSET_SEQ);
+			if (seqAfter <= (seq & ~1L) + 2) {
+				lastSeq = seq;
+				return fishes;
+			}
+		}
+		return null;
+	}
+}
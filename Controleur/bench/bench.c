@@ -0,0 +1,554 @@
+// Microbenchmarks of the hot paths of the controller, run in isolation on a synthetic aquarium.
+// Usage: bench [-q] [-f fish counts] [-v view counts] [-t ms per case] [-o results] [-b baseline] [-r %]
+//        bench -s hours [-f fishes] [-o results] [-b baseline] [-r %]
+//
+// Cases, each swept over the world it depends on:
+//   fish counts (-f, 10 to 1M, one view):
+//     create_fish_list_string     fish list of a view (getFishes, ls and the broadcast)
+//     update_fishes/scan          a tick where no fish arrives
+//     update_fishes/arrival       a tick where one fish arrives: scan, lists, send, pop
+//     add_n_fish_target_positions one target more for a fish (move function and append)
+//     add_fish/duplicate          addFish of an existing name, refused by the index
+//     dll/...                     doubly_linked_list.c on a list of that size
+//   view counts (-v, 1 to 10k, 1000 fishes):
+//     update_fishes/arrival       one list per view, sent to every view
+//     get_view_coordinates        one conversion, views taken in turn
+//     load_aquarium               parsing an aquarium file with that many views
+//
+// The subscribed views share one local socket, drained by a thread, so the sends are real
+// syscalls without the network. -q stops the sweeps at 10k fishes and 1k views.
+//
+// Results are printed as a table and, with -o, written as JSON (.json: one case per line) or
+// CSV (any other name). With -b, every case is compared with the same case of a baseline
+// written by -o: a case slower than the baseline by more than -r percent (default 10) is a
+// regression, and the exit status is 1 if there is one.
+//
+// -s runs a soak instead: the world of the first fish count (1000 by default, one view) is
+// ticked every SOAK_TICK_US on the virtual clock (see sim_clock.h) for that many simulated
+// hours, as fast as the ticks run. Every simulated hour, the tick cost, the positions queued
+// and the resident memory are printed, to see them grow over long horizons. The mean tick cost
+// is recorded as the case soak/tick.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "aquarium.h"
+#include "connection.h"
+#include "doubly_linked_list.h"
+#include "shared_buffer.h"
+#include "sim_clock.h"
+
+#define MAX_RESULTS 256
+#define MAX_SWEEP 16
+#define ROUNDS 5  // A case is timed ROUNDS times, the fastest round is kept
+#define BENCH_AQUARIUM "bench"
+#define BENCH_FILE ".bench"  // Aquarium file written in aquariums/ for load_aquarium
+#define BENCH_WIDTH 10000
+#define BENCH_HEIGHT 10000
+#define VIEW_SWEEP_FISHES 1000
+#define SOAK_TICK_US 10000  // Like the controller's tick
+#define SOAK_FISHES 1000
+
+typedef struct Result {
+    char name[64];
+    long fishes, views;
+    double ns_per_op;
+    long long ops;  // Operations of the kept round
+} Result;
+
+static Result results[MAX_RESULTS];
+static int nb_results = 0;
+static Result baseline[MAX_RESULTS];
+static int nb_baseline = 0;
+
+static double target_ms = 200;  // Time budget of a case
+static int sink_socket = -1;    // Socket of every connected view
+static volatile long long sink;  // Keeps the results of the pure cases alive
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// -------------------------- Runner --------------------------------
+
+// Runs ops operations of a case. ctx is the state of the case
+typedef void (*BenchBody)(void* ctx, long long ops);
+
+static void record(const char* name, long fishes, long views, double ns_per_op, long long ops) {
+    if (nb_results == MAX_RESULTS) return;
+    Result* r = &results[nb_results++];
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    r->fishes = fishes;
+    r->views = views;
+    r->ns_per_op = ns_per_op;
+    r->ops = ops;
+    printf("%-30s %9ld %7ld %14.1f %10lld\n", name, fishes, views, ns_per_op, ops);
+    fflush(stdout);
+}
+
+// Time body: the number of operations is doubled until a round takes a tenth of the budget,
+// then ROUNDS rounds of that size are run and the fastest one counts
+static void run_case(const char* name, long fishes, long views, BenchBody body, void* ctx) {
+    double round_ns = target_ms * 1e6 / (ROUNDS * 2);
+    long long ops = 1;
+    double elapsed;
+    for (;;) {
+        double start = now_ns();
+        body(ctx, ops);
+        elapsed = now_ns() - start;
+        if (elapsed >= round_ns / 4 || ops >= (1LL << 40)) break;
+        ops *= 2;
+    }
+    if (elapsed > 0 && elapsed < round_ns) ops = (long long)(ops * (round_ns / elapsed)) + 1;
+
+    double best = -1;
+    for (int round = 0; round < ROUNDS; round++) {
+        double start = now_ns();
+        body(ctx, ops);
+        double per_op = (now_ns() - start) / ops;
+        if (best < 0 || per_op < best) best = per_op;
+    }
+    record(name, fishes, views, best, ops);
+}
+
+// -------------------------- World --------------------------------
+
+static void* drain_sink(void* arg) {
+    int socket = *(int*)arg;
+    char buf[1 << 16];
+    while (read(socket, buf, sizeof(buf)) > 0) {
+    }
+    return NULL;
+}
+
+// One local socket for all the views, emptied by a thread
+static void open_sink() {
+    static int sockets[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0) {
+        perror("socketpair");
+        exit(1);
+    }
+    int size = 1 << 22;
+    setsockopt(sockets[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(sockets[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    pthread_t thread;
+    pthread_create(&thread, NULL, drain_sink, &sockets[1]);
+    pthread_detach(thread);
+    sink_socket = sockets[0];
+    conn_open(sink_socket);
+}
+
+// Replace the aquarium with fishes started fishes and views subscribed views tiling it
+static void build_world(long fishes, long views) {
+    lock_aquarium();
+    if (current_aquarium != NULL) destroy_aquarium();
+    create_aquarium(BENCH_AQUARIUM, BENCH_WIDTH, BENCH_HEIGHT);
+
+    long columns = 1;
+    while (columns * columns < views) columns++;
+    long rows = (views + columns - 1) / columns;
+    int view_w = BENCH_WIDTH / columns, view_h = BENCH_HEIGHT / rows;
+    for (long i = 0; i < views; i++) {
+        char name[MAX_NAME_LEN];
+        snprintf(name, sizeof(name), "N%ld", i + 1);
+        add_view(name, (i % columns) * view_w, (i / columns) * view_h, view_w, view_h, sink_socket);
+    }
+    for (Afficheur* view = current_aquarium->afficheurs; view != NULL; view = view->suivant) {
+        view->subscribed = true;
+    }
+
+    for (long i = 0; i < fishes; i++) {
+        char name[MAX_NAME_LEN];
+        snprintf(name, sizeof(name), "PoissonBench%ld", i);
+        try_add_fish(name, rand() % 101, rand() % 101, 50, 30, "RandomWayPoint");  // Percents of the first view
+    }
+    start_all_fishes();
+    update_fishes();  // Fills the positions of every fish
+    unlock_aquarium();
+}
+
+// -------------------------- Cases --------------------------------
+
+static void bench_fish_list(void* ctx, long long ops) {
+    (void)ctx;
+    lock_aquarium();
+    for (long long i = 0; i < ops; i++) {
+        SharedBuffer* list = create_fish_list_string(get_time_usec(), true, current_aquarium->afficheurs);
+        sink += list->len;
+        shared_buffer_unref(list);
+    }
+    unlock_aquarium();
+}
+
+static void bench_update_scan(void* ctx, long long ops) {
+    (void)ctx;
+    lock_aquarium();
+    for (long long i = 0; i < ops; i++) {
+        update_fishes();
+    }
+    unlock_aquarium();
+}
+
+// The first fish reaches its target at every tick
+static void bench_update_arrival(void* ctx, long long ops) {
+    (void)ctx;
+    lock_aquarium();
+    for (long long i = 0; i < ops; i++) {
+        Fish* fish = current_aquarium->poissons;
+        fill_up_fish_positions_list(fish, 3);
+        peek_front(fish->future_positions)->arrival_time = 0;
+        update_fishes();
+    }
+    unlock_aquarium();
+}
+
+static void bench_add_targets(void* ctx, long long ops) {
+    (void)ctx;
+    lock_aquarium();
+    Fish* fish = current_aquarium->poissons;
+    for (long long i = 0; i < ops; i++) {
+        add_n_fish_target_positions(fish, 1);
+        pop_front(fish->future_positions);
+    }
+    unlock_aquarium();
+}
+
+static void bench_add_duplicate(void* ctx, long long ops) {
+    (void)ctx;
+    lock_aquarium();
+    char name[MAX_NAME_LEN];
+    snprintf(name, sizeof(name), "%s", current_aquarium->poissons->name);
+    for (long long i = 0; i < ops; i++) {
+        sink += try_add_fish(name, 10, 10, 50, 30, "RandomWayPoint");
+    }
+    unlock_aquarium();
+}
+
+static void bench_view_coordinates(void* ctx, long long ops) {
+    (void)ctx;
+    lock_aquarium();
+    Afficheur* view = current_aquarium->afficheurs;
+    for (long long i = 0; i < ops; i++) {
+        Tuple coords = get_view_coordinates((int)(i % BENCH_WIDTH), (int)(i % BENCH_HEIGHT), view);
+        sink += coords.x + coords.y;
+        view = view->suivant != NULL ? view->suivant : current_aquarium->afficheurs;
+    }
+    unlock_aquarium();
+}
+
+static void bench_load_aquarium(void* ctx, long long ops) {
+    (void)ctx;
+    lock_aquarium();
+    for (long long i = 0; i < ops; i++) {
+        load_aquarium(BENCH_FILE);
+    }
+    unlock_aquarium();
+}
+
+static void write_aquarium_file(long views) {
+    char* path = get_aquarium_path(BENCH_FILE);
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        perror(path);
+        exit(1);
+    }
+    fprintf(file, "%dx%d\n", BENCH_WIDTH, BENCH_HEIGHT);
+    for (long i = 0; i < views; i++) {
+        fprintf(file, "N%ld %ldx%ld+500+500\n", i + 1, (i * 500) % BENCH_WIDTH, (i * 500 / BENCH_WIDTH) * 500 % BENCH_HEIGHT);
+    }
+    fclose(file);
+    free(path);
+}
+
+static void remove_aquarium_file() {
+    char* path = get_aquarium_path(BENCH_FILE);
+    unlink(path);
+    free(path);
+}
+
+static DoublyLinkedList* filled_list(long size) {
+    DoublyLinkedList* list = create_list();
+    for (long i = 0; i < size; i++) {
+        insert_back(list, (FishNextPos){(int)i, (int)i, i});
+    }
+    return list;
+}
+
+static void bench_dll_back_front(void* ctx, long long ops) {
+    DoublyLinkedList* list = ctx;
+    for (long long i = 0; i < ops; i++) {
+        insert_back(list, (FishNextPos){1, 2, i});
+        sink += pop_front(list).x;
+    }
+}
+
+static void bench_dll_front_back(void* ctx, long long ops) {
+    DoublyLinkedList* list = ctx;
+    for (long long i = 0; i < ops; i++) {
+        insert_front(list, (FishNextPos){1, 2, i});
+        sink += pop_back(list).x;
+    }
+}
+
+static void bench_dll_peek_middle(void* ctx, long long ops) {
+    DoublyLinkedList* list = ctx;
+    for (long long i = 0; i < ops; i++) {
+        sink += peek_at_index(list, list->size / 2)->x;
+    }
+}
+
+// The value searched is at the back, then put back there
+static void bench_dll_delete_value(void* ctx, long long ops) {
+    DoublyLinkedList* list = ctx;
+    for (long long i = 0; i < ops; i++) {
+        FishNextPos last = *peek_back(list);
+        delete_value(list, last);
+        insert_back(list, last);
+    }
+}
+
+static void bench_dll_chain(void* ctx, long long ops) {
+    DoublyLinkedList* list = ctx;
+    for (long long i = 0; i < ops; i++) {
+        DoublyLinkedList* tail = create_list();
+        insert_back(tail, (FishNextPos){1, 2, i});
+        chain_lists(list, tail);
+        pop_back(list);
+    }
+}
+
+static void run_list_cases(long size) {
+    struct {
+        const char* name;
+        BenchBody body;
+    } cases[] = {
+        {"dll/insert_back+pop_front", bench_dll_back_front},
+        {"dll/insert_front+pop_back", bench_dll_front_back},
+        {"dll/peek_at_index", bench_dll_peek_middle},
+        {"dll/delete_value", bench_dll_delete_value},
+        {"dll/chain_lists", bench_dll_chain},
+    };
+    DoublyLinkedList* list = filled_list(size);
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        run_case(cases[i].name, size, 0, cases[i].body, list);
+    }
+    destroy_list(list);
+}
+
+// -------------------------- Soak --------------------------------
+
+static long resident_kb() {
+    long pages = 0, resident = 0;
+    FILE* file = fopen("/proc/self/statm", "r");
+    if (file == NULL) return 0;
+    if (fscanf(file, "%ld %ld", &pages, &resident) != 2) resident = 0;
+    fclose(file);
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static long queued_positions() {  // Assumes the mutex is locked
+    long positions = 0;
+    for (Fish* fish = current_aquarium->poissons; fish != NULL; fish = fish->suivant) {
+        positions += fish->future_positions->size;
+    }
+    return positions;
+}
+
+static void run_soak(double hours, long fishes) {
+    sim_clock_use_virtual(0);
+    build_world(fishes, 1);
+
+    long long ticks_per_hour = 3600LL * 1000000 / SOAK_TICK_US;
+    long long total_ticks = (long long)(hours * ticks_per_hour);
+    printf("%8s %12s %12s %12s %12s %12s\n", "sim h", "ticks", "real s", "us/tick", "positions", "rss kB");
+    double start = now_ns(), hour_start = start;
+    for (long long tick = 1; tick <= total_ticks; tick++) {
+        sim_clock_step(SOAK_TICK_US);
+        lock_aquarium();
+        update_fishes();
+        unlock_aquarium();
+
+        if (tick % ticks_per_hour == 0 || tick == total_ticks) {
+            double now = now_ns();
+            long long ticks = tick % ticks_per_hour == 0 ? ticks_per_hour : tick % ticks_per_hour;
+            lock_aquarium();
+            long positions = queued_positions();
+            unlock_aquarium();
+            printf("%8.1f %12lld %12.1f %12.2f %12ld %12ld\n", (double)tick / ticks_per_hour, tick,
+                   (now - start) / 1e9, (now - hour_start) / 1e3 / ticks, positions, resident_kb());
+            fflush(stdout);
+            hour_start = now;
+        }
+    }
+    double elapsed = now_ns() - start;
+    printf("%.1f simulated hours in %.1f s: %.0fx real time\n", hours, elapsed / 1e9, hours * 3600e9 / elapsed);
+    record("soak/tick", fishes, 1, elapsed / total_ticks, total_ticks);
+}
+
+// -------------------------- Results --------------------------------
+
+static bool ends_with(const char* s, const char* suffix) {
+    size_t len = strlen(s), suffix_len = strlen(suffix);
+    return len >= suffix_len && strcmp(s + len - suffix_len, suffix) == 0;
+}
+
+static bool write_results(const char* path) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        perror(path);
+        return false;
+    }
+    bool json = ends_with(path, ".json");
+    fprintf(file, json ? "[\n" : "name,fishes,views,ns_per_op,ops\n");
+    for (int i = 0; i < nb_results; i++) {
+        Result* r = &results[i];
+        if (json) {
+            fprintf(file, "{\"name\": \"%s\", \"fishes\": %ld, \"views\": %ld, \"ns_per_op\": %.1f, \"ops\": %lld}%s\n",
+                    r->name, r->fishes, r->views, r->ns_per_op, r->ops, i + 1 < nb_results ? "," : "");
+        } else {
+            fprintf(file, "%s,%ld,%ld,%.1f,%lld\n", r->name, r->fishes, r->views, r->ns_per_op, r->ops);
+        }
+    }
+    if (json) fprintf(file, "]\n");
+    fclose(file);
+    return true;
+}
+
+// Read the results written by write_results, in either format
+static bool read_baseline(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        return false;
+    }
+    char line[512];
+    while (fgets(line, sizeof(line), file) != NULL && nb_baseline < MAX_RESULTS) {
+        Result* r = &baseline[nb_baseline];
+        if (sscanf(line, "{\"name\": \"%63[^\"]\", \"fishes\": %ld, \"views\": %ld, \"ns_per_op\": %lf, \"ops\": %lld",
+                   r->name, &r->fishes, &r->views, &r->ns_per_op, &r->ops) == 5 ||
+            sscanf(line, "%63[^,],%ld,%ld,%lf,%lld", r->name, &r->fishes, &r->views, &r->ns_per_op, &r->ops) == 5) {
+            nb_baseline++;
+        }
+    }
+    fclose(file);
+    return true;
+}
+
+// Print the cases both runs have. Returns the number of regressions
+static int compare_baseline(double threshold_percent) {
+    int regressions = 0, compared = 0;
+    printf("\n%-30s %9s %7s %14s %14s %8s\n", "vs baseline", "fishes", "views", "baseline ns", "ns/op", "change");
+    for (int i = 0; i < nb_results; i++) {
+        Result* r = &results[i];
+        for (int j = 0; j < nb_baseline; j++) {
+            Result* b = &baseline[j];
+            if (strcmp(r->name, b->name) != 0 || r->fishes != b->fishes || r->views != b->views) continue;
+            double change = b->ns_per_op > 0 ? (r->ns_per_op - b->ns_per_op) * 100 / b->ns_per_op : 0;
+            bool regressed = change > threshold_percent;
+            regressions += regressed;
+            compared++;
+            printf("%-30s %9ld %7ld %14.1f %14.1f %+7.1f%%%s\n", r->name, r->fishes, r->views,
+                   b->ns_per_op, r->ns_per_op, change, regressed ? "  REGRESSION" : "");
+            break;
+        }
+    }
+    printf("%d cases compared, %d regressions (threshold %.1f%%)\n", compared, regressions, threshold_percent);
+    return regressions;
+}
+
+// -------------------------- Main --------------------------------
+
+static int parse_sweep(const char* arg, long* sweep) {
+    int n = 0;
+    char* copy = strdup(arg);
+    for (char* tok = strtok(copy, ","); tok != NULL && n < MAX_SWEEP; tok = strtok(NULL, ",")) {
+        long value = atol(tok);
+        if (value > 0) sweep[n++] = value;
+    }
+    free(copy);
+    return n;
+}
+
+static void usage() {
+    fprintf(stderr,
+        "Usage: bench [-q] [-f fish counts] [-v view counts] [-t ms per case] [-o results] [-b baseline] [-r %%]\n"
+        "  -f 10,1000  fish counts of the fish sweep (default 10 to 1000000)\n"
+        "  -v 1,100    view counts of the view sweep (default 1 to 10000)\n"
+        "  -q          quick: the default sweeps stop at 10000 fishes and 1000 views\n"
+        "  -o file     write the results, as JSON if file ends with .json, CSV otherwise\n"
+        "  -b file     compare with a previous -o file, exit 1 if a case regressed\n"
+        "  -r percent  slowdown counted as a regression (default 10)\n"
+        "  -s hours    soak: tick the world of the first fish count for that many simulated hours\n");
+}
+
+int main(int argc, char* argv[]) {
+    long fish_sweep[MAX_SWEEP] = {10, 100, 1000, 10000, 100000, 1000000};
+    long view_sweep[MAX_SWEEP] = {1, 10, 100, 1000, 10000};
+    int nb_fish = 6, nb_views = 5;
+    bool fish_given = false, views_given = false, quick = false;
+    const char* output = NULL;
+    const char* baseline_path = NULL;
+    double threshold = 10;
+    double soak_hours = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "qf:v:t:o:b:r:s:h")) != -1) {
+        switch (opt) {
+            case 'q': quick = true; break;
+            case 'f': nb_fish = parse_sweep(optarg, fish_sweep); fish_given = true; break;
+            case 'v': nb_views = parse_sweep(optarg, view_sweep); views_given = true; break;
+            case 't': target_ms = atof(optarg); break;
+            case 'o': output = optarg; break;
+            case 'b': baseline_path = optarg; break;
+            case 'r': threshold = atof(optarg); break;
+            case 's': soak_hours = atof(optarg); break;
+            default: usage(); return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (quick && !fish_given) nb_fish = 4;
+    if (quick && !views_given) nb_views = 4;
+    if (target_ms <= 0) target_ms = 200;
+    if (baseline_path != NULL && !read_baseline(baseline_path)) return 2;
+
+    srand(42);  // Same worlds from one run to the next
+    init_connections();
+    open_sink();
+    select_aquarium(get_aquarium_slot(BENCH_AQUARIUM, true));  // No registry: no tick thread
+
+    if (soak_hours > 0) {
+        run_soak(soak_hours, fish_given ? fish_sweep[0] : SOAK_FISHES);
+        nb_fish = nb_views = 0;
+    }
+
+    if (soak_hours <= 0) printf("%-30s %9s %7s %14s %10s\n", "case", "fishes", "views", "ns/op", "ops");
+    for (int i = 0; i < nb_fish; i++) {
+        long fishes = fish_sweep[i];
+        build_world(fishes, 1);
+        run_case("create_fish_list_string", fishes, 1, bench_fish_list, NULL);
+        run_case("update_fishes/scan", fishes, 1, bench_update_scan, NULL);
+        run_case("update_fishes/arrival", fishes, 1, bench_update_arrival, NULL);
+        run_case("add_n_fish_target_positions", fishes, 1, bench_add_targets, NULL);
+        run_case("add_fish/duplicate", fishes, 1, bench_add_duplicate, NULL);
+        run_list_cases(fishes);
+    }
+    for (int i = 0; i < nb_views; i++) {
+        long views = view_sweep[i];
+        build_world(VIEW_SWEEP_FISHES, views);
+        run_case("update_fishes/arrival", VIEW_SWEEP_FISHES, views, bench_update_arrival, NULL);
+        run_case("get_view_coordinates", VIEW_SWEEP_FISHES, views, bench_view_coordinates, NULL);
+        write_aquarium_file(views);
+        run_case("load_aquarium", 0, views, bench_load_aquarium, NULL);
+        remove_aquarium_file();
+    }
+
+    if (output != NULL && !write_results(output)) return 2;
+    if (baseline_path != NULL && compare_baseline(threshold) > 0) return 1;
+    return 0;
+}
@@ -7,18 +7,53 @@
 #include <math.h>
 #include <arpa/inet.h>
 #include "aquarium.h"
+#include "connection.h"
+#include "multicast.h"
+#include "replication.h"
+#include "shm_world.h"
+#include "timer_wheel.h"
+#include "read_cfg.h"
+#include "metrics.h"
+#include "lock_profile.h"
+#include "fanout_trace.h"
+#include "trace.h"
 #include "log.h"
+#include "sim_clock.h"
+#include "mem_account.h"
+#include "tick_scheduler.h"
 
 #define MAX_PATH_LEN 256
-#define MAX_FISH_LIST_SIZE 4096
-#define MAX_FISH_INFO_SIZE 256
-
-// Mutex for aquarium access
-pthread_mutex_t mutex_aquarium = PTHREAD_MUTEX_INITIALIZER;
-
-// Currently selected aquarium
-Aquarium* current_aquarium = NULL;
-int fish_count = 0;
+#define MAX_FISH_LIST_SIZE 4096  // Initial size, the list grows as needed
+
+// Aquarium the thread works on, and the slot it was locked from
+_Thread_local Aquarium* current_aquarium = NULL;
+static _Thread_local AquariumSlot* selected_slot = NULL;
+static _Thread_local AquariumSlot* locked_slot = NULL;
+static _Thread_local LockHold aquarium_hold;
+
+// Every aquarium mutex is profiled as one lock
+static LockProfile profile_aquarium = { .name = "mutex_aquarium" };
+
+// Registry of the hosted aquariums
+static AquariumSlot* slots = NULL;
+static pthread_mutex_t mutex_registry = PTHREAD_MUTEX_INITIALIZER;
+static void* (*slot_tick_thread)(void*) = NULL;
+
+// Selected while no aquarium has been loaded yet: current_aquarium stays NULL
+static AquariumSlot no_aquarium = { .name = "", .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+// Phases of a tick, each with its latency histogram
+typedef enum {
+    TICK_ARRIVAL_SCAN,    // Looking for the fishes that reached their target
+    TICK_HORIZON_REFILL,  // Generating new waypoints for the fishes running out of them
+    TICK_PAYLOAD_BUILD,   // Formatting the fish lists
+    TICK_SEND,            // Queuing them on the views and the multicast channel
+    NB_TICK_PHASES
+} TickPhase;
+
+static const char* tick_phase_names[NB_TICK_PHASES] = {"arrival_scan", "horizon_refill", "payload_build", "send"};
+static Metric* tick_phases[NB_TICK_PHASES];
+static _Thread_local microseconds_t tick_phase_us[NB_TICK_PHASES];  // Spent by the current tick of the thread
 
 struct FunctionMapping table[] = {
     {"RandomWayPoint", RandomWayPoint}
@@ -27,6 +62,127 @@ struct FunctionMapping table[] = {
 int table_size = sizeof(table) / sizeof(table[0]);
 
 
+// -------------------------- Registry --------------------------------
+
+// Fishes and bytes sent per view of every hosted aquarium
+static void collect_aquarium_metrics(StringBuilder* out, bool comments) {
+    AquariumSlot* selected = selected_aquarium();
+    char labels[3 * MAX_NAME_LEN];
+
+    metrics_write_header(out, comments, "aquarium_fishes", "gauge", "Fishes of each hosted aquarium");
+    for (AquariumSlot* slot = next_aquarium_slot(NULL); slot != NULL; slot = next_aquarium_slot(slot)) {
+        select_aquarium(slot);
+        lock_aquarium();
+        if (current_aquarium != NULL) {
+            snprintf(labels, sizeof(labels), "aquarium=\"%s\"", slot->name);
+            metrics_write_value(out, "aquarium_fishes", labels, current_aquarium->fish_count);
+        }
+        unlock_aquarium();
+    }
+
+    metrics_write_header(out, comments, "aquarium_view_sent_bytes", "gauge",
+                         "Bytes sent to each connected view since it connected");
+    for (AquariumSlot* slot = next_aquarium_slot(NULL); slot != NULL; slot = next_aquarium_slot(slot)) {
+        select_aquarium(slot);
+        lock_aquarium();
+        for (Afficheur* view = current_aquarium != NULL ? current_aquarium->afficheurs : NULL; view != NULL; view = view->suivant) {
+            Connection* conn = conn_get(view->socket);
+            if (conn == NULL) continue;
+            snprintf(labels, sizeof(labels), "aquarium=\"%s\",view=\"%s\"", slot->name, view->name);
+            metrics_write_value(out, "aquarium_view_sent_bytes", labels, (long long)atomic_load(&conn->bytes_sent));
+        }
+        unlock_aquarium();
+    }
+    select_aquarium(selected);
+}
+
+void init_aquarium_registry(void* (*tick_thread)(void*)) {
+    pthread_mutex_lock(&mutex_registry);
+    slot_tick_thread = tick_thread;
+    pthread_mutex_unlock(&mutex_registry);
+
+    for (int phase = 0; phase < NB_TICK_PHASES; phase++) {
+        char labels[64];
+        snprintf(labels, sizeof(labels), "phase=\"%s\"", tick_phase_names[phase]);
+        tick_phases[phase] = metrics_histogram("aquarium_tick_phase_duration_us", "Time spent in each phase of a tick", labels);
+    }
+    metrics_collector(collect_aquarium_metrics);
+    lock_profile_register(&profile_aquarium);
+}
+
+AquariumSlot* get_aquarium_slot(const char* name, bool create) {
+    pthread_mutex_lock(&mutex_registry);
+    AquariumSlot** last = &slots;
+    for (AquariumSlot* slot = slots; slot != NULL; slot = slot->suivant) {
+        if (strncmp(slot->name, name, MAX_NAME_LEN) == 0) {
+            pthread_mutex_unlock(&mutex_registry);
+            return slot;
+        }
+        last = &slot->suivant;
+    }
+    if (!create) {
+        pthread_mutex_unlock(&mutex_registry);
+        return NULL;
+    }
+
+    AquariumSlot* slot = (AquariumSlot*)calloc(1, sizeof(AquariumSlot));
+    if (slot == NULL) {
+        pthread_mutex_unlock(&mutex_registry);
+        return NULL;
+    }
+    strncpy(slot->name, name, MAX_NAME_LEN - 1);
+    pthread_mutex_init(&slot->mutex, NULL);
+    *last = slot;  // Appended: the first slot stays the default one
+    if (slot_tick_thread != NULL) {
+        pthread_create(&slot->tick_thread, NULL, slot_tick_thread, slot);
+        pthread_detach(slot->tick_thread);
+    }
+    pthread_mutex_unlock(&mutex_registry);
+
+    log_msg("[INFO] Hosting aquarium %s\n", slot->name);
+    return slot;
+}
+
+AquariumSlot* default_aquarium_slot() {
+    pthread_mutex_lock(&mutex_registry);
+    AquariumSlot* slot = slots != NULL ? slots : &no_aquarium;
+    pthread_mutex_unlock(&mutex_registry);
+    return slot;
+}
+
+AquariumSlot* next_aquarium_slot(AquariumSlot* slot) {
+    pthread_mutex_lock(&mutex_registry);
+    AquariumSlot* next = slot == NULL ? slots : slot->suivant;
+    pthread_mutex_unlock(&mutex_registry);
+    return next;
+}
+
+void select_aquarium(AquariumSlot* slot) {
+    selected_slot = slot;
+}
+
+AquariumSlot* selected_aquarium() {
+    return selected_slot != NULL ? selected_slot : default_aquarium_slot();
+}
+
+void lock_aquarium_at(const char* site) {
+    AquariumSlot* slot = selected_aquarium();
+    profiled_lock(&profile_aquarium, &slot->mutex, site, &aquarium_hold);
+    locked_slot = slot;
+    current_aquarium = slot->aquarium;
+}
+
+void unlock_aquarium() {
+    replication_flush();  // The records of this hold, before another thread can add its own
+    AquariumSlot* slot = locked_slot;
+    slot->aquarium = current_aquarium;
+    locked_slot = NULL;
+    current_aquarium = NULL;
+    profiled_unlock(&slot->mutex, &aquarium_hold);
+}
+
+// -------------------------- Aquarium --------------------------------
+
 void create_aquarium(const char* name, int w, int h) {  // Assumes the mutex is locked
     if (current_aquarium == NULL) {
         current_aquarium = (Aquarium*)malloc(sizeof(Aquarium));
@@ -37,7 +193,12 @@ void create_aquarium(const char* name, int w, int h) {  // Assumes the mutex is
     current_aquarium->w = w;
     current_aquarium->h = h;
     current_aquarium->poissons = NULL;
+    current_aquarium->fish_index = create_hash_table();
     current_aquarium->afficheurs = NULL;
+    current_aquarium->fish_count = 0;
+    current_aquarium->ghosts = NULL;
+    shm_world_touch();
+    replication_resync();
 
     log_msg("Created aquarium: %s\n", name);
 }
@@ -54,8 +215,16 @@ void destroy_aquarium() {  // Assumes the mutex is locked
     Fish* current_fish = current_aquarium->poissons;
     while (current_fish != NULL) {
         Fish* next_fish = current_fish->suivant;
-        destroy_list(current_fish->future_positions);  // Free the future positions list
-        free(current_fish);
+        destroy_fish(current_fish);
+        current_fish = next_fish;
+    }
+    destroy_hash_table(current_aquarium->fish_index);
+
+    // Release ghosts
+    current_fish = current_aquarium->ghosts;
+    while (current_fish != NULL) {
+        Fish* next_fish = current_fish->suivant;
+        destroy_fish(current_fish);
         current_fish = next_fish;
     }
 
@@ -63,20 +232,35 @@ void destroy_aquarium() {  // Assumes the mutex is locked
     Afficheur* current_view = current_aquarium->afficheurs;
     while (current_view != NULL) {
         Afficheur* next_view = current_view->suivant;
-        free(current_view);
+        destroy_view(current_view);
         current_view = next_view;
     }
 
     free(current_aquarium);
+    current_aquarium = NULL;
+    shm_world_touch();
 }
 
 // -------------------------- Fish --------------------------------
 
-bool add_fish(  // Assumes the mutex is locked
+// Check that the aquarium can take one more fish: FISH_ADD_OK, FISH_ADD_TOO_MANY or FISH_ADD_MEMORY_LIMIT
+static FishAddStatus check_room_for_fish() {  // Assumes the mutex is locked
+    // Check the global cap, so that one client can't grow the world without bound
+    if (MAX_FISHES > 0 && current_aquarium->fish_count >= MAX_FISHES)
+        return FISH_ADD_TOO_MANY;
+
+    // Check the memory, so that the controller degrades instead of being OOM-killed
+    if (!mem_account_admit(MEM_FISH))
+        return FISH_ADD_MEMORY_LIMIT;
+
+    return FISH_ADD_OK;
+}
+
+FishAddStatus try_add_fish(  // Assumes the mutex is locked
     char* name,
     int x, int y,
     int w, int h,
-    char move_function[MAX_NAME_LEN]
+    const char* move_function
 ) {
     // Check if name is too long. If so, truncate it
     if (strlen(name) >= MAX_NAME_LEN) {
@@ -85,37 +269,37 @@ bool add_fish(  // Assumes the mutex is locked
     }
 
     // Check if the fish already exists
-    Fish* current_fish = current_aquarium->poissons;
-    while (current_fish != NULL) {
-        if (strncmp(current_fish->name, name, MAX_NAME_LEN) == 0) {
-            // Fish with the same name already exists
-            log_msg("Fish with the same name %s already exists\n", name);
-            return false;
-        }
-        current_fish = current_fish->suivant;
+    if (find_fish(name) != NULL) {
+        // Fish with the same name already exists
+        log_msg("Fish with the same name %s already exists\n", name);
+        return FISH_ADD_DUPLICATE;
     }
 
+    FishAddStatus room = check_room_for_fish();
+    if (room != FISH_ADD_OK)
+        return room;
+
     // Check the position
     if (x > 100 || x < 0 || y > 100 || y < 0)
-        return false;
+        return FISH_ADD_BAD_POSITION;
 
     // Check the size
     if (w * h > MAX_FISH_SIZE)
-        return false;
+        return FISH_ADD_BAD_SIZE;
 
     // Check mobility
     int index=fonctionExiste(move_function);
     if (index == 0)
-        return 0;
+        return FISH_ADD_BAD_MOVE_FUNCTION;
 
     // Calculate aquarium coordinates from view coordinates
     Tuple aquarium_coords = get_aquarium_coordinates(x, y, current_aquarium->afficheurs);
-    log_msg("Aquarium size: %d x %d\n", current_aquarium->w, current_aquarium->h);
-    log_msg("Fish: (%d, %d) View: %dx%d, %dx%d\n", x, y, current_aquarium->afficheurs->x, current_aquarium->afficheurs->y, current_aquarium->afficheurs->w, current_aquarium->afficheurs->h);
-    log_msg("Aquarium coordinates: (%d, %d)\n", aquarium_coords.x, aquarium_coords.y);
+    debug_msg("Aquarium size: %d x %d\n", current_aquarium->w, current_aquarium->h);
+    debug_msg("Fish: (%d, %d) View: %dx%d, %dx%d\n", x, y, current_aquarium->afficheurs->x, current_aquarium->afficheurs->y, current_aquarium->afficheurs->w, current_aquarium->afficheurs->h);
+    debug_msg("Aquarium coordinates: (%d, %d)\n", aquarium_coords.x, aquarium_coords.y);
 
     // Initialize the new fish
-    Fish* fish = (Fish*)malloc(sizeof(Fish));
+    Fish* fish = create_fish();
     strncpy(fish->name, name, MAX_NAME_LEN - 1);
     fish->name[MAX_NAME_LEN - 1] = '\0';
     fish->w = w;
@@ -125,60 +309,121 @@ bool add_fish(  // Assumes the mutex is locked
     fish->to_delete = false;
     fish->move_function = table[index-1].fonction;
     fish->future_positions = create_list();  // Initialize the future positions queue
-    fish->speed = get_random_fish_speed_px_per_sec();
+    seed_fish_rng(fish);
+    fish->speed = get_random_fish_speed_px_per_sec(&fish->rng);
+    fish->peer = -1;
 
     // Add to the beginning of the list
     fish->suivant = current_aquarium->poissons;
     current_aquarium->poissons = fish;
-    fish_count++;
+    hash_table_insert(current_aquarium->fish_index, fish->name, fish);
+    current_aquarium->fish_count++;
 
     // Add current fish position to the future positions list with the current time
     FishNextPos current_position;
     current_position.x = aquarium_coords.x;
     current_position.y = aquarium_coords.y;
-    current_position.arrival_time = get_time_usec();
+    current_position.arrival_time = sim_clock_now();
     insert_back(fish->future_positions, current_position);
+    replication_record_fish(fish);  // The waypoints follow
 
     // Generate n=3 future positions
     add_n_fish_target_positions(fish, 3);
+    shm_world_touch();
 
-    return true;
+    return FISH_ADD_OK;
 }
 
-bool release_fish(const char* name) {  // Assumes the mutex is locked
-    // Catch the fish (find in the list)
+bool add_fish(  // Assumes the mutex is locked
+    char* name,
+    int x, int y,
+    int w, int h,
+    char move_function[MAX_NAME_LEN]
+) {
+    return try_add_fish(name, x, y, w, h, move_function) == FISH_ADD_OK;
+}
+
+FishAddStatus adopt_fish(Fish* fish) {  // Assumes the mutex is locked
+    if (find_fish(fish->name) != NULL)
+        return FISH_ADD_DUPLICATE;
+    FishAddStatus room = check_room_for_fish();
+    if (room != FISH_ADD_OK)
+        return room;
+
+    fish->suivant = current_aquarium->poissons;
+    current_aquarium->poissons = fish;
+    hash_table_insert(current_aquarium->fish_index, fish->name, fish);
+    current_aquarium->fish_count++;
+    shm_world_touch();
+    return FISH_ADD_OK;
+}
+
+Fish* find_fish(const char* name) {  // Assumes the mutex is locked
+    return (Fish*)hash_table_get(current_aquarium->fish_index, name);
+}
+
+Fish* first_listed_fish() {  // Assumes the mutex is locked
+    return current_aquarium->poissons != NULL ? current_aquarium->poissons : current_aquarium->ghosts;
+}
+
+Fish* next_listed_fish(Fish* fish) {  // Assumes the mutex is locked
+    if (fish->suivant != NULL || fish->peer >= 0) return fish->suivant;
+    return current_aquarium->ghosts;  // Last fish simulated here
+}
+
+int start_all_fishes() {  // Assumes the mutex is locked
+    int started = 0;
     Fish* current_fish = current_aquarium->poissons;
-    Fish* previous_fish = NULL;
     while (current_fish != NULL) {
-        if (strncmp(current_fish->name, name, MAX_NAME_LEN) == 0) {
-            // Found the fish
-
-            // Actually release/delete the fish
-            if (current_fish->to_delete) {
-                if (previous_fish == NULL) {
-                    // If we release the first fish, update the aquarium
-                    current_aquarium->poissons = current_fish->suivant;
-                } else {
-                    // Else, update fish list links
-                    previous_fish->suivant = current_fish->suivant;
-                }
-
-                // Release the fish into the wilderness
-                destroy_list(current_fish->future_positions);  // Free the future positions list
-                free(current_fish);
-                fish_count--;
-            } else {
-                // Mark the fish for deletion
-                current_fish->to_delete = true;
-            }
-            return true;
+        if (!current_fish->started && !current_fish->to_delete) {
+            current_fish->started = true;
+            started++;
+            shm_world_touch();
         }
-        previous_fish = current_fish;
         current_fish = current_fish->suivant;
     }
+    if (started > 0) replication_record("startAll");
+    return started;
+}
+
+// Unlink fish (after previous_fish, NULL if first) from the aquarium and free it
+static void unlink_fish(Fish* previous_fish, Fish* fish) {  // Assumes the mutex is locked
+    if (previous_fish == NULL) {
+        // If we release the first fish, update the aquarium
+        current_aquarium->poissons = fish->suivant;
+    } else {
+        // Else, update fish list links
+        previous_fish->suivant = fish->suivant;
+    }
+
+    // Release the fish into the wilderness
+    hash_table_remove(current_aquarium->fish_index, fish->name);
+    destroy_fish(fish);
+    current_aquarium->fish_count--;
+}
+
+bool release_fish(const char* name) {  // Assumes the mutex is locked
+    // Catch the fish (the index only holds the fishes simulated here, not the ghosts)
+    Fish* fish = find_fish(name);
+    if (fish == NULL) {
+        log_msg("Fish with name %s not found\n", name);
+        return false;  // Fish not found
+    }
+    replication_record("del %s", fish->name);
 
-    log_msg("Fish with name %s not found\n", name);
-    return false;  // Fish not found
+    if (fish->to_delete) {
+        // Deleted twice before the tick released it: only then is its predecessor needed
+        Fish* previous_fish = NULL;
+        for (Fish* current_fish = current_aquarium->poissons; current_fish != fish; current_fish = current_fish->suivant) {
+            previous_fish = current_fish;
+        }
+        unlink_fish(previous_fish, fish);
+    } else {
+        // Mark the fish for deletion, the tick releases it once its last entry has been sent
+        fish->to_delete = true;
+    }
+    shm_world_touch();
+    return true;
 }
 
 // Removes the first position of each fish where the target position has been reached
@@ -203,43 +448,64 @@ void pop_reached_targets(microseconds_t curr_time_us) {  // Assumes the mutex is
 bool update_fish(Fish* p, microseconds_t curr_time_us) {  // Assumes the mutex is locked
     // Check if the fish is NULL or if it hasnt started yet
     if (p == NULL || !p->started) {
+        if (p != NULL) p->arrived = false;
         return false;
     }
 
-    // Fill up the future positions list if needed
+    // Fill up the future positions list if needed. A tick running behind only adds the next
+    // target: the list must never run empty, the rest of the horizon waits for a tick on time
     if (p->future_positions == NULL || p->future_positions->size <= 1) {
-        fill_up_fish_positions_list(p, 3);
+        microseconds_t start = sim_clock_real();
+        TraceSpan refill = trace_begin("tick", "horizon refill", NULL);
+        fill_up_fish_positions_list(p, p->future_positions != NULL && tick_skip_prefill() ? 2 : 3);
+        trace_end(&refill);
+        tick_phase_us[TICK_HORIZON_REFILL] += sim_clock_real() - start;
     }
 
     // Get the next position
     FishNextPos* next_position = peek_front(p->future_positions);
 
-    // If the fish has reached its target position
-    if (curr_time_us >= next_position->arrival_time) {
-        p->arrived = true;
-        return true;
-    }
+    // If the fish has reached its target position. Kept in the fish until the tick pops the target
+    p->arrived = curr_time_us >= next_position->arrival_time;
+    return p->arrived;
+}
+
+// View coordinates of a position, or the aquarium coordinates themselves without a view
+static Tuple list_coordinates(int x, int y, Afficheur* view) {  // Assumes the mutex is locked
+    if (view == NULL) return (Tuple){x, y};
+    return get_view_coordinates(x, y, view);
+}
 
-    return false;
+// Append one " ["name" at XxY,WxH,S]" entry to the fish list
+static void append_fish_entry(StringBuilder* sb, Fish* fish, Tuple view_coords, int seconds_to_reach) {
+    sb_appendf(
+        sb, " [\"%s\" at %dx%d,%dx%d,%d]",
+        fish->name,
+        view_coords.x, view_coords.y,
+        fish->w, fish->h,
+        seconds_to_reach
+    );
 }
 
 // Create string of the fish list
-char* create_fish_list_string(microseconds_t curr_time_us, bool mode_ls, Afficheur* view) {  // Assumes the mutex is locked
+SharedBuffer* create_fish_list_string(microseconds_t curr_time_us, bool mode_ls, Afficheur* view) {  // Assumes the mutex is locked
     // Check if the aquarium is loaded
     if (current_aquarium == NULL) {
         return NULL;
     }
 
-    // Create a string to hold the fish list
-    char* fish_list = (char*)malloc(MAX_FISH_LIST_SIZE);
-    strcpy(fish_list, "list");
+    // Create a string to hold the fish list. Grows with the number of fishes
+    StringBuilder fish_list;
+    if (!sb_init(&fish_list, MAX_FISH_LIST_SIZE)) {
+        return NULL;
+    }
+    sb_append(&fish_list, "list", 4);
 
     // Loop through all fishes
     Fish* current_fish = current_aquarium->poissons;
     while (current_fish != NULL) {
         // If the fish is not started, skip it
         if (!current_fish->started) {
-            if (current_fish->to_delete) release_fish(current_fish->name);
             current_fish = current_fish->suivant;
             continue;
         }
@@ -258,43 +524,25 @@ char* create_fish_list_string(microseconds_t curr_time_us, bool mode_ls, Affiche
         if (current_fish->to_delete) seconds_to_reach = -1;
 
         // Convert to view coordinates
-        Tuple view_coords = get_view_coordinates(
+        Tuple view_coords = list_coordinates(
             next_position->x,
             next_position->y,
             view
         );
-        // log_msg("Converted aquarium coordinates (%d, %d) to view coordinates (%d, %d)\n",
-        //        next_position->x, next_position->y, view_coords.x, view_coords.y);
 
         // Format the fish information
-        char fish_info[MAX_FISH_INFO_SIZE];
-        snprintf(
-            fish_info, MAX_FISH_INFO_SIZE, " [\"%s\" at %dx%d,%dx%d,%d]",
-            current_fish->name,
-            view_coords.x, view_coords.y,
-            current_fish->w, current_fish->h,
-            seconds_to_reach
-        );
-        strcat(fish_list, fish_info);
-
-        // If the fish is marked for deletion, we want to send it one last time with seconds_to_reach = -1
-        if (current_fish->to_delete) {
-            Fish* next_fish = current_fish->suivant;
-            // Release the fish
-            release_fish(current_fish->name);
-            current_fish = next_fish;
-            continue;
-        }
+        append_fish_entry(&fish_list, current_fish, view_coords, seconds_to_reach);
 
+        // If the fish is marked for deletion, it is released by update_fishes once every view got the list
         // If the fish has not reached its target position, continue to the next fish (we are done with this fish).
         // Also, if mode_ls, we don't want to remove the fish from the list (as we can just cover that in the next call)
-        if (seconds_to_reach != 0 || mode_ls) {
+        if (current_fish->to_delete || seconds_to_reach != 0 || mode_ls) {
             current_fish = current_fish->suivant;
             continue;
         }
 
         // If seconds_to_reach is 0, we will add the same fish AGAIN to the list, with a new target position.
-        if (current_fish->future_positions->size == 0) {
+        if (current_fish->future_positions->size <= 1) {
             add_n_fish_target_positions(current_fish, 1);  // If needed, add a new target position
             log_msg("[create_fish_list_string] Fish %s has no target position, adding a new one\n", current_fish->name);
         }
@@ -303,97 +551,216 @@ char* create_fish_list_string(microseconds_t curr_time_us, bool mode_ls, Affiche
         next_position = peek_at_index(current_fish->future_positions, 1);
         seconds_to_reach = (next_position->arrival_time - curr_time_us) / 1000000;
         if (seconds_to_reach < 3) {
-            log_msg("[create_fish_list_string] seconds_to_reach < 3, setting to 3\n");
+            debug_msg("[create_fish_list_string] seconds_to_reach < 3, setting to 3\n");
             seconds_to_reach = 3;  // No time left
         }
-        view_coords = get_view_coordinates(
+        view_coords = list_coordinates(
             next_position->x,
             next_position->y,
             view
         );
-        snprintf(
-            fish_info, MAX_FISH_INFO_SIZE, " [\"%s\" at %dx%d,%dx%d,%d]",
-            current_fish->name,
-            view_coords.x, view_coords.y,
-            current_fish->w, current_fish->h,
-            seconds_to_reach
-        );
-        strcat(fish_list, fish_info);
+        append_fish_entry(&fish_list, current_fish, view_coords, seconds_to_reach);
         
         current_fish = current_fish->suivant;
     }
 
-    strcat(fish_list, "\n");
-    return fish_list;
+    // Fishes of the federation peers, heading to their first position not reached yet
+    for (Fish* ghost = current_aquarium->ghosts; ghost != NULL; ghost = ghost->suivant) {
+        Node* node = ghost->future_positions->head;
+        while (node != NULL && node->next != NULL && node->data.arrival_time <= curr_time_us) {
+            node = node->next;
+        }
+        if (node == NULL) continue;
+
+        int seconds_to_reach = (node->data.arrival_time - curr_time_us) / 1000000;
+        if (seconds_to_reach < 0) seconds_to_reach = 0;
+        append_fish_entry(&fish_list, ghost, list_coordinates(node->data.x, node->data.y, view), seconds_to_reach);
+    }
+
+    sb_append(&fish_list, "\n", 1);
+    return sb_to_shared(&fish_list);
 }
 
-void send_fish_list_to_view(Afficheur* view, char* fish_list) {  // Assumes the mutex is locked
-    // Send the fish list to the view
-    if (view->socket != -1) {
-        send(view->socket, fish_list, strlen(fish_list), 0);
+// Queue the fish list of the arrivals detected at detected for the view, with its "update" line
+// if the view is traced (see fanout_trace.h)
+void send_fish_list_to_view(Afficheur* view, SharedBuffer* fish_list, microseconds_t detected) {  // Assumes the mutex is locked
+    unsigned int seq;
+    if (view->socket != -1 && fanout_trace_next(view->socket, &seq)) {
+        conn_send_traced(view->socket, fish_list, seq, detected);
+    } else if (view->socket != -1) {
+        conn_send_shared(view->socket, fish_list);
     } else {
         log_msg("View %s is not connected\n", view->name);
     }
 }
 
+// Release the fishes marked for deletion, once their last entry has been sent
+static void release_deleted_fishes() {  // Assumes the mutex is locked
+    Fish* previous_fish = NULL;
+    Fish* current_fish = current_aquarium->poissons;
+    bool released = false;
+    while (current_fish != NULL) {
+        Fish* next_fish = current_fish->suivant;
+        if (current_fish->to_delete) {
+            replication_record("del %s", current_fish->name);
+            unlink_fish(previous_fish, current_fish);
+            released = true;
+        } else {
+            previous_fish = current_fish;
+        }
+        current_fish = next_fish;
+    }
+    if (released) shm_world_touch();
+}
+
+// Send the fish list to every subscribed view. The list only depends on the view rectangle,
+// so views sharing a rectangle share the same buffer instead of each building its own copy
+static void broadcast_fish_lists(microseconds_t current_time_us) {  // Assumes the mutex is locked
+    HashTable* lists_by_rect = create_hash_table();
+    if (lists_by_rect == NULL) return;
+
+    int nb_lists = 0, lists_cap = 8;
+    SharedBuffer** lists = (SharedBuffer**)malloc(lists_cap * sizeof(SharedBuffer*));
+    bool multicast_wanted = false;
+
+    Afficheur* current_view = current_aquarium->afficheurs;
+    while (current_view != NULL && lists != NULL) {
+        if (current_view->multicast && current_view->socket != -1) {
+            multicast_wanted = true;
+        }
+        if (!current_view->subscribed || current_view->socket == -1) {
+            current_view = current_view->suivant;
+            continue;
+        }
+
+        char rect_key[64];
+        snprintf(rect_key, sizeof(rect_key), "%d,%d,%d,%d",
+            current_view->x, current_view->y, current_view->w, current_view->h);
+
+        SharedBuffer* fish_list = (SharedBuffer*)hash_table_get(lists_by_rect, rect_key);
+        if (fish_list == NULL) {
+            // If any fish has reached its target position, send the fish list to the subscribed views
+            microseconds_t build_start = sim_clock_real();
+            TraceSpan build = trace_begin("tick", "create_fish_list_string", NULL);
+            fish_list = create_fish_list_string(current_time_us, false, current_view);
+            trace_end(&build);
+            tick_phase_us[TICK_PAYLOAD_BUILD] += sim_clock_real() - build_start;
+            if (fish_list == NULL) {
+                log_msg("No fish list available\n");
+                break;
+            }
+            if (nb_lists == lists_cap) {
+                lists_cap *= 2;
+                SharedBuffer** bigger = (SharedBuffer**)realloc(lists, lists_cap * sizeof(SharedBuffer*));
+                if (bigger == NULL) {
+                    shared_buffer_unref(fish_list);
+                    break;
+                }
+                lists = bigger;
+            }
+            lists[nb_lists++] = fish_list;
+            hash_table_insert(lists_by_rect, rect_key, fish_list);
+        }
+
+        debug_msg("[%s] %s\n", current_view->name, fish_list->data);
+        // Send the fish list to the view
+        microseconds_t send_start = sim_clock_real();
+        send_fish_list_to_view(current_view, fish_list, current_time_us);
+        tick_phase_us[TICK_SEND] += sim_clock_real() - send_start;
+        current_view = current_view->suivant;
+    }
+
+    // A single list in aquarium coordinates for all the displays listening to the multicast group
+    if (multicast_wanted && multicast_enabled() && selected_aquarium() == default_aquarium_slot()) {
+        microseconds_t build_start = sim_clock_real();
+        SharedBuffer* aquarium_list = create_fish_list_string(current_time_us, false, NULL);
+        microseconds_t send_start = sim_clock_real();
+        multicast_publish(aquarium_list);
+        shared_buffer_unref(aquarium_list);
+        tick_phase_us[TICK_PAYLOAD_BUILD] += send_start - build_start;
+        tick_phase_us[TICK_SEND] += sim_clock_real() - send_start;
+    }
+
+    // The connections hold their own references
+    for (int i = 0; i < nb_lists; i++) {
+        shared_buffer_unref(lists[i]);
+    }
+    free(lists);
+    destroy_hash_table(lists_by_rect);
+}
+
 void update_fishes() {  // Assumes the mutex is locked
     // Check if the aquarium is loaded
     if (current_aquarium == NULL) {
         return;
     }
 
-    microseconds_t current_time_us = get_time_usec();
+    microseconds_t current_time_us = sim_clock_now();
+    microseconds_t tick_start = sim_clock_real();  // The phases are measured in real time
     bool send_fish_list = false;
-    bool arrived_arr[fish_count];
+    bool ghosts_moved = false;
+    for (int phase = 0; phase < NB_TICK_PHASES; phase++) {
+        tick_phase_us[phase] = 0;
+    }
 
     // Loop through all fishes
+    TraceSpan scan = trace_begin("tick", "arrival scan", NULL);
     Fish* current_fish = current_aquarium->poissons;
-    int i = 0;
     while (current_fish != NULL) {
         bool arrived = update_fish(current_fish, current_time_us);
-        arrived_arr[i] = arrived;
         send_fish_list = send_fish_list || arrived;
         current_fish = current_fish->suivant;
-        i++;
     }
 
-    if (!send_fish_list) {
-        return;  // Nothing to do if no fish has reached its target position
+    // Ghosts move along the trajectory their federation peer sent
+    for (Fish* ghost = current_aquarium->ghosts; ghost != NULL; ghost = ghost->suivant) {
+        while (ghost->future_positions->size > 1 &&
+               peek_front(ghost->future_positions)->arrival_time <= current_time_us) {
+            pop_front(ghost->future_positions);
+            ghosts_moved = true;
+        }
     }
 
-    Afficheur* current_view = current_aquarium->afficheurs;
-    while (current_view != NULL) {
-        if (current_view->subscribed) {
+    trace_end(&scan);
 
-            // If any fish has reached its target position, send the fish list to the subscribed views
-            char* fish_list = create_fish_list_string(current_time_us, false, current_view);
-            if (fish_list == NULL) {
-                log_msg("No fish list available\n");
-                return;
-            }
-            log_msg("=============Continuous update:==============\n");
-            log_msg("[%s] %s\n", current_view->name, fish_list);
-            // Send the fish list to the view
-            send_fish_list_to_view(current_view, fish_list);
-            free(fish_list);
-        }
-        current_view = current_view->suivant;
+    // The refills happen during the scan, they are timed on their own
+    tick_phase_us[TICK_ARRIVAL_SCAN] = sim_clock_real() - tick_start - tick_phase_us[TICK_HORIZON_REFILL];
+    metrics_record(tick_phases[TICK_ARRIVAL_SCAN], tick_phase_us[TICK_ARRIVAL_SCAN]);
+    metrics_record(tick_phases[TICK_HORIZON_REFILL], tick_phase_us[TICK_HORIZON_REFILL]);
+
+    // A list only moving the ghosts can wait when the tick runs behind, the next one carries them
+    if (ghosts_moved && !send_fish_list && !tick_shed_cosmetic()) {
+        send_fish_list = true;
     }
 
+    if (!send_fish_list) {
+        return;  // Nothing to do if no fish has reached its target position
+    }
+
+    shm_world_touch();  // New targets
+    log_msg("=============Continuous update:==============\n");
+    TraceSpan broadcast = trace_begin("tick", "broadcast", NULL);
+    broadcast_fish_lists(current_time_us);
+    trace_end(&broadcast);
+    metrics_record(tick_phases[TICK_PAYLOAD_BUILD], tick_phase_us[TICK_PAYLOAD_BUILD]);
+    metrics_record(tick_phases[TICK_SEND], tick_phase_us[TICK_SEND]);
+
     // Iterate over the fishes again to remove the reached targets
     current_fish = current_aquarium->poissons;
-    i = 0;
     while (current_fish != NULL) {
         // If the fish has reached its target position
-        if (arrived_arr[i]) {
+        if (current_fish->arrived) {
             pop_front(current_fish->future_positions);
+            current_fish->arrived = false;
             // add_n_fish_target_positions(current_fish, 1);
         }
         current_fish = current_fish->suivant;
-        i++;
     }
 
-    long long elapsed_us = get_time_usec() - current_time_us;
+    // Only now, so that every view got the last entry of the deleted fishes
+    release_deleted_fishes();
+
+    long long elapsed_us = sim_clock_real() - tick_start;
     double elapsed_ms = elapsed_us / 1000.0;
     log_msg("[update_fishes] Execution time: %.3f ms\n", elapsed_ms);
 }
@@ -424,7 +791,7 @@ bool add_view(  // Assumes the mutex is locked
     }
 
     // Initialize the new view
-    Afficheur* view = (Afficheur*)malloc(sizeof(Afficheur));
+    Afficheur* view = create_view();
     strncpy(view->name, name, MAX_NAME_LEN - 1);
     view->name[MAX_NAME_LEN - 1] = '\0';
     view->x = x;
@@ -433,9 +800,10 @@ bool add_view(  // Assumes the mutex is locked
     view->h = h;
     view->socket = socket;
     view->subscribed = 0;
+    view->multicast = false;
 
     if (socket != -1) {
-        view->last_update_time = get_time_usec();
+        touch_view(view);
     } else {
         view->last_update_time = 0;  // Not connected
     }
@@ -447,6 +815,29 @@ bool add_view(  // Assumes the mutex is locked
     return true;
 }
 
+// Same as the CLI "add view": at the end of the list, the first view is the reference of addFish
+void append_view(const char* name, int x, int y, int w, int h) {  // Assumes the mutex is locked
+    Afficheur** last = &current_aquarium->afficheurs;
+    for (Afficheur* view = *last; view != NULL; view = view->suivant) {
+        if (strcmp(view->name, name) == 0) return;  // Already there
+        last = &view->suivant;
+    }
+
+    Afficheur* view = create_view();
+    if (view == NULL) return;
+    snprintf(view->name, MAX_NAME_LEN, "%s", name);
+    view->x = x;
+    view->y = y;
+    view->w = w;
+    view->h = h;
+    view->socket = -1;
+    view->last_update_time = 0;
+    view->subscribed = false;
+    view->multicast = false;
+    view->suivant = NULL;
+    *last = view;
+}
+
 Afficheur* find_free_view() {  // Assumes the mutex is locked
     // Check if the aquarium is loaded
     if (current_aquarium == NULL) {
@@ -465,27 +856,26 @@ Afficheur* find_free_view() {  // Assumes the mutex is locked
     return NULL;  // No free view found
 }
 
-void disconnect_views() {  // Assumes the mutex is locked
-    // Check if the aquarium is loaded
-    if (current_aquarium == NULL) {
-        return;
+void touch_view(Afficheur* view) {  // Assumes the mutex is locked
+    view->last_update_time = sim_clock_real();
+    conn_heartbeat(view->socket);
+    timer_wheel_arm(view->socket, DISPLAY_TIMEOUT * 1000);
+}
+
+Afficheur* release_view(int socket) {  // Assumes the mutex is locked
+    if (current_aquarium == NULL || socket == -1) {
+        return NULL;
     }
 
-    // Loop through all views and check if the last update time is older than the timeout
-    microseconds_t current_time_us = get_time_usec();
-    microseconds_t timeout_us = 5 * 1000000;  // 5 second timeout
-    Afficheur* current_view = current_aquarium->afficheurs;
-    while (current_view != NULL) {
-        if (current_view->socket != -1 && current_time_us - current_view->last_update_time > timeout_us) {
-            // Disconnect the view
-            log_msg("[disconnect_views] Disconnecting view %s after a timeout of %d seconds\n",
-                current_view->name, (int)(timeout_us / 1000000));
-            send(current_view->socket, "bye timeout\n", 4, 0);
-            current_view->socket = -1;
-            current_view->subscribed = 0;  // Unsubscribe the view
+    for (Afficheur* view = current_aquarium->afficheurs; view != NULL; view = view->suivant) {
+        if (view->socket == socket) {
+            view->socket = -1;
+            view->subscribed = 0;  // Unsubscribe the view
+            view->multicast = false;
+            return view;
         }
-        current_view = current_view->suivant;
     }
+    return NULL;
 }
 
 // view coordinates (e.g. (40, 60) are percentage of the view size)
@@ -511,7 +901,7 @@ Tuple get_aquarium_coordinates(int xView, int yView, Afficheur* view) {  // Assu
         return (Tuple){-1, -1};  // Invalid coordinates
     }
 
-    log_msg("Aquarium coordinates: (%d, %d) from view coordinates (%d, %d)\n",
+    debug_msg("Aquarium coordinates: (%d, %d) from view coordinates (%d, %d)\n",
         x_aquarium, y_aquarium, xView, yView);
     return (Tuple){x_aquarium, y_aquarium};
 }
@@ -555,7 +945,7 @@ bool delete_view(const char* name) {  // Assumes the mutex is locked TODO Functi
             }
 
             // Release the view into the wilderness
-            free(current_view);
+            destroy_view(current_view);
             return true;
         }
         previous_view = current_view;
@@ -609,7 +999,7 @@ void save_aquarium(const char* aquarium_name) {  // Assumes the mutex is locked
     free(filename);
 }
 
-void load_aquarium(const char* aquarium_name) {  // Assumes the mutex is locked
+bool load_aquarium(const char* aquarium_name) {  // Assumes the mutex is locked
     char* filename = get_aquarium_path(aquarium_name);
 
     FILE* file = fopen(filename, "r");
@@ -617,6 +1007,7 @@ void load_aquarium(const char* aquarium_name) {  // Assumes the mutex is locked
         log_msg("[ERROR] Error opening file %s\n", filename);
         log_msg("[ERROR] The file needs to be in the 'aquariums' directory.\n");
         free(filename);
+        return false;
     }
 
     // Destroy the current aquarium if it exists
@@ -642,7 +1033,7 @@ void load_aquarium(const char* aquarium_name) {  // Assumes the mutex is locked
                  ) == 5) {
         // TODO: Check if there is no error in the file
         // e.g. same ids, negative values
-        Afficheur* view = (Afficheur*)malloc(sizeof(Afficheur));
+        Afficheur* view = create_view();
         strncpy(view->name, name, MAX_NAME_LEN - 1);
         view->name[MAX_NAME_LEN - 1] = '\0';
         view->x = x;
@@ -651,6 +1042,7 @@ void load_aquarium(const char* aquarium_name) {  // Assumes the mutex is locked
         view->h = view_h;
         view->socket = -1;
         view->subscribed = false;
+        view->multicast = false;
         view->last_update_time = 0;
 
         // Add to the beginning of the list
@@ -667,19 +1059,20 @@ void load_aquarium(const char* aquarium_name) {  // Assumes the mutex is locked
             current_view->w, current_view->h,
             current_view->socket
         );
-        free(current_view);
+        destroy_view(current_view);
         current_view = next_view;
     }
 
     fclose(file);
     free(filename);
+    return true;
 }
 
-double get_random_fish_speed_px_per_sec() {
+double get_random_fish_speed_px_per_sec(unsigned int* rng) {
     double max_px_per_sec = 50.0;
     double min_px_per_sec = 10.0;
     
-    double random_fraction = (double)rand() / RAND_MAX;  // Random value between 0.0 and 1.0
+    double random_fraction = (double)rand_r(rng) / RAND_MAX;  // Random value between 0.0 and 1.0
     return min_px_per_sec + random_fraction * (max_px_per_sec - min_px_per_sec);
 }
 
@@ -720,7 +1113,7 @@ void add_n_fish_target_positions(struct Fish *p, int n) {  // Assumes the mutex
     }
 
     // Get the absolute time when the fish needs a new destination
-    microseconds_t current_time_us = get_time_usec();
+    microseconds_t current_time_us = sim_clock_now();
     microseconds_t abs_arrival_time = current_time_us;
     microseconds_t swim_duration;
 
@@ -736,11 +1129,11 @@ void add_n_fish_target_positions(struct Fish *p, int n) {  // Assumes the mutex
     // Precalculate the next n positions using the move function
     for (int i = 0; i < n; i++) {
         // Debug prints
-        log_msg("=========================\n");
-        log_msg("Fish %s: Adding target position %d\n", p->name, i + 1);
-        log_msg("Current position: (%d, %d)\n", x_from, y_from);
-        log_msg("Current time: %lld\n", current_time_us);
-        log_msg("With speed: %f px/s\n", p->speed);
+        debug_msg("=========================\n");
+        debug_msg("Fish %s: Adding target position %d\n", p->name, i + 1);
+        debug_msg("Current position: (%d, %d)\n", x_from, y_from);
+        debug_msg("Current time: %lld\n", current_time_us);
+        debug_msg("With speed: %f px/s\n", p->speed);
 
         // Get random destination
         Tuple destination = p->move_function(p);  // E.g. RandomWayPoint(p)
@@ -755,13 +1148,14 @@ void add_n_fish_target_positions(struct Fish *p, int n) {  // Assumes the mutex
 
         // Add the next position to the list
         insert_back(p->future_positions, next_pos);
+        replication_record("wp %s %d %d %lld %u", p->name, next_pos.x, next_pos.y, (long long)next_pos.arrival_time, p->rng);
 
         // Update the current position
         x_from = next_pos.x;
         y_from = next_pos.y;
 
         // Debug prints
-        log_msg("Fish %s next position: (%d, %d) within %lld seconds\n",
+        debug_msg("Fish %s next position: (%d, %d) within %lld seconds\n",
             p->name, next_pos.x, next_pos.y, (long long)(swim_duration / 1000000));
         
         // long long time_diff = next_pos.arrival_time - current_time_us;
@@ -787,12 +1181,45 @@ Tuple RandomWayPoint(struct Fish *p) {  // Assumes the mutex is locked
     const int max_x = current_aquarium->w - p->w;
     const int max_y = current_aquarium->h - p->h;
 
-    int x = rand() % (max_x - min_x + 1) + min_x;
-    int y = rand() % (max_y - min_y + 1) + min_y;
+    int x = rand_r(&p->rng) % (max_x - min_x + 1) + min_x;
+    int y = rand_r(&p->rng) % (max_y - min_y + 1) + min_y;
 
     return (Tuple){x, y};
 }
 
+void seed_fish_rng(struct Fish *p) {
+    unsigned int hash = 2166136261u;  // FNV-1a
+    for (const char* c = p->name; *c != '\0'; c++) {
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+    }
+    p->rng = hash ^ (unsigned int)RANDOM_SEED;
+}
+
+Fish* create_fish() {
+    Fish* fish = (Fish*)calloc(1, sizeof(Fish));
+    if (fish != NULL) mem_account_add(MEM_FISH, sizeof(Fish), 1);
+    return fish;
+}
+
+Afficheur* create_view() {
+    Afficheur* view = (Afficheur*)calloc(1, sizeof(Afficheur));
+    if (view != NULL) mem_account_add(MEM_VIEWS, sizeof(Afficheur), 1);
+    return view;
+}
+
+void destroy_fish(Fish* fish) {
+    if (fish == NULL) return;
+    destroy_list(fish->future_positions);
+    free(fish);
+    mem_account_add(MEM_FISH, -(long long)sizeof(Fish), -1);
+}
+
+void destroy_view(Afficheur* view) {
+    if (view == NULL) return;
+    free(view);
+    mem_account_add(MEM_VIEWS, -(long long)sizeof(Afficheur), -1);
+}
+
 int fonctionExiste(const char* nom) {  // Assumes the mutex is locked
     for (int i = 0; i < table_size; i++) {
         if (strcmp(table[i].nom, nom) == 0) {
@@ -1,5 +1,11 @@
 // An Aquarium has a size, has fishes, holds a list of views, and can be saved to a file.
 // Is this how classes work in c lol? -OOP main
+//
+// Several aquariums can be hosted at once. Each one lives in an AquariumSlot of the registry,
+// with its own mutex and its own tick thread, so a busy aquarium doesn't slow down the others.
+// A thread selects the aquarium it works on (select_aquarium), then lock_aquarium() makes it
+// available as current_aquarium until unlock_aquarium(). The code working on current_aquarium
+// doesn't need to know which aquarium it is.
 
 #ifndef AQUARIUM_H
 #define AQUARIUM_H
@@ -8,30 +14,31 @@
 #include <time.h>
 #include <pthread.h>
 #include "doubly_linked_list.h"
+#include "hash_table.h"
+#include "shared_buffer.h"
 #include "utils.h"
 
 #define MAX_NAME_LEN 50  // Warning: If change, update the strings that say %49s
 
 #define MAX_FISH_SIZE 1000000
 
-extern pthread_mutex_t mutex_aquarium;
 extern int table_size;
 
 // Fish list
 typedef struct Fish {
     char name[MAX_NAME_LEN];
     bool started;
-    bool arrived;
+    bool arrived;  // Reached its next target this tick: the tick pops it once the lists are sent
     bool to_delete;
     int w, h;  // Size
     Tuple (*move_function) (struct Fish*);  // Fonction de déplacement
     double speed;  // Speed in pixels per second
+    unsigned int rng;  // rand_r state of the fish's waypoints, see seed_fish_rng
     DoublyLinkedList *future_positions;  // Contains the next positions (x, y, arrival_time) of the fish
+    int peer;  // Ghosts only: federation peer that simulates the fish (see federation.h)
     struct Fish *suivant;  // Liste chaînée
 } Fish;
 
-extern int fish_count;
-
 // Map of function names to their corresponding functions
 struct FunctionMapping {
     char* nom;
@@ -47,6 +54,7 @@ typedef struct Afficheur {
     int socket;  // -1 if not connected
     microseconds_t last_update_time;  // Last time the view was updated
     bool subscribed;  // If the view is subscribed to getFishesContinuously
+    bool multicast;  // If the view gets its continuous updates from the multicast channel
 
     struct Afficheur *suivant;  // Liste chaînée
 } Afficheur;
@@ -56,18 +64,78 @@ typedef struct Aquarium {
     char name[MAX_NAME_LEN];
     int w, h;  // Size
     Fish *poissons;  // Fish list
+    HashTable *fish_index;  // Fish by name, for O(1) duplicate checks and lookups
     Afficheur *afficheurs;  // View list
+    int fish_count;
+    Fish *ghosts;  // Fishes simulated by federation peers: only shown in the views, never moved here
 } Aquarium;
 
-// Currently selected aquarium
-extern Aquarium* current_aquarium;
+// Registry entry of an aquarium. Slots are never freed, so connections and threads can keep
+// a pointer to one: load and restore replace its aquarium, which is NULL until loaded
+typedef struct AquariumSlot {
+    char name[MAX_NAME_LEN];
+    pthread_mutex_t mutex;  // Lock domain of the aquarium: fishes, views and its tick
+    Aquarium* aquarium;
+    pthread_t tick_thread;
+    struct AquariumSlot* suivant;  // Registry, in creation order
+} AquariumSlot;
+
+// Aquarium of the calling thread, only valid between lock_aquarium() and unlock_aquarium()
+extern _Thread_local Aquarium* current_aquarium;
+
+// Start the registry. tick_thread runs for every slot, with the slot as argument
+void init_aquarium_registry(void* (*tick_thread)(void*));
+
+// Find the slot of an aquarium. With create, a missing slot is added (and its tick thread started).
+// NULL if not found
+AquariumSlot* get_aquarium_slot(const char* name, bool create);
+
+// The first slot created: connections without "@<aquarium>" go there, and the snapshot file,
+// the journal, the shared memory and the multicast channel follow it. An empty slot if none
+AquariumSlot* default_aquarium_slot();
+
+// Iterate over the registry: first slot with NULL, NULL after the last one
+AquariumSlot* next_aquarium_slot(AquariumSlot* slot);
 
-// Create a new empty aquarium
+// Work on slot (NULL: the default aquarium) in the calling thread
+void select_aquarium(AquariumSlot* slot);
+
+// Slot the calling thread works on
+AquariumSlot* selected_aquarium();
+
+// Lock the selected aquarium and make it current_aquarium. Not reentrant: one aquarium at a time.
+// The caller is the call site of the lock profile (see lock_profile.h)
+#define lock_aquarium() lock_aquarium_at(__func__)
+void lock_aquarium_at(const char* site);
+
+// Store current_aquarium back in its slot (load, restore may have replaced it) and unlock
+void unlock_aquarium();
+
+// Create a new empty aquarium in the selected slot
 void create_aquarium(const char* name, int w, int h);
 
-// Destroy an aquarium
+// Destroy the aquarium of the selected slot
 void destroy_aquarium();
 
+// Result of an attempt to add a fish (one status per item in addFishBatch)
+typedef enum {
+    FISH_ADD_OK = 0,
+    FISH_ADD_DUPLICATE,
+    FISH_ADD_BAD_POSITION,
+    FISH_ADD_BAD_SIZE,
+    FISH_ADD_BAD_MOVE_FUNCTION,
+    FISH_ADD_TOO_MANY,  // The aquarium holds max-fishes already
+    FISH_ADD_MEMORY_LIMIT,  // memory-limit is reached (see mem_account.h)
+} FishAddStatus;
+
+// Add a fish to the aquarium and tell why it failed, if it did
+FishAddStatus try_add_fish(
+    char* name,
+    int x, int y,
+    int w, int h,
+    const char* move_function
+);
+
 // Add a fish to the aquarium
 bool add_fish(
     char* name,
@@ -76,11 +144,30 @@ bool add_fish(
     char move_function[MAX_NAME_LEN]
 );
 
+// Add a fish built with its trajectory (handed off by a federation peer, replayed from the
+// journal), with the same name, max-fishes and memory checks as try_add_fish.
+// The aquarium owns the fish only if FISH_ADD_OK is returned
+FishAddStatus adopt_fish(Fish* fish);  // Assumes the mutex is locked
+
+// Find a fish by name. NULL if not found
+Fish* find_fish(const char* name);
+
+// Iterate over the fishes to show in the views: the fishes simulated here, then the ghosts
+// of the federation peers. NULL after the last one
+Fish* first_listed_fish();
+Fish* next_listed_fish(Fish* fish);
+
+// Start all fishes that are not moving yet. Returns the number of started fishes
+int start_all_fishes();
+
 // Loops over all fishes and, if needed, gives them a a new target position
 void update_fishes();
 
-// logs out any views that have lost connection
-void disconnect_views();
+// The client of a view showed up: its display-timeout-value starts over
+void touch_view(Afficheur* view);
+
+// Disconnect the view bound to socket (timeout, client gone). Returns it, NULL if none
+Afficheur* release_view(int socket);
 
 // Remove a fish from the aquarium
 bool release_fish(const char* name);
@@ -93,6 +180,9 @@ bool add_view(
     int socket  // -1 if not connected
 );
 
+// Add a disconnected view at the end of the list, like the CLI "add view". Nothing if it exists
+void append_view(const char* name, int x, int y, int w, int h);
+
 // Find a free view in the aquarium. NULL if no free view
 Afficheur* find_free_view();
 
@@ -140,7 +230,8 @@ void save_aquarium(const char* aquarium_name);
 // N2 500x0+500+500
 // N3 0x500+500+500
 // N4 500x500+500+500
-void load_aquarium(const char* aquarium_name);
+// Replaces the aquarium of the selected slot. Returns false if the file can't be read
+bool load_aquarium(const char* aquarium_name);
 
 // Calculates a random position in the aquarium
 Tuple RandomWayPoint(struct Fish *p);
@@ -155,10 +246,24 @@ void add_n_fish_target_positions(struct Fish *p, int n);
 // Makes sure the fish has at least n target positions in the future_positions list
 void fill_up_fish_positions_list(struct Fish *p, int n);
 
-// Create string of the fish list. If mode_ls, don't remove the fish that have reached their target position
-char* create_fish_list_string(microseconds_t curr_time_us, bool mode_ls, Afficheur* view);
+// Create string of the fish list. If mode_ls, don't remove the fish that have reached their target position.
+// With view == NULL, the positions are given in aquarium coordinates (multicast channel).
+// The returned buffer can be sent to several views, drop it with shared_buffer_unref
+SharedBuffer* create_fish_list_string(microseconds_t curr_time_us, bool mode_ls, Afficheur* view);
 
 // Calcule la vitesse d'un poisson en pixels par seconde
-double get_random_fish_speed_px_per_sec();
+double get_random_fish_speed_px_per_sec(unsigned int* rng);
+
+// Seed the random generator of a fish from random-seed and its name. Its speed and waypoints then
+// only depend on them, whatever the other fishes and the threads do (see capture.h)
+void seed_fish_rng(struct Fish *p);
+
+// Allocate a zeroed fish (or view), accounted in mem_account.h
+Fish* create_fish();
+Afficheur* create_view();
+
+// Free a fish and its future positions (or a view), and take it out of the accounting
+void destroy_fish(Fish* fish);
+void destroy_view(Afficheur* view);
 
 #endif // AQUARIUM_H
@@ -0,0 +1,178 @@
+#include "capture.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "aquarium.h"
+#include "connection.h"
+#include "shared_buffer.h"
+#include "read_cfg.h"
+#include "utils.h"
+#include "log.h"
+
+#define CAPTURE_FLUSH_INTERVAL_US 1000000  // A crash loses at most about this much traffic
+
+static FILE* capture_file = NULL;
+static char capture_path[BUFFER_SIZE_CFG];
+static unsigned int connection_ids[MAX_CONNECTIONS];  // 0: no line captured since the socket opened
+static unsigned int next_connection_id;
+static uint64_t last_record_us, last_flush_us;
+static unsigned long long nb_lines;
+static pthread_mutex_t mutex_capture = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t monotonic_usec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void write_varint(uint64_t value) {  // Assumes mutex_capture is locked
+    unsigned char bytes[10];
+    int len = 0;
+    do {
+        bytes[len] = value & 0x7f;
+        value >>= 7;
+        if (value != 0) bytes[len] |= 0x80;
+        len++;
+    } while (value != 0);
+    fwrite(bytes, 1, len, capture_file);
+}
+
+static void write_le(uint64_t value, int bytes) {  // Assumes mutex_capture is locked
+    for (int i = 0; i < bytes; i++) {
+        fputc((int)(value >> (8 * i)) & 0xff, capture_file);
+    }
+}
+
+// Type and timestamp of a record, the caller writes the rest
+static void begin_record(CaptureRecord type) {  // Assumes mutex_capture is locked
+    uint64_t now = monotonic_usec();
+    fputc(type, capture_file);
+    write_varint(now - last_record_us);
+    last_record_us = now;
+}
+
+static void end_record() {  // Assumes mutex_capture is locked
+    if (last_record_us - last_flush_us >= CAPTURE_FLUSH_INTERVAL_US) {
+        fflush(capture_file);
+        last_flush_us = last_record_us;
+    }
+}
+
+static void write_aquarium(const char* slot_name) {  // Assumes mutex_capture and the mutex are locked
+    StringBuilder text;
+    if (!sb_init(&text, 1024)) return;
+    sb_appendf(&text, "%dx%d\n", current_aquarium->w, current_aquarium->h);
+    for (Afficheur* view = current_aquarium->afficheurs; view != NULL; view = view->suivant) {
+        sb_appendf(&text, "%s %dx%d+%d+%d\n", view->name, view->x, view->y, view->w, view->h);
+    }
+
+    begin_record(CAPTURE_AQUARIUM);
+    size_t name_len = strlen(slot_name);
+    write_varint(name_len);
+    fwrite(slot_name, 1, name_len, capture_file);
+    write_varint(text.len);
+    fwrite(text.data, 1, text.len, capture_file);
+    end_record();
+    sb_free(&text);
+}
+
+bool capture_start(const char* path) {
+    pthread_mutex_lock(&mutex_capture);
+    if (capture_file != NULL) {
+        pthread_mutex_unlock(&mutex_capture);
+        return false;
+    }
+    capture_file = fopen(path, "wb");
+    if (capture_file == NULL) {
+        pthread_mutex_unlock(&mutex_capture);
+        log_msg("[ERROR] Could not create the capture file %s\n", path);
+        return false;
+    }
+    snprintf(capture_path, sizeof(capture_path), "%s", path);
+    memset(connection_ids, 0, sizeof(connection_ids));
+    next_connection_id = 0;
+    nb_lines = 0;
+
+    fwrite(CAPTURE_MAGIC, 1, strlen(CAPTURE_MAGIC), capture_file);
+    write_le((uint32_t)RANDOM_SEED, 4);
+    write_le((uint64_t)get_time_usec(), 8);
+    last_record_us = last_flush_us = monotonic_usec();
+    pthread_mutex_unlock(&mutex_capture);
+
+    // The aquariums already hosted, in the order of the registry (the first one is the default)
+    AquariumSlot* selected = selected_aquarium();
+    for (AquariumSlot* slot = next_aquarium_slot(NULL); slot != NULL; slot = next_aquarium_slot(slot)) {
+        select_aquarium(slot);
+        lock_aquarium();
+        if (current_aquarium != NULL) capture_aquarium(slot->name);
+        unlock_aquarium();
+    }
+    select_aquarium(selected);
+
+    log_msg("[INFO] Capturing the client traffic to %s (random-seed %d)\n", path, RANDOM_SEED);
+    return true;
+}
+
+void capture_stop() {
+    pthread_mutex_lock(&mutex_capture);
+    if (capture_file != NULL) {
+        fclose(capture_file);
+        capture_file = NULL;
+        log_msg("[INFO] Capture %s stopped: %llu lines from %u connections\n",
+                capture_path, nb_lines, next_connection_id);
+    }
+    pthread_mutex_unlock(&mutex_capture);
+}
+
+bool capture_running() {
+    pthread_mutex_lock(&mutex_capture);
+    bool running = capture_file != NULL;
+    pthread_mutex_unlock(&mutex_capture);
+    return running;
+}
+
+void capture_line(int socket, const char* line) {
+    if (socket < 0 || socket >= MAX_CONNECTIONS) return;
+
+    pthread_mutex_lock(&mutex_capture);
+    if (capture_file == NULL) {
+        pthread_mutex_unlock(&mutex_capture);
+        return;
+    }
+    if (connection_ids[socket] == 0) {
+        connection_ids[socket] = ++next_connection_id;
+        begin_record(CAPTURE_OPEN);
+        write_varint(connection_ids[socket]);
+    }
+    size_t len = strlen(line);
+    begin_record(CAPTURE_LINE);
+    write_varint(connection_ids[socket]);
+    write_varint(len);
+    fwrite(line, 1, len, capture_file);
+    nb_lines++;
+    end_record();
+    pthread_mutex_unlock(&mutex_capture);
+}
+
+void capture_close(int socket) {
+    if (socket < 0 || socket >= MAX_CONNECTIONS) return;
+
+    pthread_mutex_lock(&mutex_capture);
+    if (capture_file != NULL && connection_ids[socket] != 0) {
+        begin_record(CAPTURE_CLOSE);
+        write_varint(connection_ids[socket]);
+        end_record();
+    }
+    connection_ids[socket] = 0;
+    pthread_mutex_unlock(&mutex_capture);
+}
+
+void capture_aquarium(const char* slot_name) {  // Assumes the mutex is locked
+    pthread_mutex_lock(&mutex_capture);
+    if (capture_file != NULL && current_aquarium != NULL) {
+        write_aquarium(slot_name);
+    }
+    pthread_mutex_unlock(&mutex_capture);
+}
@@ -0,0 +1,52 @@
+// Capture of the client traffic, to replay it against another controller with bin/replay.
+//
+// Every line received from a client is recorded with its connection and a monotonic timestamp,
+// before it is handled, along with the random-seed and the aquariums hosted (at the start of
+// the capture and at each load). With the same seed and aquariums, a replay adds the same
+// fishes in the same order, and each fish draws the same waypoints (see seed_fish_rng).
+//
+// Started with capture-file in controller.cfg or the CLI command "capture <file>". The log is
+// binary and compact, integers are little-endian and varints LEB128:
+//
+//   header   "AQCAP001", seed (u32), start of the capture (u64, µs since the epoch)
+//   record   type (u8), µs since the previous record (varint), then
+//              CAPTURE_OPEN, CAPTURE_CLOSE   connection (varint)
+//              CAPTURE_LINE                  connection (varint), length (varint), the line
+//              CAPTURE_AQUARIUM              name length (varint), name, file length (varint),
+//                                            the aquarium in the format of its file
+//
+// Connections are numbered from 1 in the order of their first line.
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdbool.h>
+
+#define CAPTURE_MAGIC "AQCAP001"
+
+typedef enum {
+    CAPTURE_OPEN = 1,
+    CAPTURE_LINE = 2,
+    CAPTURE_CLOSE = 3,
+    CAPTURE_AQUARIUM = 4,
+} CaptureRecord;
+
+// Start capturing to path (replaced), with the aquariums hosted now. Returns false if the file
+// can't be created or a capture is running
+bool capture_start(const char* path);
+
+// Stop and flush the capture, if any
+void capture_stop();
+
+bool capture_running();
+
+// A line received from socket, just before it is handled
+void capture_line(int socket, const char* line);
+
+// The socket was closed: its next client is a new connection
+void capture_close(int socket);
+
+// current_aquarium was just loaded in slot_name
+void capture_aquarium(const char* slot_name);  // Assumes the mutex is locked
+
+#endif // CAPTURE_H
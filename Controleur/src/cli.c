@@ -1,12 +1,20 @@
 // load <aquarium> (e.g. load aquarium1 
 //     -> loads a specific aquarium and tells
-//        how many users are connected)
+//        how many users are connected. The other
+//        hosted aquariums are kept)
+// select <aquarium> (the commands below apply to it)
+// aquariums (lists the hosted aquariums)
 // show aquarium (shows the total size of the aquarium and
 //     the positioning of the connected screens)
 // add view <Name> <top_left+w+h> 
 //     (e.g. add view N5 400x400+400+200)
 // del view <Name> (e.g. del view N5)
 // save <aquarium> (e.g. save aquarium2)
+// snapshot [file] (full state: views, fishes and trajectories)
+// restore [file] (replaces the aquarium with a snapshot)
+// limits (rate limits and caps, with the requests accepted and refused)
+// trace on|off|dump [file] (span tracing, dumped as Chrome trace JSON)
+// capture <file>|stop (records the client traffic for bin/replay)
 // help (shows this message)
 #include <ncurses.h>
 #include <string.h>
@@ -14,10 +22,19 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <pthread.h>
+#include <unistd.h>
 #include "aquarium.h"
 #include "cli.h"
-
-#define NUM_COMMANDS 6
+#include "read_cfg.h"
+#include "snapshot.h"
+#include "journal.h"
+#include "replication.h"
+#include "rate_limit.h"
+#include "trace.h"
+#include "capture.h"
+#include "mem_account.h"
+
+#define NUM_COMMANDS 13
 #define BUFFER_SIZE 1024
 
 void handle_load(WINDOW* output_win, const char* message) {
@@ -34,16 +51,28 @@ void handle_load(WINDOW* output_win, const char* message) {
         wprintw(output_win, "Did you mean load <aquarium>?\n");
         return;
     }
-    
-    pthread_mutex_lock(&mutex_aquarium);
 
-    // Load the aquarium
-    load_aquarium(tok);
-    if (current_aquarium == NULL) {
-        pthread_mutex_unlock(&mutex_aquarium);
+    // Check the file first: a missing aquarium must not be hosted
+    char* filename = get_aquarium_path(tok);
+    bool exists = access(filename, R_OK) == 0;
+    free(filename);
+    AquariumSlot* slot = exists ? get_aquarium_slot(tok, true) : NULL;
+    if (slot == NULL) {
         wprintw(output_win, "Could not load aquarium named '%s'.\n", tok);
         return;
     }
+    select_aquarium(slot);
+
+    lock_aquarium();
+
+    // Load the aquarium (replaces it if it was already hosted)
+    if (!load_aquarium(tok) || current_aquarium == NULL) {
+        unlock_aquarium();
+        wprintw(output_win, "Could not load aquarium named '%s'.\n", tok);
+        return;
+    }
+    journal_record("load %s", tok);
+    capture_aquarium(slot->name);
 
     wprintw(output_win, "Loaded aquarium: %s\n", current_aquarium->name);
     wprintw(output_win, "Size: %d x %d\n", current_aquarium->w, current_aquarium->h);
@@ -54,7 +83,55 @@ void handle_load(WINDOW* output_win, const char* message) {
         view = view->suivant;
     }
 
-    pthread_mutex_unlock(&mutex_aquarium);
+    unlock_aquarium();
+    journal_sync();
+}
+
+void handle_select(WINDOW* output_win, const char* message) {
+    char buffer[BUFFER_SIZE];
+    strncpy(buffer, message, sizeof(buffer));
+    buffer[sizeof(buffer) - 1] = '\0';
+
+    char* tok = strtok(buffer, " ");  // select
+    tok = strtok(NULL, " ");          // aquarium name
+    if (tok == NULL) {
+        wprintw(output_win, "Did you mean select <aquarium>?\n");
+        return;
+    }
+
+    AquariumSlot* slot = get_aquarium_slot(tok, false);
+    if (slot == NULL) {
+        wprintw(output_win, "Aquarium '%s' is not hosted. Load it first.\n", tok);
+        return;
+    }
+    select_aquarium(slot);
+    wprintw(output_win, "Selected aquarium: %s\n", slot->name);
+}
+
+void handle_aquariums(WINDOW* output_win) {
+    AquariumSlot* selected = selected_aquarium();
+    AquariumSlot* default_slot = default_aquarium_slot();
+
+    for (AquariumSlot* slot = next_aquarium_slot(NULL); slot != NULL; slot = next_aquarium_slot(slot)) {
+        select_aquarium(slot);
+        lock_aquarium();
+        if (current_aquarium != NULL) {
+            int views = 0, connected = 0;
+            for (Afficheur* view = current_aquarium->afficheurs; view != NULL; view = view->suivant) {
+                views++;
+                if (view->socket != -1) connected++;
+            }
+            wprintw(output_win, "%c %s: %d x %d, %d fishes, %d/%d views connected%s\n",
+                slot == selected ? '*' : ' ', slot->name, current_aquarium->w, current_aquarium->h,
+                current_aquarium->fish_count, connected, views, slot == default_slot ? " (default)" : "");
+        }
+        unlock_aquarium();
+    }
+    select_aquarium(selected);
+
+    if (next_aquarium_slot(NULL) == NULL) {
+        wprintw(output_win, "No aquarium loaded. Load an aquarium first.\n");
+    }
 }
 
 void handle_show(WINDOW* output_win, const char* message) {
@@ -71,11 +148,11 @@ void handle_show(WINDOW* output_win, const char* message) {
         return;
     }
     
-    pthread_mutex_lock(&mutex_aquarium);
+    lock_aquarium();
 
     // Check if the aquarium is loaded
     if (current_aquarium == NULL) {
-        pthread_mutex_unlock(&mutex_aquarium);
+        unlock_aquarium();
         wprintw(output_win, "No aquarium loaded. Load an aquarium first.\n");
         return;
     }
@@ -89,7 +166,7 @@ void handle_show(WINDOW* output_win, const char* message) {
         view = view->suivant;
     }
 
-    pthread_mutex_unlock(&mutex_aquarium);
+    unlock_aquarium();
 }
 
 void handle_add(WINDOW* output_win, const char* message) {
@@ -148,11 +225,11 @@ void handle_add(WINDOW* output_win, const char* message) {
     xTopLeft = atoi(x_str);
     yTopLeft = atoi(y_str);
 
-    pthread_mutex_lock(&mutex_aquarium);
+    lock_aquarium();
 
     // Check if the view name already exists in the aquarium
     if (current_aquarium == NULL) {
-        pthread_mutex_unlock(&mutex_aquarium);
+        unlock_aquarium();
         wprintw(output_win, "No aquarium loaded. Load an aquarium first.\n");
         return;
     }  
@@ -160,7 +237,7 @@ void handle_add(WINDOW* output_win, const char* message) {
     Afficheur* current_view = current_aquarium->afficheurs;
     while (current_view != NULL) {
         if (strcmp(current_view->name, viewName) == 0) {
-            pthread_mutex_unlock(&mutex_aquarium);
+            unlock_aquarium();
             wprintw(output_win, "Could not add view '%s':\n", viewName);
             wprintw(output_win, "View with the same name '%s' already exists.\n", viewName);
             return;
@@ -168,14 +245,24 @@ void handle_add(WINDOW* output_win, const char* message) {
         current_view = current_view->suivant;
     }
 
+    if (!mem_account_admit(MEM_VIEWS)) {
+        unlock_aquarium();
+        wprintw(output_win, "Could not add view '%s': memory-limit of %d MB reached\n", viewName, MEMORY_LIMIT);
+        return;
+    }
+
     // Create the view
-    Afficheur* view = (Afficheur*)malloc(sizeof(Afficheur));
+    Afficheur* view = create_view();
     strncpy(view->name, viewName, sizeof(view->name));
     view->name[sizeof(view->name) - 1] = '\0';
     view->w = w;
     view->h = h;
     view->x = xTopLeft;
     view->y = yTopLeft;
+    view->socket = -1;
+    view->last_update_time = 0;
+    view->subscribed = false;
+    view->multicast = false;
 
     wprintw(output_win, "Parsed view '%s' with geometry:\n", viewName);
     wprintw(output_win, "  Width:  %d\n", w);
@@ -196,8 +283,11 @@ void handle_add(WINDOW* output_win, const char* message) {
     }
 
     wprintw(output_win, "Added view '%s' to aquarium '%s'\n", viewName, current_aquarium->name);
+    journal_record("addView %s %d %d %d %d", view->name, xTopLeft, yTopLeft, w, h);
+    replication_record("addView %s %d %d %d %d", view->name, xTopLeft, yTopLeft, w, h);
     
-    pthread_mutex_unlock(&mutex_aquarium);
+    unlock_aquarium();
+    journal_sync();
 }
 
 void handle_del(WINDOW* output_win, const char* message) {
@@ -223,7 +313,7 @@ void handle_del(WINDOW* output_win, const char* message) {
     strncpy(viewName, tok, sizeof(viewName));
     viewName[sizeof(viewName) - 1] = '\0';
     
-    pthread_mutex_lock(&mutex_aquarium);
+    lock_aquarium();
 
     // Find the view in the list
     Afficheur* current_view = current_aquarium->afficheurs;
@@ -239,9 +329,12 @@ void handle_del(WINDOW* output_win, const char* message) {
                 previous_view->suivant = current_view->suivant;
             }
 
-            free(current_view);
+            destroy_view(current_view);
             wprintw(output_win, "Deleted view '%s' from aquarium '%s'\n", viewName, current_aquarium->name);
-            pthread_mutex_unlock(&mutex_aquarium);
+            journal_record("delView %s", viewName);
+            replication_record("delView %s", viewName);
+            unlock_aquarium();
+            journal_sync();
             return;
         }
         previous_view = current_view;
@@ -250,7 +343,7 @@ void handle_del(WINDOW* output_win, const char* message) {
 
     wprintw(output_win, "View '%s' not found in aquarium '%s'\n", viewName, current_aquarium->name);
     
-    pthread_mutex_unlock(&mutex_aquarium);
+    unlock_aquarium();
 }
 
 void handle_save(WINDOW* output_win, const char* message) {
@@ -269,28 +362,175 @@ void handle_save(WINDOW* output_win, const char* message) {
     strncpy(aquarium, tok, sizeof(aquarium));
     aquarium[sizeof(aquarium) - 1] = '\0';
     
-    pthread_mutex_lock(&mutex_aquarium);
+    lock_aquarium();
 
     // Check if the aquarium is loaded
     if (current_aquarium == NULL) {
-        pthread_mutex_unlock(&mutex_aquarium);
+        unlock_aquarium();
         wprintw(output_win, "No aquarium loaded. Load an aquarium first.\n");
         return;
     }
 
     save_aquarium(aquarium);
 
-    pthread_mutex_unlock(&mutex_aquarium);
+    unlock_aquarium();
     // TODO should this function delete the aquarium from memory?
 }
 
+// File given after the command, or the snapshot-file of controller.cfg. NULL if none
+static const char* snapshot_path(const char* message, char* buffer) {
+    strncpy(buffer, message, BUFFER_SIZE);
+    buffer[BUFFER_SIZE - 1] = '\0';
+
+    strtok(buffer, " ");              // "snapshot" / "restore"
+    char* tok = strtok(NULL, " ");    // file
+    if (tok != NULL) return tok;
+    return SNAPSHOT_FILE[0] != '\0' ? SNAPSHOT_FILE : NULL;
+}
+
+void handle_snapshot(WINDOW* output_win, const char* message) {
+    char buffer[BUFFER_SIZE];
+    const char* path = snapshot_path(message, buffer);
+    if (path == NULL) {
+        wprintw(output_win, "Did you mean snapshot <file>? (no snapshot-file in controller.cfg)\n");
+        return;
+    }
+    if (path == SNAPSHOT_FILE && selected_aquarium() != default_aquarium_slot()) {
+        wprintw(output_win, "The snapshot-file holds the default aquarium: snapshot <file>\n");
+        return;
+    }
+
+    lock_aquarium();
+
+    if (current_aquarium == NULL) {
+        unlock_aquarium();
+        wprintw(output_win, "No aquarium loaded. Load an aquarium first.\n");
+        return;
+    }
+
+    bool started = snapshot_save_async(path);
+
+    unlock_aquarium();
+    if (started) {
+        wprintw(output_win, "Writing snapshot to %s\n", path);
+    } else {
+        wprintw(output_win, "Could not start the snapshot (one is already being written?)\n");
+    }
+}
+
+void handle_restore(WINDOW* output_win, const char* message) {
+    char buffer[BUFFER_SIZE];
+    const char* path = snapshot_path(message, buffer);
+    if (path == NULL) {
+        wprintw(output_win, "Did you mean restore <file>? (no snapshot-file in controller.cfg)\n");
+        return;
+    }
+
+    bool restored = snapshot_load(path, NULL);  // Selects the restored aquarium
+    if (restored) {
+        lock_aquarium();
+        journal_record("restore %s", path);
+        unlock_aquarium();
+        journal_sync();
+    }
+
+    if (restored) {
+        wprintw(output_win, "Restored snapshot %s\n", path);
+    } else {
+        wprintw(output_win, "Could not restore snapshot %s\n", path);
+    }
+}
+
+void handle_limits(WINDOW* output_win) {
+    for (int lane = 0; lane < NB_LANES; lane++) {
+        unsigned long long accepted, refused;
+        rate_limit_counters(lane, &accepted, &refused);
+        if (RATE_LIMIT_RATE[lane] > 0) {
+            wprintw(output_win, "%-12s %d/s, burst %d: %llu accepted, %llu rate limited\n",
+                rate_limit_lane_name(lane), RATE_LIMIT_RATE[lane],
+                RATE_LIMIT_BURST[lane] > 0 ? RATE_LIMIT_BURST[lane] : RATE_LIMIT_RATE[lane], accepted, refused);
+        } else {
+            wprintw(output_win, "%-12s unlimited: %llu accepted\n", rate_limit_lane_name(lane), accepted);
+        }
+    }
+    if (MAX_FISHES > 0) {
+        wprintw(output_win, "max-fishes: %d per aquarium\n", MAX_FISHES);
+    } else {
+        wprintw(output_win, "max-fishes: unlimited\n");
+    }
+    if (MAX_LS_HORIZON > 0) {
+        wprintw(output_win, "max-ls-horizon: %d\n", MAX_LS_HORIZON);
+    } else {
+        wprintw(output_win, "max-ls-horizon: unlimited\n");
+    }
+    for (int tag = 0; tag < NB_MEM_TAGS; tag++) {
+        wprintw(output_win, "%-15s %10lld bytes, %lld objects\n",
+            mem_account_tag_name(tag), mem_account_bytes(tag), mem_account_objects(tag));
+    }
+    if (MEMORY_LIMIT > 0) {
+        wprintw(output_win, "memory-limit: %.1f / %d MB, %llu fishes and %llu views refused\n",
+            mem_account_total() / 1048576.0, MEMORY_LIMIT,
+            mem_account_refused(MEM_FISH), mem_account_refused(MEM_VIEWS));
+    } else {
+        wprintw(output_win, "memory-limit: unlimited, %.1f MB accounted\n", mem_account_total() / 1048576.0);
+    }
+}
+
+void handle_trace(WINDOW* output_win, const char* message) {
+    char action[16] = "";
+    char path[BUFFER_SIZE] = "trace.json";
+    sscanf(message, "trace %15s %1023s", action, path);
+
+    if (strcmp(action, "on") == 0) {
+        trace_enable(true);
+        wprintw(output_win, "Tracing on, %d spans kept per thread\n", TRACE_BUFFER);
+    } else if (strcmp(action, "off") == 0) {
+        trace_enable(false);
+        wprintw(output_win, "Tracing off, the spans recorded are kept for trace dump\n");
+    } else if (strcmp(action, "dump") == 0) {
+        int spans = trace_dump(path);
+        if (spans < 0) {
+            wprintw(output_win, "Could not write %s\n", path);
+        } else {
+            wprintw(output_win, "%d spans written to %s (chrome://tracing or ui.perfetto.dev)\n", spans, path);
+        }
+    } else {
+        wprintw(output_win, "Tracing is %s. Did you mean trace on|off|dump [file]?\n", trace_enabled() ? "on" : "off");
+    }
+}
+
+void handle_capture(WINDOW* output_win, const char* message) {
+    char path[BUFFER_SIZE] = "";
+    sscanf(message, "capture %1023s", path);
+
+    if (strcmp(path, "stop") == 0) {
+        capture_stop();
+        wprintw(output_win, "Capture stopped\n");
+    } else if (path[0] != '\0') {
+        if (capture_start(path)) {
+            wprintw(output_win, "Capturing the client traffic to %s (random-seed %d)\n", path, RANDOM_SEED);
+        } else {
+            wprintw(output_win, "Could not capture to %s%s\n", path, capture_running() ? ": a capture is running" : "");
+        }
+    } else {
+        wprintw(output_win, "Capture is %s. Did you mean capture <file>|stop?\n", capture_running() ? "running" : "stopped");
+    }
+}
+
 void handle_help(WINDOW* output_win) {
     wprintw(output_win, "Available commands:\n");
     wprintw(output_win, "  load <aquarium>\n");
+    wprintw(output_win, "  select <aquarium>\n");
+    wprintw(output_win, "  aquariums\n");
     wprintw(output_win, "  show\n");
     wprintw(output_win, "  add view <Name> <geometry>\n");
     wprintw(output_win, "  del view <Name>\n");
     wprintw(output_win, "  save <aquarium>\n");
+    wprintw(output_win, "  snapshot [file]\n");
+    wprintw(output_win, "  restore [file]\n");
+    wprintw(output_win, "  limits\n");
+    wprintw(output_win, "  trace on|off|dump [file]\n");
+    wprintw(output_win, "  capture <file>|stop\n");
     wprintw(output_win, "  help\n");
 }
 
@@ -298,13 +538,34 @@ void handle_help(WINDOW* output_win) {
 // load <aquarium> (e.g. load aquarium1 
 //     -> loads a specific aquarium and tells
 //        how many users are connected)
+// select <aquarium>
+// aquariums
 // show aquarium (shows the total size of the aquarium and
 //     the positioning of the connected screens)
 // add view <Name> <geometry> 
 //     (e.g. add view N5 400x400+400+200)
 // del view <Name> (e.g. del view N5)
 // save <aquarium> (e.g. save aquarium2)
+// snapshot [file]
+// restore [file]
+// limits
+// trace on|off|dump [file]
+// capture <file>|stop
 // help (shows this message)
+
+// Name of a command in the traces, which only take static strings
+static const char* command_name(const char* input) {
+    static const char* names[NUM_COMMANDS] = {
+        "load", "select", "aquariums", "show", "add", "del", "save", "snapshot", "restore", "limits", "trace", "capture",
+        "help",
+    };
+    for (int i = 0; i < NUM_COMMANDS; i++) {
+        size_t len = strlen(names[i]);
+        if (strncmp(input, names[i], len) == 0 && (input[len] == ' ' || input[len] == '\0')) return names[i];
+    }
+    return "unknown";
+}
+
 int cli(WINDOW* input_win, WINDOW* output_win) {
     char input[BUFFER_SIZE];
     
@@ -320,11 +581,22 @@ int cli(WINDOW* input_win, WINDOW* output_win) {
         wgetnstr(input_win, input, BUFFER_SIZE - 1);
         if (input[0] == '\0') continue;
 
+        TraceSpan span = trace_begin("cli", command_name(input), NULL);
         if (strncmp(input, "load", 4) == 0 &&
             (input[4] == ' ' || input[4] == '\0'))
         {
             handle_load(output_win, input);
         }
+        else if (strncmp(input, "select", 6) == 0 &&
+                 (input[6] == ' ' || input[6] == '\0'))
+        {
+            handle_select(output_win, input);
+        }
+        else if (strncmp(input, "aquariums", 9) == 0 &&
+                 (input[9] == ' ' || input[9] == '\0'))
+        {
+            handle_aquariums(output_win);
+        }
         else if (strncmp(input, "show", 4) == 0 &&
                  (input[4] == ' ' || input[4] == '\0'))
         {
@@ -345,6 +617,31 @@ int cli(WINDOW* input_win, WINDOW* output_win) {
         {
             handle_save(output_win, input);
         }
+        else if (strncmp(input, "snapshot", 8) == 0 &&
+                 (input[8] == ' ' || input[8] == '\0'))
+        {
+            handle_snapshot(output_win, input);
+        }
+        else if (strncmp(input, "restore", 7) == 0 &&
+                 (input[7] == ' ' || input[7] == '\0'))
+        {
+            handle_restore(output_win, input);
+        }
+        else if (strncmp(input, "limits", 6) == 0 &&
+                 (input[6] == ' ' || input[6] == '\0'))
+        {
+            handle_limits(output_win);
+        }
+        else if (strncmp(input, "trace", 5) == 0 &&
+                 (input[5] == ' ' || input[5] == '\0'))
+        {
+            handle_trace(output_win, input);
+        }
+        else if (strncmp(input, "capture", 7) == 0 &&
+                 (input[7] == ' ' || input[7] == '\0'))
+        {
+            handle_capture(output_win, input);
+        }
         else if (strncmp(input, "help", 4) == 0 &&
                  (input[4] == ' ' || input[4] == '\0'))
         {
@@ -354,6 +651,7 @@ int cli(WINDOW* input_win, WINDOW* output_win) {
             wprintw(output_win, "Commande inconnue: %s\n", input);
             handle_help(output_win);
         }
+        trace_end(&span);
         wrefresh(output_win);
     }
 
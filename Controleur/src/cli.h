@@ -11,6 +11,12 @@ typedef struct {
 // handles load <aquarium> command
 void handle_load(WINDOW* output_win, const char* message);
 
+// handles select <aquarium> command
+void handle_select(WINDOW* output_win, const char* message);
+
+// handles aquariums command
+void handle_aquariums(WINDOW* output_win);
+
 // handles show <aquarium> command
 void handle_show(WINDOW* output_win, const char* message);
 
@@ -23,6 +29,21 @@ void handle_del(WINDOW* output_win, const char* message);
 // handles save <aquarium> command
 void handle_save(WINDOW* output_win, const char* message);
 
+// handles snapshot [file] command
+void handle_snapshot(WINDOW* output_win, const char* message);
+
+// handles restore [file] command
+void handle_restore(WINDOW* output_win, const char* message);
+
+// handles limits command
+void handle_limits(WINDOW* output_win);
+
+// handles trace on|off|dump [file] command
+void handle_trace(WINDOW* output_win, const char* message);
+
+// handles capture <file>|stop command
+void handle_capture(WINDOW* output_win, const char* message);
+
 // handles help command
 void handle_help(WINDOW* output_win);
 
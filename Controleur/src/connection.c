@@ -0,0 +1,525 @@
+#include "connection.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "utils.h"
+#include "log.h"
+#include "metrics.h"
+#include "trace.h"
+#include "sim_clock.h"
+#include "mem_account.h"
+#include "fanout_trace.h"
+
+static Connection connections[MAX_CONNECTIONS];
+static atomic_int nb_open = 0;
+static atomic_ullong total_bytes_sent = 0;
+static atomic_ullong nb_dropped = 0;  // Slow consumers hung up
+static int writer_epoll = -1;         // Sockets with output the kernel did not take yet
+
+static void* writer_thread(void* arg);
+
+static void collect_connection_metrics(StringBuilder* out, bool comments) {
+    metrics_write_header(out, comments, "aquarium_connections", "gauge", "Open client connections");
+    metrics_write_value(out, "aquarium_connections", "", conn_count());
+    metrics_write_header(out, comments, "aquarium_sent_bytes_total", "counter", "Bytes sent to the clients");
+    metrics_write_value(out, "aquarium_sent_bytes_total", "", (long long)atomic_load(&total_bytes_sent));
+    metrics_write_header(out, comments, "aquarium_slow_consumers_dropped_total", "counter",
+                         "Clients hung up for letting MAX_OUTPUT_QUEUE bytes pile up");
+    metrics_write_value(out, "aquarium_slow_consumers_dropped_total", "", (long long)atomic_load(&nb_dropped));
+}
+
+int conn_count() {
+    return atomic_load(&nb_open);
+}
+
+// Count the bytes handed to a connection
+static void count_sent(Connection* conn, size_t len) {
+    atomic_fetch_add_explicit(&conn->bytes_sent, len, memory_order_relaxed);
+    atomic_fetch_add_explicit(&total_bytes_sent, len, memory_order_relaxed);
+}
+
+void init_connections() {
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        connections[i].socket = -1;
+        connections[i].open = false;
+        connections[i].in_buf = NULL;
+        connections[i].out_queue = NULL;
+        pthread_mutex_init(&connections[i].out_mutex, NULL);
+        pthread_cond_init(&connections[i].out_drained, NULL);
+    }
+    metrics_collector(collect_connection_metrics);
+
+    writer_epoll = epoll_create1(0);
+    pthread_t writer;
+    if (writer_epoll < 0 || pthread_create(&writer, NULL, writer_thread, NULL) != 0) {
+        log_msg("[WARN] No writer thread: replies the sockets can't take at once are lost\n");
+        return;
+    }
+    pthread_detach(writer);
+}
+
+Connection* conn_open(int socket) {
+    if (socket < 0 || socket >= MAX_CONNECTIONS) {
+        log_msg("[WARN] Socket %d is out of the connection table\n", socket);
+        return NULL;
+    }
+
+    Connection* conn = &connections[socket];
+    pthread_mutex_lock(&conn->out_mutex);
+    bool was_open = conn->open;
+    conn->socket = socket;
+    conn->open = true;
+    conn->aquarium = NULL;
+    conn->in_buf = NULL;
+    conn->in_len = conn->in_cap = 0;
+    conn->out_queue = NULL;
+    conn->out_count = conn->out_cap = 0;
+    conn->out_bytes = 0;
+    conn->corked = 0;
+    conn->out_armed = false;
+    conn->dropped = false;
+    conn->frozen = false;
+    atomic_store(&conn->bytes_sent, 0);
+    pthread_mutex_unlock(&conn->out_mutex);
+    if (!was_open) {
+        atomic_fetch_add(&nb_open, 1);
+        mem_account_add(MEM_CONNECTIONS, 0, 1);
+    }
+
+    // Replies are batched by the corking logic, so Nagle would only add latency
+    int opt = 1;
+    setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+    // Nothing may wait for a client: what the socket does not take is left to the writer thread
+    fcntl(socket, F_SETFL, fcntl(socket, F_GETFL) | O_NONBLOCK);
+    struct epoll_event ev = { .events = EPOLLONESHOT, .data.fd = socket };  // Disarmed until output is left
+    if (epoll_ctl(writer_epoll, EPOLL_CTL_ADD, socket, &ev) < 0 && errno == EEXIST) {
+        epoll_ctl(writer_epoll, EPOLL_CTL_MOD, socket, &ev);
+    }
+    return conn;
+}
+
+Connection* conn_get(int socket) {
+    if (socket < 0 || socket >= MAX_CONNECTIONS || !connections[socket].open) {
+        return NULL;
+    }
+    return &connections[socket];
+}
+
+// Grow a buffer so it can hold at least needed bytes
+static bool reserve(char** buf, size_t* cap, size_t needed) {
+    if (needed <= *cap) return true;
+    size_t new_cap = *cap ? *cap : 1024;
+    while (new_cap < needed) new_cap *= 2;
+    char* bigger = realloc(*buf, new_cap);
+    if (!bigger) return false;
+    mem_account_add(MEM_CONNECTIONS, (long long)(new_cap - *cap), 0);
+    *buf = bigger;
+    *cap = new_cap;
+    return true;
+}
+
+// Drop the queued chunks. Assumes the out_mutex is locked
+static void discard_queue(Connection* conn) {
+    for (int i = 0; i < conn->out_count; i++) {
+        shared_buffer_unref(conn->out_queue[i].buf);
+    }
+    conn->out_count = 0;
+    conn->out_bytes = 0;
+    pthread_cond_broadcast(&conn->out_drained);
+}
+
+// Write the "update" line of the traced list that just left the queue: it was sent now.
+// Returns false if out of memory. Assumes the out_mutex is locked
+static bool write_update_line(Connection* conn, OutChunk* chunk) {
+    char line[96];
+    int len = fanout_trace_sent(conn->socket, chunk->seq, chunk->detected, sim_clock_now(), line, sizeof(line));
+    chunk->buf = shared_buffer_copy(line, len);  // Empty if the socket is not traced anymore
+    if (chunk->buf == NULL) return false;
+    count_sent(conn, len);
+    conn->out_bytes += len;
+    return true;
+}
+
+// Send the queued chunks the socket takes without blocking. When the queue needs more than
+// one call, TCP_CORK keeps the kernel from emitting partial segments in between.
+// Returns false if the peer is gone. Assumes the out_mutex is locked
+static bool flush_queue(Connection* conn) {
+    if (conn->out_count == 0 || conn->frozen) return true;
+    TraceSpan span = trace_begin("net", "sendmsg", NULL);
+
+    bool cork = conn->out_count > MAX_IOV_PER_WRITE;
+    int opt = 1;
+    if (cork) setsockopt(conn->socket, IPPROTO_TCP, TCP_CORK, &opt, sizeof(opt));
+
+    bool alive = true;
+    int first = 0;
+    while (first < conn->out_count) {
+        // The list before an update line has left: stamp it
+        if (conn->out_queue[first].buf == NULL && !write_update_line(conn, &conn->out_queue[first])) break;
+
+        struct iovec iov[MAX_IOV_PER_WRITE];
+        int nb_iov = 0;
+        for (int i = first; i < conn->out_count && nb_iov < MAX_IOV_PER_WRITE; i++) {
+            if (conn->out_queue[i].buf == NULL) break;  // Its list has not left yet
+            iov[nb_iov].iov_base = conn->out_queue[i].buf->data + conn->out_queue[i].offset;
+            iov[nb_iov].iov_len = conn->out_queue[i].buf->len - conn->out_queue[i].offset;
+            nb_iov++;
+        }
+
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = nb_iov };
+        ssize_t sent = sendmsg(conn->socket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            alive = errno == EAGAIN || errno == EWOULDBLOCK;  // Else the reader side closes the connection
+            break;
+        }
+        conn->out_bytes -= sent;
+
+        // Drop what has been fully sent, remember where a partial write stopped
+        while (first < conn->out_count && conn->out_queue[first].buf != NULL) {
+            OutChunk* chunk = &conn->out_queue[first];
+            size_t left = chunk->buf->len - chunk->offset;
+            if ((size_t)sent < left) {
+                chunk->offset += sent;
+                break;
+            }
+            sent -= left;
+            shared_buffer_unref(chunk->buf);
+            first++;
+        }
+    }
+
+    // Keep what the socket did not take, in order
+    if (first > 0) {
+        memmove(conn->out_queue, conn->out_queue + first, (conn->out_count - first) * sizeof(OutChunk));
+        conn->out_count -= first;
+        pthread_cond_broadcast(&conn->out_drained);
+    }
+    if (!alive) discard_queue(conn);
+
+    if (cork) {
+        opt = 0;
+        setsockopt(conn->socket, IPPROTO_TCP, TCP_CORK, &opt, sizeof(opt));
+    }
+    trace_end(&span);
+    return alive;
+}
+
+// Have the writer thread send the rest of the queue once the socket is writable.
+// Assumes the out_mutex is locked
+static void arm_writer(Connection* conn) {
+    if (conn->out_armed || conn->out_count == 0 || conn->frozen) return;
+    struct epoll_event ev = { .events = EPOLLOUT | EPOLLONESHOT, .data.fd = conn->socket };
+    if (epoll_ctl(writer_epoll, EPOLL_CTL_MOD, conn->socket, &ev) == 0) conn->out_armed = true;
+}
+
+// Stop sending to a client that does not read: its output is discarded and it is hung up,
+// the worker that sees it closed next closes it. Assumes the out_mutex is locked
+static void drop_slow_consumer(Connection* conn) {
+    if (conn->dropped) return;
+    log_msg("[WARN] Client %d is too slow, dropped with %zu bytes waiting to be sent\n", conn->socket, conn->out_bytes);
+    conn->dropped = true;
+    discard_queue(conn);
+    shutdown(conn->socket, SHUT_RDWR);
+    atomic_fetch_add(&nb_dropped, 1);
+}
+
+// Next free chunk at the end of the queue, NULL (and the client dropped) if out of memory.
+// Assumes the out_mutex is locked
+static OutChunk* append_chunk(Connection* conn) {
+    if (conn->out_count == conn->out_cap) {
+        int new_cap = conn->out_cap ? conn->out_cap * 2 : 16;
+        OutChunk* bigger = realloc(conn->out_queue, new_cap * sizeof(OutChunk));
+        if (!bigger) {
+            drop_slow_consumer(conn);  // The order of the replies can't be kept
+            return NULL;
+        }
+        mem_account_add(MEM_CONNECTIONS, (long long)(new_cap - conn->out_cap) * sizeof(OutChunk), 0);
+        conn->out_queue = bigger;
+        conn->out_cap = new_cap;
+    }
+    OutChunk* chunk = &conn->out_queue[conn->out_count++];
+    memset(chunk, 0, sizeof(OutChunk));
+    return chunk;
+}
+
+// Queue a reference to buf, or drop the client if it already has MAX_OUTPUT_QUEUE bytes waiting.
+// Returns false if it was not queued. Assumes the out_mutex is locked
+static bool enqueue_chunk(Connection* conn, SharedBuffer* buf) {
+    if (conn->dropped) return false;
+    if (conn->out_bytes + buf->len > MAX_OUTPUT_QUEUE) {
+        drop_slow_consumer(conn);
+        return false;
+    }
+    OutChunk* chunk = append_chunk(conn);
+    if (chunk == NULL) return false;
+    chunk->buf = shared_buffer_ref(buf);
+    conn->out_bytes += buf->len;
+    return true;
+}
+
+// Sends what the sockets could not take at once, as they become writable
+static void* writer_thread(void* arg) {
+    (void)arg;
+    trace_thread_name("writer");
+    struct epoll_event events[MAX_IOV_PER_WRITE];
+    while (1) {
+        int nb_events = epoll_wait(writer_epoll, events, MAX_IOV_PER_WRITE, -1);
+        for (int i = 0; i < nb_events; i++) {
+            Connection* conn = conn_get(events[i].data.fd);
+            if (conn == NULL) continue;
+            pthread_mutex_lock(&conn->out_mutex);
+            conn->out_armed = false;
+            if (conn->open && conn->socket == events[i].data.fd) {
+                flush_queue(conn);
+                arm_writer(conn);
+            }
+            pthread_mutex_unlock(&conn->out_mutex);
+        }
+    }
+    return NULL;
+}
+
+void conn_close(int socket) {
+    Connection* conn = conn_get(socket);
+    if (conn == NULL) {
+        close(socket);
+        return;
+    }
+
+    pthread_mutex_lock(&conn->out_mutex);
+    flush_queue(conn);  // Last replies ("bye"), as far as the socket takes them
+    discard_queue(conn);
+    epoll_ctl(writer_epoll, EPOLL_CTL_DEL, socket, NULL);
+    conn->open = false;
+    mem_account_add(MEM_CONNECTIONS, -(long long)(conn->in_cap + conn->out_cap * sizeof(OutChunk)), -1);
+    free(conn->in_buf);
+    free(conn->out_queue);
+    conn->in_buf = NULL;
+    conn->out_queue = NULL;
+    conn->in_len = conn->in_cap = 0;
+    conn->out_count = conn->out_cap = 0;
+    conn->corked = 0;
+    conn->out_armed = false;
+    conn->dropped = false;
+    conn->socket = -1;
+    close(socket);  // Still under the lock: the fd can't be reused before the entry is reset
+    pthread_mutex_unlock(&conn->out_mutex);
+    atomic_fetch_sub(&nb_open, 1);
+}
+
+int conn_fill(Connection* conn) {
+    if (!reserve(&conn->in_buf, &conn->in_cap, conn->in_len + READ_CHUNK_SIZE)) {
+        return -1;
+    }
+
+    ssize_t bytes_read;
+    do {
+        bytes_read = recv(conn->socket, conn->in_buf + conn->in_len, READ_CHUNK_SIZE, MSG_DONTWAIT);
+    } while (bytes_read < 0 && errno == EINTR);
+
+    if (bytes_read == 0) return 0;  // Peer closed
+    if (bytes_read < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return -1;
+        return 0;  // Reset or other error, treat as closed
+    }
+    conn->in_len += bytes_read;
+    return (int)bytes_read;
+}
+
+bool conn_feed(Connection* conn, const char* data, size_t len) {
+    if (!reserve(&conn->in_buf, &conn->in_cap, conn->in_len + len)) return false;
+    memcpy(conn->in_buf + conn->in_len, data, len);
+    conn->in_len += len;
+    return true;
+}
+
+bool conn_has_line(const Connection* conn) {
+    return conn->in_len > 0 && memchr(conn->in_buf, '\n', conn->in_len) != NULL;
+}
+
+char* conn_next_line(Connection* conn, size_t max_len, bool* too_long) {
+    *too_long = false;
+    char* newline = conn->in_len > 0 ? memchr(conn->in_buf, '\n', conn->in_len) : NULL;
+
+    if (newline == NULL) {
+        // Incomplete line: drop it if it can never fit
+        if (conn->in_len > max_len) {
+            conn->in_len = 0;
+            *too_long = true;
+        }
+        return NULL;
+    }
+
+    size_t line_len = newline - conn->in_buf;
+    size_t consumed = line_len + 1;
+    char* line = NULL;
+
+    if (line_len > max_len) {
+        *too_long = true;
+    } else {
+        line = malloc(line_len + 1);
+        if (line) {
+            memcpy(line, conn->in_buf, line_len);
+            line[line_len] = '\0';
+        }
+    }
+
+    memmove(conn->in_buf, conn->in_buf + consumed, conn->in_len - consumed);
+    conn->in_len -= consumed;
+    return line;
+}
+
+void conn_send(int socket, const char* data, size_t len) {
+    Connection* conn = conn_get(socket);
+    if (conn == NULL) {
+        log_msg("[WARN] Dropping %d bytes for unknown socket %d\n", (int)len, socket);
+        return;
+    }
+
+    pthread_mutex_lock(&conn->out_mutex);
+    if (!conn->open) {
+        pthread_mutex_unlock(&conn->out_mutex);
+        return;
+    }
+    count_sent(conn, len);
+    SharedBuffer* buf = shared_buffer_copy(data, len);
+    if (buf != NULL) {
+        enqueue_chunk(conn, buf);
+        shared_buffer_unref(buf);  // The queue holds the reference now
+    } else {
+        drop_slow_consumer(conn);  // The order of the replies can't be kept
+    }
+    if (conn->corked == 0) arm_writer(conn);
+    pthread_mutex_unlock(&conn->out_mutex);
+}
+
+void conn_heartbeat(int socket) {
+    Connection* conn = conn_get(socket);
+    if (conn != NULL) atomic_store(&conn->last_heartbeat, sim_clock_real());
+}
+
+void conn_hangup(int socket, const char* data, size_t len) {
+    conn_send(socket, data, len);
+
+    Connection* conn = conn_get(socket);
+    if (conn == NULL) return;
+    pthread_mutex_lock(&conn->out_mutex);
+    if (conn->open) shutdown(socket, SHUT_RD);  // The queued replies still leave with conn_close
+    pthread_mutex_unlock(&conn->out_mutex);
+}
+
+void conn_send_shared(int socket, SharedBuffer* buf) {
+    Connection* conn = conn_get(socket);
+    if (conn == NULL || buf == NULL) {
+        log_msg("[WARN] Dropping shared buffer for unknown socket %d\n", socket);
+        return;
+    }
+
+    pthread_mutex_lock(&conn->out_mutex);
+    if (!conn->open) {
+        pthread_mutex_unlock(&conn->out_mutex);
+        return;
+    }
+    count_sent(conn, buf->len);
+    enqueue_chunk(conn, buf);
+    if (conn->corked == 0) arm_writer(conn);  // The tick only queues: it holds its aquarium
+    pthread_mutex_unlock(&conn->out_mutex);
+}
+
+void conn_send_traced(int socket, SharedBuffer* buf, unsigned int seq, microseconds_t detected) {
+    Connection* conn = conn_get(socket);
+    if (conn == NULL || buf == NULL) {
+        log_msg("[WARN] Dropping shared buffer for unknown socket %d\n", socket);
+        return;
+    }
+
+    pthread_mutex_lock(&conn->out_mutex);
+    if (!conn->open) {
+        pthread_mutex_unlock(&conn->out_mutex);
+        return;
+    }
+    count_sent(conn, buf->len);
+    if (enqueue_chunk(conn, buf)) {
+        OutChunk* update = append_chunk(conn);  // Written by flush_queue once the list has left
+        if (update != NULL) {
+            update->seq = seq;
+            update->detected = detected;
+        }
+    }
+    if (conn->corked == 0) arm_writer(conn);
+    pthread_mutex_unlock(&conn->out_mutex);
+}
+
+void conn_cork(Connection* conn) {
+    pthread_mutex_lock(&conn->out_mutex);
+    conn->corked++;
+    pthread_mutex_unlock(&conn->out_mutex);
+}
+
+void conn_uncork(Connection* conn) {
+    pthread_mutex_lock(&conn->out_mutex);
+    if (conn->corked > 0) conn->corked--;
+    if (conn->corked == 0 && conn->open) {
+        flush_queue(conn);
+        arm_writer(conn);
+    }
+    pthread_mutex_unlock(&conn->out_mutex);
+}
+
+bool conn_freeze_output(Connection* conn, StringBuilder* output) {
+    pthread_mutex_lock(&conn->out_mutex);
+    conn->frozen = true;
+    bool ok = true;
+    for (int i = 0; ok && i < conn->out_count; i++) {
+        OutChunk* chunk = &conn->out_queue[i];
+        // Its list leaves with the new controller: the update line is stamped now
+        if (chunk->buf == NULL) ok = write_update_line(conn, chunk);
+        if (ok) ok = sb_append(output, chunk->buf->data + chunk->offset, chunk->buf->len - chunk->offset);
+    }
+    pthread_mutex_unlock(&conn->out_mutex);
+    return ok;
+}
+
+void conn_thaw_output(Connection* conn) {
+    pthread_mutex_lock(&conn->out_mutex);
+    conn->frozen = false;
+    if (conn->open && conn->corked == 0) arm_writer(conn);
+    pthread_mutex_unlock(&conn->out_mutex);
+}
+
+bool conn_throttle(Connection* conn) {
+    pthread_mutex_lock(&conn->out_mutex);
+    if (conn->open && !conn->dropped && conn->out_bytes > MAX_OUTPUT_QUEUE / 2) {
+        flush_queue(conn);
+        arm_writer(conn);
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += OUTPUT_STALL_TIMEOUT;
+        while (conn->open && !conn->dropped && conn->out_bytes > MAX_OUTPUT_QUEUE / 2) {
+            size_t before = conn->out_bytes;
+            if (pthread_cond_timedwait(&conn->out_drained, &conn->out_mutex, &deadline) == ETIMEDOUT &&
+                conn->out_bytes >= before)
+            {
+                drop_slow_consumer(conn);
+            } else if (conn->out_bytes < before) {
+                // Progress: the client gets another OUTPUT_STALL_TIMEOUT for the rest
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_sec += OUTPUT_STALL_TIMEOUT;
+            }
+        }
+    }
+    bool alive = conn->open && !conn->dropped;
+    pthread_mutex_unlock(&conn->out_mutex);
+    return alive;
+}
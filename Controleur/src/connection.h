@@ -0,0 +1,132 @@
+// A Connection holds the per-client state needed for pipelining:
+// the bytes received but not handled yet, and the replies waiting to be flushed.
+//
+// The sockets are non-blocking and nothing sends while holding an aquarium: replies and lists
+// are only queued. A worker flushes its replies when it uncorks, what the socket does not take
+// right away is sent by the writer thread once epoll reports it writable. A client letting
+// MAX_OUTPUT_QUEUE bytes pile up is a slow consumer: its output is dropped and it is hung up.
+
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "shared_buffer.h"
+#include "utils.h"
+
+#define MAX_CONNECTIONS 4096       // Connections are indexed by their socket fd
+#define MAX_REQUESTS_PER_TURN 32   // Fairness: requests handled before the worker moves to another client
+#define READ_CHUNK_SIZE 65536      // Bytes read from a socket per turn
+#define MAX_IOV_PER_WRITE 64       // Chunks handed to a single sendmsg()
+#define MAX_OUTPUT_QUEUE (8 << 20) // Bytes queued for a client before it is dropped as a slow consumer
+#define OUTPUT_STALL_TIMEOUT 5     // s a worker waits for a client to take a long reply (conn_throttle)
+
+// A reply waiting in the output queue. Several queues can point to the same buffer.
+// buf == NULL: the "update" line of the traced list queued before it (see fanout_trace.h),
+// written once that list has left
+typedef struct OutChunk {
+    SharedBuffer* buf;
+    size_t offset;            // Bytes of buf already sent
+    unsigned int seq;         // Update lines only
+    microseconds_t detected;  // Update lines only
+} OutChunk;
+
+struct AquariumSlot;
+
+typedef struct Connection {
+    int socket;
+    bool open;
+    struct AquariumSlot* aquarium;  // Aquarium the client greeted into, NULL: the default one
+
+    // Received bytes, possibly several requests and an incomplete last line
+    char* in_buf;
+    size_t in_len, in_cap;
+
+    // Replies batched while the connection is corked or the socket is full, flushed with sendmsg
+    OutChunk* out_queue;
+    int out_count, out_cap;
+    size_t out_bytes;  // Queued and not sent yet
+    int corked;        // > 0 while a worker handles a batch of requests
+    bool out_armed;    // The writer thread waits for the socket to be writable
+    bool dropped;      // Slow consumer: its output is discarded until the connection is closed
+    bool frozen;       // Its output is being handed over to a new controller: nothing is sent
+
+    atomic_llong last_heartbeat;  // sim_clock_real() of the last hello or ping of its view
+    atomic_ullong bytes_sent;     // Handed to conn_send and conn_send_shared, for the metrics
+
+    pthread_mutex_t out_mutex;  // Protects the output side (workers and the update thread both write)
+    pthread_cond_t out_drained; // Part of the queue was sent, or the connection was dropped
+} Connection;
+
+// Initialize the connection table and start the writer thread. Call once before accepting clients
+void init_connections();
+
+// Number of open connections
+int conn_count();
+
+// Register a newly accepted socket. Returns NULL if the fd is out of range
+Connection* conn_open(int socket);
+
+// Get the connection of a socket. NULL if not registered
+Connection* conn_get(int socket);
+
+// Flush the pending replies, forget the connection and close its socket
+void conn_close(int socket);
+
+// Read what is available on the socket (without blocking) into the input buffer.
+// Returns the number of bytes read, 0 if the peer closed, -1 if nothing was available
+int conn_fill(Connection* conn);
+
+// Extract the next complete line (without '\n') from the input buffer into a heap string.
+// Returns NULL if no complete line is buffered. Lines longer than max_len are discarded
+// and reported through *too_long
+char* conn_next_line(Connection* conn, size_t max_len, bool* too_long);
+
+// Put bytes in the input buffer as if they had just been read (requests received by
+// the controller we take over from). Returns false if out of memory
+bool conn_feed(Connection* conn, const char* data, size_t len);
+
+// True if at least one complete line is buffered
+bool conn_has_line(const Connection* conn);
+
+// Queue data for a client. While the connection is corked it goes out with the next
+// uncork, in order with the other replies, else the writer thread sends it. Never blocks
+void conn_send(int socket, const char* data, size_t len);
+
+// The view of the client showed up (hello, ping). Its deadline is handled by the caller
+void conn_heartbeat(int socket);
+
+// Send a last message and stop reading: the worker that handles the socket next sees
+// the client gone and closes the connection. Safe while a worker is using it
+void conn_hangup(int socket, const char* data, size_t len);
+
+// Same as conn_send for a buffer that may be queued on several connections.
+// The connection takes its own reference, the caller keeps its one
+void conn_send_shared(int socket, SharedBuffer* buf);
+
+// Same as conn_send_shared for a traced list: it is followed by the line "update <seq> <detected>
+// <sent>", where sent is the time its last byte was handed to the kernel (fanout_trace_sent)
+void conn_send_traced(int socket, SharedBuffer* buf, unsigned int seq, microseconds_t detected);
+
+// Start batching the replies of a connection
+void conn_cork(Connection* conn);
+
+// Stop batching and send what the socket takes with as few sendmsg() calls as possible,
+// the writer thread sends the rest
+void conn_uncork(Connection* conn);
+
+// Live upgrade: stop sending to the client and append the output it has not received yet to
+// output (the rest of a partly sent chunk, then the queued ones). Returns false if out of memory
+bool conn_freeze_output(Connection* conn, StringBuilder* output);
+
+// The upgrade failed: send the frozen output again
+void conn_thaw_output(Connection* conn);
+
+// A worker streaming a long reply: past half of MAX_OUTPUT_QUEUE, flush and wait for the client
+// to take it. The client is dropped if it takes nothing for OUTPUT_STALL_TIMEOUT. Returns false
+// if it is gone. Must be called without holding an aquarium
+bool conn_throttle(Connection* conn);
+
+#endif // CONNECTION_H
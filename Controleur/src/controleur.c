@@ -1,51 +1,235 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <errno.h>
+#include <signal.h>
 #include <arpa/inet.h>
+#include <sys/epoll.h>
 #include "log.h"
 #include "handle_client.h"
+#include "connection.h"
 #include "cli.h"
 #include "aquarium.h"
 #include "read_cfg.h"
+#include "multicast.h"
+#include "shm_world.h"
+#include "snapshot.h"
+#include "journal.h"
+#include "takeover.h"
+#include "federation.h"
+#include "replication.h"
+#include "timer_wheel.h"
+#include "rate_limit.h"
+#include "metrics.h"
+#include "lock_profile.h"
+#include "fanout_trace.h"
+#include "capture.h"
+#include "trace.h"
+#include "sim_clock.h"
+#include "mem_account.h"
+#include "tick_scheduler.h"
 
-#define MAX_JOBS 100
+#define MAX_JOBS MAX_CONNECTIONS  // Each socket is queued at most once (EPOLLONESHOT)
 #define NB_THREADS 10
-#define MAX_CLIENTS 10
+#define TURN_BUDGET_US 2000  // A worker moves on to another client after this, even with requests left
+#define LISTEN_BACKLOG SOMAXCONN  // Connections waiting for accept(): a burst of displays must not stall in SYN retries
+#define MAX_EVENTS 64
 #define FISH_UPDATE_INTERVAL 10000  // en microseconds, 10ms atm
 
-int jobs_socket[MAX_JOBS];
-int index_current_job = 0;
+// One FIFO of sockets per request lane (see handle_client.h). FIFO rather than a stack so
+// that a client sent back to the queue after its turn waits behind the others.
+// The workers pick the lanes by smooth weighted round-robin, and bulk work can't take
+// every worker, so a ping never waits for a deep ls
+typedef struct JobLane
+{
+    int sockets[MAX_JOBS];
+    int head;
+    int count;
+    int weight;    // Share of the turns when every lane has work
+    int credit;    // Smooth weighted round-robin state
+    int busy;      // Workers serving the lane
+    int max_busy;  // Workers the lane may take
+    int max_requests;  // Requests handled per turn
+} JobLane;
+
+JobLane lanes[NB_LANES] = {
+    [LANE_CONTROL] = { .weight = 8, .max_busy = NB_THREADS, .max_requests = MAX_REQUESTS_PER_TURN },
+    [LANE_INTERACTIVE] = { .weight = 4, .max_busy = NB_THREADS, .max_requests = MAX_REQUESTS_PER_TURN },
+    [LANE_MUTATION] = { .weight = 2, .max_busy = NB_THREADS, .max_requests = MAX_REQUESTS_PER_TURN },
+    [LANE_BULK] = { .weight = 1, .max_busy = NB_THREADS / 2, .max_requests = 1 },
+};
+int nb_jobs = 0;
+int busy_workers = 0;  // Workers between dequeue_job() and job_done()
+Metric* queue_depth[NB_LANES];  // Sockets waiting in each lane
+Metric* busy_gauge = NULL;
 
 pthread_mutex_t mutex_jobs = PTHREAD_MUTEX_INITIALIZER;
+LockProfile profile_jobs = { .name = "mutex_jobs" };
 pthread_cond_t cond_jobs = PTHREAD_COND_INITIALIZER;
+pthread_cond_t cond_idle = PTHREAD_COND_INITIALIZER;
+
+int epoll_fd = -1;
+volatile sig_atomic_t stop_requested = 0;
 
-void enqueue_job(int socket)
+void enqueue_job(int socket, RequestLane lane)
 {
-    pthread_mutex_lock(&mutex_jobs);
-    while (index_current_job >= MAX_JOBS)
+    LockHold hold;
+    profiled_lock(&profile_jobs, &mutex_jobs, __func__, &hold);
+    JobLane* jobs = &lanes[lane];
+    while (jobs->count >= MAX_JOBS)
     {
-        pthread_cond_wait(&cond_jobs, &mutex_jobs);
+        profiled_cond_wait(&cond_jobs, &mutex_jobs, &hold);
     }
-    jobs_socket[index_current_job++] = socket;
+    jobs->sockets[(jobs->head + jobs->count) % MAX_JOBS] = socket;
+    jobs->count++;
+    nb_jobs++;
+    metrics_set(queue_depth[lane], jobs->count);
     pthread_cond_signal(&cond_jobs);
-    pthread_mutex_unlock(&mutex_jobs);
+    profiled_unlock(&mutex_jobs, &hold);
+}
+
+// Lane to serve next, -1 if none has work a worker may take. Assumes mutex_jobs is locked
+int pick_lane()
+{
+    int best = -1;
+    int total_weight = 0;
+    for (int lane = 0; lane < NB_LANES; lane++)
+    {
+        JobLane* jobs = &lanes[lane];
+        if (jobs->count == 0 || jobs->busy >= jobs->max_busy) continue;
+        jobs->credit += jobs->weight;
+        total_weight += jobs->weight;
+        if (best < 0 || jobs->credit > lanes[best].credit) best = lane;
+    }
+    if (best >= 0) lanes[best].credit -= total_weight;
+    return best;
 }
 
-int dequeue_job()
+int dequeue_job(RequestLane* lane)
 {
-    pthread_mutex_lock(&mutex_jobs);
-    while (index_current_job <= 0)
+    LockHold hold;
+    profiled_lock(&profile_jobs, &mutex_jobs, __func__, &hold);
+    int picked;
+    while ((picked = pick_lane()) < 0)
     {
-        pthread_cond_wait(&cond_jobs, &mutex_jobs);
+        profiled_cond_wait(&cond_jobs, &mutex_jobs, &hold);
     }
-    int job_socket = jobs_socket[--index_current_job];
+    JobLane* jobs = &lanes[picked];
+    int job_socket = jobs->sockets[jobs->head];
+    jobs->head = (jobs->head + 1) % MAX_JOBS;
+    jobs->count--;
+    jobs->busy++;
+    nb_jobs--;
+    busy_workers++;
+    metrics_set(queue_depth[picked], jobs->count);
+    metrics_set(busy_gauge, busy_workers);
     pthread_cond_signal(&cond_jobs);
-    pthread_mutex_unlock(&mutex_jobs);
+    profiled_unlock(&mutex_jobs, &hold);
+    *lane = (RequestLane)picked;
     return job_socket;
 }
 
+void job_done(RequestLane lane)
+{
+    LockHold hold;
+    profiled_lock(&profile_jobs, &mutex_jobs, __func__, &hold);
+    busy_workers--;
+    metrics_set(busy_gauge, busy_workers);
+    if (lanes[lane].busy-- == lanes[lane].max_busy) pthread_cond_broadcast(&cond_jobs);  // The lane is open again
+    if (busy_workers == 0 && nb_jobs == 0) pthread_cond_signal(&cond_idle);
+    profiled_unlock(&mutex_jobs, &hold);
+}
+
+// Gauges of the job queue (see metrics.h)
+void init_job_metrics()
+{
+    for (int lane = 0; lane < NB_LANES; lane++)
+    {
+        char labels[64];
+        snprintf(labels, sizeof(labels), "lane=\"%s\"", rate_limit_lane_name(lane));
+        queue_depth[lane] = metrics_gauge("aquarium_queue_depth", "Connections waiting for a worker, per lane", labels);
+    }
+    busy_gauge = metrics_gauge("aquarium_busy_workers", "Workers handling requests", "");
+}
+
+// Wait until every queued request has been handled. Only the event loop enqueues
+// new jobs, so when called from it the workers stay idle until it goes back to epoll
+void wait_workers_idle()
+{
+    LockHold hold;
+    profiled_lock(&profile_jobs, &mutex_jobs, __func__, &hold);
+    while (nb_jobs > 0 || busy_workers > 0)
+    {
+        profiled_cond_wait(&cond_idle, &mutex_jobs, &hold);
+    }
+    profiled_unlock(&mutex_jobs, &hold);
+}
+
+// Ask epoll to report the socket again once it is readable
+void rearm_socket(int socket)
+{
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.fd = socket;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, socket, &ev);
+}
+
+void close_client(int socket)
+{
+    // The view of the client is free again for the next hello
+    Connection* conn = conn_get(socket);
+    if (conn != NULL)
+    {
+        select_aquarium(conn->aquarium);
+        lock_aquarium();
+        release_view(socket);
+        unlock_aquarium();
+    }
+    timer_wheel_cancel(socket);
+    rate_limit_reset(socket);
+    fanout_trace_reset(socket);
+    capture_close(socket);
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, socket, NULL);
+    conn_close(socket);
+}
+
+// The view of a client stayed silent for display-timeout-value: release it and hang up.
+// The worker that sees the connection closed next closes it
+void expire_client(int socket)
+{
+    Connection* conn = conn_get(socket);
+    if (conn == NULL) return;
+
+    select_aquarium(conn->aquarium);
+    lock_aquarium();
+    bool expired = false;
+    Afficheur* view = current_aquarium != NULL ? current_aquarium->afficheurs : NULL;
+    while (view != NULL && view->socket != socket)
+    {
+        view = view->suivant;
+    }
+    // Unless a ping came in since the timer fired
+    if (view != NULL && sim_clock_real() - atomic_load(&conn->last_heartbeat) >= (microseconds_t)DISPLAY_TIMEOUT * 1000000)
+    {
+        log_msg("[timeout] Disconnecting view %s after a timeout of %d seconds\n", view->name, DISPLAY_TIMEOUT);
+        release_view(socket);
+        expired = true;
+    }
+    unlock_aquarium();
+    select_aquarium(NULL);
+
+    if (expired)
+    {
+        char reponse[] = "bye timeout\n";
+        conn_hangup(socket, reponse, strlen(reponse));
+    }
+}
+
 void *prompt_thread(void *arg){
+    trace_thread_name("cli");
     usleep(10000); // Wait 10ms to let the aquarium load
     log_msg("[WARNING] Load an aquarium before connecting clients!\n");
     CliContext* ctx = (CliContext*)arg;
@@ -53,59 +237,180 @@ void *prompt_thread(void *arg){
     return NULL;
 }
 
+// Tick of one aquarium: every hosted aquarium has its own thread (see get_aquarium_slot)
 void *getFishesContinuously_thread(void *arg)
 {
+    AquariumSlot* slot = (AquariumSlot*)arg;
+    select_aquarium(slot);
+    char thread_name[64];
+    snprintf(thread_name, sizeof(thread_name), "tick %s", slot->name);
+    trace_thread_name(thread_name);
+
+    microseconds_t last_snapshot_time = sim_clock_real();
+    TickSchedule schedule;
+    tick_schedule_init(&schedule, slot->name, FISH_UPDATE_INTERVAL);
     while (1)
     {
-        // Call update_fishes() every FISH_UPDATE_INTERVAL micro seconds
-        usleep(FISH_UPDATE_INTERVAL);
+        // Call update_fishes() every FISH_UPDATE_INTERVAL micro seconds of simulation time.
+        // With the virtual clock, the tick of the default aquarium is the one that moves it
+        tick_wait(&schedule, slot == default_aquarium_slot());
+
+        // A follower only mirrors the primary's ticks (see replication.h)
+        if (replication_following()) continue;
         
-        pthread_mutex_lock(&mutex_aquarium);
+        TraceSpan tick = trace_begin("tick", "tick", NULL);
+        lock_aquarium();
         update_fishes();
-        disconnect_views();
-        pthread_mutex_unlock(&mutex_aquarium);
+
+        // The shared memory and the snapshot file hold the default aquarium
+        if (slot == default_aquarium_slot())
+        {
+            shm_world_publish();
+            federation_tick();
+
+            // Periodic snapshot: only the copy is done here, the file is written in the background
+            microseconds_t now = sim_clock_real();
+            if (SNAPSHOT_FILE[0] != '\0' && SNAPSHOT_INTERVAL > 0 &&
+                now - last_snapshot_time >= (microseconds_t)SNAPSHOT_INTERVAL * 1000000)
+            {
+                last_snapshot_time = now;
+                if (current_aquarium != NULL) snapshot_save_async(SNAPSHOT_FILE);
+            }
+        }
+        unlock_aquarium();
+        trace_end(&tick);
+        tick_done(&schedule);
     }
     return NULL;
 }
 
-void *fct_thread(void *arg)
+// Lane of the next request buffered on a connection
+RequestLane buffered_lane(Connection* conn)
 {
-    while (1)
+    return request_lane(conn->in_buf, conn->in_len);
+}
+
+// Lane of a socket epoll reports readable: its buffered bytes, or a peek at the new ones
+RequestLane incoming_lane(int socket)
+{
+    Connection* conn = conn_get(socket);
+    if (conn != NULL && conn->in_len > 0) return buffered_lane(conn);
+
+    char peek[32];
+    ssize_t len = recv(socket, peek, sizeof(peek), MSG_PEEK | MSG_DONTWAIT);
+    return len > 0 ? request_lane(peek, len) : LANE_CONTROL;  // Closed: quick to handle
+}
+
+// Handles the pipelined requests of a connection that belong to lane, up to the lane's
+// max_requests and TURN_BUDGET_US. The replies are corked and leave in as few send() calls
+// as possible. Returns false if the connection has been closed
+bool handle_requests(Connection* conn, RequestLane lane)
+{
+    int job_socket = conn->socket;
+    bool open = true;
+    microseconds_t turn_end = sim_clock_real() + TURN_BUDGET_US;
+
+    conn_cork(conn);
+    for (int i = 0; i < lanes[lane].max_requests; i++)
     {
-        int job_socket = dequeue_job(); // Récupérer un socket client
-        if (job_socket < 0) {
-            log_msg("Erreur: job_socket < 0\n");
-            continue; // Sécurité : éviter les erreurs si aucun job disponible
+        // A request of another lane waits for its own turn
+        if (i > 0 && (buffered_lane(conn) != lane || sim_clock_real() >= turn_end)) break;
+
+        bool too_long = false;
+        char* line = conn_next_line(conn, MAX_MESSAGE_SIZE, &too_long);
+        if (too_long)
+        {
+            char response[] = "NOK Message too long\n";
+            conn_send(job_socket, response, strlen(response));
+        }
+        if (line == NULL)
+        {
+            if (!too_long) break;
+            continue;
         }
 
-        char buffer[BUFFER_SIZE];
-        
-        int bytesRead = read(job_socket, buffer, BUFFER_SIZE - 1);
-        if (bytesRead > 0)
+        trim(line);
+        if (line[0] == '\0')  // Empty line (e.g. println of a message ending with '\n')
         {
-            buffer[bytesRead] = '\0';  // Assurer la fin de chaîne
-            
-            if (strncmp(buffer, "log", 3) == 0 && strlen(buffer) == 4)
-            {
-                char reponse[4] = "bye";
-                log_msg("Fermeture du socket client.\n");
-                send(job_socket, reponse, strlen(reponse), 0);
-                close(job_socket);  // Fermer proprement la connexion
-            }
-            else
-            {
-                handle_message(job_socket, buffer);
-                
-                // 🔄 Remettre le job dans la file pour qu'un autre thread le prenne
-                enqueue_job(job_socket);
-            }
+            free(line);
+            i--;
+            continue;
+        }
+
+        if (strcmp(line, "log") == 0)
+        {
+            free(line);
+            char reponse[] = "bye\n";
+            log_msg("Fermeture du socket client.\n");
+            conn_send(job_socket, reponse, strlen(reponse));
+            open = false;
+            break;
         }
-        else
+
+        // Over its budget, the client gets a refusal instead of taking a worker's time
+        if (!rate_limit_take(job_socket, request_lane(line, strlen(line)), rate_limit_cost(line)))
+        {
+            free(line);
+            char response[] = "NOK rate limited\n";
+            conn_send(job_socket, response, strlen(response));
+            continue;
+        }
+
+        // Every request runs against the aquarium of the connection: a failed "hello in as
+        // view@aquarium" must not leave the next pipelined ones on the aquarium it selected
+        select_aquarium(conn->aquarium);
+        handle_message(job_socket, line);
+        free(line);
+    }
+    journal_sync();  // Replies to mutations leave once the mutations are on disk
+    conn_uncork(conn);
+
+    if (!open) close_client(job_socket);
+    return open;
+}
+
+void handle_job(int job_socket, RequestLane lane)
+{
+    Connection* conn = conn_get(job_socket);
+    if (conn == NULL) {
+        log_msg("Erreur: socket %d inconnu\n", job_socket);
+        return; // Sécurité : la connexion a déjà été fermée
+    }
+
+    // Only read when the previous turn left no complete request behind
+    if (!conn_has_line(conn))
+    {
+        int bytesRead = conn_fill(conn);
+        if (bytesRead == 0)
         {
             log_msg("Client déconnecté.\n");
-            close(job_socket);  // Fermer si le client coupe la connexion
+            close_client(job_socket);  // Fermer si le client coupe la connexion
+            return;
         }
     }
+
+    if (!handle_requests(conn, lane)) return;
+
+    // 🔄 More requests already buffered: go to the back of the queue of their lane so
+    // that one pipelining client can't monopolize a worker. Otherwise wait for epoll
+    if (conn_has_line(conn))
+        enqueue_job(job_socket, buffered_lane(conn));
+    else
+        rearm_socket(job_socket);
+}
+
+void *fct_thread(void *arg)
+{
+    char thread_name[32];
+    snprintf(thread_name, sizeof(thread_name), "worker %d", (int)(intptr_t)arg);
+    trace_thread_name(thread_name);
+    while (1)
+    {
+        RequestLane lane;
+        int job_socket = dequeue_job(&lane); // Récupérer un socket client
+        handle_job(job_socket, lane);
+        job_done(lane);
+    }
     return NULL;
 }
 
@@ -138,19 +443,9 @@ CliContext* init_ncurses()
     return ctx;
 }
 
-int main()
+// Socket TCP d'écoute sur le port du contrôleur
+int create_server_socket(int port)
 {
-    // Initialisation de ncurses
-    CliContext* cli_ctx = init_ncurses();
-
-    // Lire config
-    if (!read_cfg("controller.cfg"))
-    {
-        log_msg("Erreur de lecture du fichier de configuration.\n");
-        return EXIT_FAILURE;
-    }
-
-    // Création du socket
     int server_fd;
     if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0)
     {
@@ -160,10 +455,9 @@ int main()
 
     // Définition de l'adresse du serveur
     struct sockaddr_in address;
-    socklen_t addrlen = sizeof(address);
     address.sin_family = AF_INET;
     address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(CONTROLLER_PORT);
+    address.sin_port = htons(port);
 
     // Options du socket (réutilisation de l'adresse)
     int opt = 1;
@@ -181,43 +475,262 @@ int main()
     }
 
     // Écoute
-    if (listen(server_fd, MAX_CLIENTS) < 0)
+    if (listen(server_fd, LISTEN_BACKLOG) < 0)
     {
         perror("Erreur listen");
         exit(EXIT_FAILURE);
     }
+    return server_fd;
+}
+
+// Ctrl-C or SIGTERM: the event loop stops the controller
+void request_stop(int signal)
+{
+    (void)signal;
+    stop_requested = 1;
+}
+
+// Give the terminal back, then print the lock profile where it stays readable
+void stop_controller(int status)
+{
+    endwin();
+    capture_stop();
+    lock_profile_report(stderr);
+    exit(status);
+}
+
+// Ask epoll to report a client socket once it is readable
+void watch_client(int socket)
+{
+    struct epoll_event client_ev;
+    client_ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    client_ev.data.fd = socket;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socket, &client_ev);
+}
+
+int main(int argc, char *argv[])
+{
+    // "serveur --takeover" : reprendre le contrôleur en cours (sockets et monde) au lieu de démarrer
+    bool takeover = argc > 1 && strcmp(argv[1], "--takeover") == 0;
+    // "serveur --follow <hôte>:<port>" : réplique du contrôleur primaire, prend le relais à sa disparition
+    const char* primary = argc > 2 && strcmp(argv[1], "--follow") == 0 ? argv[2] : NULL;
+
+    // Initialisation de ncurses
+    CliContext* cli_ctx = init_ncurses();
+
+    // Lire config
+    if (!read_cfg("controller.cfg"))
+    {
+        log_msg("Erreur de lecture du fichier de configuration.\n");
+        return EXIT_FAILURE;
+    }
+
+    // Métriques : latence de chaque requête et de chaque phase du tick, files d'attente
+    init_request_metrics();
+    init_job_metrics();
+    init_rate_limit_metrics();
+    init_fanout_trace();
+    init_mem_account();  // Mémoire par sous-système, memory-limit
+    init_tick_scheduler(TICK_OVERRUN_POLICY);  // Échéances des ticks, retards
+
+    // Profil de contention des verrous (lock-profiling), affiché à l'arrêt
+    lock_profile_enable(LOCK_PROFILING != 0);
+    trace_configure(TRACE_BUFFER);
+    trace_enable(TRACE != 0);
+    trace_thread_name("main");
+    lock_profile_register(&profile_jobs);
+
+    // Horloge virtuelle : le tick de l'aquarium par défaut la fait avancer, sans attendre le temps réel
+    if (strcmp(SIM_CLOCK, "virtual") == 0)
+    {
+        sim_clock_use_virtual(SIM_CLOCK_SPEED);
+        log_msg("[INFO] Virtual clock, %s\n", SIM_CLOCK_SPEED > 0 ? "paced by clock-speed" : "as fast as the ticks run");
+        if (FEDERATION_PORT != 0)
+        {
+            log_msg("[WARN] Federation peers compare their times with ours: they must run the same clock\n");
+        }
+    }
+    else if (strcmp(SIM_CLOCK, "real") != 0)
+    {
+        log_msg("[WARN] Unknown clock '%s', using 'real'\n", SIM_CLOCK);
+    }
+
+    // Chaque aquarium chargé aura son propre thread de mise à jour
+    init_aquarium_registry(getFishesContinuously_thread);
+
+    // Création du socket (hérité du contrôleur en cours avec --takeover)
+    int server_fd = -1;
+    if (!takeover && primary == NULL)
+    {
+        server_fd = create_server_socket(CONTROLLER_PORT);
+    }
+
+    init_connections();
+    timer_wheel_init(MAX_CONNECTIONS);
+    multicast_init(MULTICAST_GROUP, MULTICAST_PORT, MULTICAST_INTERFACE);
+    shm_world_init(SHM_NAME, SHM_CAPACITY);
+
+    JournalPolicy journal_policy = JOURNAL_SYNC_ALWAYS;
+    if (!journal_parse_policy(JOURNAL_FSYNC, &journal_policy))
+    {
+        log_msg("[WARN] Unknown journal-fsync '%s', using 'always'\n", JOURNAL_FSYNC);
+    }
+
+    int* client_sockets = NULL;
+    int nb_clients = 0;
+    if (takeover)
+    {
+        // Le monde arrive de l'ancien contrôleur, déjà à jour : le journal n'est pas rejoué
+        server_fd = takeover_receive(UPGRADE_SOCKET, &client_sockets, &nb_clients);
+        if (server_fd < 0)
+        {
+            endwin();
+            fprintf(stderr, "Impossible de reprendre le contrôleur en cours (%s).\n", UPGRADE_SOCKET);
+            return EXIT_FAILURE;
+        }
+        journal_start(JOURNAL_FILE, journal_policy, JOURNAL_FSYNC_INTERVAL, 0, false);
+    }
+    else if (primary != NULL)
+    {
+        // Le monde arrive du primaire jusqu'à sa disparition ; ensuite on sert les clients à sa place
+        if (!replication_follow(primary))
+        {
+            endwin();
+            fprintf(stderr, "Impossible de suivre le contrôleur primaire (%s).\n", primary);
+            return EXIT_FAILURE;
+        }
+        server_fd = create_server_socket(CONTROLLER_PORT);
+        journal_start(JOURNAL_FILE, journal_policy, JOURNAL_FSYNC_INTERVAL, 0, false);
+    }
+    else
+    {
+        // Reprendre là où le contrôleur s'était arrêté : dernier instantané, puis le journal
+        uint64_t journal_generation = 0;
+        if (SNAPSHOT_FILE[0] != '\0')
+        {
+            snapshot_load(SNAPSHOT_FILE, &journal_generation);
+        }
+        journal_start(JOURNAL_FILE, journal_policy, JOURNAL_FSYNC_INTERVAL, journal_generation, true);
+    }
+
+    // Les contrôleurs voisins se partagent l'aquarium par défaut
+    federation_start(FEDERATION_PORT, FEDERATION_REGION, FEDERATION_PEERS, FEDERATION_PEER_COUNT);
+
+    // Les répliques en attente reçoivent le monde puis chaque mutation
+    replication_start(REPLICATION_PORT);
+
+    // Les métriques au format Prometheus sur http://127.0.0.1:<metrics-port>/metrics
+    metrics_http_start(METRICS_PORT);
+
+    // Le trafic des clients est enregistré pour bin/replay, avec les aquariums déjà chargés
+    if (CAPTURE_FILE[0] != '\0')
+    {
+        capture_start(CAPTURE_FILE);
+    }
 
     // Création des threads
     pthread_t threads[NB_THREADS];
     for (int i = 0; i < NB_THREADS; i++)
     {
-        pthread_create(&threads[i], NULL, fct_thread, NULL);
+        pthread_create(&threads[i], NULL, fct_thread, (void*)(intptr_t)i);
     }
 
     // Création du thread pour le prompt
     pthread_t prompt;
     pthread_create(&prompt, NULL, prompt_thread, (void*)cli_ctx);
 
-    // Création du thread pour le getFishesContinuously
-    pthread_t getFishesContinuously;
-    pthread_create(&getFishesContinuously, NULL, getFishesContinuously_thread, NULL);
+    // Ctrl-C et SIGTERM arrêtent la boucle d'événements (le profil des verrous est affiché)
+    struct sigaction stop_action;
+    memset(&stop_action, 0, sizeof(stop_action));
+    stop_action.sa_handler = request_stop;
+    sigaction(SIGINT, &stop_action, NULL);
+    sigaction(SIGTERM, &stop_action, NULL);
+
+    // Boucle d'événements : accepte les connexions et transmet les sockets lisibles aux workers
+    epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0)
+    {
+        perror("Erreur epoll");
+        exit(EXIT_FAILURE);
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = server_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &ev);
+
+    // Les clients de l'ancien contrôleur : leurs requêtes en attente sont traitées tout de suite
+    for (int i = 0; i < nb_clients; i++)
+    {
+        watch_client(client_sockets[i]);
+    }
+    free(client_sockets);
+
+    // Un prochain binaire pourra reprendre celui-ci
+    int upgrade_fd = takeover_listen(UPGRADE_SOCKET);
+    if (upgrade_fd >= 0)
+    {
+        ev.events = EPOLLIN;
+        ev.data.fd = upgrade_fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, upgrade_fd, &ev);
+    }
 
-    // Accepter les connexions
     log_msg("[INFO] Serveur en attente de connexions sur le port %d...\n", CONTROLLER_PORT);
-    while (1)
+    struct epoll_event events[MAX_EVENTS];
+    static int expired[MAX_CONNECTIONS];
+    while (!stop_requested)
     {
-        // Accepter un client
-        int new_socket = accept(server_fd, (struct sockaddr *)&address, &addrlen);
-        if (new_socket < 0)
+        // Les vues muettes depuis display-timeout-value sont déconnectées en une fois
+        int nb_expired = timer_wheel_expire(expired);
+        for (int i = 0; i < nb_expired; i++)
+        {
+            expire_client(expired[i]);
+        }
+
+        int nb_events = epoll_wait(epoll_fd, events, MAX_EVENTS, timer_wheel_next_timeout());
+        if (nb_events < 0)
         {
-            perror("Erreur accept");
+            if (errno == EINTR) continue;
+            perror("Erreur epoll_wait");
             exit(EXIT_FAILURE);
         }
-        log_msg("Nouvelle connexion acceptée\n");
-        // Ajouter le job à la file
 
-        enqueue_job(new_socket);
+        for (int i = 0; i < nb_events; i++)
+        {
+            int fd = events[i].data.fd;
+            if (fd == upgrade_fd)
+            {
+                // Un nouveau binaire prend la suite : plus de requête en cours, puis passation
+                wait_workers_idle();
+                if (takeover_handoff(upgrade_fd, server_fd))
+                {
+                    stop_controller(EXIT_SUCCESS);
+                }
+                continue;
+            }
+            if (fd != server_fd)
+            {
+                // Ajouter le job à la file
+                enqueue_job(fd, incoming_lane(fd));
+                continue;
+            }
+
+            // Accepter un client
+            int new_socket = accept(server_fd, NULL, NULL);
+            if (new_socket < 0)
+            {
+                perror("Erreur accept");
+                continue;
+            }
+            if (conn_open(new_socket) == NULL)
+            {
+                close(new_socket);
+                continue;
+            }
+            log_msg("Nouvelle connexion acceptée\n");
+            watch_client(new_socket);
+        }
     }
 
+    stop_controller(EXIT_SUCCESS);
     return 0;
 }
@@ -1,10 +1,12 @@
 #include "doubly_linked_list.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include "mem_account.h"
 
 DoublyLinkedList* create_list() {
     DoublyLinkedList* list = (DoublyLinkedList*)malloc(sizeof(DoublyLinkedList));
     if (!list) return NULL;
+    mem_account_add(MEM_WAYPOINTS, sizeof(DoublyLinkedList), 0);
     list->head = NULL;
     list->tail = NULL;
     list->size = 0;
@@ -19,6 +21,7 @@ void destroy_list(DoublyLinkedList* list) {
         free(current);
         current = next;
     }
+    mem_account_add(MEM_WAYPOINTS, -(long long)(list->size * sizeof(Node) + sizeof(DoublyLinkedList)), -(long long)list->size);
     free(list);
 }
 
@@ -26,6 +29,7 @@ void insert_front(DoublyLinkedList* list, FishNextPos data) {
     if (!list) return;
     Node* new_node = (Node*)malloc(sizeof(Node));
     if (!new_node) return;
+    mem_account_add(MEM_WAYPOINTS, sizeof(Node), 1);
     new_node->data = data;
     new_node->prev = NULL;
     new_node->next = list->head;
@@ -43,6 +47,7 @@ void insert_back(DoublyLinkedList* list, FishNextPos data) {
     if (!list) return;
     Node* new_node = (Node*)malloc(sizeof(Node));
     if (!new_node) return;
+    mem_account_add(MEM_WAYPOINTS, sizeof(Node), 1);
     new_node->data = data;
     new_node->next = NULL;
     new_node->prev = list->tail;
@@ -76,6 +81,7 @@ void delete_value(DoublyLinkedList* list, FishNextPos data) {
                 list->tail = current->prev;
 
             free(current);
+            mem_account_add(MEM_WAYPOINTS, -(long long)sizeof(Node), -1);
             list->size--;
             return;
         }
@@ -143,6 +149,7 @@ FishNextPos pop_front(DoublyLinkedList* list) {
         list->tail = NULL; // List became empty
 
     free(front);
+    mem_account_add(MEM_WAYPOINTS, -(long long)sizeof(Node), -1);
     list->size--;
 
     return data;
@@ -184,6 +191,7 @@ FishNextPos pop_back(DoublyLinkedList* list) {
         list->head = NULL; // List became empty
 
     free(back);
+    mem_account_add(MEM_WAYPOINTS, -(long long)sizeof(Node), -1);
     list->size--;
 
     return data;
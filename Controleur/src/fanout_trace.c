@@ -0,0 +1,186 @@
+#include "fanout_trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "aquarium.h"
+#include "connection.h"
+#include "metrics.h"
+#include "read_cfg.h"
+#include "log.h"
+
+#define SLOW_VIEW_WEIGHT 8  // The latency of a view is averaged over about this many updates
+
+// Latencies of a view, kept across its reconnections. Never freed
+typedef struct ViewLatency {
+    char name[MAX_NAME_LEN];
+    Histogram send_delay;  // Detection to send
+    Histogram ack_delay;   // Send to ack
+    atomic_ullong unacked;
+    double average_us;  // Moving average of detection to ack (to send, while the display never acked)
+    bool observed;      // average_us holds a latency
+    bool slow;
+    struct ViewLatency* suivant;
+} ViewLatency;
+
+typedef struct PendingUpdate {
+    unsigned int seq;
+    microseconds_t detected, sent;  // sent == 0: free
+    bool acked;
+} PendingUpdate;
+
+typedef struct TracedSocket {
+    ViewLatency* view;  // NULL: not traced
+    unsigned int next_seq;
+    bool acks;  // The display acked at least once
+    PendingUpdate pending[FANOUT_TRACE_PENDING];  // By seq % FANOUT_TRACE_PENDING
+} TracedSocket;
+
+static TracedSocket traced[MAX_CONNECTIONS];
+static ViewLatency* views = NULL;  // In tracing order
+static pthread_mutex_t mutex_trace = PTHREAD_MUTEX_INITIALIZER;
+
+static void collect_fanout_metrics(StringBuilder* out, bool comments) {
+    // Views are never removed: the list can be walked once its head is read
+    pthread_mutex_lock(&mutex_trace);
+    ViewLatency* first = views;
+    pthread_mutex_unlock(&mutex_trace);
+    if (first == NULL) return;
+
+    char labels[80];
+    metrics_write_header(out, comments, "aquarium_view_send_delay_us", "summary",
+                         "Time from the detection of an arrival to the last byte of its list taken by the kernel, per traced view");
+    for (ViewLatency* view = first; view != NULL; view = view->suivant) {
+        snprintf(labels, sizeof(labels), "view=\"%s\"", view->name);
+        metrics_write_histogram(out, "aquarium_view_send_delay_us", labels, &view->send_delay);
+    }
+    metrics_write_header(out, comments, "aquarium_view_ack_delay_us", "summary",
+                         "Time from the last byte of the list taken by the kernel to its ack, per traced view");
+    for (ViewLatency* view = first; view != NULL; view = view->suivant) {
+        snprintf(labels, sizeof(labels), "view=\"%s\"", view->name);
+        metrics_write_histogram(out, "aquarium_view_ack_delay_us", labels, &view->ack_delay);
+    }
+    metrics_write_header(out, comments, "aquarium_view_unacked_total", "counter",
+                         "Updates of an acking display that were never acked");
+    for (ViewLatency* view = first; view != NULL; view = view->suivant) {
+        snprintf(labels, sizeof(labels), "view=\"%s\"", view->name);
+        metrics_write_value(out, "aquarium_view_unacked_total", labels, (long long)atomic_load(&view->unacked));
+    }
+    metrics_write_header(out, comments, "aquarium_view_slow", "gauge",
+                         "1 while the display lags more than slow-view-ms behind the arrivals");
+    pthread_mutex_lock(&mutex_trace);
+    for (ViewLatency* view = first; view != NULL; view = view->suivant) {
+        snprintf(labels, sizeof(labels), "view=\"%s\"", view->name);
+        metrics_write_value(out, "aquarium_view_slow", labels, view->slow);
+    }
+    pthread_mutex_unlock(&mutex_trace);
+}
+
+void init_fanout_trace() {
+    metrics_collector(collect_fanout_metrics);
+}
+
+// Add a latency to the average of a view, and flag it slow or caught up
+static void observe(ViewLatency* view, microseconds_t latency) {  // Assumes mutex_trace is locked
+    view->average_us = view->observed ? view->average_us + (latency - view->average_us) / SLOW_VIEW_WEIGHT : latency;
+    view->observed = true;
+    if (SLOW_VIEW_MS <= 0) return;
+
+    double threshold_us = SLOW_VIEW_MS * 1000.0;
+    if (!view->slow && view->average_us > threshold_us) {
+        view->slow = true;
+        log_msg("[WARN] View %s is slow: its updates are shown %.1f ms after the arrivals\n",
+                view->name, view->average_us / 1000);
+    } else if (view->slow && view->average_us < threshold_us / 2) {
+        view->slow = false;
+        log_msg("[INFO] View %s caught up: %.1f ms\n", view->name, view->average_us / 1000);
+    }
+}
+
+static ViewLatency* find_view(const char* name) {  // Assumes mutex_trace is locked
+    ViewLatency** last = &views;
+    for (ViewLatency* view = views; view != NULL; view = view->suivant) {
+        if (strcmp(view->name, name) == 0) return view;
+        last = &view->suivant;
+    }
+    ViewLatency* view = (ViewLatency*)calloc(1, sizeof(ViewLatency));
+    if (view == NULL) return NULL;
+    strncpy(view->name, name, MAX_NAME_LEN - 1);
+    *last = view;
+    return view;
+}
+
+bool fanout_trace_enable(int socket, const char* view_name) {
+    if (socket < 0 || socket >= MAX_CONNECTIONS) return false;
+
+    pthread_mutex_lock(&mutex_trace);
+    ViewLatency* view = find_view(view_name);
+    if (view != NULL && traced[socket].view != view) {
+        memset(&traced[socket], 0, sizeof(TracedSocket));
+        traced[socket].view = view;
+    }
+    pthread_mutex_unlock(&mutex_trace);
+    return view != NULL;
+}
+
+bool fanout_trace_next(int socket, unsigned int* seq) {
+    if (socket < 0 || socket >= MAX_CONNECTIONS) return false;
+
+    pthread_mutex_lock(&mutex_trace);
+    bool traced_socket = traced[socket].view != NULL;
+    if (traced_socket) *seq = traced[socket].next_seq++;
+    pthread_mutex_unlock(&mutex_trace);
+    return traced_socket;
+}
+
+int fanout_trace_sent(int socket, unsigned int seq, microseconds_t detected, microseconds_t sent,
+                      char* line, size_t size) {
+    if (socket < 0 || socket >= MAX_CONNECTIONS) return 0;
+
+    pthread_mutex_lock(&mutex_trace);
+    TracedSocket* t = &traced[socket];
+    if (t->view == NULL) {
+        pthread_mutex_unlock(&mutex_trace);
+        return 0;
+    }
+    PendingUpdate* slot = &t->pending[seq % FANOUT_TRACE_PENDING];
+    if (t->acks && slot->sent != 0 && !slot->acked) {
+        // Still not acked FANOUT_TRACE_PENDING updates later: at least that late
+        atomic_fetch_add(&t->view->unacked, 1);
+        observe(t->view, sent - slot->detected);
+    }
+    *slot = (PendingUpdate){seq, detected, sent, false};
+    histogram_record(&t->view->send_delay, sent - detected);
+    if (!t->acks) observe(t->view, sent - detected);
+    pthread_mutex_unlock(&mutex_trace);
+
+    int len = snprintf(line, size, "update %u %lld %lld\n", seq, detected, sent);
+    return len < 0 || (size_t)len >= size ? 0 : len;
+}
+
+bool fanout_trace_ack(int socket, unsigned int seq, microseconds_t now) {
+    if (socket < 0 || socket >= MAX_CONNECTIONS) return false;
+
+    pthread_mutex_lock(&mutex_trace);
+    TracedSocket* t = &traced[socket];
+    PendingUpdate* slot = &t->pending[seq % FANOUT_TRACE_PENDING];
+    bool awaited = t->view != NULL && slot->sent != 0 && slot->seq == seq && !slot->acked;
+    if (awaited) {
+        slot->acked = true;
+        if (!t->acks) t->view->observed = false;  // Judged on its acks from now on
+        t->acks = true;
+        histogram_record(&t->view->ack_delay, now - slot->sent);
+        observe(t->view, now - slot->detected);
+    }
+    pthread_mutex_unlock(&mutex_trace);
+    return awaited;
+}
+
+void fanout_trace_reset(int socket) {
+    if (socket < 0 || socket >= MAX_CONNECTIONS) return;
+
+    pthread_mutex_lock(&mutex_trace);
+    memset(&traced[socket], 0, sizeof(TracedSocket));
+    pthread_mutex_unlock(&mutex_trace);
+}
@@ -0,0 +1,44 @@
+// Fan-out latency of the continuous updates: how stale the positions on a wall are.
+//
+// A display subscribed with "getFishesContinuously trace" gets, right after each list, the line
+// "update <seq> <detected> <sent>": the tick time (µs) at which the arrival was detected and
+// the time the last byte of the list was handed to the kernel, stamped by the connection once
+// the list has left its output queue. The display may answer "ack <seq>" once it has drawn the
+// list. Per view, the controller keeps the histograms of detection to send (tick scheduling,
+// formatting and the wait in the output queue behind a slow client) and of send to ack (network
+// and display), and flags the view as slow when detection to ack stays over slow-view-ms.
+// Displays that never ack are judged on detection to send.
+//
+// Everything is in the metrics (stats, metrics-port): aquarium_view_send_delay_us,
+// aquarium_view_ack_delay_us, aquarium_view_slow and aquarium_view_unacked_total, per view.
+
+#ifndef FANOUT_TRACE_H
+#define FANOUT_TRACE_H
+
+#include <stdbool.h>
+#include "utils.h"
+
+#define FANOUT_TRACE_PENDING 16  // Updates awaiting their ack per display. Older ones count as unacked
+
+// Export the per-view latencies in the metrics (see metrics.h)
+void init_fanout_trace();
+
+// Trace the updates sent to socket, the connection of view_name. Returns false if out of memory
+bool fanout_trace_enable(int socket, const char* view_name);
+
+// Is socket traced? *seq gets the number of its next update, to queue with its list (conn_send_traced)
+bool fanout_trace_next(int socket, unsigned int* seq);
+
+// The last byte of update seq, detected at detected, was handed to the kernel at sent: record it
+// and write its "update" line in line. Returns the length of the line, 0 if socket is not traced
+// anymore. Called by the connection with its output locked
+int fanout_trace_sent(int socket, unsigned int seq, microseconds_t detected, microseconds_t sent,
+                      char* line, size_t size);
+
+// "ack <seq>" received at now. Returns false if seq is not awaited (unknown or too old)
+bool fanout_trace_ack(int socket, unsigned int seq, microseconds_t now);
+
+// The socket was closed: its next connection is not traced
+void fanout_trace_reset(int socket);
+
+#endif // FANOUT_TRACE_H
@@ -0,0 +1,737 @@
+#include "federation.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include "aquarium.h"
+#include "journal.h"
+#include "replication.h"
+#include "shared_buffer.h"
+#include "shm_world.h"
+#include "log.h"
+#include "sim_clock.h"
+
+#define MAX_LINKS (FEDERATION_MAX_PEERS * 2)  // Inbound links, a reconnecting peer may briefly have two
+#define REGION_LEN 64
+
+typedef struct Region {
+    int x, y, w, h;
+} Region;
+
+typedef struct Peer {
+    char address[BUFFER_SIZE_CFG];
+    struct sockaddr_in sockaddr;
+    Region region;  // Area the peer simulates
+
+    // The link we dialed and send on, protected by mutex_federation
+    int out_socket;  // -1 while down
+    StringBuilder out;  // Lines not sent yet
+    char interest_sent[REGION_LEN + 16];  // Last interest line sent, "" after a reconnection
+    microseconds_t next_dial;
+    bool dial_failed;  // Only log the first failed attempt
+
+    // What the peer told us on its link, protected by the mutex of the default aquarium
+    bool has_interest;
+    Region interest;
+} Peer;
+
+// A link a peer dialed: we only read from it
+typedef struct Link {
+    int socket;  // -1: free
+    int peer;    // -1 until its region line
+    char* buf;
+    size_t len, cap;
+} Link;
+
+static bool enabled = false;
+static Region own_region;
+static Peer peers[FEDERATION_MAX_PEERS];
+static int nb_peers = 0;
+static Link links[MAX_LINKS];
+static int listen_port = 0;
+static int listen_socket = -1;
+static int wake_pipe[2] = { -1, -1 };  // The tick wakes the federation thread up when it queues lines
+static pthread_mutex_t mutex_federation = PTHREAD_MUTEX_INITIALIZER;
+
+// -------------------------- Helpers --------------------------------
+
+static bool parse_region(const char* text, Region* region) {
+    return sscanf(text, "%dx%d+%d+%d", &region->x, &region->y, &region->w, &region->h) == 4 &&
+        region->w > 0 && region->h > 0;
+}
+
+static void format_region(char* buffer, size_t size, const Region* region) {
+    snprintf(buffer, size, "%dx%d+%d+%d", region->x, region->y, region->w, region->h);
+}
+
+static bool region_contains(const Region* region, int x, int y) {
+    return x >= region->x && x < region->x + region->w && y >= region->y && y < region->y + region->h;
+}
+
+static bool regions_overlap(const Region* a, const Region* b) {
+    return a->x < b->x + b->w && b->x < a->x + a->w && a->y < b->y + b->h && b->y < a->y + a->h;
+}
+
+static bool same_region(const Region* a, const Region* b) {
+    return a->x == b->x && a->y == b->y && a->w == b->w && a->h == b->h;
+}
+
+static void wake_up() {
+    char byte = 1;
+    ssize_t written = write(wake_pipe[1], &byte, 1);
+    (void)written;  // Full pipe: the thread is already going to wake up
+}
+
+// Queue bytes for a peer. False if the link is down or the peer is not reading.
+// Assumes mutex_federation is locked
+static bool queue_locked(Peer* peer, const char* data, size_t len) {
+    if (peer->out_socket < 0) return false;
+    if (peer->out.len + len > FEDERATION_MAX_PENDING) {
+        log_msg("[WARN] Federation peer %s is not reading, dropping what is queued for it\n", peer->address);
+        return false;
+    }
+    return sb_append(&peer->out, data, len);
+}
+
+static bool queue_line(Peer* peer, const char* data, size_t len) {
+    pthread_mutex_lock(&mutex_federation);
+    bool queued = queue_locked(peer, data, len);
+    pthread_mutex_unlock(&mutex_federation);
+    if (queued) wake_up();
+    return queued;
+}
+
+static const char* move_function_name(const Fish* fish) {
+    for (int i = 0; i < table_size; i++) {
+        if (table[i].fonction == fish->move_function) return table[i].nom;
+    }
+    return "RandomWayPoint";
+}
+
+// Append up to max_positions positions of a fish as " <n> <x> <y> <dt>..."
+static void append_positions(StringBuilder* sb, const Fish* fish, size_t max_positions, microseconds_t now) {
+    size_t count = fish->future_positions->size < max_positions ? fish->future_positions->size : max_positions;
+    sb_appendf(sb, " %d", (int)count);
+    Node* node = fish->future_positions->head;
+    for (size_t i = 0; i < count && node != NULL; i++, node = node->next) {
+        sb_appendf(sb, " %d %d %lld", node->data.x, node->data.y, (long long)(node->data.arrival_time - now));
+    }
+}
+
+// Read positions written by append_positions into a new list. NULL if malformed
+static DoublyLinkedList* parse_positions(char** save, microseconds_t now) {
+    char* tok = strtok_r(NULL, " ", save);
+    int count = tok != NULL ? atoi(tok) : -1;
+    if (count < 0) return NULL;
+
+    DoublyLinkedList* positions = create_list();
+    for (int i = 0; i < count; i++) {
+        char* x = strtok_r(NULL, " ", save);
+        char* y = strtok_r(NULL, " ", save);
+        char* dt = strtok_r(NULL, " ", save);
+        if (x == NULL || y == NULL || dt == NULL) {
+            destroy_list(positions);
+            return NULL;
+        }
+        FishNextPos position = { atoi(x), atoi(y), now + strtoll(dt, NULL, 10) };
+        insert_back(positions, position);
+    }
+    return positions;
+}
+
+// -------------------------- Tick (sending side) --------------------------------
+
+// Peer that simulates the area where the fish is heading, -1 if it is ours
+static int fish_owner(const Fish* fish) {
+    FishNextPos* target = peek_front(fish->future_positions);
+    if (target == NULL || region_contains(&own_region, target->x, target->y)) return -1;
+    for (int i = 0; i < nb_peers; i++) {
+        if (region_contains(&peers[i].region, target->x, target->y)) return i;
+    }
+    return -1;  // Nobody's region: keep simulating it
+}
+
+static bool send_fish(Peer* peer, const Fish* fish, microseconds_t now) {
+    StringBuilder line;
+    if (!sb_init(&line, 256)) return false;
+    sb_appendf(&line, "fish %s %s %d %d %.17g %d", fish->name, move_function_name(fish),
+        fish->w, fish->h, fish->speed, fish->started ? 1 : 0);
+    append_positions(&line, fish, fish->future_positions->size, now);
+    sb_append(&line, "\n", 1);
+    bool sent = queue_line(peer, line.data, line.len);
+    sb_free(&line);
+    return sent;
+}
+
+// Hand the fishes heading out of our region to their new owner. They stay here as ghosts
+// until the owner's next ghosts line
+static void handoff_fishes(microseconds_t now) {  // Assumes the mutex is locked
+    int handed = 0;
+    Fish* previous = NULL;
+    Fish* fish = current_aquarium->poissons;
+    while (fish != NULL) {
+        Fish* next = fish->suivant;
+        int owner = fish->to_delete ? -1 : fish_owner(fish);
+        if (owner >= 0 && send_fish(&peers[owner], fish, now)) {
+            if (previous == NULL) {
+                current_aquarium->poissons = next;
+            } else {
+                previous->suivant = next;
+            }
+            hash_table_remove(current_aquarium->fish_index, fish->name);
+            current_aquarium->fish_count--;
+            journal_record("delFish %s", fish->name);  // A replay must not bring it back here
+            replication_record("drop %s", fish->name);
+
+            fish->peer = owner;
+            fish->suivant = current_aquarium->ghosts;
+            current_aquarium->ghosts = fish;
+            handed++;
+        } else {
+            previous = fish;
+        }
+        fish = next;
+    }
+
+    if (handed > 0) {
+        shm_world_touch();
+        log_msg("[INFO] Federation: handed off %d fishes\n", handed);
+    }
+}
+
+// Tell the peers which part of the aquarium our connected views show, when it changes
+static void send_interest() {  // Assumes the mutex is locked
+    bool any = false;
+    int x1 = 0, y1 = 0, x2 = 0, y2 = 0;
+    for (Afficheur* view = current_aquarium->afficheurs; view != NULL; view = view->suivant) {
+        if (view->socket == -1) continue;
+        if (!any || view->x < x1) x1 = view->x;
+        if (!any || view->y < y1) y1 = view->y;
+        if (!any || view->x + view->w > x2) x2 = view->x + view->w;
+        if (!any || view->y + view->h > y2) y2 = view->y + view->h;
+        any = true;
+    }
+
+    char line[REGION_LEN + 16];
+    if (any) {
+        Region interest = { x1, y1, x2 - x1, y2 - y1 };
+        char region[REGION_LEN];
+        format_region(region, sizeof(region), &interest);
+        snprintf(line, sizeof(line), "interest %s\n", region);
+    } else {
+        snprintf(line, sizeof(line), "interest none\n");
+    }
+
+    bool queued = false;
+    pthread_mutex_lock(&mutex_federation);
+    for (int i = 0; i < nb_peers; i++) {
+        if (strcmp(peers[i].interest_sent, line) != 0 && queue_locked(&peers[i], line, strlen(line))) {
+            snprintf(peers[i].interest_sent, sizeof(peers[i].interest_sent), "%s", line);
+            queued = true;
+        }
+    }
+    pthread_mutex_unlock(&mutex_federation);
+    if (queued) wake_up();
+}
+
+// Area a ghost may cover over its next positions
+static Region fish_extent(const Fish* fish) {
+    Region extent = { 0, 0, 0, 0 };
+    Node* node = fish->future_positions->head;
+    for (int i = 0; i < FEDERATION_GHOST_POSITIONS && node != NULL; i++, node = node->next) {
+        int x1 = i == 0 || node->data.x < extent.x ? node->data.x : extent.x;
+        int y1 = i == 0 || node->data.y < extent.y ? node->data.y : extent.y;
+        int x2 = i == 0 || node->data.x + fish->w > extent.x + extent.w ? node->data.x + fish->w : extent.x + extent.w;
+        int y2 = i == 0 || node->data.y + fish->h > extent.y + extent.h ? node->data.y + fish->h : extent.y + extent.h;
+        extent = (Region){ x1, y1, x2 - x1 + 1, y2 - y1 + 1 };
+    }
+    return extent;
+}
+
+// Send every peer with connected views the fishes it can see
+static void send_ghosts(microseconds_t now) {  // Assumes the mutex is locked
+    for (int i = 0; i < nb_peers; i++) {
+        Peer* peer = &peers[i];
+        if (!peer->has_interest) continue;
+
+        StringBuilder line;
+        if (!sb_init(&line, 4096)) return;
+        sb_append(&line, "ghosts", 6);
+        for (Fish* fish = current_aquarium->poissons; fish != NULL; fish = fish->suivant) {
+            if (!fish->started || fish->to_delete || fish->future_positions->size == 0) continue;
+            Region extent = fish_extent(fish);
+            if (!regions_overlap(&extent, &peer->interest)) continue;
+
+            sb_appendf(&line, " %s %d %d", fish->name, fish->w, fish->h);
+            append_positions(&line, fish, FEDERATION_GHOST_POSITIONS, now);
+        }
+        sb_append(&line, "\n", 1);
+        queue_line(peer, line.data, line.len);
+        sb_free(&line);
+    }
+}
+
+void federation_tick() {  // Assumes the mutex is locked
+    if (!enabled || current_aquarium == NULL) return;
+
+    microseconds_t now = sim_clock_now();
+    handoff_fishes(now);
+    send_interest();
+    send_ghosts(now);
+}
+
+// -------------------------- Federation thread (receiving side) --------------------------------
+
+static void free_fish_list(Fish* fish) {
+    while (fish != NULL) {
+        Fish* next = fish->suivant;
+        destroy_fish(fish);
+        fish = next;
+    }
+}
+
+// Remove the ghosts that match (peer >= 0: every ghost of peer, else the one named name)
+static void remove_ghosts(int peer, const char* name) {  // Assumes the mutex is locked
+    Fish** link = &current_aquarium->ghosts;
+    while (*link != NULL) {
+        Fish* ghost = *link;
+        if (peer >= 0 ? ghost->peer == peer : strncmp(ghost->name, name, MAX_NAME_LEN) == 0) {
+            *link = ghost->suivant;
+            ghost->suivant = NULL;
+            free_fish_list(ghost);
+        } else {
+            link = &ghost->suivant;
+        }
+    }
+}
+
+static Fish* new_fish(const char* name, int w, int h) {
+    Fish* fish = create_fish();
+    if (fish == NULL) return NULL;
+    snprintf(fish->name, MAX_NAME_LEN, "%s", name);
+    seed_fish_rng(fish);
+    fish->w = w;
+    fish->h = h;
+    fish->peer = -1;
+    return fish;
+}
+
+// Journal an adopted fish: "fish <name> <move_function> <w> <h> <speed> <started> <rng>", then its
+// positions like append_positions, relative to now. A replay must bring it back with its trajectory
+static void journal_fish(const Fish* fish, microseconds_t now) {  // Assumes the mutex is locked
+    StringBuilder record;
+    if (!sb_init(&record, 256)) return;
+    sb_appendf(&record, "fish %s %s %d %d %.17g %d %u", fish->name, move_function_name(fish),
+        fish->w, fish->h, fish->speed, fish->started ? 1 : 0, fish->rng);
+    append_positions(&record, fish, JOURNAL_FISH_POSITIONS, now);
+    journal_record("%s", record.data);
+    sb_free(&record);
+}
+
+// "fish ...": the fish is ours from now on
+static void receive_fish(Peer* peer, char* args) {
+    char* save = NULL;
+    char* name = strtok_r(args, " ", &save);
+    char* move_function = strtok_r(NULL, " ", &save);
+    char* w = strtok_r(NULL, " ", &save);
+    char* h = strtok_r(NULL, " ", &save);
+    char* speed = strtok_r(NULL, " ", &save);
+    char* started = strtok_r(NULL, " ", &save);
+    if (started == NULL) {
+        log_msg("[WARN] Malformed fish from federation peer %s\n", peer->address);
+        return;
+    }
+
+    microseconds_t now = sim_clock_now();
+    Fish* fish = new_fish(name, atoi(w), atoi(h));
+    if (fish == NULL) return;
+    fish->future_positions = parse_positions(&save, now);
+    if (fish->future_positions == NULL || fish->future_positions->size == 0) {
+        log_msg("[WARN] Fish %s from federation peer %s has no trajectory\n", name, peer->address);
+        free_fish_list(fish);
+        return;
+    }
+    int index = fonctionExiste(move_function);
+    fish->move_function = table[(index > 0 ? index : 1) - 1].fonction;
+    fish->speed = strtod(speed, NULL);
+    fish->started = atoi(started) != 0;
+
+    lock_aquarium();
+    FishAddStatus status = current_aquarium != NULL ? adopt_fish(fish) : FISH_ADD_DUPLICATE;
+    if (status != FISH_ADD_OK) {
+        unlock_aquarium();
+        log_msg("[WARN] Fish %s handed off by %s dropped (%s)\n", name, peer->address,
+            status == FISH_ADD_TOO_MANY ? "max-fishes reached" :
+            status == FISH_ADD_MEMORY_LIMIT ? "memory-limit reached" : "no aquarium or name taken");
+        free_fish_list(fish);
+        return;
+    }
+    remove_ghosts(-1, fish->name);
+    journal_fish(fish, now);
+    replication_record_fish(fish);
+    unlock_aquarium();
+}
+
+// "ghosts ...": replace the ghosts of the peer
+static void receive_ghosts(int peer_index, char* args) {
+    microseconds_t now = sim_clock_now();
+    Fish* ghosts = NULL;
+    char* save = NULL;
+    char* name = strtok_r(args, " ", &save);
+    while (name != NULL) {
+        char* w = strtok_r(NULL, " ", &save);
+        char* h = strtok_r(NULL, " ", &save);
+        Fish* ghost = h != NULL ? new_fish(name, atoi(w), atoi(h)) : NULL;
+        if (ghost == NULL) break;
+        ghost->started = true;
+        ghost->peer = peer_index;
+        ghost->future_positions = parse_positions(&save, now);
+        if (ghost->future_positions == NULL) {
+            destroy_fish(ghost);
+            break;
+        }
+        ghost->suivant = ghosts;
+        ghosts = ghost;
+        name = strtok_r(NULL, " ", &save);
+    }
+
+    lock_aquarium();
+    if (current_aquarium == NULL) {
+        unlock_aquarium();
+        free_fish_list(ghosts);
+        return;
+    }
+    remove_ghosts(peer_index, NULL);
+    while (ghosts != NULL) {
+        Fish* next = ghosts->suivant;
+        ghosts->suivant = current_aquarium->ghosts;
+        current_aquarium->ghosts = ghosts;
+        ghosts = next;
+    }
+    unlock_aquarium();
+}
+
+static void receive_interest(Peer* peer, const char* args) {
+    Region interest;
+    bool has_interest = parse_region(args, &interest);
+    lock_aquarium();
+    peer->has_interest = has_interest;
+    if (has_interest) peer->interest = interest;
+    unlock_aquarium();
+}
+
+// Returns false if the link must be closed
+static bool handle_line(Link* link, char* line) {
+    if (link->peer < 0) {
+        Region region;
+        if (strncmp(line, "region ", 7) != 0 || !parse_region(line + 7, &region)) {
+            log_msg("[WARN] Federation link without a region line, closing it\n");
+            return false;
+        }
+        for (int i = 0; i < nb_peers; i++) {
+            if (same_region(&peers[i].region, &region)) {
+                link->peer = i;
+                log_msg("[INFO] Federation peer %s connected\n", peers[i].address);
+                return true;
+            }
+        }
+        log_msg("[WARN] No federation-peer with the region %s, closing its link\n", line + 7);
+        return false;
+    }
+
+    Peer* peer = &peers[link->peer];
+    if (strncmp(line, "ghosts", 6) == 0 && (line[6] == ' ' || line[6] == '\0')) {
+        receive_ghosts(link->peer, line + 6);
+    } else if (strncmp(line, "fish ", 5) == 0) {
+        receive_fish(peer, line + 5);
+    } else if (strncmp(line, "interest ", 9) == 0) {
+        receive_interest(peer, line + 9);
+    } else {
+        log_msg("[WARN] Unknown federation message from %s: %.40s\n", peer->address, line);
+    }
+    return true;
+}
+
+static void close_link(Link* link) {
+    if (link->peer >= 0) {
+        // Its ghosts would freeze where they are
+        Peer* peer = &peers[link->peer];
+        lock_aquarium();
+        peer->has_interest = false;
+        if (current_aquarium != NULL) remove_ghosts(link->peer, NULL);
+        unlock_aquarium();
+        log_msg("[WARN] Federation peer %s disconnected\n", peer->address);
+    }
+    close(link->socket);
+    free(link->buf);
+    link->socket = -1;
+    link->peer = -1;
+    link->buf = NULL;
+    link->len = link->cap = 0;
+}
+
+static void read_link(Link* link) {
+    if (link->cap - link->len < 65536) {
+        size_t new_cap = link->cap ? link->cap * 2 : 65536;
+        char* bigger = new_cap <= FEDERATION_MAX_PENDING ? realloc(link->buf, new_cap) : NULL;
+        if (bigger == NULL) {
+            log_msg("[ERROR] Federation line too long, closing the link\n");
+            close_link(link);
+            return;
+        }
+        link->buf = bigger;
+        link->cap = new_cap;
+    }
+
+    ssize_t received = recv(link->socket, link->buf + link->len, link->cap - link->len, MSG_DONTWAIT);
+    if (received < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) return;
+    if (received <= 0) {
+        close_link(link);
+        return;
+    }
+    link->len += received;
+
+    size_t start = 0;
+    char* newline;
+    while ((newline = memchr(link->buf + start, '\n', link->len - start)) != NULL) {
+        *newline = '\0';
+        if (!handle_line(link, link->buf + start)) {
+            close_link(link);
+            return;
+        }
+        start = newline - link->buf + 1;
+    }
+    memmove(link->buf, link->buf + start, link->len - start);
+    link->len -= start;
+}
+
+static void accept_link() {
+    int socket = accept(listen_socket, NULL, NULL);
+    if (socket < 0) return;
+    for (int i = 0; i < MAX_LINKS; i++) {
+        if (links[i].socket < 0) {
+            links[i].socket = socket;
+            links[i].peer = -1;
+            return;
+        }
+    }
+    log_msg("[WARN] Too many federation links, refusing one\n");
+    close(socket);
+}
+
+// Assumes mutex_federation is locked
+static void close_out_locked(Peer* peer) {
+    log_msg("[WARN] Federation link to %s down\n", peer->address);
+    close(peer->out_socket);
+    peer->out_socket = -1;
+    peer->out.len = 0;
+    peer->next_dial = sim_clock_real() + FEDERATION_RECONNECT_INTERVAL * 1000LL;
+}
+
+// Send what is queued for the peer, as much as the socket takes
+static void flush_peer(Peer* peer) {
+    pthread_mutex_lock(&mutex_federation);
+    while (peer->out_socket >= 0 && peer->out.len > 0) {
+        ssize_t sent = send(peer->out_socket, peer->out.data, peer->out.len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) close_out_locked(peer);
+            break;
+        }
+        memmove(peer->out.data, peer->out.data + sent, peer->out.len - sent);
+        peer->out.len -= sent;
+    }
+    pthread_mutex_unlock(&mutex_federation);
+}
+
+// Dial the peers whose link is down. connect() blocks at most one second
+static void dial_peers() {
+    microseconds_t now = sim_clock_real();
+    for (int i = 0; i < nb_peers; i++) {
+        Peer* peer = &peers[i];
+        pthread_mutex_lock(&mutex_federation);
+        bool dial = peer->out_socket < 0 && now >= peer->next_dial;
+        pthread_mutex_unlock(&mutex_federation);
+        if (!dial) continue;
+
+        int socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+        struct timeval timeout = { 1, 0 };
+        if (socket_fd >= 0) setsockopt(socket_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        if (socket_fd < 0 || connect(socket_fd, (struct sockaddr*)&peer->sockaddr, sizeof(peer->sockaddr)) < 0) {
+            if (socket_fd >= 0) close(socket_fd);
+            if (!peer->dial_failed) log_msg("[INFO] Federation peer %s not reachable yet\n", peer->address);
+            peer->dial_failed = true;
+            peer->next_dial = now + FEDERATION_RECONNECT_INTERVAL * 1000LL;
+            continue;
+        }
+        int opt = 1;
+        setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+        fcntl(socket_fd, F_SETFL, fcntl(socket_fd, F_GETFL) | O_NONBLOCK);
+
+        char region[REGION_LEN];
+        format_region(region, sizeof(region), &own_region);
+        pthread_mutex_lock(&mutex_federation);
+        peer->out_socket = socket_fd;
+        peer->out.len = 0;
+        peer->interest_sent[0] = '\0';  // The peer forgot our interest with the previous link
+        sb_appendf(&peer->out, "region %s\n", region);
+        pthread_mutex_unlock(&mutex_federation);
+        peer->dial_failed = false;
+        log_msg("[INFO] Federation link to %s up\n", peer->address);
+    }
+}
+
+// Listen for the peers. Retried by the thread: after a live upgrade the previous controller
+// holds the port until it exits
+static void open_listener() {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener < 0) return;
+
+    int opt = 1;
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(listen_port);
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (bind(listener, (struct sockaddr*)&address, sizeof(address)) < 0 ||
+        listen(listener, FEDERATION_MAX_PEERS) < 0) {
+        close(listener);
+        return;
+    }
+    listen_socket = listener;
+    log_msg("[INFO] Listening for federation peers on port %d\n", listen_port);
+}
+
+static void* federation_thread(void* arg) {
+    (void)arg;
+    select_aquarium(NULL);  // The default aquarium is the federated one
+
+    struct pollfd fds[2 + MAX_LINKS + FEDERATION_MAX_PEERS];
+    Link* fd_links[2 + MAX_LINKS + FEDERATION_MAX_PEERS];
+    Peer* fd_peers[2 + MAX_LINKS + FEDERATION_MAX_PEERS];
+    while (1) {
+        if (listen_socket < 0) open_listener();
+        dial_peers();
+
+        int nb_fds = 0;
+        fds[nb_fds++] = (struct pollfd){ listen_socket, POLLIN, 0 };
+        fds[nb_fds++] = (struct pollfd){ wake_pipe[0], POLLIN, 0 };
+        for (int i = 0; i < MAX_LINKS; i++) {
+            if (links[i].socket < 0) continue;
+            fd_links[nb_fds] = &links[i];
+            fd_peers[nb_fds] = NULL;
+            fds[nb_fds++] = (struct pollfd){ links[i].socket, POLLIN, 0 };
+        }
+        pthread_mutex_lock(&mutex_federation);
+        for (int i = 0; i < nb_peers; i++) {
+            if (peers[i].out_socket < 0) continue;
+            fd_links[nb_fds] = NULL;
+            fd_peers[nb_fds] = &peers[i];
+            // The peer never writes on this link: readable means closed
+            short events = POLLIN | (peers[i].out.len > 0 ? POLLOUT : 0);
+            fds[nb_fds++] = (struct pollfd){ peers[i].out_socket, events, 0 };
+        }
+        pthread_mutex_unlock(&mutex_federation);
+
+        if (poll(fds, nb_fds, FEDERATION_RECONNECT_INTERVAL) < 0) continue;
+
+        if (fds[0].revents & POLLIN) accept_link();
+        if (fds[1].revents & POLLIN) {
+            char drain[64];
+            while (read(wake_pipe[0], drain, sizeof(drain)) > 0) {}
+        }
+        for (int i = 2; i < nb_fds; i++) {
+            if (fds[i].revents == 0) continue;
+            if (fd_links[i] != NULL) {
+                read_link(fd_links[i]);
+            } else if (fds[i].revents & (POLLIN | POLLERR | POLLHUP)) {
+                pthread_mutex_lock(&mutex_federation);
+                if (fd_peers[i]->out_socket == fds[i].fd) close_out_locked(fd_peers[i]);
+                pthread_mutex_unlock(&mutex_federation);
+            }
+        }
+        // Also what the tick queued since the poll
+        for (int i = 0; i < nb_peers; i++) {
+            flush_peer(&peers[i]);
+        }
+    }
+    return NULL;
+}
+
+// -------------------------- Setup --------------------------------
+
+bool federation_start(int port, const char* region, char peer_list[][BUFFER_SIZE_CFG], int nb_peer_list) {
+    if (port <= 0) {
+        log_msg("[INFO] Federation disabled\n");
+        return false;
+    }
+    if (!parse_region(region, &own_region)) {
+        log_msg("[ERROR] Federation needs a federation-region (e.g. 0x0+500+1000), got '%s'\n", region);
+        return false;
+    }
+
+    for (int i = 0; i < nb_peer_list && nb_peers < FEDERATION_MAX_PEERS; i++) {
+        Peer* peer = &peers[nb_peers];
+        char host[64], peer_region[BUFFER_SIZE_CFG];
+        int peer_port;
+        memset(peer, 0, sizeof(*peer));
+        if (sscanf(peer_list[i], "%63[^:]:%d %255s", host, &peer_port, peer_region) != 3 ||
+            !parse_region(peer_region, &peer->region)) {
+            log_msg("[ERROR] Invalid federation-peer '%s' (expected <host>:<port> <x>x<y>+<w>+<h>)\n", peer_list[i]);
+            continue;
+        }
+        peer->sockaddr.sin_family = AF_INET;
+        peer->sockaddr.sin_port = htons(peer_port);
+        if (inet_pton(AF_INET, host, &peer->sockaddr.sin_addr) != 1) {
+            log_msg("[ERROR] Invalid federation peer address: %s\n", host);
+            continue;
+        }
+        snprintf(peer->address, sizeof(peer->address), "%s:%d", host, peer_port);
+        peer->out_socket = -1;
+        if (!sb_init(&peer->out, 4096)) continue;
+        nb_peers++;
+    }
+    for (int i = 0; i < MAX_LINKS; i++) {
+        links[i].socket = -1;
+        links[i].peer = -1;
+    }
+
+    if (pipe(wake_pipe) < 0) {
+        log_msg("[ERROR] Could not start the federation\n");
+        return false;
+    }
+    fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK);
+
+    listen_port = port;
+    open_listener();
+    if (listen_socket < 0) {
+        log_msg("[WARN] Federation port %d busy, retrying in the background\n", port);
+    }
+
+    enabled = true;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, federation_thread, NULL) != 0) {
+        enabled = false;
+        log_msg("[ERROR] Could not start the federation thread\n");
+        return false;
+    }
+    pthread_detach(thread);
+
+    log_msg("[INFO] Federation on port %d, simulating %s with %d peers\n", port, region, nb_peers);
+    return true;
+}
+
+bool federation_enabled() {
+    return enabled;
+}
@@ -0,0 +1,40 @@
+// Federation: several controllers share one (default) aquarium, each simulating a region of it.
+// Every controller loads the same aquarium file and owns the fishes heading into its region;
+// a fish whose next target lies in a peer's region is handed off to that peer, with its
+// trajectory, and stops being simulated here. Displays connect to any controller: the views
+// are served by merging the local fishes with "ghosts" of the peers' fishes.
+//
+// Each controller dials its peers (federation-peer) and only sends on the links it dialed,
+// so between two controllers there is one link per direction. Messages are lines:
+//     region <x>x<y>+<w>+<h>     first line: who is talking (matched against federation-peer)
+//     interest <x>x<y>+<w>+<h>   bounding box of the views connected to the sender ("none": no view)
+//     fish <name> <move_function> <w> <h> <speed> <started> <n> <x> <y> <dt>...
+//                                handoff: the receiver owns the fish from now on
+//     ghosts <name> <w> <h> <n> <x> <y> <dt>... ...
+//                                the sender's fishes in the receiver's interest, every tick.
+//                                They replace the previous ghosts of the sender
+// dt are microseconds from now, so the clocks of the hosts don't have to agree.
+// Fish names must be unique across the federation: a handed-off fish whose name is taken is dropped.
+
+#ifndef FEDERATION_H
+#define FEDERATION_H
+
+#include <stdbool.h>
+#include "read_cfg.h"
+
+#define FEDERATION_RECONNECT_INTERVAL 1000  // ms between two attempts to dial a peer
+#define FEDERATION_MAX_PENDING (16 << 20)   // Bytes queued for a peer before the link is dropped
+#define FEDERATION_GHOST_POSITIONS 3        // Positions sent with a ghost
+
+// Listen for peers on port and dial every peer ("<host>:<port> <region>") in a background thread.
+// Returns false if the federation stays disabled
+bool federation_start(int port, const char* region, char peers[][BUFFER_SIZE_CFG], int nb_peers);
+
+// True if federation_start succeeded
+bool federation_enabled();
+
+// Hand off the fishes heading into a peer's region, then send the ghosts and our interest.
+// Called by the tick of the default aquarium
+void federation_tick();  // Assumes the mutex is locked
+
+#endif // FEDERATION_H
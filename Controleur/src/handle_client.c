@@ -8,23 +8,32 @@
 #include <sys/time.h>
 #include "handle_client.h"
 #include "aquarium.h"
+#include "connection.h"
+#include "multicast.h"
+#include "shm_world.h"
+#include "journal.h"
+#include "replication.h"
+#include "timer_wheel.h"
+#include "read_cfg.h"
+#include "metrics.h"
+#include "fanout_trace.h"
+#include "capture.h"
+#include "trace.h"
 #include "utils.h"
 #include "log.h"
-
-char buffer[BUFFER_SIZE];  // Copie locale du message pour strtok
-
+#include "sim_clock.h"
 
 bool aquarium_null_send(int job_socket, const char* send_msg) {
-    pthread_mutex_lock(&mutex_aquarium);
+    lock_aquarium();
     if (current_aquarium == NULL) {
-        pthread_mutex_unlock(&mutex_aquarium);
+        unlock_aquarium();
         log_msg("No aquarium available\n");
         char response[BUFFER_SIZE];
         snprintf(response, BUFFER_SIZE, "%s (no aquarium available)\n", send_msg);
-        send(job_socket, response, strlen(response), 0);
+        conn_send(job_socket, response, strlen(response));
         return true;
     }
-    pthread_mutex_unlock(&mutex_aquarium);
+    unlock_aquarium();
     return false;
 }
 
@@ -34,7 +43,7 @@ bool view_null_send(Afficheur* view, int job_socket, const char* send_msg) {
         log_msg("No view available\n");
         char response[BUFFER_SIZE];
         snprintf(response, BUFFER_SIZE, "%s (no view available)\n", send_msg);
-        send(job_socket, response, strlen(response), 0);
+        conn_send(job_socket, response, strlen(response));
         return true;
     }
     return false;
@@ -45,7 +54,7 @@ int wrong_msg_received_send_NOK(int job_socket, const char* msg, const char* exp
     log_msg("Received '%s' instead of '%s'. %s\n", msg, expected_msg, err_msg);
     char response[BUFFER_SIZE];
     snprintf(response, BUFFER_SIZE, "NOK Received %s instead of '%s'. %s\n", msg, expected_msg, err_msg);
-    send(job_socket, response, strlen(response), 0);
+    conn_send(job_socket, response, strlen(response));
     return -1;
 }
 
@@ -54,11 +63,18 @@ int send_NOK(int job_socket, const char* msg) {
     log_msg("Sending NOK: %s\n", msg);
     char response[BUFFER_SIZE];
     snprintf(response, BUFFER_SIZE, "NOK %s\n", msg);
-    send(job_socket, response, strlen(response), 0);
+    conn_send(job_socket, response, strlen(response));
     return -1;
 }
 
 
+// The requests of a greeted connection go to the aquarium of its view
+static void bind_connection(int job_socket) {
+    Connection* conn = conn_get(job_socket);
+    if (conn != NULL) conn->aquarium = selected_aquarium();
+}
+
+
 int handle_hello_no_arg(int job_socket) {
     log_msg("Hello without 'in as'\n");
 
@@ -67,20 +83,21 @@ int handle_hello_no_arg(int job_socket) {
         return -1;
     }
 
-    pthread_mutex_lock(&mutex_aquarium);
+    lock_aquarium();
 
     // Check if there is a free view
     Afficheur* free_view = find_free_view();
 
     // Handle free_view == NULL
     if (view_null_send(free_view, job_socket, "no greeting")) {
-        pthread_mutex_unlock(&mutex_aquarium);
+        unlock_aquarium();
         return -1;
     }
 
     free_view->socket = job_socket;
-    free_view->last_update_time = get_time_usec();
+    touch_view(free_view);
     free_view->subscribed = 0;  // Not subscribed yet
+    free_view->multicast = false;
     log_msg("Found a free view: %s\n", free_view->name);
 
     char response[BUFFER_SIZE];
@@ -90,14 +107,15 @@ int handle_hello_no_arg(int job_socket) {
         free_view->w, free_view->h
     );
     strcat(response, "\n");
-    send(job_socket, response, strlen(response), 0);
+    conn_send(job_socket, response, strlen(response));
     log_msg("[hello] Sending 'greeting %s %dx%d+%d+%d'\n", 
         free_view->name, 
         free_view->x, free_view->y, 
         free_view->w, free_view->h
     );
 
-    pthread_mutex_unlock(&mutex_aquarium);
+    unlock_aquarium();
+    bind_connection(job_socket);
     return 0;
 }
 
@@ -107,6 +125,7 @@ int handle_hello_no_arg(int job_socket) {
 // In valid case, respond with "Greeting <ID> <X>x<Y>+<w>+<h>"
 // Else, either we create a new view and respond with "Greeting <new ID>"
 // or we respond with "no greeting" if the aquarium is full
+// "hello in as ID@aquarium" greets into another hosted aquarium than the default one
 int handle_Hello(int job_socket, const char* message) {
     log_msg("Message reçu (Hello) : '%s'\n", message);
 
@@ -139,12 +158,26 @@ int handle_Hello(int job_socket, const char* message) {
         return wrong_msg_received_send_NOK(job_socket, tok, "<view name>", "Did you mean 'hello' or 'hello in as <view name>'?");
     }
 
+    // view@aquarium
+    char* at = strchr(tok, '@');
+    if (at != NULL) {
+        *at = '\0';
+        AquariumSlot* slot = at[1] != '\0' ? get_aquarium_slot(at + 1, false) : NULL;
+        if (slot == NULL) {
+            log_msg("[hello] Unknown aquarium '%s'\n", at + 1);
+            char response[] = "no greeting (unknown aquarium)\n";
+            conn_send(job_socket, response, strlen(response));
+            return -1;
+        }
+        select_aquarium(slot);
+    }
+
     // If no aquarium, say "no greeting"
     if (aquarium_null_send(job_socket, "no greeting")) {
         return -1;
     }
     
-    pthread_mutex_lock(&mutex_aquarium);
+    lock_aquarium();
 
     // Check if there is a view without connection with the same ID.
     // If the requested view name does not exist or is already occupied by another client, 
@@ -157,8 +190,9 @@ int handle_Hello(int job_socket, const char* message) {
             } else {
                 // View not connected, connect it
                 current_view->socket = job_socket;
-                current_view->last_update_time = get_time_usec();
+                touch_view(current_view);
                 current_view->subscribed = 0;  // Not subscribed yet
+                current_view->multicast = false;
                 log_msg("[hello] Connected view '%s'\n", current_view->name);
 
                 char response[BUFFER_SIZE];
@@ -168,13 +202,14 @@ int handle_Hello(int job_socket, const char* message) {
                     current_view->w, current_view->h
                 );
                 strcat(response, "\n");
-                send(job_socket, response, strlen(response), 0);
+                conn_send(job_socket, response, strlen(response));
                 log_msg("[hello] Sending 'greeting %s %dx%d+%d+%d'\n", 
                     current_view->name, 
                     current_view->x, current_view->y, 
                     current_view->w, current_view->h
                 );
-                pthread_mutex_unlock(&mutex_aquarium);
+                unlock_aquarium();
+                bind_connection(job_socket);
                 return 0;
             }
         }
@@ -188,8 +223,9 @@ int handle_Hello(int job_socket, const char* message) {
         if (current_view->socket == -1) {  // If view not connected
             // Found a free view
             current_view->socket = job_socket;
-            current_view->last_update_time = get_time_usec();
+            touch_view(current_view);
             current_view->subscribed = 0;  // Not subscribed yet
+            current_view->multicast = false;
             log_msg("[hello] Found a free view: %s\n", current_view->name);
 
             char response[BUFFER_SIZE];
@@ -199,22 +235,23 @@ int handle_Hello(int job_socket, const char* message) {
                 current_view->w, current_view->h
             );
             strcat(response, "\n");
-            send(job_socket, response, strlen(response), 0);
+            conn_send(job_socket, response, strlen(response));
             log_msg("[hello] Sending 'greeting %s %dx%d+%d+%d'\n", 
                 current_view->name, 
                 current_view->x, current_view->y, 
                 current_view->w, current_view->h
             );
-            pthread_mutex_unlock(&mutex_aquarium);
+            unlock_aquarium();
+            bind_connection(job_socket);
             return 0;
         }
         current_view = current_view->suivant;
     }
     // No free view found
-    pthread_mutex_unlock(&mutex_aquarium);
+    unlock_aquarium();
     log_msg("[hello] No free view found\n");
     char response[] = "no greeting (No free view)\n";
-    send(job_socket, response, strlen(response), 0);
+    conn_send(job_socket, response, strlen(response));
     return -1;
 }
 
@@ -231,12 +268,16 @@ int handle_getFishes(int job_socket, const char* message) {
     if (aquarium_null_send(job_socket, "no greeting")) {
         return -1;
     }
-    char response[BUFFER_SIZE];
-    strcpy(response, "list ");
+    StringBuilder response;
+    if (!sb_init(&response, BUFFER_SIZE)) {
+        return send_NOK(job_socket, "Out of memory in getFishes");
+    }
+    sb_append(&response, "list ", 5);
 
-    pthread_mutex_lock(&mutex_aquarium);
+    lock_aquarium();
 
-    Fish* current_fish = current_aquarium->poissons;
+    // The fishes simulated here, then the ghosts of the federation peers
+    Fish* current_fish = first_listed_fish();
     while (current_fish != NULL) {
         // Find if the client is connected to a view
         Afficheur* current_view = current_aquarium->afficheurs;
@@ -247,7 +288,8 @@ int handle_getFishes(int job_socket, const char* message) {
             current_view = current_view->suivant;
         }
         if (current_view == NULL) {
-            pthread_mutex_unlock(&mutex_aquarium);
+            unlock_aquarium();
+            sb_free(&response);
             return wrong_msg_received_send_NOK(job_socket, message, "view", "Client is not connected to a view");
         }
 
@@ -256,7 +298,7 @@ int handle_getFishes(int job_socket, const char* message) {
         FishNextPos* next_position = peek_front(current_fish->future_positions);
         if (next_position == NULL) {
             log_msg("[getFishes] Fish %s has no target position\n", current_fish->name);
-            current_fish = current_fish->suivant;
+            current_fish = next_listed_fish(current_fish);
             continue;  // Skip this fish
         }
 
@@ -271,68 +313,292 @@ int handle_getFishes(int job_socket, const char* message) {
         // TODO For now, we don't send fishes whose target position is outside the view
         if (view_coords.x < 0 || view_coords.y < 0) {
             log_msg("[getFishes] Fish %s is outside the view\n", current_fish->name);
-            current_fish = current_fish->suivant;
+            current_fish = next_listed_fish(current_fish);
             continue;  // Skip this fish
         }
 
-        int seconds_to_reach = (next_position->arrival_time - get_time_usec()) / 1000000;
+        int seconds_to_reach = (next_position->arrival_time - sim_clock_now()) / 1000000;
         if (seconds_to_reach < 0) {
             seconds_to_reach = 0;  // No time left
         }
 
-        char fish_info[BUFFER_SIZE];
-        snprintf(fish_info, BUFFER_SIZE, "[\"%s\" at %dx%d,%dx%d,%d]", 
+        sb_appendf(&response, "[\"%s\" at %dx%d,%dx%d,%d]", 
             current_fish->name,
             view_coords.x, view_coords.y,
             current_fish->w, current_fish->h,
             seconds_to_reach
         );
-        strcat(response, fish_info);
-        current_fish = current_fish->suivant;
+        current_fish = next_listed_fish(current_fish);
         if (current_fish != NULL) {
-            strcat(response, " ");
+            sb_append(&response, " ", 1);
         }
     }
 
-    pthread_mutex_unlock(&mutex_aquarium);
+    unlock_aquarium();
 
-    strcat(response, "\n");
-    send(job_socket, response, strlen(response), 0);
-    log_msg("[getFishes] Sending '%s'\n", response);
+    sb_append(&response, "\n", 1);
+    conn_send(job_socket, response.data, response.len);
+    debug_msg("[getFishes] Sending '%s'\n", response.data);
+    sb_free(&response);
 
     return 0;
 }
 
-// 
+// getFishesContinuously [trace]: with trace, every update is followed by its timestamps
+// "update <seq> <detected> <sent>", which the display may ack (see fanout_trace.h)
 int handle_Continuous(int job_socket, const char* message) {
     log_msg("Message reçu (Continuous) : %s\n", message);
+    bool trace = strcmp(message, "getFishesContinuously trace") == 0;
     
-    pthread_mutex_lock(&mutex_aquarium);
+    lock_aquarium();
     
     if (current_aquarium == NULL) {
-        pthread_mutex_unlock(&mutex_aquarium);
+        unlock_aquarium();
         char response[] = "NOK No aquarium\n";
-        send(job_socket, response, strlen(response), 0);
+        conn_send(job_socket, response, strlen(response));
         return -1;
     }
 
     // Find view by socket
+    char view_name[MAX_NAME_LEN] = "";
     Afficheur* current_view = current_aquarium->afficheurs;
     while (current_view != NULL) {
         if (current_view->socket == job_socket) {
             current_view->subscribed = true;  // Subscribe to continuous updates
+            strcpy(view_name, current_view->name);
             break;  // Found the view
         }
         current_view = current_view->suivant;
     }
     
-    pthread_mutex_unlock(&mutex_aquarium);
+    unlock_aquarium();
 
+    if (trace && view_name[0] != '\0' && fanout_trace_enable(job_socket, view_name)) {
+        char response[] = "OK Subscribed to getFishesContinuously, traced\n";
+        conn_send(job_socket, response, strlen(response));
+        return 0;
+    }
     char response[] = "OK Subscribed to getFishesContinuously\n";
-    send(job_socket, response, strlen(response), 0);
+    conn_send(job_socket, response, strlen(response));
+    return 0;
+}
+
+// ack <seq>: the display drew the update <seq>. No reply, unless the request is malformed
+int handle_ack(int job_socket, const char* message) {
+    unsigned int seq = 0;
+    if (sscanf(message, "ack %u", &seq) != 1) {
+        return wrong_msg_received_send_NOK(job_socket, message, "ack <seq>", "Did you mean 'ack <seq>'?");
+    }
+    if (!fanout_trace_ack(job_socket, seq, sim_clock_now())) {
+        debug_msg("Ack of update %u not awaited\n", seq);
+    }
+    return 0;
+}
+
+// getFishesMulticast: continuous updates come from the multicast channel instead of the TCP socket.
+// Responds "OK multicast <group> <port> <last seq>"
+int handle_Multicast(int job_socket, const char* message) {
+    log_msg("Message reçu (Multicast) : %s\n", message);
+
+    if (!multicast_enabled()) {
+        return send_NOK(job_socket, "Multicast channel disabled, use getFishesContinuously");
+    }
+    if (selected_aquarium() != default_aquarium_slot()) {
+        return send_NOK(job_socket, "Multicast channel only carries the default aquarium, use getFishesContinuously");
+    }
+
+    lock_aquarium();
+
+    if (current_aquarium == NULL) {
+        unlock_aquarium();
+        char response[] = "NOK No aquarium\n";
+        conn_send(job_socket, response, strlen(response));
+        return -1;
+    }
+
+    // Find view by socket
+    Afficheur* current_view = current_aquarium->afficheurs;
+    while (current_view != NULL) {
+        if (current_view->socket == job_socket) {
+            current_view->multicast = true;
+            current_view->subscribed = false;  // No more TCP copies of the updates
+            break;  // Found the view
+        }
+        current_view = current_view->suivant;
+    }
+
+    unlock_aquarium();
+
+    if (current_view == NULL) {
+        return wrong_msg_received_send_NOK(job_socket, message, "hello", "Client is not connected to a view");
+    }
+
+    char response[BUFFER_SIZE];
+    snprintf(response, BUFFER_SIZE, "OK multicast %s %d %u\n", MULTICAST_GROUP, MULTICAST_PORT, multicast_last_seq());
+    conn_send(job_socket, response, strlen(response));
     return 0;
 }
 
+// getFishesShm: the display reads the positions from the shared-memory snapshot, no continuous updates over TCP.
+// Replies "OK shm <name> <capacity>"
+int handle_Shm(int job_socket, const char* message) {
+    log_msg("Message reçu (Shm) : %s\n", message);
+
+    if (!shm_world_enabled()) {
+        return send_NOK(job_socket, "Shared-memory snapshot disabled, use getFishesContinuously");
+    }
+    if (selected_aquarium() != default_aquarium_slot()) {
+        return send_NOK(job_socket, "Shared-memory snapshot only holds the default aquarium, use getFishesContinuously");
+    }
+
+    lock_aquarium();
+
+    if (current_aquarium == NULL) {
+        unlock_aquarium();
+        char response[] = "NOK No aquarium\n";
+        conn_send(job_socket, response, strlen(response));
+        return -1;
+    }
+
+    // Find view by socket
+    Afficheur* current_view = current_aquarium->afficheurs;
+    while (current_view != NULL) {
+        if (current_view->socket == job_socket) {
+            current_view->subscribed = false;  // No TCP copies of the updates
+            current_view->multicast = false;
+            break;  // Found the view
+        }
+        current_view = current_view->suivant;
+    }
+
+    unlock_aquarium();
+
+    if (current_view == NULL) {
+        return wrong_msg_received_send_NOK(job_socket, message, "hello", "Client is not connected to a view");
+    }
+
+    char response[BUFFER_SIZE];
+    snprintf(response, BUFFER_SIZE, "OK shm %s %d\n", shm_world_name(), shm_world_capacity());
+    conn_send(job_socket, response, strlen(response));
+    return 0;
+}
+
+// resync: sends the whole world in aquarium coordinates, "sync <seq> [..] [..]".
+// Datagrams with a sequence number greater than <seq> apply on top of it
+int handle_resync(int job_socket, const char* message) {
+    log_msg("Message reçu (resync) : %s\n", message);
+
+    lock_aquarium();
+
+    if (current_aquarium == NULL) {
+        unlock_aquarium();
+        char response[] = "NOK No aquarium\n";
+        conn_send(job_socket, response, strlen(response));
+        return -1;
+    }
+
+    // Taken under the lock: no datagram can be published before the world is copied
+    unsigned int seq = multicast_last_seq();
+    SharedBuffer* world = create_fish_list_string(sim_clock_now(), true, NULL);
+
+    unlock_aquarium();
+
+    if (world == NULL) {
+        return send_NOK(job_socket, "Could not build the world in resync");
+    }
+
+    char header[64];
+    snprintf(header, sizeof(header), "sync %u", seq);
+    conn_send(job_socket, header, strlen(header));
+    conn_send(job_socket, world->data + 4, world->len - 4);  // Skip "list"
+    shared_buffer_unref(world);
+    return 0;
+}
+
+// nack <seq>: a datagram was lost, send it again over TCP (or the whole world if it is too old)
+int handle_nack(int job_socket, const char* message) {
+    log_msg("Message reçu (nack) : %s\n", message);
+
+    unsigned int seq = 0;
+    if (sscanf(message, "nack %u", &seq) != 1) {
+        return wrong_msg_received_send_NOK(job_socket, message, "nack <seq>", "Did you mean 'nack <seq>'?");
+    }
+
+    if (multicast_retransmit(job_socket, seq)) {
+        return 0;
+    }
+    return handle_resync(job_socket, message);
+}
+
+// Trajectory of a fish listed by ls, copied chunk by chunk so that the lines are formatted
+// without the world lock
+typedef struct LsTrack {
+    char name[MAX_NAME_LEN];
+    int w, h;
+    bool ghost;  // Federation ghost: its trajectory can't be extended here
+    bool gone;   // Released since the ls started: no more frames
+    FishNextPos* positions;  // The frames of the current chunk
+    int count;
+    microseconds_t last_arrival;  // Arrival time of the last position copied
+} LsTrack;
+
+// Copy the next frames of a track (from the first position for the first chunk), generating
+// the positions the fish doesn't have yet. Arrival times only grow along a trajectory, so the
+// chunk resumes after the last copied position even if the tick popped some meanwhile
+static void copy_horizon(LsTrack* track, bool first_chunk, int frames) {  // Assumes the mutex is locked
+    track->count = 0;
+    if (track->gone) return;
+
+    Fish* fish = NULL;
+    if (!track->ghost) {
+        fish = find_fish(track->name);
+    } else {
+        for (Fish* ghost = current_aquarium->ghosts; ghost != NULL && fish == NULL; ghost = ghost->suivant) {
+            if (strncmp(ghost->name, track->name, MAX_NAME_LEN) == 0) fish = ghost;
+        }
+    }
+    if (fish == NULL || fish->future_positions == NULL) {
+        track->gone = true;
+        return;
+    }
+
+    Node* node = fish->future_positions->head;
+    int available = fish->future_positions->size;
+    while (!first_chunk && node != NULL && node->data.arrival_time <= track->last_arrival) {
+        node = node->next;
+        available--;
+    }
+    if (!track->ghost && available < frames) {
+        if (fish->future_positions->size == 0) {
+            add_n_fish_target_positions(fish, frames);
+            node = fish->future_positions->head;
+        } else {
+            Node* last = fish->future_positions->tail;
+            add_n_fish_target_positions(fish, frames - available);
+            if (node == NULL) node = last->next;  // Everything was already listed
+        }
+    }
+
+    if (track->positions == NULL) {
+        track->positions = (FishNextPos*)malloc(LS_CHUNK * sizeof(FishNextPos));
+        if (track->positions == NULL) {
+            track->gone = true;
+            return;
+        }
+    }
+    for (; node != NULL && track->count < frames; node = node->next) {
+        track->positions[track->count++] = node->data;
+    }
+    if (track->count > 0) track->last_arrival = track->positions[track->count - 1].arrival_time;
+}
+
+// get_view_coordinates on a copy of the view, without the world lock
+static Tuple ls_view_coordinates(int x, int y, const Afficheur* view) {
+    int x_view = (int)((float)(x - view->x) / (float)view->w * 100.0f);
+    int y_view = (int)((float)(y - view->y) / (float)view->h * 100.0f);
+    return (Tuple){x_view, y_view};
+}
+
 // ls [<n>]
 // Precalculates the next n (default 3) positions of the fishes and sends them to the client
 int handle_ls(int job_socket, const char* message) {
@@ -357,74 +623,107 @@ int handle_ls(int job_socket, const char* message) {
                 "Invalid value for <n> (needs to be an integer). Did you mean 'ls [<n>]'?"
             );
         }
+        if (MAX_LS_HORIZON > 0 && n > MAX_LS_HORIZON) {
+            char response[BUFFER_SIZE];
+            snprintf(response, BUFFER_SIZE, "Horizon too deep (max-ls-horizon = %d)", MAX_LS_HORIZON);
+            return send_NOK(job_socket, response);
+        }
     }
     
-    pthread_mutex_lock(&mutex_aquarium);
+    lock_aquarium();
 
     if (current_aquarium == NULL) {
-        pthread_mutex_unlock(&mutex_aquarium);
+        unlock_aquarium();
         char response[] = "NOK No aquarium\n";
-        send(job_socket, response, strlen(response), 0);
+        conn_send(job_socket, response, strlen(response));
         return -1;
     }
 
-    // Loop through all fishes and make sure they have at least n target positions
-    Fish* current_fish = current_aquarium->poissons;
-    while (current_fish != NULL) {
-        if (current_fish->future_positions == NULL) {
-            current_fish->future_positions = create_list();
-        }
-
-        if (current_fish->future_positions->size == 0) {
-            add_n_fish_target_positions(current_fish, n);
-        } else {
-            fill_up_fish_positions_list(current_fish, n);
-        }
-
-        current_fish = current_fish->suivant;
+    // The listed fishes and the reference view are taken once: every frame shows the same
+    // fishes, in the same coordinates, with the times counted from the same instant
+    microseconds_t now = sim_clock_now();
+    bool has_view = current_aquarium->afficheurs != NULL;
+    Afficheur view = has_view ? *current_aquarium->afficheurs : (Afficheur){0};
+    int nb_tracks = 0;
+    for (Fish* fish = first_listed_fish(); fish != NULL; fish = next_listed_fish(fish)) {
+        nb_tracks++;
+    }
+    LsTrack* tracks = (LsTrack*)calloc(nb_tracks > 0 ? nb_tracks : 1, sizeof(LsTrack));
+    if (tracks == NULL) {
+        unlock_aquarium();
+        return send_NOK(job_socket, "Out of memory");
+    }
+    int i = 0;
+    for (Fish* fish = first_listed_fish(); fish != NULL; fish = next_listed_fish(fish), i++) {
+        snprintf(tracks[i].name, MAX_NAME_LEN, "%s", fish->name);
+        tracks[i].w = fish->w;
+        tracks[i].h = fish->h;
+        tracks[i].ghost = fish->peer >= 0;
     }
 
-    // Loop through all fishes n times and get their target positions.
-    for (int i = 0; i < n; i++) {
-        char response[BUFFER_SIZE];
-        strcpy(response, "list");
-
-        current_fish = current_aquarium->poissons;
-        while (current_fish != NULL) {
-            FishNextPos* next_position = peek_at_index(current_fish->future_positions, i);
-            if (next_position == NULL) {
-                current_fish = current_fish->suivant;
-                continue;
+    // The horizon is generated and streamed LS_CHUNK frames at a time. The world lock is
+    // only held to extend and copy the trajectories, the lines are formatted without it
+    Connection* conn = conn_get(job_socket);
+    bool client_gone = false;
+    for (int first_frame = 0; first_frame < n; first_frame += LS_CHUNK) {
+        int frames = n - first_frame < LS_CHUNK ? n - first_frame : LS_CHUNK;
+        if (first_frame > 0) {
+            lock_aquarium();
+            if (current_aquarium == NULL) {  // Unloaded meanwhile
+                unlock_aquarium();
+                break;
+            }
+        }
+        for (i = 0; i < nb_tracks; i++) {
+            copy_horizon(&tracks[i], first_frame == 0, frames);
+        }
+        unlock_aquarium();
+
+        for (int frame = 0; frame < frames; frame++) {
+            StringBuilder response;
+            if (!sb_init(&response, BUFFER_SIZE)) break;
+            sb_append(&response, "list", 4);
+            for (i = 0; i < nb_tracks; i++) {
+                if (frame >= tracks[i].count) continue;  // Released, or a ghost with a shorter trajectory
+                FishNextPos* position = &tracks[i].positions[frame];
+                Tuple view_coords = has_view ? ls_view_coordinates(position->x, position->y, &view) : (Tuple){-1, -1};
+                int seconds_to_reach = (position->arrival_time - now) / 1000000;
+                if (seconds_to_reach < 0) seconds_to_reach = 0;
+
+                sb_appendf(&response, " [\"%s\" at %dx%d,%dx%d,%d]",
+                    tracks[i].name,
+                    view_coords.x, view_coords.y,
+                    tracks[i].w, tracks[i].h,
+                    seconds_to_reach
+                );
             }
 
-            Tuple view_coords = get_view_coordinates(
-                next_position->x,
-                next_position->y,
-                current_aquarium->afficheurs
-            );
-
-            int seconds_to_reach = (next_position->arrival_time - get_time_usec()) / 1000000;
-            if (seconds_to_reach < 0) seconds_to_reach = 0;
-
-            char fish_info[BUFFER_SIZE];
-            snprintf(fish_info, BUFFER_SIZE, " [\"%s\" at %dx%d,%dx%d,%d]",
-                current_fish->name,
-                view_coords.x, view_coords.y,
-                current_fish->w, current_fish->h,
-                seconds_to_reach
-            );
-            strcat(response, fish_info);
+            // Send the response to the client
+            sb_append(&response, "\n", 1);
+            debug_msg("[ls] Sending '%s'\n", response.data);
+            SharedBuffer* line = sb_to_shared(&response);
+            conn_send_shared(job_socket, line);
+            shared_buffer_unref(line);
+
+            // A client reading slower than the frames are built holds this worker, not the aquarium
+            if (conn != NULL && !conn_throttle(conn)) {
+                client_gone = true;
+                break;
+            }
+        }
 
-            current_fish = current_fish->suivant;
+        // Let the chunk leave before the next one is built
+        if (conn != NULL && first_frame + frames < n) {
+            conn_uncork(conn);
+            conn_cork(conn);
         }
-        
-        // Send the response to the client
-        strcat(response, "\n");
-        send(job_socket, response, strlen(response), 0);
-        log_msg("[ls] Sending '%s'\n", response);
+        if (client_gone) break;
     }
-    
-    pthread_mutex_unlock(&mutex_aquarium);
+
+    for (i = 0; i < nb_tracks; i++) {
+        free(tracks[i].positions);
+    }
+    free(tracks);
 
     gettimeofday(&end, NULL);
     long seconds = end.tv_sec - start.tv_sec;
@@ -436,36 +735,43 @@ int handle_ls(int job_socket, const char* message) {
 
 int handle_ping(int job_socket, const char* message) {
     // log_msg("Message reçu (ping) : %s\n", message);
+    char buffer[BUFFER_SIZE];  // Copie locale du message pour strtok
     strncpy(buffer, message, BUFFER_SIZE - 1);
     buffer[BUFFER_SIZE - 1] = '\0';  // Sécurisation de la fin de chaîne
 
     char *key = strtok(buffer, " ");
     key = strtok(NULL, " ");
 
-    if (aquarium_null_send(job_socket, "no greeting")) {
-        return -1;
-    }
-    
-    pthread_mutex_lock(&mutex_aquarium);
+    // The deadline of a bound view is pushed back without the world lock, whatever the
+    // other clients are doing. The view is only looked up if its deadline has fired
+    if (timer_wheel_refresh(job_socket, DISPLAY_TIMEOUT * 1000)) {
+        conn_heartbeat(job_socket);
+    } else {
+        if (aquarium_null_send(job_socket, "no greeting")) {
+            return -1;
+        }
 
-    // Find connected view and reset its last update time
-    Afficheur* current_view = current_aquarium->afficheurs;
-    while (current_view != NULL) {
-        if (current_view->socket == job_socket) {
-            current_view->last_update_time = get_time_usec();
-            log_msg("[ping] View %s is still connected on socket %d\n", current_view->name, job_socket);
-            break;  // Found the view
+        lock_aquarium();
+
+        // Find connected view and reset its last update time
+        Afficheur* current_view = current_aquarium->afficheurs;
+        while (current_view != NULL) {
+            if (current_view->socket == job_socket) {
+                touch_view(current_view);
+                log_msg("[ping] View %s is still connected on socket %d\n", current_view->name, job_socket);
+                break;  // Found the view
+            }
+            current_view = current_view->suivant;
         }
-        current_view = current_view->suivant;
+
+        unlock_aquarium();
     }
-    
-    pthread_mutex_unlock(&mutex_aquarium);
 
     char response[BUFFER_SIZE];  // Déclarer un buffer vide
     strcpy(response, "pong ");   // Copier "pong" au début
     strcat(response, key);       // Ajouter `key` à la fin
     strcat(response, "\n");
-    send(job_socket, response, strlen(response), 0);
+    conn_send(job_socket, response, strlen(response));
     return 0;
 }
 
@@ -514,24 +820,30 @@ int handle_addFish(int job_socket, const char* message) {
         strcpy(move_function, "RandomWayPoint");  // Valeur par défaut
     }
 
-    pthread_mutex_lock(&mutex_aquarium);
+    lock_aquarium();
 
     if (current_aquarium == NULL) {
-        pthread_mutex_unlock(&mutex_aquarium);
+        unlock_aquarium();
         return wrong_msg_received_send_NOK(job_socket, message, "loading an aquarium", "No aquarium available in addFish");
     }
 
     char response[BUFFER_SIZE];
-    if (add_fish(name, x, y, w, h, move_function)) {
+    FishAddStatus result = try_add_fish(name, x, y, w, h, move_function);
+    if (result == FISH_ADD_OK) {
+        journal_record("addFish %s %d %d %d %d %s", name, x, y, w, h, move_function);
         strcpy(response, "OK Fish added\n");
+    } else if (result == FISH_ADD_TOO_MANY) {
+        strcpy(response, "NOK Too many fishes\n");
+    } else if (result == FISH_ADD_MEMORY_LIMIT) {
+        strcpy(response, "NOK Memory limit reached\n");
     } else {
         strcpy(response, "NOK Fish could not be added\n");
     }
     
-    pthread_mutex_unlock(&mutex_aquarium);
+    unlock_aquarium();
 
     log_msg("[addFish] Response: %s", response);
-    send(job_socket, response, strlen(response), 0);
+    conn_send(job_socket, response, strlen(response));
     return 0;
 }
 
@@ -550,24 +862,25 @@ int handle_delFish(int job_socket, const char* message) {
         return wrong_msg_received_send_NOK(job_socket, tok, "<fish name>", "No fish name provided in delFish");
     }
     
-    pthread_mutex_lock(&mutex_aquarium);
+    lock_aquarium();
 
     // Send "NOK" if no aquarium
     if (current_aquarium == NULL) {
-        pthread_mutex_unlock(&mutex_aquarium);
+        unlock_aquarium();
         return wrong_msg_received_send_NOK(job_socket, message, "loading an aquarium", "No aquarium available in delFish");
     }
     
     if(release_fish(tok)) {
-        pthread_mutex_unlock(&mutex_aquarium);
+        journal_record("delFish %s", tok);
+        unlock_aquarium();
         // If fish is released, send "OK"
         char response[] = "OK Fish released\n";
-        send(job_socket, response, strlen(response), 0);
+        conn_send(job_socket, response, strlen(response));
         return 0;
     }
 
     // If no (fish not in aquarium), send "NOK"
-    pthread_mutex_unlock(&mutex_aquarium);
+    unlock_aquarium();
     return wrong_msg_received_send_NOK(job_socket, tok, "<fish name>", "Fish not found in delFish");
 }
 
@@ -585,58 +898,252 @@ int handle_startFish(int job_socket, const char* message) {
         return wrong_msg_received_send_NOK(job_socket, tok, "<fish name>", "No fish name provided in startFish");
     }
     
-    pthread_mutex_lock(&mutex_aquarium);
+    lock_aquarium();
 
     // If no aquarium, send "NOK"
     if (current_aquarium == NULL) {
-        pthread_mutex_unlock(&mutex_aquarium);
+        unlock_aquarium();
         return wrong_msg_received_send_NOK(job_socket, message, "loading an aquarium", "No aquarium available in startFish");
     }
     
     // Check if the fish is in the aquarium
-    Fish* current_fish = current_aquarium->poissons;
-    while (current_fish != NULL) {
-        if (strcmp(current_fish->name, tok) == 0) {
-            break;  // Found the fish
-        }
-        current_fish = current_fish->suivant;
-    }
+    Fish* current_fish = find_fish(tok);
 
     char response[BUFFER_SIZE];
 
     if (current_fish == NULL) {
-        pthread_mutex_unlock(&mutex_aquarium);
+        unlock_aquarium();
         snprintf(response, BUFFER_SIZE, "[startFish] Fish %s not found in aquarium\n", tok);
         return send_NOK(job_socket, buffer);
     }
 
     // Check if the fish is already moving
     if (current_fish->started) {
-        pthread_mutex_unlock(&mutex_aquarium);
+        unlock_aquarium();
         snprintf(response, BUFFER_SIZE, "OK [startFish] Fish %s is already moving\n", tok);
-        send(job_socket, response, strlen(response), 0);
+        conn_send(job_socket, response, strlen(response));
         return 0;
     }
     
     // Start the fish
     current_fish->started = true;
+    shm_world_touch();
+    journal_record("startFish %s", current_fish->name);
+    replication_record("start %s", current_fish->name);
     
-    pthread_mutex_unlock(&mutex_aquarium);
+    unlock_aquarium();
     snprintf(response, BUFFER_SIZE, "OK [startFish] Fish %s started\n", tok);
-    send(job_socket, response, strlen(response), 0);
+    conn_send(job_socket, response, strlen(response));
+    return 0;
+}
+
+// One status character per item of a batch, in the order of the request
+static char fish_add_status_char(FishAddStatus status) {
+    switch (status) {
+        case FISH_ADD_OK:                return '1';
+        case FISH_ADD_DUPLICATE:         return 'D';
+        case FISH_ADD_BAD_POSITION:      return 'P';
+        case FISH_ADD_BAD_SIZE:          return 'S';
+        case FISH_ADD_BAD_MOVE_FUNCTION: return 'M';
+        case FISH_ADD_TOO_MANY:          return 'F';
+        case FISH_ADD_MEMORY_LIMIT:      return 'R';
+    }
+    return '0';
+}
+
+typedef struct FishSpec {
+    char name[MAX_NAME_LEN];
+    int x, y, w, h;
+    char move_function[MAX_NAME_LEN];
+    bool valid;  // false if the spec could not be parsed
+} FishSpec;
+
+// Parses "<name> at <x>x<y>, <w>x<h>[, <move_function>]"
+static bool parse_fish_spec(const char* spec, FishSpec* out) {
+    out->valid = false;
+    strcpy(out->move_function, "RandomWayPoint");  // Valeur par défaut
+    int read = sscanf(spec, " %49s at %dx%d , %dx%d , %49[^ ;\r\n]",  // 49 = MAX_NAME_LEN - 1
+                      out->name, &out->x, &out->y, &out->w, &out->h, out->move_function);
+    out->valid = read >= 5;
+    return out->valid;
+}
+
+// Le client envoie "addFishBatch <spec>; <spec>; ..." avec <spec> = "<name> at <x>x<y>, <w>x<h>, <move_function>"
+// Every spec is parsed before the aquarium is locked, then all fishes are inserted
+// under a single lock acquisition. The response carries one status character per spec:
+// "OK <added>/<total> <status>" where status is made of
+// '1' added, 'D' duplicate name, 'P' bad position, 'S' bad size, 'M' unknown move function,
+// 'F' max-fishes reached, 'R' memory-limit reached, 'X' syntax error
+int handle_addFishBatch(int job_socket, const char* message) {
+    log_msg("Message reçu (addFishBatch) : %d bytes\n", (int)strlen(message));
+
+    // Skip the verb
+    const char* specs_start = strchr(message, ' ');
+    if (specs_start == NULL) {
+        return wrong_msg_received_send_NOK(job_socket, message, "<spec>; <spec>; ...", "Did you mean 'addFishBatch <name> at <x>x<y>, <w>x<h>, <move_function>; ...'?");
+    }
+
+    char* specs_str = strdup(specs_start + 1);
+    if (specs_str == NULL) {
+        return send_NOK(job_socket, "Out of memory in addFishBatch");
+    }
+
+    // Count the specs to size the arrays once
+    int nb_specs = 1;
+    for (const char* c = specs_str; *c; c++) {
+        if (*c == ';') nb_specs++;
+    }
+    FishSpec* specs = (FishSpec*)malloc(nb_specs * sizeof(FishSpec));
+    char* status = (char*)malloc(nb_specs + 1);
+    if (specs == NULL || status == NULL) {
+        free(specs_str);
+        free(specs);
+        free(status);
+        return send_NOK(job_socket, "Out of memory in addFishBatch");
+    }
+
+    // Parse outside of the lock
+    int n = 0;
+    char* saveptr = NULL;
+    for (char* tok = strtok_r(specs_str, ";", &saveptr); tok != NULL; tok = strtok_r(NULL, ";", &saveptr)) {
+        trim(tok);
+        if (tok[0] == '\0') continue;  // Trailing ';'
+        parse_fish_spec(tok, &specs[n]);
+        n++;
+    }
+    free(specs_str);
+
+    lock_aquarium();
+
+    if (current_aquarium == NULL) {
+        unlock_aquarium();
+        free(specs);
+        free(status);
+        return wrong_msg_received_send_NOK(job_socket, "addFishBatch", "loading an aquarium", "No aquarium available in addFishBatch");
+    }
+
+    int added = 0;
+    for (int i = 0; i < n; i++) {
+        if (!specs[i].valid) {
+            status[i] = 'X';
+            continue;
+        }
+        FishAddStatus result = try_add_fish(
+            specs[i].name,
+            specs[i].x, specs[i].y,
+            specs[i].w, specs[i].h,
+            specs[i].move_function
+        );
+        status[i] = fish_add_status_char(result);
+        if (result == FISH_ADD_OK) {
+            journal_record("addFish %s %d %d %d %d %s", specs[i].name,
+                specs[i].x, specs[i].y, specs[i].w, specs[i].h, specs[i].move_function);
+            added++;
+        }
+    }
+
+    unlock_aquarium();
+    status[n] = '\0';
+    free(specs);
+
+    size_t response_size = n + 64;
+    char* response = (char*)malloc(response_size);
+    if (response != NULL) {
+        snprintf(response, response_size, "OK %d/%d %s\n", added, n, status);
+        conn_send(job_socket, response, strlen(response));
+        free(response);
+    }
+    log_msg("[addFishBatch] Added %d/%d fishes\n", added, n);
+    free(status);
+    return 0;
+}
+
+// Le client envoie "delFishBatch <name> <name> ..."
+// Responds "OK <released>/<total> <status>" with '1' released or 'N' not found per name
+int handle_delFishBatch(int job_socket, const char* message) {
+    log_msg("Message reçu (delFishBatch) : %d bytes\n", (int)strlen(message));
+
+    char* names = strdup(message);
+    if (names == NULL) {
+        return send_NOK(job_socket, "Out of memory in delFishBatch");
+    }
+
+    size_t status_size = strlen(message) / 2 + 2;  // At most one name every 2 characters
+    char* status = (char*)malloc(status_size);
+    if (status == NULL) {
+        free(names);
+        return send_NOK(job_socket, "Out of memory in delFishBatch");
+    }
+
+    lock_aquarium();
+
+    if (current_aquarium == NULL) {
+        unlock_aquarium();
+        free(names);
+        free(status);
+        return wrong_msg_received_send_NOK(job_socket, "delFishBatch", "loading an aquarium", "No aquarium available in delFishBatch");
+    }
+
+    int n = 0, released = 0;
+    char* saveptr = NULL;
+    strtok_r(names, " ", &saveptr);  // delFishBatch
+    for (char* tok = strtok_r(NULL, " ,;", &saveptr); tok != NULL; tok = strtok_r(NULL, " ,;", &saveptr)) {
+        if (release_fish(tok)) {
+            journal_record("delFish %s", tok);
+            status[n++] = '1';
+            released++;
+        } else {
+            status[n++] = 'N';
+        }
+    }
+
+    unlock_aquarium();
+    status[n] = '\0';
+    free(names);
+
+    size_t response_size = n + 64;
+    char* response = (char*)malloc(response_size);
+    if (response != NULL) {
+        snprintf(response, response_size, "OK %d/%d %s\n", released, n, status);
+        conn_send(job_socket, response, strlen(response));
+        free(response);
+    }
+    free(status);
+    return 0;
+}
+
+// Handle "startAll": starts every fish that is not moving yet
+int handle_startAll(int job_socket, const char* message) {
+    log_msg("Message reçu (startAll) : %s\n", message);
+
+    lock_aquarium();
+
+    if (current_aquarium == NULL) {
+        unlock_aquarium();
+        return wrong_msg_received_send_NOK(job_socket, message, "loading an aquarium", "No aquarium available in startAll");
+    }
+
+    int started = start_all_fishes();
+    if (started > 0) journal_record("startAll");
+
+    unlock_aquarium();
+
+    char response[BUFFER_SIZE];
+    snprintf(response, BUFFER_SIZE, "OK %d fishes started\n", started);
+    conn_send(job_socket, response, strlen(response));
     return 0;
 }
 
 int handle_logOut(int job_socket, const char* message) {
     log_msg("Message reçu (logOut) : %s\n", message);
     
-    pthread_mutex_lock(&mutex_aquarium);
+    lock_aquarium();
 
     // Si aucun aquarium n'existe
     if (current_aquarium == NULL) {
-        pthread_mutex_unlock(&mutex_aquarium);
+        unlock_aquarium();
         char response[] = "bye\n";
-        send(job_socket, response, strlen(response), 0);
+        conn_send(job_socket, response, strlen(response));
         return 0;
     }
 
@@ -647,6 +1154,7 @@ int handle_logOut(int job_socket, const char* message) {
             log_msg("[logOut] Déconnexion de la vue : %s\n", current_view->name);
             current_view->socket = -1;
             current_view->subscribed = false;  // Unsubscribe the view
+            current_view->multicast = false;
             break;
         }
         current_view = current_view->suivant;
@@ -658,24 +1166,78 @@ int handle_logOut(int job_socket, const char* message) {
         log_msg("[logOut] Vue déconnectée : %s\n", current_view->name);
     }
 
-    pthread_mutex_unlock(&mutex_aquarium);
+    unlock_aquarium();
     char response[] = "bye\n";
-    send(job_socket, response, strlen(response), 0);
+    conn_send(job_socket, response, strlen(response));
     return 0;
 }
 
+// stats: sends the metrics (see metrics.h), "stats <n>" then n lines "<metric>{<labels>} <value>"
+int handle_stats(int job_socket, const char* message) {
+    (void)message;
+    StringBuilder body;
+    if (!sb_init(&body, 16384) || !metrics_format(&body, false)) {
+        sb_free(&body);
+        return send_NOK(job_socket, "Out of memory in stats");
+    }
+    int lines = 0;
+    for (size_t i = 0; i < body.len; i++) {
+        if (body.data[i] == '\n') lines++;
+    }
+    char header[64];
+    snprintf(header, sizeof(header), "stats %d\n", lines);
+    conn_send(job_socket, header, strlen(header));
+    conn_send(job_socket, body.data, body.len);
+    sb_free(&body);
+    return 0;
+}
 
 int handle_Unknown(int job_socket, const char* message) {
     log_msg("Message reçu (Unknown) : '%s'\n", message);
     
     char response[BUFFER_SIZE];
     snprintf(response, BUFFER_SIZE, "Commande inconnue : %s\n", message);
-    send(job_socket, response, strlen(response), 0);
+    conn_send(job_socket, response, strlen(response));
     
     return 0;
 }
 
 
+RequestLane request_lane(const char* message, size_t len) {
+    // Skip the empty lines left by the previous request
+    while (len > 0 && (*message == '\n' || *message == '\r' || *message == ' ')) {
+        message++;
+        len--;
+    }
+    char word[32];
+    size_t word_len = 0;
+    while (word_len < len && word_len < sizeof(word) - 1 && message[word_len] != ' ' &&
+           message[word_len] != '\n' && message[word_len] != '\r') {
+        word[word_len] = message[word_len];
+        word_len++;
+    }
+    word[word_len] = '\0';
+
+    if (strcmp(word, "ls") == 0) {
+        // The horizon decides: "ls" alone is 3 positions
+        int n = 0;
+        for (size_t i = word_len + 1; i < len && message[i] >= '0' && message[i] <= '9'; i++) {
+            n = n * 10 + (message[i] - '0');
+            if (n > LS_INTERACTIVE_HORIZON) return LANE_BULK;
+        }
+        return LANE_INTERACTIVE;
+    }
+    if (strncmp(word, "getFishes", 9) == 0) {
+        // getFishesContinuously, getFishesMulticast and getFishesShm only change a subscription
+        return word[9] == '\0' ? LANE_INTERACTIVE : LANE_CONTROL;
+    }
+    if (strncmp(word, "addFish", 7) == 0 || strncmp(word, "delFish", 7) == 0 ||
+        strcmp(word, "startFish") == 0 || strcmp(word, "startAll") == 0) {
+        return LANE_MUTATION;
+    }
+    return LANE_CONTROL;  // hello, ping, nack, resync, log, unknown requests (quick NOK)
+}
+
 int first_word(int job_socket, char* message) {
     // strip message
     trim(message);
@@ -685,24 +1247,75 @@ int first_word(int job_socket, char* message) {
         return handle_Hello(job_socket, message);
     else if (strncmp(message, "getFishesContinuously", 21) == 0) 
         return handle_Continuous(job_socket, message);
+    else if (strncmp(message, "getFishesMulticast", 18) == 0)
+        return handle_Multicast(job_socket, message);
+    else if (strncmp(message, "getFishesShm", 12) == 0)
+        return handle_Shm(job_socket, message);
     else if (strncmp(message, "getFishes", 9) == 0) 
         return handle_getFishes(job_socket, message);
     else if (strncmp(message, "ls", 2) == 0)
         return handle_ls(job_socket, message);
     else if (strncmp(message, "ping ", 5) == 0) 
         return handle_ping(job_socket, message);
+    else if (strncmp(message, "addFishBatch ", 13) == 0)
+        return handle_addFishBatch(job_socket, message);
     else if (strncmp(message, "addFish ", 8) == 0) 
         return handle_addFish(job_socket, message);
+    else if (strncmp(message, "delFishBatch ", 13) == 0)
+        return handle_delFishBatch(job_socket, message);
     else if (strncmp(message, "delFish ", 8) == 0) 
         return handle_delFish(job_socket, message);
     else if (strncmp(message, "startFish ", 10) == 0) 
         return handle_startFish(job_socket, message);
+    else if (strncmp(message, "startAll", 8) == 0)
+        return handle_startAll(job_socket, message);
+    else if (strncmp(message, "ack ", 4) == 0)
+        return handle_ack(job_socket, message);
+    else if (strncmp(message, "nack ", 5) == 0)
+        return handle_nack(job_socket, message);
+    else if (strncmp(message, "resync", 6) == 0)
+        return handle_resync(job_socket, message);
     else if (strncmp(message, "log out", 7) == 0)
         return handle_logOut(job_socket, message);
+    else if (strcmp(message, "stats") == 0)
+        return handle_stats(job_socket, message);
     else
         return handle_Unknown(job_socket, message);
 }
 
+// Verbs timed by the request metrics, matched by prefix in the order of first_word
+static const char* verbs[] = {
+    "hello", "getFishesContinuously", "getFishesMulticast", "getFishesShm", "getFishes", "ls", "ping",
+    "addFishBatch", "addFish", "delFishBatch", "delFish", "startFish", "startAll", "ack", "nack", "resync",
+    "log out", "stats",
+};
+#define NB_VERBS (int)(sizeof(verbs) / sizeof(verbs[0]))
+static Metric* verb_latency[NB_VERBS + 1];  // The last one for the unknown requests
+
+void init_request_metrics() {
+    for (int i = 0; i <= NB_VERBS; i++) {
+        char labels[64];
+        snprintf(labels, sizeof(labels), "verb=\"%s\"", i < NB_VERBS ? verbs[i] : "unknown");
+        verb_latency[i] = metrics_histogram("aquarium_request_duration_us",
+            "Time to handle a request until its reply is queued, per verb", labels);
+    }
+}
+
+static int request_verb(const char* message) {
+    int i = 0;
+    while (i < NB_VERBS && strncmp(message, verbs[i], strlen(verbs[i])) != 0) {
+        i++;
+    }
+    return i;
+}
+
 void handle_message(int job_socket, char* buffer) {
+    trim(buffer);
+    capture_line(job_socket, buffer);
+    int verb = request_verb(buffer);
+    microseconds_t start = sim_clock_real();
+    TraceSpan span = trace_begin("request", verb < NB_VERBS ? verbs[verb] : "unknown", NULL);
     first_word(job_socket, buffer);
+    trace_end(&span);
+    metrics_record(verb_latency[verb], sim_clock_real() - start);
 }
\ No newline at end of file
@@ -1,3 +1,30 @@
+#ifndef HANDLE_CLIENT_H
+#define HANDLE_CLIENT_H
+
+#include <stddef.h>
+
 #define BUFFER_SIZE 1024
+#define MAX_MESSAGE_SIZE (1 << 20)  // Longest accepted batch command
+
+#define LS_INTERACTIVE_HORIZON 10  // "ls <n>" beyond this is bulk work
+#define LS_CHUNK 64                // Frames of "ls <n>" generated and streamed per hold of the world lock
+
+// Scheduling lanes of the requests, most urgent first. The workers serve them with
+// weighted round-robin, so heartbeats never wait behind bulk reads (see controleur.c)
+typedef enum {
+    LANE_CONTROL,      // hello, ping, subscriptions, acks, log out
+    LANE_INTERACTIVE,  // getFishes, short ls
+    LANE_MUTATION,     // addFish, delFish, startFish, startAll and their batches
+    LANE_BULK,         // ls over more than LS_INTERACTIVE_HORIZON positions
+    NB_LANES
+} RequestLane;
+
+// Lane of a request from its first bytes (the line may still be incomplete)
+RequestLane request_lane(const char* message, size_t len);
+
+// Register the latency histograms of the requests, one per verb (see metrics.h)
+void init_request_metrics();
+
+void handle_message(int job_socket, char* buffer);
 
-void handle_message(int job_socket, char* buffer);
\ No newline at end of file
+#endif // HANDLE_CLIENT_H
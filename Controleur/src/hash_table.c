@@ -0,0 +1,125 @@
+#include "hash_table.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define INITIAL_NB_BUCKETS 64
+
+// FNV-1a
+static uint64_t hash_string(const char* str) {
+    uint64_t hash = 14695981039346656037ULL;
+    while (*str) {
+        hash ^= (unsigned char)*str++;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+HashTable* create_hash_table() {
+    HashTable* table = (HashTable*)malloc(sizeof(HashTable));
+    if (!table) return NULL;
+    table->nb_buckets = INITIAL_NB_BUCKETS;
+    table->size = 0;
+    table->buckets = (HashEntry**)calloc(table->nb_buckets, sizeof(HashEntry*));
+    if (!table->buckets) {
+        free(table);
+        return NULL;
+    }
+    return table;
+}
+
+void destroy_hash_table(HashTable* table) {
+    if (!table) return;
+    for (size_t i = 0; i < table->nb_buckets; i++) {
+        HashEntry* entry = table->buckets[i];
+        while (entry) {
+            HashEntry* next = entry->next;
+            free(entry->key);
+            free(entry);
+            entry = next;
+        }
+    }
+    free(table->buckets);
+    free(table);
+}
+
+// Double the number of buckets once the load factor reaches 1
+static void grow(HashTable* table) {
+    size_t new_nb_buckets = table->nb_buckets * 2;
+    HashEntry** new_buckets = (HashEntry**)calloc(new_nb_buckets, sizeof(HashEntry*));
+    if (!new_buckets) return;  // Keep the old buckets, lookups stay correct
+
+    for (size_t i = 0; i < table->nb_buckets; i++) {
+        HashEntry* entry = table->buckets[i];
+        while (entry) {
+            HashEntry* next = entry->next;
+            size_t index = hash_string(entry->key) & (new_nb_buckets - 1);
+            entry->next = new_buckets[index];
+            new_buckets[index] = entry;
+            entry = next;
+        }
+    }
+
+    free(table->buckets);
+    table->buckets = new_buckets;
+    table->nb_buckets = new_nb_buckets;
+}
+
+void hash_table_reserve(HashTable* table, size_t n) {
+    if (!table) return;
+    while (table->nb_buckets <= n) {
+        size_t before = table->nb_buckets;
+        grow(table);
+        if (table->nb_buckets == before) return;  // Out of memory, the table stays usable
+    }
+}
+
+bool hash_table_insert(HashTable* table, const char* key, void* value) {
+    if (!table || !key) return false;
+    size_t index = hash_string(key) & (table->nb_buckets - 1);
+    for (HashEntry* entry = table->buckets[index]; entry; entry = entry->next) {
+        if (strcmp(entry->key, key) == 0) return false;
+    }
+
+    HashEntry* entry = (HashEntry*)malloc(sizeof(HashEntry));
+    if (!entry) return false;
+    entry->key = strdup(key);
+    if (!entry->key) {
+        free(entry);
+        return false;
+    }
+    entry->value = value;
+    entry->next = table->buckets[index];
+    table->buckets[index] = entry;
+    table->size++;
+
+    if (table->size >= table->nb_buckets) grow(table);
+    return true;
+}
+
+void* hash_table_get(const HashTable* table, const char* key) {
+    if (!table || !key) return NULL;
+    size_t index = hash_string(key) & (table->nb_buckets - 1);
+    for (HashEntry* entry = table->buckets[index]; entry; entry = entry->next) {
+        if (strcmp(entry->key, key) == 0) return entry->value;
+    }
+    return NULL;
+}
+
+bool hash_table_remove(HashTable* table, const char* key) {
+    if (!table || !key) return false;
+    size_t index = hash_string(key) & (table->nb_buckets - 1);
+    HashEntry* previous = NULL;
+    for (HashEntry* entry = table->buckets[index]; entry; entry = entry->next) {
+        if (strcmp(entry->key, key) == 0) {
+            if (previous) previous->next = entry->next;
+            else table->buckets[index] = entry->next;
+            free(entry->key);
+            free(entry);
+            table->size--;
+            return true;
+        }
+        previous = entry;
+    }
+    return false;
+}
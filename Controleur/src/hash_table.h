@@ -0,0 +1,40 @@
+#ifndef HASH_TABLE_H
+#define HASH_TABLE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// String-keyed hash table (separate chaining). Keys are copied, values are borrowed pointers.
+// Used to look up fishes by name in O(1) instead of scanning the fish list.
+
+typedef struct HashEntry {
+    char* key;
+    void* value;
+    struct HashEntry* next;
+} HashEntry;
+
+typedef struct HashTable {
+    HashEntry** buckets;
+    size_t nb_buckets;  // Always a power of two
+    size_t size;
+} HashTable;
+
+// Create and initialize a new table
+HashTable* create_hash_table();
+
+// Destroy the table and free memory (the values are not freed)
+void destroy_hash_table(HashTable* table);
+
+// Make room for n keys at once, so that a bulk insert doesn't rehash as it grows
+void hash_table_reserve(HashTable* table, size_t n);
+
+// Insert a key. Returns false if the key already exists
+bool hash_table_insert(HashTable* table, const char* key, void* value);
+
+// Get the value of a key. NULL if not found
+void* hash_table_get(const HashTable* table, const char* key);
+
+// Remove a key. Returns false if the key was not found
+bool hash_table_remove(HashTable* table, const char* key);
+
+#endif // HASH_TABLE_H
@@ -0,0 +1,529 @@
+#include "journal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "aquarium.h"
+#include "shm_world.h"
+#include "sim_clock.h"
+#include "snapshot.h"
+#include "utils.h"
+#include "log.h"
+
+#define MAX_PATH_LEN 256
+#define JOURNAL_HEADER_SIZE 16  // magic + uint64 generation
+#define RECORD_HEADER_SIZE 8    // uint32 length + uint32 crc
+
+static char journal_path[MAX_PATH_LEN];
+static char old_path[MAX_PATH_LEN];
+static int journal_fd = -1;
+static uint64_t generation = 0;      // Generation of journal_path
+static uint64_t appending_generation = 0;  // Generation of the records appended now, ahead while rotations are pending
+static uint64_t old_generation = 0;  // Generation of old_path, 0 if there is none
+static bool replaying = false;
+static JournalPolicy fsync_policy = JOURNAL_SYNC_ALWAYS;
+static int fsync_interval_ms = 100;
+
+// Records appended but not written yet. Two buffers: one fills while the other is written
+static char* pending = NULL;
+static size_t pending_len = 0, pending_cap = 0;
+static char* writing_buf = NULL;
+static size_t writing_cap = 0;
+
+// Records are numbered: a thread waits until durable_lsn reaches the last one it appended
+static uint64_t appended_lsn = 0;
+static uint64_t durable_lsn = 0;
+static _Thread_local uint64_t thread_lsn = 0;
+
+// A generation ended by journal_rotate: its last records, written and closed by the journal thread
+typedef struct Rotation {
+    char* records;
+    size_t len;
+    uint64_t lsn;  // Last record of the generation
+    struct Rotation* suivant;
+} Rotation;
+static Rotation* rotations = NULL;  // Oldest first
+static Rotation** last_rotation = &rotations;
+
+static pthread_mutex_t mutex_journal = PTHREAD_MUTEX_INITIALIZER;     // Buffer and counters
+static pthread_mutex_t mutex_journal_io = PTHREAD_MUTEX_INITIALIZER;  // Journal file (lock before mutex_journal)
+static pthread_cond_t cond_pending = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t cond_durable = PTHREAD_COND_INITIALIZER;
+
+bool journal_parse_policy(const char* name, JournalPolicy* policy) {
+    if (strcmp(name, "always") == 0) *policy = JOURNAL_SYNC_ALWAYS;
+    else if (strcmp(name, "interval") == 0) *policy = JOURNAL_SYNC_INTERVAL;
+    else if (strcmp(name, "never") == 0) *policy = JOURNAL_SYNC_NEVER;
+    else return false;
+    return true;
+}
+
+static bool write_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(fd, data, len);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += written;
+        len -= written;
+    }
+    return true;
+}
+
+// Create an empty journal file of a generation. Returns its fd, -1 on error
+static int create_journal_file(const char* path, uint64_t file_generation) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+
+    char header[JOURNAL_HEADER_SIZE];
+    memcpy(header, JOURNAL_MAGIC, 8);
+    memcpy(header + 8, &file_generation, sizeof(file_generation));
+    if (!write_all(fd, header, sizeof(header)) || fdatasync(fd) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// -------------------------- Replay --------------------------------
+
+// "fish ...": a fish handed off by a federation peer, with the trajectory it had
+static void apply_fish(const char* args) {  // Assumes the mutex is locked
+    char copy[JOURNAL_MAX_RECORD + 1];
+    snprintf(copy, sizeof(copy), "%s", args);
+    char* save = NULL;
+    char* name = strtok_r(copy, " ", &save);
+    char* move_function = strtok_r(NULL, " ", &save);
+    char* w = strtok_r(NULL, " ", &save);
+    char* h = strtok_r(NULL, " ", &save);
+    char* speed = strtok_r(NULL, " ", &save);
+    char* started = strtok_r(NULL, " ", &save);
+    char* rng = strtok_r(NULL, " ", &save);
+    char* count = strtok_r(NULL, " ", &save);
+    if (count == NULL) {
+        log_msg("[WARN] Malformed journal record: fish %s\n", args);
+        return;
+    }
+
+    Fish* fish = create_fish();
+    if (fish == NULL) return;
+    snprintf(fish->name, MAX_NAME_LEN, "%s", name);
+    fish->rng = (unsigned int)strtoul(rng, NULL, 10);
+    int index = fonctionExiste(move_function);
+    fish->move_function = table[(index > 0 ? index : 1) - 1].fonction;
+    fish->w = atoi(w);
+    fish->h = atoi(h);
+    fish->speed = strtod(speed, NULL);
+    fish->started = atoi(started) != 0;
+    fish->peer = -1;
+    fish->future_positions = create_list();
+    microseconds_t now = sim_clock_now();
+    for (int i = atoi(count); i > 0; i--) {
+        char* x = strtok_r(NULL, " ", &save);
+        char* y = strtok_r(NULL, " ", &save);
+        char* dt = strtok_r(NULL, " ", &save);
+        if (dt == NULL) break;
+        FishNextPos position = { atoi(x), atoi(y), now + strtoll(dt, NULL, 10) };
+        insert_back(fish->future_positions, position);
+    }
+
+    FishAddStatus status = fish->future_positions->size > 0 ? adopt_fish(fish) : FISH_ADD_BAD_POSITION;
+    if (status != FISH_ADD_OK) {
+        log_msg("[WARN] Journaled fish %s not replayed (status %d)\n", fish->name, (int)status);
+        destroy_fish(fish);
+    }
+}
+
+// Apply one mutation. Same effect as the request that produced it, without a reply
+// Only the default aquarium is journaled: the records apply to it
+static void apply_record(const char* record) {
+    char name[MAX_NAME_LEN], move_function[MAX_NAME_LEN], path[MAX_PATH_LEN];
+    int x, y, w, h;
+
+    if (sscanf(record, "load %49s", name) == 1) {  // 49 = MAX_NAME_LEN - 1
+        select_aquarium(get_aquarium_slot(name, true));
+        lock_aquarium();
+        load_aquarium(name);
+        unlock_aquarium();
+        select_aquarium(NULL);
+        return;
+    }
+    if (sscanf(record, "restore %255s", path) == 1) {
+        snapshot_load(path, NULL);
+        select_aquarium(NULL);
+        return;
+    }
+
+    lock_aquarium();
+    if (current_aquarium == NULL) {
+        unlock_aquarium();
+        return;
+    }
+
+    if (strncmp(record, "fish ", 5) == 0) {
+        apply_fish(record + 5);
+    } else if (sscanf(record, "addFish %49s %d %d %d %d %49s", name, &x, &y, &w, &h, move_function) == 6) {
+        try_add_fish(name, x, y, w, h, move_function);
+    } else if (sscanf(record, "delFish %49s", name) == 1) {
+        release_fish(name);
+    } else if (sscanf(record, "startFish %49s", name) == 1) {
+        Fish* fish = find_fish(name);
+        if (fish != NULL) {
+            fish->started = true;
+            shm_world_touch();
+        }
+    } else if (strcmp(record, "startAll") == 0) {
+        start_all_fishes();
+    } else if (sscanf(record, "addView %49s %d %d %d %d", name, &x, &y, &w, &h) == 5) {
+        append_view(name, x, y, w, h);
+    } else if (sscanf(record, "delView %49s", name) == 1) {
+        delete_view(name);
+    } else {
+        log_msg("[WARN] Unknown journal record: %s\n", record);
+    }
+    unlock_aquarium();
+}
+
+// Replay a journal file (or only check it, if !replay). *file_generation gets its generation, *valid_end
+// the offset after its last complete record. Returns the number of records, -1 if there is no valid file
+static int replay_file(const char* path, bool replay, uint64_t min_generation, uint64_t* file_generation, off_t* valid_end) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < JOURNAL_HEADER_SIZE) {
+        close(fd);
+        return -1;
+    }
+    const char* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return -1;
+
+    if (memcmp(data, JOURNAL_MAGIC, 8) != 0) {
+        log_msg("[ERROR] %s is not a journal\n", path);
+        munmap((void*)data, st.st_size);
+        return -1;
+    }
+    memcpy(file_generation, data + 8, sizeof(*file_generation));
+
+    // Older than the snapshot: already in it
+    bool apply = replay && *file_generation >= min_generation;
+
+    int count = 0;
+    off_t offset = JOURNAL_HEADER_SIZE;
+    char record[JOURNAL_MAX_RECORD + 1];
+    while (st.st_size - offset >= RECORD_HEADER_SIZE) {
+        uint32_t len, crc;
+        memcpy(&len, data + offset, sizeof(len));
+        memcpy(&crc, data + offset + 4, sizeof(crc));
+        if (len > JOURNAL_MAX_RECORD || (off_t)len > st.st_size - offset - RECORD_HEADER_SIZE) break;
+        if (crc32(data + offset + RECORD_HEADER_SIZE, len) != crc) break;  // Torn write
+
+        memcpy(record, data + offset + RECORD_HEADER_SIZE, len);
+        record[len] = '\0';
+        if (apply) {
+            apply_record(record);
+            count++;
+        }
+        offset += RECORD_HEADER_SIZE + len;
+    }
+    if (offset < st.st_size) {
+        log_msg("[WARN] %s: %lld bytes after the last complete record ignored\n",
+            path, (long long)(st.st_size - offset));
+    }
+
+    munmap((void*)data, st.st_size);
+    if (valid_end != NULL) *valid_end = offset;
+    return count;
+}
+
+// -------------------------- Writing --------------------------------
+
+// Write the records of buf and sync them according to the policy. Assumes mutex_journal_io is locked
+static void write_records(const char* buf, size_t len) {
+    if (len == 0 || journal_fd < 0) return;
+    if (!write_all(journal_fd, buf, len)) {
+        log_msg("[ERROR] Could not write the journal %s\n", journal_path);
+        return;
+    }
+    if (fsync_policy != JOURNAL_SYNC_NEVER && fdatasync(journal_fd) != 0) {
+        log_msg("[ERROR] Could not sync the journal %s\n", journal_path);
+    }
+}
+
+// Append the records of the current file to <path>.old. Assumes mutex_journal_io is locked
+static bool merge_into_old() {
+    int in = open(journal_path, O_RDONLY);
+    int out = open(old_path, O_WRONLY | O_APPEND);
+    bool ok = in >= 0 && out >= 0 && lseek(in, JOURNAL_HEADER_SIZE, SEEK_SET) == JOURNAL_HEADER_SIZE;
+
+    char buf[65536];
+    ssize_t n;
+    while (ok && (n = read(in, buf, sizeof(buf))) > 0) {
+        ok = write_all(out, buf, n);
+    }
+    if (ok) ok = fdatasync(out) == 0;
+    if (in >= 0) close(in);
+    if (out >= 0) close(out);
+    return ok;
+}
+
+// Close the generations ended by journal_rotate: their last records go to their file, which
+// becomes (or is merged into) <path>.old, and the next generation gets its file.
+// Assumes mutex_journal_io is locked
+static void finish_rotations() {
+    while (1) {
+        pthread_mutex_lock(&mutex_journal);
+        Rotation* rotation = rotations;
+        if (rotation != NULL) {
+            rotations = rotation->suivant;
+            if (rotations == NULL) last_rotation = &rotations;
+        }
+        pthread_mutex_unlock(&mutex_journal);
+        if (rotation == NULL) return;
+
+        write_records(rotation->records, rotation->len);
+        if (old_generation != 0) {
+            // The previous snapshot failed: its records must wait for this one
+            if (!merge_into_old()) {
+                log_msg("[ERROR] Could not merge the journal into %s\n", old_path);
+            }
+        } else if (rename(journal_path, old_path) == 0) {
+            old_generation = generation;
+        } else {
+            log_msg("[ERROR] Could not rotate the journal %s\n", journal_path);
+        }
+
+        // journal_record keeps appending meanwhile: the fd is only swapped once the new file exists
+        generation++;
+        int fd = create_journal_file(journal_path, generation);
+        if (fd < 0) {
+            log_msg("[ERROR] Could not create the journal %s, mutations are not journaled\n", journal_path);
+        }
+        close(journal_fd);
+        journal_fd = fd;
+
+        pthread_mutex_lock(&mutex_journal);
+        if (rotation->lsn > durable_lsn) durable_lsn = rotation->lsn;
+        pthread_cond_broadcast(&cond_durable);
+        pthread_mutex_unlock(&mutex_journal);
+        free(rotation->records);
+        free(rotation);
+    }
+}
+
+// Group commit: everything appended while the previous group was being synced goes in the next one
+static void* journal_thread(void* arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&mutex_journal);
+        if (fsync_policy == JOURNAL_SYNC_ALWAYS) {
+            while (pending_len == 0 && rotations == NULL) {
+                pthread_cond_wait(&cond_pending, &mutex_journal);
+            }
+        } else {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += (long)fsync_interval_ms * 1000000L;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+            deadline.tv_nsec %= 1000000000L;
+            if (rotations == NULL) pthread_cond_timedwait(&cond_pending, &mutex_journal, &deadline);
+        }
+        pthread_mutex_unlock(&mutex_journal);
+
+        pthread_mutex_lock(&mutex_journal_io);
+        finish_rotations();
+        pthread_mutex_lock(&mutex_journal);
+        if (rotations != NULL) {
+            // Rotated meanwhile: the pending records belong to the generation after it
+            pthread_mutex_unlock(&mutex_journal);
+            pthread_mutex_unlock(&mutex_journal_io);
+            continue;
+        }
+        char* buf = pending;
+        size_t len = pending_len;
+        size_t cap = pending_cap;
+        uint64_t lsn = appended_lsn;
+        pending = writing_buf;
+        pending_cap = writing_cap;
+        pending_len = 0;
+        writing_buf = buf;
+        writing_cap = cap;
+        pthread_mutex_unlock(&mutex_journal);
+
+        write_records(buf, len);
+        pthread_mutex_unlock(&mutex_journal_io);
+
+        pthread_mutex_lock(&mutex_journal);
+        if (lsn > durable_lsn) durable_lsn = lsn;
+        pthread_cond_broadcast(&cond_durable);
+        pthread_mutex_unlock(&mutex_journal);
+    }
+    return NULL;
+}
+
+int journal_start(const char* path, JournalPolicy policy, int interval_ms, uint64_t min_generation, bool replay) {
+    if (path == NULL || path[0] == '\0') {
+        log_msg("[INFO] Mutation journal disabled\n");
+        return 0;
+    }
+    snprintf(journal_path, sizeof(journal_path), "%s", path);
+    snprintf(old_path, sizeof(old_path), "%s.old", path);
+    fsync_policy = policy;
+    fsync_interval_ms = interval_ms > 0 ? interval_ms : 100;
+
+    replaying = true;
+    int replayed = 0;
+
+    // <path>.old survives only if its snapshot never made it to disk
+    uint64_t file_generation = 0;
+    int count = replay_file(old_path, replay, min_generation, &file_generation, NULL);
+    if (count >= 0 && file_generation >= min_generation) {
+        replayed += count;
+        old_generation = file_generation;
+    } else if (count >= 0) {
+        unlink(old_path);  // Already in the snapshot
+    }
+
+    off_t valid_end = 0;
+    count = replay_file(journal_path, replay, min_generation, &file_generation, &valid_end);
+    if (count >= 0 && file_generation >= min_generation) {
+        replayed += count;
+        generation = file_generation;
+        journal_fd = open(journal_path, O_WRONLY);
+        // Drop a torn last record, or the records appended after it could never be replayed
+        if (journal_fd >= 0 && (ftruncate(journal_fd, valid_end) != 0 || lseek(journal_fd, 0, SEEK_END) < 0)) {
+            close(journal_fd);
+            journal_fd = -1;
+        }
+    } else {
+        generation = min_generation > old_generation ? min_generation : old_generation + 1;
+        if (generation == 0) generation = 1;
+        journal_fd = create_journal_file(journal_path, generation);
+    }
+    appending_generation = generation;
+    replaying = false;
+
+    if (journal_fd < 0) {
+        log_msg("[ERROR] Could not open the journal %s, mutations are not journaled\n", journal_path);
+        return replayed;
+    }
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, journal_thread, NULL);
+    pthread_detach(thread);
+
+    log_msg("[INFO] Journal %s (generation %llu): %d mutations replayed\n",
+        journal_path, (unsigned long long)generation, replayed);
+    return replayed;
+}
+
+void journal_record(const char* format, ...) {  // Assumes the mutex is locked
+    if (journal_fd < 0 || replaying || selected_aquarium() != default_aquarium_slot()) return;
+
+    char record[RECORD_HEADER_SIZE + JOURNAL_MAX_RECORD + 1];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(record + RECORD_HEADER_SIZE, JOURNAL_MAX_RECORD + 1, format, args);
+    va_end(args);
+    if (len < 0) return;
+    if (len > JOURNAL_MAX_RECORD) len = JOURNAL_MAX_RECORD;
+
+    uint32_t record_len = len;
+    uint32_t crc = crc32(record + RECORD_HEADER_SIZE, record_len);
+    memcpy(record, &record_len, sizeof(record_len));
+    memcpy(record + 4, &crc, sizeof(crc));
+    size_t total = RECORD_HEADER_SIZE + record_len;
+
+    pthread_mutex_lock(&mutex_journal);
+    if (pending_len + total > pending_cap) {
+        size_t new_cap = pending_cap ? pending_cap : 4096;
+        while (new_cap < pending_len + total) new_cap *= 2;
+        char* bigger = realloc(pending, new_cap);
+        if (bigger == NULL) {
+            pthread_mutex_unlock(&mutex_journal);
+            log_msg("[ERROR] Journal buffer full, mutation not journaled\n");
+            return;
+        }
+        pending = bigger;
+        pending_cap = new_cap;
+    }
+    memcpy(pending + pending_len, record, total);
+    pending_len += total;
+    thread_lsn = ++appended_lsn;
+    if (fsync_policy == JOURNAL_SYNC_ALWAYS) pthread_cond_signal(&cond_pending);
+    pthread_mutex_unlock(&mutex_journal);
+}
+
+void journal_sync() {
+    if (thread_lsn == 0) return;
+    if (fsync_policy == JOURNAL_SYNC_ALWAYS) {
+        pthread_mutex_lock(&mutex_journal);
+        while (durable_lsn < thread_lsn) {
+            pthread_cond_wait(&cond_durable, &mutex_journal);
+        }
+        pthread_mutex_unlock(&mutex_journal);
+    }
+    thread_lsn = 0;
+}
+
+// Write what is appended without waiting for the journal thread. Assumes both journal mutexes are locked
+static void flush_pending() {
+    write_records(pending, pending_len);
+    pending_len = 0;
+    durable_lsn = appended_lsn;
+    pthread_cond_broadcast(&cond_durable);
+}
+
+void journal_flush() {
+    pthread_mutex_lock(&mutex_journal_io);
+    finish_rotations();
+    pthread_mutex_lock(&mutex_journal);
+    flush_pending();
+    pthread_mutex_unlock(&mutex_journal);
+    pthread_mutex_unlock(&mutex_journal_io);
+}
+
+uint64_t journal_rotate() {  // Assumes the mutex is locked
+    if (journal_fd < 0) return 0;
+
+    // Under the aquarium mutex only the buffer changes hands: the journal thread writes,
+    // closes and renames the file, without stalling the tick
+    Rotation* rotation = (Rotation*)malloc(sizeof(Rotation));
+    if (rotation == NULL) {
+        log_msg("[ERROR] Could not rotate the journal %s, its records may be replayed twice\n", journal_path);
+        return appending_generation;
+    }
+
+    pthread_mutex_lock(&mutex_journal);
+    // What is already appended belongs to the generation being closed
+    rotation->records = pending;
+    rotation->len = pending_len;
+    rotation->lsn = appended_lsn;
+    rotation->suivant = NULL;
+    pending = NULL;
+    pending_len = pending_cap = 0;
+    *last_rotation = rotation;
+    last_rotation = &rotation->suivant;
+    uint64_t new_generation = ++appending_generation;
+    pthread_cond_signal(&cond_pending);
+    pthread_mutex_unlock(&mutex_journal);
+    return new_generation;
+}
+
+void journal_drop_old(uint64_t snapshot_generation) {
+    pthread_mutex_lock(&mutex_journal_io);
+    finish_rotations();  // The generations before the snapshot are in <path>.old
+    if (old_generation != 0 && old_generation < snapshot_generation) {
+        unlink(old_path);
+        old_generation = 0;
+    }
+    pthread_mutex_unlock(&mutex_journal_io);
+}
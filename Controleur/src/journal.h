@@ -0,0 +1,65 @@
+// Write-ahead journal of the accepted mutations (addFish, delFish, startFish, startAll,
+// fishes handed off by a federation peer, CLI view changes, load and restore), so that what
+// happened since the last snapshot survives a crash. On startup the journal is replayed on
+// top of the snapshot.
+//
+// The journal is a file of records: uint32 length, uint32 CRC-32, then the mutation as
+// text ("addFish <name> <x> <y> <w> <h> <move_function>", "delFish <name>"...). A fish
+// handed off keeps its trajectory: "fish <name> <move_function> <w> <h> <speed> <started>
+// <rng> <n> <x> <y> <dt>...", dt relative to the record, like the snapshot shifts its times.
+// A record cut by a crash fails its checksum and ends the replay.
+//
+// Records are appended to a memory buffer under the aquarium mutex; a journal thread
+// writes and syncs them in groups. With the "always" policy a request's reply is held
+// until its records are on disk, but a burst of requests shares the same fsync.
+//
+// Every snapshot starts a new journal generation: the current file becomes <file>.old
+// and is deleted once the snapshot is on disk. A snapshot remembers the generation that
+// follows it, so older records are never replayed twice.
+//
+// Only the default aquarium (the first one hosted) is journaled, like it is snapshotted.
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define JOURNAL_MAGIC "AQJRNL\0"
+#define JOURNAL_MAX_RECORD 1024
+#define JOURNAL_FISH_POSITIONS 16  // Positions journaled with an adopted fish: its record fits in JOURNAL_MAX_RECORD
+
+typedef enum {
+    JOURNAL_SYNC_ALWAYS,    // Replies wait for the fsync of their group
+    JOURNAL_SYNC_INTERVAL,  // Written and synced every interval, replies don't wait
+    JOURNAL_SYNC_NEVER,     // Written every interval, the OS decides when it reaches the disk
+} JournalPolicy;
+
+// Parse "always", "interval" or "never". Returns false if unknown
+bool journal_parse_policy(const char* name, JournalPolicy* policy);
+
+// Replay <path>.old and <path> (skipping generations older than min_generation),
+// then open the journal for appending and start the journal thread. Without replay the
+// records are only checked: the state already contains them (live upgrade).
+// An empty path disables the journal. Returns the number of replayed records
+int journal_start(const char* path, JournalPolicy policy, int interval_ms, uint64_t min_generation, bool replay);
+
+// Append a mutation (printf-like). Does nothing when the journal is disabled, replaying,
+// or when the selected aquarium is not the default one
+void journal_record(const char* format, ...);  // Assumes the mutex is locked
+
+// Wait until the records appended by the calling thread are durable (policy "always" only).
+// Call it after releasing the aquarium mutex, before the reply leaves
+void journal_sync();
+
+// Write (and sync, unless the policy is "never") everything appended so far, now
+void journal_flush();
+
+// Start a new generation for the snapshot being captured. Returns it (0 if no journal).
+// Only hands the buffer over: the journal thread closes the file of the previous generation
+uint64_t journal_rotate();  // Assumes the mutex is locked
+
+// The snapshot of generation is on disk: the previous generation is not needed anymore
+void journal_drop_old(uint64_t generation);
+
+#endif // JOURNAL_H
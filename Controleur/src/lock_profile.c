@@ -0,0 +1,169 @@
+#include "lock_profile.h"
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include "metrics.h"
+#include "trace.h"
+
+static atomic_bool enabled = false;
+static LockProfile* profiles = NULL;
+static pthread_mutex_t mutex_profiles = PTHREAD_MUTEX_INITIALIZER;
+static const char* other_site = "other";
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void store_max(atomic_ullong* max, unsigned long long value) {
+    unsigned long long current = atomic_load_explicit(max, memory_order_relaxed);
+    while (value > current && !atomic_compare_exchange_weak(max, &current, value)) {
+    }
+}
+
+// Entry of a call site: its name's address hashed, then the next free entries
+static LockSite* find_site(LockProfile* profile, const char* name) {
+    unsigned int start = (unsigned int)(((uintptr_t)name >> 3) % (LOCK_PROFILE_SITES - 1));
+    for (int i = 0; i < LOCK_PROFILE_SITES - 1; i++) {
+        LockSite* site = &profile->sites[(start + i) % (LOCK_PROFILE_SITES - 1)];
+        const char* owner = atomic_load(&site->name);
+        if (owner == name) return site;
+        if (owner == NULL && atomic_compare_exchange_strong(&site->name, &owner, name)) return site;
+        if (owner == name) return site;  // Taken by another thread for the same site
+    }
+    LockSite* other = &profile->sites[LOCK_PROFILE_SITES - 1];  // The last entry is kept for the overflow
+    const char* owner = NULL;
+    atomic_compare_exchange_strong(&other->name, &owner, other_site);
+    return other;
+}
+
+void profiled_lock(LockProfile* profile, pthread_mutex_t* mutex, const char* site, LockHold* hold) {
+    TraceSpan span = trace_begin("lock", profile->name, site);
+    if (!atomic_load_explicit(&enabled, memory_order_relaxed)) {
+        pthread_mutex_lock(mutex);
+        trace_end(&span);
+        hold->site = NULL;
+        return;
+    }
+
+    uint64_t start = now_ns();
+    pthread_mutex_lock(mutex);
+    hold->acquired_ns = now_ns();
+    trace_end(&span);
+    hold->site = find_site(profile, site);
+
+    uint64_t wait = hold->acquired_ns - start;
+    atomic_fetch_add_explicit(&hold->site->acquisitions, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&hold->site->wait_ns, wait, memory_order_relaxed);
+    store_max(&hold->site->max_wait_ns, wait);
+}
+
+// The holder is done with the lock, for now or for good
+static void end_hold(LockHold* hold) {
+    if (hold->site == NULL) return;
+    uint64_t held = now_ns() - hold->acquired_ns;
+    atomic_fetch_add_explicit(&hold->site->hold_ns, held, memory_order_relaxed);
+    store_max(&hold->site->max_hold_ns, held);
+}
+
+void profiled_unlock(pthread_mutex_t* mutex, LockHold* hold) {
+    end_hold(hold);
+    hold->site = NULL;
+    pthread_mutex_unlock(mutex);
+}
+
+void profiled_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex, LockHold* hold) {
+    end_hold(hold);
+    pthread_cond_wait(cond, mutex);
+    if (hold->site != NULL) hold->acquired_ns = now_ns();
+}
+
+// -------------------------- Report --------------------------------
+
+static void write_site_family(StringBuilder* out, bool comments, const char* name, const char* type,
+                              const char* help, size_t field, bool ns) {
+    metrics_write_header(out, comments, name, type, help);
+    pthread_mutex_lock(&mutex_profiles);
+    for (LockProfile* profile = profiles; profile != NULL; profile = profile->suivant) {
+        for (int i = 0; i < LOCK_PROFILE_SITES; i++) {
+            LockSite* site = &profile->sites[i];
+            const char* site_name = atomic_load(&site->name);
+            if (site_name == NULL) continue;
+            char labels[160];
+            snprintf(labels, sizeof(labels), "lock=\"%s\",site=\"%s\"", profile->name, site_name);
+            unsigned long long value = atomic_load((atomic_ullong*)((char*)site + field));
+            metrics_write_value(out, name, labels, (long long)(ns ? value / 1000 : value));
+        }
+    }
+    pthread_mutex_unlock(&mutex_profiles);
+}
+
+static void collect_lock_metrics(StringBuilder* out, bool comments) {
+    write_site_family(out, comments, "aquarium_lock_acquisitions_total", "counter",
+                      "Acquisitions of a lock per call site", offsetof(LockSite, acquisitions), false);
+    write_site_family(out, comments, "aquarium_lock_wait_us_total", "counter",
+                      "Time spent waiting for a lock per call site", offsetof(LockSite, wait_ns), true);
+    write_site_family(out, comments, "aquarium_lock_wait_max_us", "gauge",
+                      "Longest wait for a lock per call site", offsetof(LockSite, max_wait_ns), true);
+    write_site_family(out, comments, "aquarium_lock_hold_us_total", "counter",
+                      "Time a lock was held per call site", offsetof(LockSite, hold_ns), true);
+    write_site_family(out, comments, "aquarium_lock_hold_max_us", "gauge",
+                      "Longest hold of a lock per call site", offsetof(LockSite, max_hold_ns), true);
+}
+
+void lock_profile_enable(bool enable) {
+    bool was_enabled = atomic_exchange(&enabled, enable);
+    if (enable && !was_enabled) metrics_collector(collect_lock_metrics);
+}
+
+void lock_profile_register(LockProfile* profile) {
+    pthread_mutex_lock(&mutex_profiles);
+    profile->suivant = profiles;
+    profiles = profile;
+    pthread_mutex_unlock(&mutex_profiles);
+}
+
+static int compare_hold(const void* a, const void* b) {
+    unsigned long long hold_a = atomic_load(&(*(LockSite* const*)a)->hold_ns);
+    unsigned long long hold_b = atomic_load(&(*(LockSite* const*)b)->hold_ns);
+    return hold_a < hold_b ? 1 : hold_a > hold_b ? -1 : 0;
+}
+
+void lock_profile_report(FILE* out) {
+    if (!atomic_load(&enabled)) return;
+
+    pthread_mutex_lock(&mutex_profiles);
+    for (LockProfile* profile = profiles; profile != NULL; profile = profile->suivant) {
+        LockSite* sites[LOCK_PROFILE_SITES];
+        int nb_sites = 0;
+        unsigned long long acquisitions = 0, wait_ns = 0, hold_ns = 0;
+        for (int i = 0; i < LOCK_PROFILE_SITES; i++) {
+            if (atomic_load(&profile->sites[i].name) == NULL) continue;
+            sites[nb_sites++] = &profile->sites[i];
+            acquisitions += atomic_load(&profile->sites[i].acquisitions);
+            wait_ns += atomic_load(&profile->sites[i].wait_ns);
+            hold_ns += atomic_load(&profile->sites[i].hold_ns);
+        }
+        qsort(sites, nb_sites, sizeof(LockSite*), compare_hold);
+
+        fprintf(out, "%s: %llu acquisitions, %.3f ms waited, %.3f ms held\n",
+                profile->name, acquisitions, wait_ns / 1e6, hold_ns / 1e6);
+        if (nb_sites == 0) continue;
+
+        LockSite* longest = sites[0];
+        for (int i = 1; i < nb_sites; i++) {
+            if (atomic_load(&sites[i]->max_hold_ns) > atomic_load(&longest->max_hold_ns)) longest = sites[i];
+        }
+        fprintf(out, "  longest hold: %s (%.3f ms)\n", atomic_load(&longest->name), atomic_load(&longest->max_hold_ns) / 1e6);
+        fprintf(out, "  %-32s %12s %12s %12s %12s %12s\n", "site", "acquisitions", "wait ms", "max wait ms", "hold ms", "max hold ms");
+        for (int i = 0; i < nb_sites; i++) {
+            fprintf(out, "  %-32s %12llu %12.3f %12.3f %12.3f %12.3f\n", atomic_load(&sites[i]->name),
+                    (unsigned long long)atomic_load(&sites[i]->acquisitions),
+                    atomic_load(&sites[i]->wait_ns) / 1e6, atomic_load(&sites[i]->max_wait_ns) / 1e6,
+                    atomic_load(&sites[i]->hold_ns) / 1e6, atomic_load(&sites[i]->max_hold_ns) / 1e6);
+        }
+    }
+    pthread_mutex_unlock(&mutex_profiles);
+}
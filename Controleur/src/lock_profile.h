@@ -0,0 +1,59 @@
+// Lock contention profiling, enabled with lock-profiling = 1 in controller.cfg.
+// For each profiled lock (mutex_aquarium, mutex_jobs) and each function taking it: the
+// acquisitions, the time spent waiting for the lock and the time it was held. The call site
+// is the caller's __func__, so the report tells which handler (handle_ls, update_fishes, a
+// CLI command...) keeps the others waiting, and which lock is worth sharding.
+//
+// The results are part of the metrics (stats, metrics-port) and printed when the controller
+// stops. Disabled, a profiled lock costs a branch. While tracing (see trace.h), every wait for
+// a profiled lock is also a span, profiling or not.
+
+#ifndef LOCK_PROFILE_H
+#define LOCK_PROFILE_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#define LOCK_PROFILE_SITES 64  // Call sites per lock. Beyond, they are counted as "other"
+
+typedef struct LockSite {
+    _Atomic(const char*) name;  // NULL while unused
+    atomic_ullong acquisitions;
+    atomic_ullong wait_ns, hold_ns;
+    atomic_ullong max_wait_ns, max_hold_ns;
+} LockSite;
+
+typedef struct LockProfile {
+    const char* name;
+    LockSite sites[LOCK_PROFILE_SITES];
+    struct LockProfile* suivant;
+} LockProfile;
+
+// Kept by the holder between profiled_lock and profiled_unlock
+typedef struct LockHold {
+    LockSite* site;  // NULL if the lock was taken while profiling was disabled
+    uint64_t acquired_ns;
+} LockHold;
+
+// Start or stop recording. Call once with the configuration, before the threads start
+void lock_profile_enable(bool enabled);
+
+// Add a lock to the report. profile is static and named
+void lock_profile_register(LockProfile* profile);
+
+// Lock mutex on behalf of site (a function name), recording the wait
+void profiled_lock(LockProfile* profile, pthread_mutex_t* mutex, const char* site, LockHold* hold);
+
+// Unlock mutex, recording how long it was held
+void profiled_unlock(pthread_mutex_t* mutex, LockHold* hold);
+
+// pthread_cond_wait on a profiled mutex: the time spent waiting for the condition is no hold
+void profiled_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex, LockHold* hold);
+
+// Print every lock, its sites sorted by time held, and the site that held it longest
+void lock_profile_report(FILE* out);
+
+#endif // LOCK_PROFILE_H
@@ -9,4 +9,12 @@ extern WINDOW* output_win;
 void init_logger(WINDOW* win);
 void log_msg(const char* format, ...);
 
+// Per-fish trajectory traces. Far too chatty for thousands of fishes,
+// so they are only compiled in with `make CFLAGS+=-DDEBUG_TRAJECTORIES`
+#ifdef DEBUG_TRAJECTORIES
+#define debug_msg(...) log_msg(__VA_ARGS__)
+#else
+#define debug_msg(...) ((void)0)
+#endif
+
 #endif  // LOG_H
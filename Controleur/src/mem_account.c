@@ -0,0 +1,87 @@
+#include "mem_account.h"
+#include <stdio.h>
+#include <stdatomic.h>
+#include "metrics.h"
+#include "read_cfg.h"
+#include "log.h"
+
+static atomic_llong bytes[NB_MEM_TAGS];
+static atomic_llong objects[NB_MEM_TAGS];
+static atomic_ullong refused[NB_MEM_TAGS];
+static atomic_bool limit_reached = false;  // For the log: once per crossing
+
+static const char* tag_names[NB_MEM_TAGS] = {"fish", "waypoints", "views", "output_buffers", "connections"};
+
+static void collect_mem_metrics(StringBuilder* out, bool comments) {
+    char labels[64];
+    metrics_write_header(out, comments, "aquarium_memory_bytes", "gauge",
+                         "Bytes held per subsystem, as accounted at allocation");
+    for (int tag = 0; tag < NB_MEM_TAGS; tag++) {
+        snprintf(labels, sizeof(labels), "subsystem=\"%s\"", tag_names[tag]);
+        metrics_write_value(out, "aquarium_memory_bytes", labels, mem_account_bytes(tag));
+    }
+    metrics_write_header(out, comments, "aquarium_memory_objects", "gauge",
+                         "Objects held per subsystem (waypoints: positions, connections: open ones)");
+    for (int tag = 0; tag < NB_MEM_TAGS; tag++) {
+        snprintf(labels, sizeof(labels), "subsystem=\"%s\"", tag_names[tag]);
+        metrics_write_value(out, "aquarium_memory_objects", labels, mem_account_objects(tag));
+    }
+    metrics_write_header(out, comments, "aquarium_memory_limit_bytes", "gauge",
+                         "memory-limit, 0: unlimited");
+    metrics_write_value(out, "aquarium_memory_limit_bytes", "", (long long)MEMORY_LIMIT * 1024 * 1024);
+    metrics_write_header(out, comments, "aquarium_memory_refused_total", "counter",
+                         "New fishes and views refused because memory-limit was reached");
+    metrics_write_value(out, "aquarium_memory_refused_total", "subsystem=\"fish\"", (long long)mem_account_refused(MEM_FISH));
+    metrics_write_value(out, "aquarium_memory_refused_total", "subsystem=\"views\"", (long long)mem_account_refused(MEM_VIEWS));
+}
+
+void init_mem_account() {
+    metrics_collector(collect_mem_metrics);
+}
+
+void mem_account_add(MemTag tag, long long n_bytes, long long n_objects) {
+    atomic_fetch_add_explicit(&bytes[tag], n_bytes, memory_order_relaxed);
+    if (n_objects != 0) atomic_fetch_add_explicit(&objects[tag], n_objects, memory_order_relaxed);
+}
+
+long long mem_account_bytes(MemTag tag) {
+    return atomic_load_explicit(&bytes[tag], memory_order_relaxed);
+}
+
+long long mem_account_objects(MemTag tag) {
+    return atomic_load_explicit(&objects[tag], memory_order_relaxed);
+}
+
+long long mem_account_total() {
+    long long total = 0;
+    for (int tag = 0; tag < NB_MEM_TAGS; tag++) {
+        total += mem_account_bytes(tag);
+    }
+    return total;
+}
+
+bool mem_account_admit(MemTag tag) {
+    if (MEMORY_LIMIT <= 0) return true;
+
+    long long total = mem_account_total();
+    long long limit = (long long)MEMORY_LIMIT * 1024 * 1024;
+    if (total < limit) {
+        if (atomic_exchange(&limit_reached, false)) {
+            log_msg("[INFO] Memory back under memory-limit (%.1f MB): new fishes and views accepted again\n", total / 1048576.0);
+        }
+        return true;
+    }
+    atomic_fetch_add(&refused[tag], 1);
+    if (!atomic_exchange(&limit_reached, true)) {
+        log_msg("[WARN] memory-limit of %d MB reached: new fishes and views are refused\n", MEMORY_LIMIT);
+    }
+    return false;
+}
+
+unsigned long long mem_account_refused(MemTag tag) {
+    return atomic_load(&refused[tag]);
+}
+
+const char* mem_account_tag_name(MemTag tag) {
+    return tag_names[tag];
+}
@@ -0,0 +1,46 @@
+// Memory accounting per subsystem: the bytes and objects the controller holds for its fishes,
+// their waypoints, the views, the output buffers and the connections, counted where they are
+// allocated and freed. Exported in the metrics (stats, metrics-port) as aquarium_memory_bytes
+// and aquarium_memory_objects, and shown by the CLI command "limits".
+//
+// With memory-limit (MB) in controller.cfg, new fishes ("NOK Memory limit reached", 'R' in
+// addFishBatch) and new views (CLI add view) are refused once the accounted total reaches it,
+// so that the controller degrades instead of being OOM-killed. What is already there keeps
+// running: hello only binds a display to an existing view and is never refused, nor are the
+// waypoints, buffers and connections.
+
+#ifndef MEM_ACCOUNT_H
+#define MEM_ACCOUNT_H
+
+#include <stdbool.h>
+
+typedef enum {
+    MEM_FISH,            // Fish structs, ghosts included
+    MEM_WAYPOINTS,       // Future positions: list nodes and heads (objects: positions)
+    MEM_VIEWS,           // Afficheur structs
+    MEM_OUTPUT_BUFFERS,  // Shared buffers: lists, replies, waiting in the output queues
+    MEM_CONNECTIONS,     // Input buffers and output queues (objects: open connections)
+    NB_MEM_TAGS
+} MemTag;
+
+// Export the accounting in the metrics (see metrics.h)
+void init_mem_account();
+
+// bytes and objects were allocated (positive) or freed (negative) for tag
+void mem_account_add(MemTag tag, long long bytes, long long objects);
+
+long long mem_account_bytes(MemTag tag);
+long long mem_account_objects(MemTag tag);
+
+// Bytes accounted over every subsystem
+long long mem_account_total();
+
+// May a new fish or view (tag) be created? false (and counted as refused) once memory-limit is reached
+bool mem_account_admit(MemTag tag);
+
+// Creations refused by mem_account_admit for tag
+unsigned long long mem_account_refused(MemTag tag);
+
+const char* mem_account_tag_name(MemTag tag);
+
+#endif // MEM_ACCOUNT_H
@@ -0,0 +1,272 @@
+#include "metrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "log.h"
+
+#define METRICS_HTTP_TIMEOUT 1  // s a scraper may take to send its request
+
+static Metric* metrics = NULL;  // In registration order
+static Metric** last_metric = &metrics;
+static MetricsCollector collectors[METRICS_MAX_COLLECTORS];
+static int nb_collectors = 0;
+static pthread_mutex_t mutex_metrics = PTHREAD_MUTEX_INITIALIZER;
+static int http_socket = -1;
+
+static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+static Metric* register_metric(MetricKind kind, const char* name, const char* help, const char* labels) {
+    Metric* metric = (Metric*)calloc(1, sizeof(Metric));
+    if (metric == NULL) return NULL;
+    if (kind == METRIC_HISTOGRAM) {
+        metric->histogram = (Histogram*)calloc(1, sizeof(Histogram));
+        if (metric->histogram == NULL) {
+            free(metric);
+            return NULL;
+        }
+    }
+    metric->kind = kind;
+    snprintf(metric->name, sizeof(metric->name), "%s", name);
+    snprintf(metric->help, sizeof(metric->help), "%s", help);
+    snprintf(metric->labels, sizeof(metric->labels), "%s", labels);
+
+    pthread_mutex_lock(&mutex_metrics);
+    *last_metric = metric;
+    last_metric = &metric->suivant;
+    pthread_mutex_unlock(&mutex_metrics);
+    return metric;
+}
+
+Metric* metrics_counter(const char* name, const char* help, const char* labels) {
+    return register_metric(METRIC_COUNTER, name, help, labels);
+}
+
+Metric* metrics_gauge(const char* name, const char* help, const char* labels) {
+    return register_metric(METRIC_GAUGE, name, help, labels);
+}
+
+Metric* metrics_histogram(const char* name, const char* help, const char* labels) {
+    return register_metric(METRIC_HISTOGRAM, name, help, labels);
+}
+
+void metrics_collector(MetricsCollector collect) {
+    pthread_mutex_lock(&mutex_metrics);
+    if (nb_collectors < METRICS_MAX_COLLECTORS) {
+        collectors[nb_collectors++] = collect;
+    } else {
+        log_msg("[WARN] Too many metrics collectors\n");
+    }
+    pthread_mutex_unlock(&mutex_metrics);
+}
+
+void metrics_add(Metric* counter, long long n) {
+    if (counter != NULL) atomic_fetch_add_explicit(&counter->value, n, memory_order_relaxed);
+}
+
+void metrics_set(Metric* gauge, long long value) {
+    if (gauge != NULL) atomic_store_explicit(&gauge->value, value, memory_order_relaxed);
+}
+
+// Bucket of a value: exact below 2 * HISTOGRAM_SUB_BUCKETS, then HISTOGRAM_SUB_BUCKETS
+// buckets per power of two
+static int bucket_index(unsigned long long value) {
+    if (value < 2 * HISTOGRAM_SUB_BUCKETS) return (int)value;
+    int magnitude = 63 - __builtin_clzll(value);
+    int shift = magnitude - 4;  // value >> shift is in [HISTOGRAM_SUB_BUCKETS, 2 * HISTOGRAM_SUB_BUCKETS[
+    int index = shift * HISTOGRAM_SUB_BUCKETS + (int)(value >> shift);
+    return index < HISTOGRAM_BUCKETS ? index : HISTOGRAM_BUCKETS - 1;
+}
+
+// Largest value falling in a bucket
+static long long bucket_upper_bound(int index) {
+    if (index < 2 * HISTOGRAM_SUB_BUCKETS) return index;
+    int shift = index / HISTOGRAM_SUB_BUCKETS - 1;
+    long long lower = (long long)(index % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS) << shift;
+    return lower + (1LL << shift) - 1;
+}
+
+void metrics_record(Metric* histogram, microseconds_t value) {
+    if (histogram != NULL) histogram_record(histogram->histogram, value);
+}
+
+void histogram_record(Histogram* h, microseconds_t value) {
+    if (value < 0) value = 0;
+    atomic_fetch_add_explicit(&h->buckets[bucket_index(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, value, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+}
+
+long long histogram_quantile(const Histogram* histogram, double q) {
+    // The buckets are read one by one while being written: count them rather than trust count
+    unsigned long long counts[HISTOGRAM_BUCKETS];
+    unsigned long long total = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        counts[i] = atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+        total += counts[i];
+    }
+    if (total == 0) return 0;
+
+    unsigned long long rank = (unsigned long long)(q * total);
+    if (rank >= total) rank = total - 1;
+    unsigned long long seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += counts[i];
+        if (seen > rank) return bucket_upper_bound(i);
+    }
+    return bucket_upper_bound(HISTOGRAM_BUCKETS - 1);
+}
+
+void metrics_write_header(StringBuilder* out, bool comments, const char* name, const char* type, const char* help) {
+    if (!comments) return;
+    sb_appendf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void metrics_write_value(StringBuilder* out, const char* name, const char* labels, long long value) {
+    if (labels[0] != '\0') {
+        sb_appendf(out, "%s{%s} %lld\n", name, labels, value);
+    } else {
+        sb_appendf(out, "%s %lld\n", name, value);
+    }
+}
+
+void metrics_write_histogram(StringBuilder* out, const char* name, const char* labels, const Histogram* histogram) {
+    const char* sep = labels[0] != '\0' ? "," : "";
+    for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+        sb_appendf(out, "%s{%s%squantile=\"%g\"} %lld\n", name, labels, sep,
+                   quantiles[i], histogram_quantile(histogram, quantiles[i]));
+    }
+    char suffixed[80];
+    snprintf(suffixed, sizeof(suffixed), "%s_sum", name);
+    metrics_write_value(out, suffixed, labels, (long long)atomic_load(&histogram->sum));
+    snprintf(suffixed, sizeof(suffixed), "%s_count", name);
+    metrics_write_value(out, suffixed, labels, (long long)atomic_load(&histogram->count));
+}
+
+bool metrics_format(StringBuilder* out, bool comments) {
+    static const char* types[] = {"counter", "gauge", "summary"};
+
+    // Registered metrics are never removed: the list can be walked once its head is read
+    pthread_mutex_lock(&mutex_metrics);
+    Metric* first = metrics;
+    int count = nb_collectors;
+    pthread_mutex_unlock(&mutex_metrics);
+
+    const char* family = "";
+    for (Metric* metric = first; metric != NULL; metric = metric->suivant) {
+        if (strcmp(metric->name, family) != 0) {
+            metrics_write_header(out, comments, metric->name, types[metric->kind], metric->help);
+            family = metric->name;
+        }
+        if (metric->kind == METRIC_HISTOGRAM) {
+            metrics_write_histogram(out, metric->name, metric->labels, metric->histogram);
+        } else {
+            metrics_write_value(out, metric->name, metric->labels, atomic_load(&metric->value));
+        }
+    }
+
+    // Outside of mutex_metrics: the collectors take the aquarium locks
+    for (int i = 0; i < count; i++) {
+        collectors[i](out, comments);
+    }
+    return out->data != NULL;
+}
+
+// -------------------------- HTTP --------------------------------
+
+// Answer one scrape and hang up
+static void serve_scrape(int socket_fd) {
+    char request[1024];
+    size_t len = 0;
+    while (len < sizeof(request) - 1) {
+        ssize_t received = recv(socket_fd, request + len, sizeof(request) - 1 - len, 0);
+        if (received < 0 && errno == EINTR) continue;
+        if (received <= 0) break;
+        len += received;
+        request[len] = '\0';
+        if (strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL) break;
+    }
+    request[len] = '\0';
+
+    char header[256];
+    StringBuilder body;
+    bool found = strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET / ", 6) == 0;
+    if (!sb_init(&body, 16384)) return;
+    if (found) {
+        metrics_format(&body, true);
+    } else {
+        sb_appendf(&body, "Not found: GET /metrics\n");
+    }
+    snprintf(header, sizeof(header),
+             "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+             found ? "200 OK" : "404 Not Found", body.len);
+
+    send(socket_fd, header, strlen(header), MSG_NOSIGNAL);
+    size_t sent = 0;
+    while (sent < body.len) {
+        ssize_t n = send(socket_fd, body.data + sent, body.len - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        sent += n;
+    }
+    sb_free(&body);
+}
+
+static void* http_thread(void* arg) {
+    (void)arg;
+    while (1) {
+        int socket_fd = accept(http_socket, NULL, NULL);
+        if (socket_fd < 0) {
+            if (errno != EINTR) usleep(100000);
+            continue;
+        }
+        struct timeval timeout = { METRICS_HTTP_TIMEOUT, 0 };
+        setsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(socket_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        serve_scrape(socket_fd);
+        close(socket_fd);
+    }
+    return NULL;
+}
+
+bool metrics_http_start(int port) {
+    if (port <= 0) {
+        log_msg("[INFO] Metrics endpoint disabled\n");
+        return false;
+    }
+
+    // Local only: the metrics tell a lot about the clients
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    int opt = 1;
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    if (listener < 0 ||
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+        bind(listener, (struct sockaddr*)&address, sizeof(address)) < 0 ||
+        listen(listener, 8) < 0) {
+        log_msg("[ERROR] Could not serve the metrics on port %d\n", port);
+        if (listener >= 0) close(listener);
+        return false;
+    }
+    http_socket = listener;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, http_thread, NULL) != 0) {
+        log_msg("[ERROR] Could not start the metrics thread\n");
+        close(listener);
+        return false;
+    }
+    pthread_detach(thread);
+
+    log_msg("[INFO] Metrics served on http://127.0.0.1:%d/metrics\n", port);
+    return true;
+}
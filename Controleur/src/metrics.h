@@ -0,0 +1,83 @@
+// Metrics of the controller: counters, gauges and latency histograms, registered once at
+// startup and updated with atomics only, so the workers and the ticks can record on every
+// request without a lock.
+//
+// Histograms are HDR-style: values (µs) below 2 * HISTOGRAM_SUB_BUCKETS have their own bucket,
+// larger ones share a bucket with the values within 1/HISTOGRAM_SUB_BUCKETS (6%) of them,
+// up to 2^HISTOGRAM_MAGNITUDES µs. Quantiles are read from the buckets, never from samples.
+//
+// Everything is read in the Prometheus text format, through the "stats" request or over HTTP
+// on 127.0.0.1:metrics-port ("GET /metrics"). Values only known when read (fish counts,
+// bytes sent per view...) come from collectors.
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdbool.h>
+#include <stdatomic.h>
+#include "shared_buffer.h"
+#include "utils.h"
+
+#define HISTOGRAM_SUB_BUCKETS 16
+#define HISTOGRAM_MAGNITUDES 37  // Up to 2^37 µs (38 hours)
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAGNITUDES - 3) * HISTOGRAM_SUB_BUCKETS)
+#define METRICS_MAX_COLLECTORS 16
+
+typedef struct Histogram {
+    atomic_ullong buckets[HISTOGRAM_BUCKETS];
+    atomic_ullong count;
+    atomic_ullong sum;
+} Histogram;
+
+typedef enum {
+    METRIC_COUNTER,
+    METRIC_GAUGE,
+    METRIC_HISTOGRAM,  // Exposed as a summary: quantiles, _sum and _count
+} MetricKind;
+
+typedef struct Metric {
+    MetricKind kind;
+    char name[64];
+    char help[128];
+    char labels[128];  // e.g. verb="ls", empty for none
+    atomic_llong value;  // Counter and gauge
+    Histogram* histogram;
+    struct Metric* suivant;
+} Metric;
+
+// Write the values of a collector. comments: with the # HELP and # TYPE lines
+typedef void (*MetricsCollector)(StringBuilder* out, bool comments);
+
+// Register a metric. The metrics of a name must be registered one after the other, with the
+// same kind. Never freed. NULL if out of memory: recording into NULL does nothing
+Metric* metrics_counter(const char* name, const char* help, const char* labels);
+Metric* metrics_gauge(const char* name, const char* help, const char* labels);
+Metric* metrics_histogram(const char* name, const char* help, const char* labels);
+
+// Register a collector, called each time the metrics are read
+void metrics_collector(MetricsCollector collect);
+
+void metrics_add(Metric* counter, long long n);
+void metrics_set(Metric* gauge, long long value);
+void metrics_record(Metric* histogram, microseconds_t value);
+
+// Record into a histogram kept outside the registry, exposed by a collector
+void histogram_record(Histogram* histogram, microseconds_t value);
+
+// Value below which a fraction q (0 to 1) of the recorded values are: the upper bound of
+// the bucket reaching it. 0 if nothing was recorded
+long long histogram_quantile(const Histogram* histogram, double q);
+
+// Helpers for the collectors
+void metrics_write_header(StringBuilder* out, bool comments, const char* name, const char* type, const char* help);
+void metrics_write_value(StringBuilder* out, const char* name, const char* labels, long long value);
+void metrics_write_histogram(StringBuilder* out, const char* name, const char* labels, const Histogram* histogram);
+
+// Every metric in the Prometheus text format. Without comments for the stats request
+bool metrics_format(StringBuilder* out, bool comments);
+
+// Serve the metrics over HTTP on 127.0.0.1:port in a background thread.
+// Returns false if they stay unavailable (port 0 or error)
+bool metrics_http_start(int port);
+
+#endif // METRICS_H
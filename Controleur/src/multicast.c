@@ -0,0 +1,165 @@
+#include "multicast.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "connection.h"
+#include "log.h"
+
+static int multicast_socket = -1;
+static struct sockaddr_in group_address;
+
+// Last datagrams sent, for retransmission over TCP
+static SharedBuffer* history[MULTICAST_HISTORY];
+static unsigned int history_seq[MULTICAST_HISTORY];
+static unsigned int last_seq = 0;
+static pthread_mutex_t mutex_multicast = PTHREAD_MUTEX_INITIALIZER;
+
+bool multicast_init(const char* group, int port, const char* interface_addr) {
+    if (port <= 0 || group == NULL || group[0] == '\0') {
+        log_msg("[INFO] Multicast channel disabled\n");
+        return false;
+    }
+
+    multicast_socket = socket(AF_INET, SOCK_DGRAM, 0);
+    if (multicast_socket < 0) {
+        log_msg("[ERROR] Could not create the multicast socket\n");
+        return false;
+    }
+
+    // Displays on the same host must receive our own datagrams
+    unsigned char loop = 1;
+    unsigned char ttl = 1;  // Stay on the local network
+    setsockopt(multicast_socket, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+    setsockopt(multicast_socket, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+
+    // Without an explicit interface the datagrams follow the default route, not the loopback
+    struct in_addr interface;
+    if (interface_addr != NULL && inet_pton(AF_INET, interface_addr, &interface) == 1) {
+        setsockopt(multicast_socket, IPPROTO_IP, IP_MULTICAST_IF, &interface, sizeof(interface));
+    }
+
+    memset(&group_address, 0, sizeof(group_address));
+    group_address.sin_family = AF_INET;
+    group_address.sin_port = htons(port);
+    if (inet_pton(AF_INET, group, &group_address.sin_addr) != 1) {
+        log_msg("[ERROR] Invalid multicast group: %s\n", group);
+        close(multicast_socket);
+        multicast_socket = -1;
+        return false;
+    }
+
+    log_msg("[INFO] Multicast channel on %s:%d via %s\n", group, port, interface_addr);
+    return true;
+}
+
+bool multicast_enabled() {
+    return multicast_socket != -1;
+}
+
+unsigned int multicast_last_seq() {
+    pthread_mutex_lock(&mutex_multicast);
+    unsigned int seq = last_seq;
+    pthread_mutex_unlock(&mutex_multicast);
+    return seq;
+}
+
+void multicast_resume_seq(unsigned int seq) {
+    pthread_mutex_lock(&mutex_multicast);
+    last_seq = seq;
+    pthread_mutex_unlock(&mutex_multicast);
+}
+
+// Number, send and remember one datagram made of the entries [start, start + len[
+static void send_datagram(const char* entries, size_t len) {  // Assumes mutex_multicast is locked
+    char datagram[MULTICAST_MAX_DATAGRAM + 1];
+    unsigned int seq = ++last_seq;
+    int header_len = snprintf(datagram, sizeof(datagram), "aq %u", seq);
+    memcpy(datagram + header_len, entries, len);
+    datagram[header_len + len] = '\n';
+    size_t datagram_len = header_len + len + 1;
+
+    sendto(multicast_socket, datagram, datagram_len, 0,
+           (struct sockaddr*)&group_address, sizeof(group_address));
+
+    unsigned int slot = seq % MULTICAST_HISTORY;
+    shared_buffer_unref(history[slot]);
+    history[slot] = shared_buffer_copy(datagram, datagram_len);
+    history_seq[slot] = seq;
+}
+
+// End of the entry " [...]" starting at entry (one past its ']')
+static const char* entry_end(const char* entry, const char* end) {
+    const char* bracket = memchr(entry, ']', end - entry);
+    return bracket ? bracket + 1 : end;
+}
+
+// Do the entries starting at a and b describe the same fish (same "<name>")?
+static bool same_fish(const char* a, const char* a_end, const char* b, const char* b_end) {
+    const char* a_name = memchr(a, '"', a_end - a);
+    const char* b_name = memchr(b, '"', b_end - b);
+    if (a_name == NULL || b_name == NULL) return false;
+    const char* a_quote = memchr(a_name + 1, '"', a_end - a_name - 1);
+    const char* b_quote = memchr(b_name + 1, '"', b_end - b_name - 1);
+    if (a_quote == NULL || b_quote == NULL) return false;
+    return a_quote - a_name == b_quote - b_name && memcmp(a_name, b_name, a_quote - a_name) == 0;
+}
+
+void multicast_publish(const SharedBuffer* fish_list) {
+    if (multicast_socket == -1 || fish_list == NULL) return;
+
+    // Skip "list" and the final '\n': what is left is a sequence of " [...]" entries
+    const char* entries = fish_list->data + 4;
+    const char* end = fish_list->data + fish_list->len;
+    while (end > entries && (end[-1] == '\n' || end[-1] == ' ')) end--;
+
+    // Room left for the entries once the header ("aq <seq>") and '\n' are written
+    const size_t max_entries_len = MULTICAST_MAX_DATAGRAM - 16;
+
+    pthread_mutex_lock(&mutex_multicast);
+    const char* start = entries;
+    while (start < end) {
+        // Cut at the last entry boundary that fits
+        const char* cut = start;
+        const char* next = start;
+        while (next < end) {
+            const char* next_end = entry_end(next, end);
+            if ((size_t)(next_end - start) > max_entries_len) break;
+            // An arrived fish ("...,0]") is followed by its new target: keep the pair in one datagram
+            bool pair_start = next_end - next >= 3 && next_end[-2] == '0' && next_end[-3] == ',' &&
+                next_end < end && same_fish(next, next_end, next_end, entry_end(next_end, end));
+            next = next_end;
+            if (!pair_start) cut = next;
+        }
+        if (cut == start) {
+            const char* first_end = entry_end(start, end);
+            if ((size_t)(first_end - start) > max_entries_len) {
+                // A single entry is larger than a datagram (very long name): skip it
+                start = first_end;
+                continue;
+            }
+            cut = first_end;  // The pair alone does not fit: send it over two datagrams
+        }
+        send_datagram(start, cut - start);
+        start = cut;
+    }
+    pthread_mutex_unlock(&mutex_multicast);
+}
+
+bool multicast_retransmit(int socket, unsigned int seq) {
+    pthread_mutex_lock(&mutex_multicast);
+    unsigned int slot = seq % MULTICAST_HISTORY;
+    SharedBuffer* datagram = NULL;
+    if (seq != 0 && history[slot] != NULL && history_seq[slot] == seq) {
+        datagram = shared_buffer_ref(history[slot]);
+    }
+    pthread_mutex_unlock(&mutex_multicast);
+
+    if (datagram == NULL) return false;
+    conn_send_shared(socket, datagram);
+    shared_buffer_unref(datagram);
+    return true;
+}
@@ -0,0 +1,39 @@
+// Optional UDP multicast channel for continuous updates.
+// The fish list is sent once per update in aquarium coordinates, whatever the number of
+// displays; each display projects it onto its own view. Datagrams are numbered so that
+// a display can ask for a lost one over TCP ("nack <seq>") or for the whole world ("resync").
+//
+// Datagram format (one line, at most MULTICAST_MAX_DATAGRAM bytes):
+// aq <seq> ["name" at X x Y,W x H,S] ["name" at ...] ...
+// X and Y are aquarium coordinates, the entries have the same meaning as in "list".
+
+#ifndef MULTICAST_H
+#define MULTICAST_H
+
+#include <stdbool.h>
+#include "shared_buffer.h"
+
+#define MULTICAST_MAX_DATAGRAM 1400  // Fits in an Ethernet MTU
+#define MULTICAST_HISTORY 1024       // Datagrams kept for retransmission
+
+// Open the multicast socket, sending through the interface with address interface_addr.
+// Returns false if the channel stays disabled
+bool multicast_init(const char* group, int port, const char* interface_addr);
+
+// True if multicast_init succeeded
+bool multicast_enabled();
+
+// Split a fish list ("list [..] [..]\n", aquarium coordinates) into numbered datagrams and send them
+void multicast_publish(const SharedBuffer* fish_list);
+
+// Sequence number of the last datagram sent (0 if none)
+unsigned int multicast_last_seq();
+
+// Continue the numbering of the controller we take over from (live upgrade),
+// so the displays don't see the sequence go back
+void multicast_resume_seq(unsigned int seq);
+
+// Send datagram seq again on a TCP socket. Returns false if it is no longer in the history
+bool multicast_retransmit(int socket, unsigned int seq);
+
+#endif // MULTICAST_H
@@ -0,0 +1,96 @@
+#include "rate_limit.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "connection.h"
+#include "read_cfg.h"
+#include "metrics.h"
+#include "utils.h"
+#include "sim_clock.h"
+
+_Static_assert(RATE_LIMIT_CLASSES == NB_LANES, "one rate-limit-<lane> entry per request lane");
+
+typedef struct Bucket {
+    double tokens;
+    microseconds_t last;  // Last refill, 0: never used (full)
+} Bucket;
+
+static Bucket buckets[MAX_CONNECTIONS][NB_LANES];
+static atomic_ullong accepted_requests[NB_LANES];
+static atomic_ullong refused_requests[NB_LANES];
+
+static const char* lane_names[NB_LANES] = {"control", "interactive", "mutation", "bulk"};
+
+static void collect_rate_limit_metrics(StringBuilder* out, bool comments) {
+    char labels[64];
+    metrics_write_header(out, comments, "aquarium_requests_accepted_total", "counter",
+                         "Requests let through by the rate limits, per lane");
+    for (int lane = 0; lane < NB_LANES; lane++) {
+        snprintf(labels, sizeof(labels), "lane=\"%s\"", lane_names[lane]);
+        metrics_write_value(out, "aquarium_requests_accepted_total", labels, (long long)atomic_load(&accepted_requests[lane]));
+    }
+    metrics_write_header(out, comments, "aquarium_requests_rate_limited_total", "counter",
+                         "Requests refused with NOK rate limited, per lane");
+    for (int lane = 0; lane < NB_LANES; lane++) {
+        snprintf(labels, sizeof(labels), "lane=\"%s\"", lane_names[lane]);
+        metrics_write_value(out, "aquarium_requests_rate_limited_total", labels, (long long)atomic_load(&refused_requests[lane]));
+    }
+}
+
+void init_rate_limit_metrics() {
+    metrics_collector(collect_rate_limit_metrics);
+}
+
+int rate_limit_cost(const char* message) {
+    if (strncmp(message, "addFishBatch", 12) != 0 && strncmp(message, "delFishBatch", 12) != 0) return 1;
+
+    int items = 1;
+    for (const char* c = message; *c != '\0'; c++) {
+        if (*c == ';' && c[1] != '\0') items++;  // A trailing ';' is no item
+    }
+    return items;
+}
+
+bool rate_limit_take(int socket, RequestLane lane, int cost) {
+    int rate = RATE_LIMIT_RATE[lane];
+    if (rate <= 0 || socket < 0 || socket >= MAX_CONNECTIONS) {
+        atomic_fetch_add(&accepted_requests[lane], 1);
+        return true;
+    }
+    double burst = RATE_LIMIT_BURST[lane] > 0 ? RATE_LIMIT_BURST[lane] : rate;
+
+    Bucket* bucket = &buckets[socket][lane];
+    microseconds_t now = sim_clock_real();
+    if (bucket->last == 0) {
+        bucket->tokens = burst;
+    } else {
+        bucket->tokens += (double)(now - bucket->last) * rate / 1000000.0;
+        if (bucket->tokens > burst) bucket->tokens = burst;
+    }
+    bucket->last = now;
+
+    // A batch larger than the burst could never pass: it may empty a full bucket instead
+    if (bucket->tokens >= cost || bucket->tokens >= burst) {
+        bucket->tokens -= cost;
+        atomic_fetch_add(&accepted_requests[lane], 1);
+        return true;
+    }
+    atomic_fetch_add(&refused_requests[lane], 1);
+    return false;
+}
+
+void rate_limit_reset(int socket) {
+    if (socket < 0 || socket >= MAX_CONNECTIONS) return;
+    for (int lane = 0; lane < NB_LANES; lane++) {
+        buckets[socket][lane].last = 0;
+    }
+}
+
+void rate_limit_counters(RequestLane lane, unsigned long long* accepted, unsigned long long* refused) {
+    *accepted = atomic_load(&accepted_requests[lane]);
+    *refused = atomic_load(&refused_requests[lane]);
+}
+
+const char* rate_limit_lane_name(RequestLane lane) {
+    return lane >= 0 && lane < NB_LANES ? lane_names[lane] : "?";
+}
@@ -0,0 +1,33 @@
+// Per-client rate limiting: every connection has one token bucket per request lane (see
+// handle_client.h), refilled at rate-limit-<lane> requests per second up to its burst.
+// A request finding its bucket empty is answered "NOK rate limited" and not run, so a client
+// flooding the controller only slows itself down; the others keep their own budgets.
+//
+// The buckets of a socket are only touched by the worker serving it (one job per socket at
+// a time), so they need no lock. The counters are shared and atomic.
+
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+#include <stdbool.h>
+#include "handle_client.h"
+
+// Export the counters in the metrics (see metrics.h)
+void init_rate_limit_metrics();
+
+// Tokens taken by a request: 1, or one per item of a batch
+int rate_limit_cost(const char* message);
+
+// Take cost tokens from the bucket of lane of socket. Returns false if the request is refused
+bool rate_limit_take(int socket, RequestLane lane, int cost);
+
+// The socket was closed: its next connection starts with full buckets
+void rate_limit_reset(int socket);
+
+// Requests let through and refused in lane since the start
+void rate_limit_counters(RequestLane lane, unsigned long long* accepted, unsigned long long* refused);
+
+// Name of a lane, as in controller.cfg
+const char* rate_limit_lane_name(RequestLane lane);
+
+#endif // RATE_LIMIT_H
@@ -6,6 +6,55 @@
 int CONTROLLER_PORT = 12345;
 int DISPLAY_TIMEOUT = 45;      // s
 int FISH_UPDATE_INTERVAL = 1;  // s
+char MULTICAST_GROUP[BUFFER_SIZE_CFG] = "239.255.0.1";
+int MULTICAST_PORT = 0;        // 0: multicast channel disabled
+char MULTICAST_INTERFACE[BUFFER_SIZE_CFG] = "127.0.0.1";
+char SHM_NAME[BUFFER_SIZE_CFG] = "";  // Empty: shared-memory snapshot disabled
+int SHM_CAPACITY = 65536;      // Fishes
+char SNAPSHOT_FILE[BUFFER_SIZE_CFG] = "";  // Empty: no snapshots
+int SNAPSHOT_INTERVAL = 60;    // s, 0: only on the "snapshot" command
+char JOURNAL_FILE[BUFFER_SIZE_CFG] = "";  // Empty: no journal
+char JOURNAL_FSYNC[BUFFER_SIZE_CFG] = "always";
+int JOURNAL_FSYNC_INTERVAL = 100;  // ms
+char UPGRADE_SOCKET[BUFFER_SIZE_CFG] = "";  // Empty: no live upgrade
+int FEDERATION_PORT = 0;       // 0: no federation
+char FEDERATION_REGION[BUFFER_SIZE_CFG] = "";  // Area of the aquarium simulated here
+char FEDERATION_PEERS[FEDERATION_MAX_PEERS][BUFFER_SIZE_CFG];  // "<host>:<port> <region>"
+int FEDERATION_PEER_COUNT = 0;
+int REPLICATION_PORT = 0;      // 0: no follower accepted
+int RATE_LIMIT_RATE[RATE_LIMIT_CLASSES] = {0};   // Requests per second and connection, 0: unlimited
+int RATE_LIMIT_BURST[RATE_LIMIT_CLASSES] = {0};  // Bucket size, 0: the rate
+int MAX_FISHES = 0;            // Fishes per aquarium, 0: unlimited
+int MAX_LS_HORIZON = 0;        // Positions per "ls <n>", 0: unlimited
+int METRICS_PORT = 0;          // 0: metrics only through the stats request
+int LOCK_PROFILING = 0;        // 1: time the waits and holds of the main locks
+int SLOW_VIEW_MS = 1000;       // Detection to ack beyond which a traced view is slow, 0: never
+int TRACE = 0;                 // 1: record spans from the start (see trace.h)
+int TRACE_BUFFER = 16384;      // Spans kept per thread
+int RANDOM_SEED = 1;           // Seed of the fishes' speeds and waypoints
+char CAPTURE_FILE[BUFFER_SIZE_CFG] = "";  // Empty: no capture of the client traffic
+char SIM_CLOCK[BUFFER_SIZE_CFG] = "real";  // Or "virtual" (see sim_clock.h)
+int SIM_CLOCK_SPEED = 0;       // Virtual clock: simulated seconds per second, 0: as fast as the ticks run
+int MEMORY_LIMIT = 0;          // MB of accounted memory before new fishes and views are refused, 0: unlimited
+char TICK_OVERRUN_POLICY[BUFFER_SIZE_CFG] = "coalesce";  // What the ticks running behind give up (see tick_scheduler.h)
+
+static const char* rate_limit_classes[RATE_LIMIT_CLASSES] = {"control", "interactive", "mutation", "bulk"};
+
+// Returns true if line set the rate limit of a class
+static bool read_rate_limit(const char* line) {
+    for (int i = 0; i < RATE_LIMIT_CLASSES; i++) {
+        char format[64];
+        snprintf(format, sizeof(format), "rate-limit-%s = %%d %%d", rate_limit_classes[i]);
+        int rate, burst = 0;
+        if (sscanf(line, format, &rate, &burst) >= 1) {
+            RATE_LIMIT_RATE[i] = rate;
+            RATE_LIMIT_BURST[i] = burst;
+            log_msg("[INFO] Rate limit of %s requests set to: %d/s, burst %d\n", rate_limit_classes[i], rate, burst);
+            return true;
+        }
+    }
+    return false;
+}
 
 bool read_cfg(const char* filename) {
     FILE* file = fopen(filename, "r");
@@ -32,6 +81,124 @@ bool read_cfg(const char* filename) {
         else if (sscanf(line, "fish-update-interval = %d", &FISH_UPDATE_INTERVAL) == 1) {
             log_msg("[INFO] Fish update interval set to: %d seconds\n", FISH_UPDATE_INTERVAL);
         }
+        // Read line "multicast-group = <ipv4 group>"
+        else if (sscanf(line, "multicast-group = %255s", MULTICAST_GROUP) == 1) {
+            log_msg("[INFO] Multicast group set to: %s\n", MULTICAST_GROUP);
+        }
+        // Read line "multicast-port = <port>"
+        else if (sscanf(line, "multicast-port = %d", &MULTICAST_PORT) == 1) {
+            log_msg("[INFO] Multicast port set to: %d\n", MULTICAST_PORT);
+        }
+        // Read line "multicast-interface = <ipv4 address>"
+        else if (sscanf(line, "multicast-interface = %255s", MULTICAST_INTERFACE) == 1) {
+            log_msg("[INFO] Multicast interface set to: %s\n", MULTICAST_INTERFACE);
+        }
+        // Read line "shm-name = </name>"
+        else if (sscanf(line, "shm-name = %255s", SHM_NAME) == 1) {
+            log_msg("[INFO] Shared-memory snapshot name set to: %s\n", SHM_NAME);
+        }
+        // Read line "shm-capacity = <fishes>"
+        else if (sscanf(line, "shm-capacity = %d", &SHM_CAPACITY) == 1) {
+            log_msg("[INFO] Shared-memory snapshot capacity set to: %d fishes\n", SHM_CAPACITY);
+        }
+        // Read line "snapshot-file = <path>"
+        else if (sscanf(line, "snapshot-file = %255s", SNAPSHOT_FILE) == 1) {
+            log_msg("[INFO] Snapshot file set to: %s\n", SNAPSHOT_FILE);
+        }
+        // Read line "snapshot-interval = <seconds>"
+        else if (sscanf(line, "snapshot-interval = %d", &SNAPSHOT_INTERVAL) == 1) {
+            log_msg("[INFO] Snapshot interval set to: %d seconds\n", SNAPSHOT_INTERVAL);
+        }
+        // Read line "journal-file = <path>"
+        else if (sscanf(line, "journal-file = %255s", JOURNAL_FILE) == 1) {
+            log_msg("[INFO] Journal file set to: %s\n", JOURNAL_FILE);
+        }
+        // Read line "journal-fsync = always|interval|never"
+        else if (sscanf(line, "journal-fsync = %255s", JOURNAL_FSYNC) == 1) {
+            log_msg("[INFO] Journal fsync policy set to: %s\n", JOURNAL_FSYNC);
+        }
+        // Read line "journal-fsync-interval = <ms>"
+        else if (sscanf(line, "journal-fsync-interval = %d", &JOURNAL_FSYNC_INTERVAL) == 1) {
+            log_msg("[INFO] Journal fsync interval set to: %d ms\n", JOURNAL_FSYNC_INTERVAL);
+        }
+        // Read line "upgrade-socket = <path>"
+        else if (sscanf(line, "upgrade-socket = %255s", UPGRADE_SOCKET) == 1) {
+            log_msg("[INFO] Upgrade socket set to: %s\n", UPGRADE_SOCKET);
+        }
+        // Read line "federation-port = <port>"
+        else if (sscanf(line, "federation-port = %d", &FEDERATION_PORT) == 1) {
+            log_msg("[INFO] Federation port set to: %d\n", FEDERATION_PORT);
+        }
+        // Read line "federation-region = <x>x<y>+<w>+<h>"
+        else if (sscanf(line, "federation-region = %255s", FEDERATION_REGION) == 1) {
+            log_msg("[INFO] Federation region set to: %s\n", FEDERATION_REGION);
+        }
+        // Read lines "federation-peer = <host>:<port> <x>x<y>+<w>+<h>", one per peer
+        else if (FEDERATION_PEER_COUNT < FEDERATION_MAX_PEERS &&
+                 sscanf(line, "federation-peer = %255[^\n]", FEDERATION_PEERS[FEDERATION_PEER_COUNT]) == 1) {
+            log_msg("[INFO] Federation peer added: %s\n", FEDERATION_PEERS[FEDERATION_PEER_COUNT]);
+            FEDERATION_PEER_COUNT++;
+        }
+        // Read line "replication-port = <port>"
+        else if (sscanf(line, "replication-port = %d", &REPLICATION_PORT) == 1) {
+            log_msg("[INFO] Replication port set to: %d\n", REPLICATION_PORT);
+        }
+        // Read lines "rate-limit-<class> = <requests per second> [<burst>]"
+        else if (read_rate_limit(line)) {
+            continue;
+        }
+        // Read line "max-fishes = <fishes>"
+        else if (sscanf(line, "max-fishes = %d", &MAX_FISHES) == 1) {
+            log_msg("[INFO] Max fishes per aquarium set to: %d\n", MAX_FISHES);
+        }
+        // Read line "max-ls-horizon = <positions>"
+        else if (sscanf(line, "max-ls-horizon = %d", &MAX_LS_HORIZON) == 1) {
+            log_msg("[INFO] Max ls horizon set to: %d\n", MAX_LS_HORIZON);
+        }
+        // Read line "metrics-port = <port>"
+        else if (sscanf(line, "metrics-port = %d", &METRICS_PORT) == 1) {
+            log_msg("[INFO] Metrics port set to: %d\n", METRICS_PORT);
+        }
+        // Read line "lock-profiling = 0|1"
+        else if (sscanf(line, "lock-profiling = %d", &LOCK_PROFILING) == 1) {
+            log_msg("[INFO] Lock profiling set to: %d\n", LOCK_PROFILING);
+        }
+        // Read line "slow-view-ms = <ms>"
+        else if (sscanf(line, "slow-view-ms = %d", &SLOW_VIEW_MS) == 1) {
+            log_msg("[INFO] Slow view threshold set to: %d ms\n", SLOW_VIEW_MS);
+        }
+        // Read line "trace = 0|1"
+        else if (sscanf(line, "trace = %d", &TRACE) == 1) {
+            log_msg("[INFO] Tracing set to: %d\n", TRACE);
+        }
+        // Read line "trace-buffer = <spans>"
+        else if (sscanf(line, "trace-buffer = %d", &TRACE_BUFFER) == 1) {
+            log_msg("[INFO] Trace buffer set to: %d spans per thread\n", TRACE_BUFFER);
+        }
+        // Read line "random-seed = <seed>"
+        else if (sscanf(line, "random-seed = %d", &RANDOM_SEED) == 1) {
+            log_msg("[INFO] Random seed set to: %d\n", RANDOM_SEED);
+        }
+        // Read line "capture-file = <path>"
+        else if (sscanf(line, "capture-file = %255s", CAPTURE_FILE) == 1) {
+            log_msg("[INFO] Capture file set to: %s\n", CAPTURE_FILE);
+        }
+        // Read line "clock = <real|virtual>"
+        else if (sscanf(line, "clock = %255s", SIM_CLOCK) == 1) {
+            log_msg("[INFO] Simulation clock set to: %s\n", SIM_CLOCK);
+        }
+        // Read line "clock-speed = <speed>"
+        else if (sscanf(line, "clock-speed = %d", &SIM_CLOCK_SPEED) == 1) {
+            log_msg("[INFO] Virtual clock speed set to: %d\n", SIM_CLOCK_SPEED);
+        }
+        // Read line "memory-limit = <MB>"
+        else if (sscanf(line, "memory-limit = %d", &MEMORY_LIMIT) == 1) {
+            log_msg("[INFO] Memory limit set to: %d MB\n", MEMORY_LIMIT);
+        }
+        // Read line "tick-overrun-policy = <policy>[,<policy>...]"
+        else if (sscanf(line, "tick-overrun-policy = %255s", TICK_OVERRUN_POLICY) == 1) {
+            log_msg("[INFO] Tick overrun policy set to: %s\n", TICK_OVERRUN_POLICY);
+        }
     }
 
     fclose(file);
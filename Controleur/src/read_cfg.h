@@ -4,10 +4,43 @@
 #include <stdbool.h>
 
 #define BUFFER_SIZE_CFG 256
+#define FEDERATION_MAX_PEERS 8
+#define RATE_LIMIT_CLASSES 4  // control, interactive, mutation, bulk: the request lanes
 
 extern int CONTROLLER_PORT;
 extern int DISPLAY_TIMEOUT;
 extern int FISH_UPDATE_INTERVAL;
+extern char MULTICAST_GROUP[BUFFER_SIZE_CFG];
+extern int MULTICAST_PORT;
+extern char MULTICAST_INTERFACE[BUFFER_SIZE_CFG];
+extern char SHM_NAME[BUFFER_SIZE_CFG];
+extern int SHM_CAPACITY;
+extern char SNAPSHOT_FILE[BUFFER_SIZE_CFG];
+extern int SNAPSHOT_INTERVAL;
+extern char JOURNAL_FILE[BUFFER_SIZE_CFG];
+extern char JOURNAL_FSYNC[BUFFER_SIZE_CFG];
+extern int JOURNAL_FSYNC_INTERVAL;
+extern char UPGRADE_SOCKET[BUFFER_SIZE_CFG];
+extern int FEDERATION_PORT;
+extern char FEDERATION_REGION[BUFFER_SIZE_CFG];
+extern char FEDERATION_PEERS[FEDERATION_MAX_PEERS][BUFFER_SIZE_CFG];
+extern int FEDERATION_PEER_COUNT;
+extern int REPLICATION_PORT;
+extern int RATE_LIMIT_RATE[RATE_LIMIT_CLASSES];
+extern int RATE_LIMIT_BURST[RATE_LIMIT_CLASSES];
+extern int MAX_FISHES;
+extern int MAX_LS_HORIZON;
+extern int METRICS_PORT;
+extern int LOCK_PROFILING;
+extern int SLOW_VIEW_MS;
+extern int TRACE;
+extern int TRACE_BUFFER;
+extern int RANDOM_SEED;
+extern char CAPTURE_FILE[BUFFER_SIZE_CFG];
+extern char SIM_CLOCK[BUFFER_SIZE_CFG];
+extern int SIM_CLOCK_SPEED;
+extern int MEMORY_LIMIT;
+extern char TICK_OVERRUN_POLICY[BUFFER_SIZE_CFG];
 
 bool read_cfg(const char* filename);
 
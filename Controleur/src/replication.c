@@ -0,0 +1,524 @@
+#include "replication.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include "snapshot.h"
+#include "shared_buffer.h"
+#include "log.h"
+#include "sim_clock.h"
+
+#define MAX_RECORD 1024          // replication_record lines (fish lines are built apart)
+#define RECEIVE_CHUNK 65536
+
+typedef struct Follower {
+    int socket;
+    uint64_t start;  // Stream position of its snapshot: the records before it are in the snapshot
+    char address[INET_ADDRSTRLEN + 8];
+} Follower;
+
+// Records not sent yet, protected by mutex_replication. The stream position of a record is
+// the number of bytes recorded before it
+static StringBuilder pending;
+static uint64_t pending_base = 0;  // Stream position of pending.data[0]
+static _Thread_local StringBuilder batch;  // Records of the thread not handed over yet, see replication_flush
+static bool resync_needed = false;
+static pthread_mutex_t mutex_replication = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond_replication = PTHREAD_COND_INITIALIZER;
+
+// Set while followers are attached (or being attached): read by the tick without locking
+static atomic_bool streaming = false;
+
+// The followers, protected by mutex_send (held while sending to them)
+static Follower followers[REPLICATION_MAX_FOLLOWERS];
+static int nb_followers = 0;
+static pthread_mutex_t mutex_send = PTHREAD_MUTEX_INITIALIZER;
+
+static int listen_socket = -1;
+static atomic_bool following = false;
+
+// -------------------------- Helpers --------------------------------
+
+static const char* move_function_name(const Fish* fish) {
+    for (int i = 0; i < table_size; i++) {
+        if (table[i].fonction == fish->move_function) return table[i].nom;
+    }
+    return "RandomWayPoint";
+}
+
+// Blocking send of everything. False if the follower is gone or blocked us for REPLICATION_SEND_TIMEOUT
+static bool send_all(int socket, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t sent = send(socket, data, len, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return false;
+        data += sent;
+        len -= sent;
+    }
+    return true;
+}
+
+static bool recording() {
+    return atomic_load(&streaming) && selected_aquarium() == default_aquarium_slot();
+}
+
+// The records only go to the thread's batch: no lock nor wake-up per record
+static void append_record(const char* data, size_t len) {  // Assumes the mutex is locked
+    if (batch.data == NULL && !sb_init(&batch, 4096)) return;
+    sb_append(&batch, data, len);
+}
+
+// -------------------------- Primary --------------------------------
+
+void replication_flush() {  // Assumes the mutex is locked
+    if (batch.len == 0) return;
+    if (!atomic_load(&streaming)) {
+        batch.len = 0;  // The last follower left meanwhile
+        return;
+    }
+
+    pthread_mutex_lock(&mutex_replication);
+    if (pending.len + batch.len > REPLICATION_MAX_PENDING) {
+        // The followers can't keep up: start again from a snapshot rather than grow without bound
+        log_msg("[WARN] Replication is lagging, the followers will get a new snapshot\n");
+        pending_base += pending.len;
+        pending.len = 0;
+        resync_needed = true;
+    } else {
+        sb_append(&pending, batch.data, batch.len);
+    }
+    pthread_cond_signal(&cond_replication);
+    pthread_mutex_unlock(&mutex_replication);
+    batch.len = 0;
+}
+
+void replication_record(const char* format, ...) {  // Assumes the mutex is locked
+    if (!recording()) return;
+
+    char record[MAX_RECORD + 2];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(record, MAX_RECORD + 1, format, args);
+    va_end(args);
+    if (len < 0) return;
+    if (len > MAX_RECORD) len = MAX_RECORD;
+    record[len++] = '\n';
+    append_record(record, len);
+}
+
+void replication_record_fish(const Fish* fish) {  // Assumes the mutex is locked
+    if (!recording()) return;
+
+    StringBuilder line;
+    if (!sb_init(&line, 256)) return;
+    sb_appendf(&line, "fish %s %s %d %d %.17g %d %u %d", fish->name, move_function_name(fish),
+        fish->w, fish->h, fish->speed, fish->started ? 1 : 0, fish->rng, (int)fish->future_positions->size);
+    for (Node* node = fish->future_positions->head; node != NULL; node = node->next) {
+        sb_appendf(&line, " %d %d %lld", node->data.x, node->data.y, (long long)node->data.arrival_time);
+    }
+    sb_append(&line, "\n", 1);
+    append_record(line.data, line.len);
+    sb_free(&line);
+}
+
+void replication_resync() {
+    if (!recording()) return;
+    pthread_mutex_lock(&mutex_replication);
+    resync_needed = true;
+    pthread_cond_signal(&cond_replication);
+    pthread_mutex_unlock(&mutex_replication);
+}
+
+// Capture the default aquarium. *position gets the stream position it is up to date with.
+// NULL if no aquarium is loaded
+static Snapshot* capture(uint64_t* position) {
+    select_aquarium(NULL);
+    lock_aquarium();
+    Snapshot* snapshot = current_aquarium != NULL ? snapshot_capture() : NULL;
+    pthread_mutex_lock(&mutex_replication);
+    *position = pending_base + pending.len;
+    pthread_mutex_unlock(&mutex_replication);
+    unlock_aquarium();
+
+    if (snapshot != NULL) snapshot_seal(snapshot);
+    return snapshot;
+}
+
+static bool send_snapshot(Follower* follower, const Snapshot* snapshot) {
+    if (snapshot == NULL) return true;  // Nothing loaded yet: the load triggers a resync
+    char line[64];
+    int len = snprintf(line, sizeof(line), "snapshot %llu\n", (unsigned long long)snapshot->size);
+    return send_all(follower->socket, line, len) &&
+        send_all(follower->socket, (const char*)snapshot->data, snapshot->size);
+}
+
+static void drop_follower(int index) {  // Assumes mutex_send is locked
+    log_msg("[WARN] Replication follower %s dropped\n", followers[index].address);
+    close(followers[index].socket);
+    followers[index] = followers[--nb_followers];
+}
+
+// Without follower the records are not needed anymore. Assumes mutex_send is locked
+static void stop_streaming_if_idle() {
+    if (nb_followers > 0) return;
+    atomic_store(&streaming, false);
+    pthread_mutex_lock(&mutex_replication);
+    pending_base += pending.len;
+    pending.len = 0;
+    resync_needed = false;
+    pthread_mutex_unlock(&mutex_replication);
+}
+
+// Accept the followers: each one gets a snapshot, then the records that follow it
+static void* accept_thread(void* arg) {
+    (void)arg;
+    while (1) {
+        struct sockaddr_in address;
+        socklen_t address_len = sizeof(address);
+        int socket_fd = accept(listen_socket, (struct sockaddr*)&address, &address_len);
+        if (socket_fd < 0) {
+            if (errno != EINTR) usleep(100000);
+            continue;
+        }
+        struct timeval timeout = { REPLICATION_SEND_TIMEOUT, 0 };
+        setsockopt(socket_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        int opt = 1;
+        setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+        pthread_mutex_lock(&mutex_send);
+        if (nb_followers == REPLICATION_MAX_FOLLOWERS) {
+            pthread_mutex_unlock(&mutex_send);
+            log_msg("[WARN] Too many replication followers, connection refused\n");
+            close(socket_fd);
+            continue;
+        }
+
+        // Records are buffered from now on, so none is lost between the capture and the first send
+        atomic_store(&streaming, true);
+        Follower* follower = &followers[nb_followers];
+        follower->socket = socket_fd;
+        char host[INET_ADDRSTRLEN] = "?";
+        inet_ntop(AF_INET, &address.sin_addr, host, sizeof(host));
+        snprintf(follower->address, sizeof(follower->address), "%s:%d", host, ntohs(address.sin_port));
+
+        Snapshot* snapshot = capture(&follower->start);
+        if (send_snapshot(follower, snapshot)) {
+            nb_followers++;
+            log_msg("[INFO] Replication follower %s attached\n", follower->address);
+        } else {
+            log_msg("[WARN] Could not send the snapshot to replication follower %s\n", follower->address);
+            close(socket_fd);
+        }
+        if (snapshot != NULL) snapshot_free(snapshot);
+        stop_streaming_if_idle();
+        pthread_mutex_unlock(&mutex_send);
+    }
+    return NULL;
+}
+
+// Send the buffered records to the followers, a heartbeat when there is none
+static void* replication_thread(void* arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&mutex_replication);
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += REPLICATION_HEARTBEAT / 1000;
+        deadline.tv_nsec += (REPLICATION_HEARTBEAT % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (pending.len == 0 && !resync_needed) {
+            if (pthread_cond_timedwait(&cond_replication, &mutex_replication, &deadline) == ETIMEDOUT) break;
+        }
+        // Take the whole buffer: the tick appends to a new one meanwhile
+        StringBuilder chunk = pending;
+        uint64_t chunk_base = pending_base;
+        pending_base += pending.len;
+        sb_init(&pending, chunk.cap);
+        bool resync = resync_needed;
+        resync_needed = false;
+        pthread_mutex_unlock(&mutex_replication);
+
+        pthread_mutex_lock(&mutex_send);
+        if (resync && nb_followers > 0) {
+            uint64_t position;
+            Snapshot* snapshot = capture(&position);
+            for (int i = nb_followers; i-- > 0;) {
+                followers[i].start = position;
+                if (!send_snapshot(&followers[i], snapshot)) drop_follower(i);
+            }
+            if (snapshot != NULL) snapshot_free(snapshot);
+        }
+        for (int i = nb_followers; i-- > 0;) {
+            Follower* follower = &followers[i];
+            bool sent;
+            if (chunk.len == 0) {
+                sent = send_all(follower->socket, "hb\n", 3);
+            } else {
+                uint64_t skip = follower->start > chunk_base ? follower->start - chunk_base : 0;
+                sent = skip >= chunk.len || send_all(follower->socket, chunk.data + skip, chunk.len - skip);
+            }
+            if (!sent) drop_follower(i);
+        }
+        stop_streaming_if_idle();
+        pthread_mutex_unlock(&mutex_send);
+        sb_free(&chunk);
+    }
+    return NULL;
+}
+
+bool replication_start(int port) {
+    if (port <= 0) {
+        log_msg("[INFO] Replication disabled\n");
+        return false;
+    }
+
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    int opt = 1;
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+    if (listener < 0 ||
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+        bind(listener, (struct sockaddr*)&address, sizeof(address)) < 0 ||
+        listen(listener, REPLICATION_MAX_FOLLOWERS) < 0) {
+        log_msg("[ERROR] Could not listen for replication followers on port %d\n", port);
+        if (listener >= 0) close(listener);
+        return false;
+    }
+    listen_socket = listener;
+    if (!sb_init(&pending, 4096)) return false;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, replication_thread, NULL) != 0 ||
+        pthread_detach(thread) != 0 ||
+        pthread_create(&thread, NULL, accept_thread, NULL) != 0) {
+        log_msg("[ERROR] Could not start the replication threads\n");
+        return false;
+    }
+    pthread_detach(thread);
+
+    log_msg("[INFO] Replication followers accepted on port %d\n", port);
+    return true;
+}
+
+// -------------------------- Follower --------------------------------
+
+bool replication_following() {
+    return atomic_load(&following);
+}
+
+// Drop the positions the fish has passed, like the primary's tick does
+static void trim_reached_targets(Fish* fish, microseconds_t now) {
+    while (fish->started && fish->future_positions->size > 1 &&
+           peek_front(fish->future_positions)->arrival_time <= now) {
+        pop_front(fish->future_positions);
+    }
+}
+
+// "fish ...": a new fish, with its trajectory
+static void apply_fish(char* args, microseconds_t offset) {  // Assumes the mutex is locked
+    char* save = NULL;
+    char* name = strtok_r(args, " ", &save);
+    char* move_function = strtok_r(NULL, " ", &save);
+    char* w = strtok_r(NULL, " ", &save);
+    char* h = strtok_r(NULL, " ", &save);
+    char* speed = strtok_r(NULL, " ", &save);
+    char* started = strtok_r(NULL, " ", &save);
+    char* rng = strtok_r(NULL, " ", &save);
+    char* count = strtok_r(NULL, " ", &save);
+    if (count == NULL || find_fish(name) != NULL) return;
+
+    Fish* fish = create_fish();
+    if (fish == NULL) return;
+    snprintf(fish->name, MAX_NAME_LEN, "%s", name);
+    fish->rng = (unsigned int)strtoul(rng, NULL, 10);  // The fish may be promoted with the follower
+    int index = fonctionExiste(move_function);
+    fish->move_function = table[(index > 0 ? index : 1) - 1].fonction;
+    fish->w = atoi(w);
+    fish->h = atoi(h);
+    fish->speed = strtod(speed, NULL);
+    fish->started = atoi(started) != 0;
+    fish->peer = -1;
+    fish->future_positions = create_list();
+    for (int i = atoi(count); i > 0; i--) {
+        char* x = strtok_r(NULL, " ", &save);
+        char* y = strtok_r(NULL, " ", &save);
+        char* t = strtok_r(NULL, " ", &save);
+        if (t == NULL) break;
+        FishNextPos position = { atoi(x), atoi(y), strtoll(t, NULL, 10) + offset };
+        insert_back(fish->future_positions, position);
+    }
+
+    fish->suivant = current_aquarium->poissons;
+    current_aquarium->poissons = fish;
+    hash_table_insert(current_aquarium->fish_index, fish->name, fish);
+    current_aquarium->fish_count++;
+}
+
+// "drop <name>": handed off to a federation peer, gone without being marked first
+static void apply_drop(const char* name) {  // Assumes the mutex is locked
+    Fish** link = &current_aquarium->poissons;
+    while (*link != NULL) {
+        Fish* fish = *link;
+        if (strncmp(fish->name, name, MAX_NAME_LEN) == 0) {
+            *link = fish->suivant;
+            hash_table_remove(current_aquarium->fish_index, fish->name);
+            current_aquarium->fish_count--;
+            destroy_fish(fish);
+            return;
+        }
+        link = &fish->suivant;
+    }
+}
+
+// Apply one line of the primary to the default aquarium
+static void apply_line(char* line, microseconds_t offset) {
+    char name[MAX_NAME_LEN];
+    int x, y, w, h;
+    long long t;
+    unsigned int rng;
+
+    select_aquarium(NULL);
+    lock_aquarium();
+    if (current_aquarium == NULL) {
+        unlock_aquarium();
+        return;
+    }
+
+    if (strncmp(line, "fish ", 5) == 0) {
+        apply_fish(line + 5, offset);
+    } else if (sscanf(line, "wp %49s %d %d %lld %u", name, &x, &y, &t, &rng) == 5) {  // 49 = MAX_NAME_LEN - 1
+        Fish* fish = find_fish(name);
+        if (fish != NULL) {
+            FishNextPos position = { x, y, t + offset };
+            insert_back(fish->future_positions, position);
+            fish->rng = rng;
+            trim_reached_targets(fish, sim_clock_now());
+        }
+    } else if (sscanf(line, "del %49s", name) == 1) {
+        release_fish(name);
+    } else if (sscanf(line, "drop %49s", name) == 1) {
+        apply_drop(name);
+    } else if (sscanf(line, "start %49s", name) == 1) {
+        Fish* fish = find_fish(name);
+        if (fish != NULL) fish->started = true;
+    } else if (strcmp(line, "startAll") == 0) {
+        start_all_fishes();
+    } else if (sscanf(line, "addView %49s %d %d %d %d", name, &x, &y, &w, &h) == 5) {
+        append_view(name, x, y, w, h);
+    } else if (sscanf(line, "delView %49s", name) == 1) {
+        delete_view(name);
+    } else if (strcmp(line, "hb") != 0) {
+        log_msg("[WARN] Unknown replication record: %s\n", line);
+    }
+    unlock_aquarium();
+}
+
+// Restore a snapshot of the primary. Returns the shift to apply to the primary's times
+static microseconds_t apply_snapshot(const char* data, size_t size) {
+    // Copied: the snapshot is read in place and must be aligned
+    void* copy = malloc(size);
+    if (copy == NULL) return 0;
+    memcpy(copy, data, size);
+    const SnapshotHeader* header = (const SnapshotHeader*)copy;
+    microseconds_t offset = size >= sizeof(SnapshotHeader) ? sim_clock_now() - header->created_us : 0;
+    if (offset < 0) offset = 0;  // Same shift as snapshot_restore
+
+    if (snapshot_restore(copy, size)) {
+        log_msg("[INFO] Replication: world received from the primary\n");
+    } else {
+        log_msg("[ERROR] Replication: invalid snapshot from the primary\n");
+    }
+    select_aquarium(NULL);
+    free(copy);
+    return offset;
+}
+
+bool replication_follow(const char* address) {
+    char host[64];
+    int port;
+    struct sockaddr_in primary;
+    memset(&primary, 0, sizeof(primary));
+    primary.sin_family = AF_INET;
+    if (sscanf(address, "%63[^:]:%d", host, &port) != 2 || inet_pton(AF_INET, host, &primary.sin_addr) != 1) {
+        log_msg("[ERROR] Invalid primary address '%s' (expected <host>:<port>)\n", address);
+        return false;
+    }
+    primary.sin_port = htons(port);
+
+    int socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (socket_fd < 0 || connect(socket_fd, (struct sockaddr*)&primary, sizeof(primary)) < 0) {
+        log_msg("[ERROR] Could not reach the primary at %s\n", address);
+        if (socket_fd >= 0) close(socket_fd);
+        return false;
+    }
+    struct timeval timeout = { REPLICATION_TIMEOUT, 0 };
+    setsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    atomic_store(&following, true);
+    log_msg("[INFO] Following the primary at %s\n", address);
+
+    size_t cap = RECEIVE_CHUNK * 2, len = 0;
+    char* buf = (char*)malloc(cap);
+    size_t snapshot_size = 0;  // > 0 while the bytes of a snapshot are expected
+    microseconds_t offset = 0;
+    while (buf != NULL) {
+        size_t wanted = len + (snapshot_size > RECEIVE_CHUNK ? snapshot_size : RECEIVE_CHUNK);
+        if (wanted > cap) {
+            char* bigger = (char*)realloc(buf, wanted);
+            if (bigger == NULL) break;
+            buf = bigger;
+            cap = wanted;
+        }
+        ssize_t received = recv(socket_fd, buf + len, cap - len, 0);
+        if (received < 0 && errno == EINTR) continue;
+        if (received <= 0) break;  // Closed, or silent for REPLICATION_TIMEOUT
+        len += received;
+
+        size_t start = 0;
+        while (start < len) {
+            if (snapshot_size > 0) {
+                if (len - start < snapshot_size) break;
+                offset = apply_snapshot(buf + start, snapshot_size);
+                start += snapshot_size;
+                snapshot_size = 0;
+                continue;
+            }
+            char* end = memchr(buf + start, '\n', len - start);
+            if (end == NULL) break;
+            *end = '\0';
+            char* line = buf + start;
+            start = end - buf + 1;
+
+            unsigned long long size;
+            if (sscanf(line, "snapshot %llu", &size) == 1) {
+                snapshot_size = size;
+            } else {
+                apply_line(line, offset);
+            }
+        }
+        memmove(buf, buf + start, len - start);
+        len -= start;
+    }
+    free(buf);
+    close(socket_fd);
+
+    atomic_store(&following, false);
+    log_msg("[WARN] The primary at %s is gone, taking over\n", address);
+    return true;
+}
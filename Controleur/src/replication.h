@@ -0,0 +1,62 @@
+// Hot standby: a follower controller keeps an identical copy of the default aquarium and takes
+// over when the primary dies. The primary listens on replication-port; "serveur --follow
+// <host>:<port>" connects to it and receives, over TCP:
+//     snapshot <size>\n      followed by a sealed snapshot (see snapshot.h), first and on every resync
+//     then one line per mutation applied by the primary, in order:
+//     fish <name> <move_function> <w> <h> <speed> <started> <rng> <n> <x> <y> <t>...
+//                            a new fish (addFish, or handed off by a federation peer)
+//     wp <name> <x> <y> <t> <rng>
+//                            a waypoint generated for a fish
+//     del <name>             release_fish (marks the fish, then releases it)
+//     drop <name>            the fish was handed off to a federation peer
+//     start <name>, startAll
+//     addView <name> <x> <y> <w> <h>, delView <name>
+//     hb                     nothing happened for a while
+// Waypoints are sent rather than regenerated, so the follower does not depend on rand(). <rng> is
+// the fish's rand_r state once they are drawn: a promoted follower goes on with the same waypoints.
+// t are arrival times on the primary's clock; the follower shifts them like a snapshot restore.
+//
+// The tick only appends lines to a buffer of its thread under the aquarium mutex, handed over
+// in one go when it unlocks (replication_flush): a replication thread sends them, and a follower too slow to keep up is dropped rather than stalling the primary.
+// The follower does not tick nor accept clients: when the stream ends (or stays silent for
+// REPLICATION_TIMEOUT), it is promoted and starts serving on its own controller-port.
+//
+// Only the default aquarium is replicated, like it is snapshotted and journaled.
+
+#ifndef REPLICATION_H
+#define REPLICATION_H
+
+#include <stdbool.h>
+#include "aquarium.h"
+
+#define REPLICATION_MAX_FOLLOWERS 4
+#define REPLICATION_MAX_PENDING (16 << 20)  // Bytes buffered for the followers before they resync
+#define REPLICATION_HEARTBEAT 1000          // ms without mutation before a heartbeat
+#define REPLICATION_TIMEOUT 3               // s of silence before a follower takes over
+#define REPLICATION_SEND_TIMEOUT 2          // s a follower may block a send before it is dropped
+
+// Accept followers on port in a background thread. Returns false if replication stays disabled
+bool replication_start(int port);
+
+// Follow the primary at "<host>:<port>": receive its world and apply its mutations until it
+// disappears. Blocking. Returns false if the primary could not be reached
+bool replication_follow(const char* address);
+
+// True while this controller is a follower: its ticks must not move the fishes
+bool replication_following();
+
+// Stream a mutation (printf-like) to the followers. Does nothing without follower,
+// or when the selected aquarium is not the default one
+void replication_record(const char* format, ...);  // Assumes the mutex is locked
+
+// Stream a whole fish, with its trajectory
+void replication_record_fish(const Fish* fish);  // Assumes the mutex is locked
+
+// Hand the records of the calling thread over to the replication thread, in one append.
+// Called by unlock_aquarium, so that the records stay in the order of the mutations
+void replication_flush();  // Assumes the mutex is locked
+
+// The default aquarium was replaced: the followers get a new snapshot
+void replication_resync();
+
+#endif // REPLICATION_H
@@ -0,0 +1,105 @@
+#include "shared_buffer.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include "mem_account.h"
+
+SharedBuffer* shared_buffer_wrap(char* data, size_t len) {
+    SharedBuffer* buf = (SharedBuffer*)malloc(sizeof(SharedBuffer));
+    if (!buf) return NULL;
+    atomic_init(&buf->refcount, 1);
+    buf->len = len;
+    buf->data = data;
+    mem_account_add(MEM_OUTPUT_BUFFERS, sizeof(SharedBuffer) + len, 1);
+    return buf;
+}
+
+SharedBuffer* shared_buffer_copy(const char* data, size_t len) {
+    char* copy = (char*)malloc(len + 1);
+    if (!copy) return NULL;
+    memcpy(copy, data, len);
+    copy[len] = '\0';
+    SharedBuffer* buf = shared_buffer_wrap(copy, len);
+    if (!buf) free(copy);
+    return buf;
+}
+
+SharedBuffer* shared_buffer_ref(SharedBuffer* buf) {
+    if (buf) atomic_fetch_add(&buf->refcount, 1);
+    return buf;
+}
+
+void shared_buffer_unref(SharedBuffer* buf) {
+    if (!buf) return;
+    if (atomic_fetch_sub(&buf->refcount, 1) == 1) {
+        mem_account_add(MEM_OUTPUT_BUFFERS, -(long long)(sizeof(SharedBuffer) + buf->len), -1);
+        free(buf->data);
+        free(buf);
+    }
+}
+
+// -------------------------- Builder --------------------------------
+
+static bool sb_reserve(StringBuilder* sb, size_t extra) {
+    size_t needed = sb->len + extra + 1;  // + '\0'
+    if (needed <= sb->cap) return true;
+    size_t new_cap = sb->cap ? sb->cap : 256;
+    while (new_cap < needed) new_cap *= 2;
+    char* bigger = (char*)realloc(sb->data, new_cap);
+    if (!bigger) return false;
+    sb->data = bigger;
+    sb->cap = new_cap;
+    return true;
+}
+
+bool sb_init(StringBuilder* sb, size_t cap) {
+    sb->data = NULL;
+    sb->len = 0;
+    sb->cap = 0;
+    if (!sb_reserve(sb, cap)) return false;
+    sb->data[0] = '\0';
+    return true;
+}
+
+bool sb_append(StringBuilder* sb, const char* data, size_t len) {
+    if (!sb_reserve(sb, len)) return false;
+    memcpy(sb->data + sb->len, data, len);
+    sb->len += len;
+    sb->data[sb->len] = '\0';
+    return true;
+}
+
+bool sb_appendf(StringBuilder* sb, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int needed = vsnprintf(sb->data + sb->len, sb->cap - sb->len, format, args);
+    va_end(args);
+    if (needed < 0) return false;
+
+    if ((size_t)needed >= sb->cap - sb->len) {
+        if (!sb_reserve(sb, needed)) return false;
+        va_start(args, format);
+        vsnprintf(sb->data + sb->len, sb->cap - sb->len, format, args);
+        va_end(args);
+    }
+    sb->len += needed;
+    return true;
+}
+
+SharedBuffer* sb_to_shared(StringBuilder* sb) {
+    SharedBuffer* buf = shared_buffer_wrap(sb->data, sb->len);
+    if (!buf) {
+        sb_free(sb);
+        return NULL;
+    }
+    sb->data = NULL;
+    sb->len = sb->cap = 0;
+    return buf;
+}
+
+void sb_free(StringBuilder* sb) {
+    free(sb->data);
+    sb->data = NULL;
+    sb->len = sb->cap = 0;
+}
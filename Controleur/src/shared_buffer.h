@@ -0,0 +1,51 @@
+// Reference-counted immutable output buffers.
+// A payload built once (e.g. a fish list) can be queued on several connections
+// without being copied; it is freed when the last connection has sent it.
+
+#ifndef SHARED_BUFFER_H
+#define SHARED_BUFFER_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+typedef struct SharedBuffer {
+    atomic_int refcount;
+    size_t len;
+    char* data;  // Never modified once shared
+} SharedBuffer;
+
+// Take ownership of a malloc'd buffer. The returned buffer has one reference
+SharedBuffer* shared_buffer_wrap(char* data, size_t len);
+
+// Copy data into a new buffer with one reference
+SharedBuffer* shared_buffer_copy(const char* data, size_t len);
+
+// Take one more reference
+SharedBuffer* shared_buffer_ref(SharedBuffer* buf);
+
+// Drop one reference, frees the buffer with the last one
+void shared_buffer_unref(SharedBuffer* buf);
+
+// Growable string used to build a payload before sharing it
+typedef struct StringBuilder {
+    char* data;
+    size_t len, cap;
+} StringBuilder;
+
+// Initialize an empty builder with an initial capacity
+bool sb_init(StringBuilder* sb, size_t cap);
+
+// Append a formatted string
+bool sb_appendf(StringBuilder* sb, const char* format, ...);
+
+// Append raw bytes
+bool sb_append(StringBuilder* sb, const char* data, size_t len);
+
+// Turn the builder into a shared buffer (the builder is emptied). NULL on error
+SharedBuffer* sb_to_shared(StringBuilder* sb);
+
+// Give up the builder's content
+void sb_free(StringBuilder* sb);
+
+#endif // SHARED_BUFFER_H
@@ -0,0 +1,148 @@
+#include "shm_world.h"
+#include <stddef.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "aquarium.h"
+#include "log.h"
+#include "sim_clock.h"
+
+// The layout is read by other programs, keep it in sync with the comment in shm_world.h
+_Static_assert(sizeof(ShmWorldHeader) <= SHM_WORLD_HEADER_SIZE, "header too large");
+_Static_assert(offsetof(ShmWorldHeader, seq) == 24, "seq offset");
+_Static_assert(offsetof(ShmWorldHeader, active) == 32, "active offset");
+_Static_assert(offsetof(ShmWorldHeader, tables) == 40, "tables offset");
+_Static_assert(sizeof(ShmFish) == 80, "ShmFish size");
+_Static_assert(MAX_NAME_LEN <= SHM_NAME_LEN, "fish names don't fit in ShmFish");
+
+static ShmWorldHeader* header = NULL;
+static ShmFish* tables[2];
+static char name_of_region[MAX_NAME_LEN];
+static int capacity = 0;
+static bool dirty = true;
+
+bool shm_world_init(const char* name, int requested_capacity) {
+    if (name == NULL || name[0] != '/' || requested_capacity <= 0) {
+        log_msg("[INFO] Shared-memory snapshot disabled\n");
+        return false;
+    }
+
+    size_t table_size = (size_t)requested_capacity * sizeof(ShmFish);
+    size_t size = SHM_WORLD_HEADER_SIZE + 2 * table_size;
+
+    int fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+    if (fd < 0) {
+        log_msg("[ERROR] Could not create the shared memory %s\n", name);
+        return false;
+    }
+    if (ftruncate(fd, size) < 0) {
+        log_msg("[ERROR] Could not size the shared memory %s\n", name);
+        close(fd);
+        return false;
+    }
+    void* region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);  // The mapping stays valid
+    if (region == MAP_FAILED) {
+        log_msg("[ERROR] Could not map the shared memory %s\n", name);
+        return false;
+    }
+
+    capacity = requested_capacity;
+    header = (ShmWorldHeader*)region;
+    tables[0] = (ShmFish*)((unsigned char*)region + SHM_WORLD_HEADER_SIZE);
+    tables[1] = (ShmFish*)((unsigned char*)region + SHM_WORLD_HEADER_SIZE + table_size);
+    strncpy(name_of_region, name, MAX_NAME_LEN - 1);
+    name_of_region[MAX_NAME_LEN - 1] = '\0';
+
+    // Same layout as the controller we take over from (live upgrade): keep its last frame
+    // and continue its sequence, the attached readers don't notice the change of writer
+    if (header->magic == SHM_WORLD_MAGIC && header->layout_version == SHM_WORLD_VERSION &&
+        header->capacity == (uint32_t)capacity && header->entry_size == sizeof(ShmFish)) {
+        uint64_t seq = atomic_load(&header->seq);
+        if (seq % 2 == 0) {
+            log_msg("[INFO] Shared-memory snapshot %s reused (%d fishes, %zu bytes)\n", name, capacity, size);
+            return true;
+        }
+        // Odd: the previous writer died in the middle of a publish, start over
+    }
+
+    // A reader still attached from a previous run sees seq go back to 0: "nothing published"
+    atomic_store(&header->seq, 0);
+    header->layout_version = SHM_WORLD_VERSION;
+    header->capacity = capacity;
+    header->entry_size = sizeof(ShmFish);
+    header->aquarium_w = header->aquarium_h = 0;
+    atomic_store(&header->active, 0);
+    memset(header->tables, 0, sizeof(header->tables));
+    atomic_thread_fence(memory_order_release);
+    header->magic = SHM_WORLD_MAGIC;
+
+    log_msg("[INFO] Shared-memory snapshot %s (%d fishes, %zu bytes)\n", name, capacity, size);
+    return true;
+}
+
+bool shm_world_enabled() {
+    return header != NULL;
+}
+
+const char* shm_world_name() {
+    return name_of_region;
+}
+
+int shm_world_capacity() {
+    return capacity;
+}
+
+void shm_world_touch() {  // Assumes the mutex is locked
+    dirty = true;
+}
+
+void shm_world_publish() {  // Assumes the mutex is locked
+    if (header == NULL || !dirty) return;
+
+    uint64_t seq = atomic_load_explicit(&header->seq, memory_order_relaxed);
+    uint32_t target = 1 - atomic_load_explicit(&header->active, memory_order_relaxed);
+
+    // Odd: readers of the table we are about to overwrite will notice it
+    atomic_store_explicit(&header->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    ShmFish* table = tables[target];
+    uint32_t count = 0;
+    bool truncated = false;
+    if (current_aquarium != NULL) {
+        header->aquarium_w = current_aquarium->w;
+        header->aquarium_h = current_aquarium->h;
+
+        for (Fish* fish = current_aquarium->poissons; fish != NULL; fish = fish->suivant) {
+            // Same fishes as in "list": the others are not visible yet, or not anymore
+            if (!fish->started || fish->to_delete) continue;
+            FishNextPos* next_position = peek_front(fish->future_positions);
+            if (next_position == NULL) continue;
+
+            if (count == (uint32_t)capacity) {
+                truncated = true;
+                break;
+            }
+            ShmFish* entry = &table[count++];
+            entry->arrival_us = next_position->arrival_time;
+            entry->x = next_position->x;
+            entry->y = next_position->y;
+            entry->w = fish->w;
+            entry->h = fish->h;
+            memcpy(entry->name, fish->name, MAX_NAME_LEN);
+        }
+    } else {
+        header->aquarium_w = header->aquarium_h = 0;
+    }
+
+    header->tables[target].published_us = sim_clock_now();
+    header->tables[target].count = count;
+    header->tables[target].truncated = truncated;
+
+    atomic_store_explicit(&header->active, target, memory_order_release);
+    atomic_store_explicit(&header->seq, seq + 2, memory_order_release);
+    dirty = false;
+}
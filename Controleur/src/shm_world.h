@@ -0,0 +1,116 @@
+// Shared-memory snapshot of the world, for displays running on the same host.
+// After each update the controller copies the started fishes into a POSIX shared-memory
+// region; a co-located display maps it read-only and reads the positions in place,
+// using TCP only for the control commands (hello, ping, addFish...).
+//
+// The region holds two fish tables. The controller fills the table readers are not
+// using, then switches "active" to it. A sequence counter (seqlock) is odd while a
+// table is being filled, so that a reader can check that the table it just read has
+// not been overwritten in the meantime (see shm_world_end_read).
+//
+// Layout (native byte order, offsets in bytes, mirrored by Affichage/src/ShmWorldReader.java):
+// Header (SHM_WORLD_HEADER_SIZE bytes)
+//     0  uint32 magic           SHM_WORLD_MAGIC
+//     4  uint32 layout_version  SHM_WORLD_VERSION
+//     8  uint32 capacity        Fishes per table
+//    12  uint32 entry_size      sizeof(ShmFish)
+//    16  int32  aquarium_w, aquarium_h
+//    24  uint64 seq             Even: stable, odd: a table is being filled
+//    32  uint32 active          Index of the last published table (0 or 1)
+//    40  ShmTableInfo tables[2] { int64 published_us; uint32 count; uint32 truncated; }
+// Table 0 at SHM_WORLD_HEADER_SIZE, table 1 right after it, capacity entries each:
+//     0  int64  arrival_us      When the fish reaches (x, y), same clock as gettimeofday
+//     8  int32  x, y            Target position, aquarium coordinates
+//    16  int32  w, h            Size
+//    24  char   name[SHM_NAME_LEN], '\0' terminated
+
+#ifndef SHM_WORLD_H
+#define SHM_WORLD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define SHM_WORLD_MAGIC 0x48535141u  // "AQSH"
+#define SHM_WORLD_VERSION 1
+#define SHM_WORLD_HEADER_SIZE 128
+#define SHM_NAME_LEN 56
+
+typedef struct ShmFish {
+    int64_t arrival_us;
+    int32_t x, y;
+    int32_t w, h;
+    char name[SHM_NAME_LEN];
+} ShmFish;
+
+typedef struct ShmTableInfo {
+    int64_t published_us;  // Time of the update that filled the table
+    uint32_t count;        // Fishes in the table
+    uint32_t truncated;    // 1 if the aquarium had more started fishes than capacity
+} ShmTableInfo;
+
+typedef struct ShmWorldHeader {
+    uint32_t magic;
+    uint32_t layout_version;
+    uint32_t capacity;
+    uint32_t entry_size;
+    int32_t aquarium_w, aquarium_h;
+    _Atomic uint64_t seq;
+    _Atomic uint32_t active;
+    uint32_t reserved;
+    ShmTableInfo tables[2];
+} ShmWorldHeader;
+
+// ------------------------- Controller side ------------------------------
+
+// Create (or reuse) the shared-memory object name, with room for capacity fishes per table.
+// Returns false if the snapshot stays disabled
+bool shm_world_init(const char* name, int capacity);
+
+// True if shm_world_init succeeded
+bool shm_world_enabled();
+
+// Name and capacity announced to the displays
+const char* shm_world_name();
+int shm_world_capacity();
+
+// Note that the world changed (fish added, started, removed, arrived...)
+void shm_world_touch();  // Assumes the mutex is locked
+
+// Copy the started fishes into the inactive table and make it the active one.
+// Does nothing if the world did not change since the last call
+void shm_world_publish();  // Assumes the mutex is locked
+
+// -------------------------- Reader side ---------------------------------
+// (shm_world_reader.c, no dependency on the rest of the controller)
+
+typedef struct ShmWorldReader {
+    const ShmWorldHeader* header;
+    const unsigned char* base;
+    size_t size;
+} ShmWorldReader;
+
+// A table as published by the controller. fishes points into the shared memory
+typedef struct ShmWorldView {
+    const ShmFish* fishes;
+    int count;
+    bool truncated;
+    int64_t published_us;
+    int aquarium_w, aquarium_h;
+    uint64_t seq;  // Sequence number when the read began
+} ShmWorldView;
+
+// Map the snapshot read-only. NULL if it does not exist or has another layout
+ShmWorldReader* shm_world_attach(const char* name);
+
+void shm_world_detach(ShmWorldReader* reader);
+
+// Start reading the active table, without copying it. False if nothing was published yet
+bool shm_world_begin_read(const ShmWorldReader* reader, ShmWorldView* view);
+
+// True if what was read from view since shm_world_begin_read is consistent.
+// Otherwise the controller overwrote the table meanwhile: read again
+bool shm_world_end_read(const ShmWorldReader* reader, const ShmWorldView* view);
+
+#endif // SHM_WORLD_H
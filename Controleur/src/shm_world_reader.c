@@ -0,0 +1,71 @@
+#include "shm_world.h"
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+ShmWorldReader* shm_world_attach(const char* name) {
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < SHM_WORLD_HEADER_SIZE) {
+        close(fd);
+        return NULL;
+    }
+    void* region = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (region == MAP_FAILED) return NULL;
+
+    const ShmWorldHeader* header = (const ShmWorldHeader*)region;
+    size_t needed = SHM_WORLD_HEADER_SIZE + 2 * (size_t)header->capacity * sizeof(ShmFish);
+    if (header->magic != SHM_WORLD_MAGIC || header->layout_version != SHM_WORLD_VERSION ||
+        header->entry_size != sizeof(ShmFish) || (size_t)st.st_size < needed) {
+        munmap(region, st.st_size);
+        return NULL;
+    }
+
+    ShmWorldReader* reader = malloc(sizeof(ShmWorldReader));
+    if (reader == NULL) {
+        munmap(region, st.st_size);
+        return NULL;
+    }
+    reader->header = header;
+    reader->base = region;
+    reader->size = st.st_size;
+    return reader;
+}
+
+void shm_world_detach(ShmWorldReader* reader) {
+    if (reader == NULL) return;
+    munmap((void*)reader->base, reader->size);
+    free(reader);
+}
+
+bool shm_world_begin_read(const ShmWorldReader* reader, ShmWorldView* view) {
+    const ShmWorldHeader* header = reader->header;
+    view->seq = atomic_load_explicit(&header->seq, memory_order_acquire);
+    if (view->seq < 2) return false;  // Nothing published yet
+
+    uint32_t active = atomic_load_explicit(&header->active, memory_order_acquire) & 1;
+    const ShmTableInfo* info = &header->tables[active];
+
+    view->fishes = (const ShmFish*)(reader->base + SHM_WORLD_HEADER_SIZE
+        + active * (size_t)header->capacity * sizeof(ShmFish));
+    view->count = info->count <= header->capacity ? (int)info->count : (int)header->capacity;
+    view->truncated = info->truncated != 0;
+    view->published_us = info->published_us;
+    view->aquarium_w = header->aquarium_w;
+    view->aquarium_h = header->aquarium_h;
+    return true;
+}
+
+bool shm_world_end_read(const ShmWorldReader* reader, const ShmWorldView* view) {
+    atomic_thread_fence(memory_order_acquire);
+    uint64_t seq = atomic_load_explicit(&reader->header->seq, memory_order_relaxed);
+
+    // The active table is only overwritten by the publication after the next one:
+    // that one starts at the second odd value following the even value read at the beginning
+    return seq <= (view->seq & ~(uint64_t)1) + 2;
+}
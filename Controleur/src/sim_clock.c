@@ -0,0 +1,83 @@
+#include "sim_clock.h"
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+static atomic_bool virtual_clock = false;
+static int virtual_speed = 0;
+static atomic_llong virtual_us = 0;
+static pthread_mutex_t mutex_clock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t clock_stepped = PTHREAD_COND_INITIALIZER;
+
+static microseconds_t epoch_at_start;     // Wall clock when the clock was first read
+static microseconds_t monotonic_at_start;
+static pthread_once_t start_once = PTHREAD_ONCE_INIT;
+
+static microseconds_t monotonic_usec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (microseconds_t)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void anchor_clock() {
+    epoch_at_start = get_time_usec();
+    monotonic_at_start = monotonic_usec();
+}
+
+microseconds_t sim_clock_real() {
+    pthread_once(&start_once, anchor_clock);
+    return epoch_at_start + monotonic_usec() - monotonic_at_start;
+}
+
+void sim_clock_use_virtual(int speed) {
+    pthread_mutex_lock(&mutex_clock);
+    virtual_speed = speed > 0 ? speed : 0;
+    atomic_store(&virtual_us, sim_clock_real());
+    atomic_store(&virtual_clock, true);
+    pthread_mutex_unlock(&mutex_clock);
+}
+
+bool sim_clock_is_virtual() {
+    return atomic_load(&virtual_clock);
+}
+
+microseconds_t sim_clock_now() {
+    if (atomic_load_explicit(&virtual_clock, memory_order_relaxed)) return atomic_load(&virtual_us);
+    return sim_clock_real();
+}
+
+void sim_clock_step(microseconds_t us) {
+    if (!sim_clock_is_virtual()) return;
+    pthread_mutex_lock(&mutex_clock);
+    atomic_fetch_add(&virtual_us, us);
+    pthread_cond_broadcast(&clock_stepped);
+    pthread_mutex_unlock(&mutex_clock);
+}
+
+void sim_clock_sleep(microseconds_t us) {
+    if (!sim_clock_is_virtual()) {
+        usleep(us);
+        return;
+    }
+    pthread_mutex_lock(&mutex_clock);
+    microseconds_t wake_up = atomic_load(&virtual_us) + us;
+    while (atomic_load(&virtual_us) < wake_up) {
+        pthread_cond_wait(&clock_stepped, &mutex_clock);
+    }
+    pthread_mutex_unlock(&mutex_clock);
+}
+
+void sim_clock_pace(microseconds_t us) {
+    if (!sim_clock_is_virtual()) {
+        usleep(us);
+        return;
+    }
+    if (virtual_speed > 0) {
+        usleep(us / virtual_speed);
+    } else {
+        sched_yield();  // Let the workers take the aquarium between two ticks
+    }
+    sim_clock_step(us);
+}
@@ -0,0 +1,39 @@
+// Clock of the simulation: the arrival times of the fishes, the ticks that reach them and the
+// times handed to the displays. Two backends:
+//   real     monotonic time, in µs since the epoch at startup: the times can still be compared
+//            with the peers' and the displays' wall clocks, but never jump when NTP steps it
+//   virtual  only moves when stepped. The tick of the default aquarium steps it by one tick
+//            interval instead of sleeping, the other ticks wait for it: a headless controller
+//            simulates clock-speed times faster than real time, or as fast as its ticks run
+//
+// Display timeouts, rate limits and measures stay in real time whatever the backend: the
+// clients and the machine live in it (sim_clock_real).
+
+#ifndef SIM_CLOCK_H
+#define SIM_CLOCK_H
+
+#include <stdbool.h>
+#include "utils.h"
+
+// Switch to the virtual backend, starting at the current time. speed: simulated µs per real µs,
+// 0: no sleep between the ticks
+void sim_clock_use_virtual(int speed);
+
+bool sim_clock_is_virtual();
+
+// Simulation time, µs
+microseconds_t sim_clock_now();
+
+// Monotonic real time, µs since the epoch at startup
+microseconds_t sim_clock_real();
+
+// Virtual: move the clock forward by us and wake up the ticks waiting for it. Real: no effect
+void sim_clock_step(microseconds_t us);
+
+// Wait for us of simulation time. Virtual: until the clock is stepped past it
+void sim_clock_sleep(microseconds_t us);
+
+// Wait for us of simulation time, driving the virtual clock: sleep us / speed, then step it
+void sim_clock_pace(microseconds_t us);
+
+#endif // SIM_CLOCK_H
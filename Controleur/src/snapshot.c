@@ -0,0 +1,401 @@
+#include "snapshot.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "aquarium.h"
+#include "journal.h"
+#include "read_cfg.h"
+#include "log.h"
+#include "sim_clock.h"
+
+#define MAX_PATH_LEN 256
+
+_Static_assert(sizeof(SnapshotHeader) <= SNAPSHOT_HEADER_SIZE, "header too large");
+_Static_assert(sizeof(SnapshotView) % 8 == 0, "sections must stay 8-byte aligned");
+_Static_assert(sizeof(SnapshotFish) % 8 == 0, "sections must stay 8-byte aligned");
+_Static_assert(MAX_NAME_LEN <= SNAPSHOT_NAME_LEN, "names don't fit in the snapshot");
+
+// Only one background write at a time
+static pthread_mutex_t mutex_snapshot = PTHREAD_MUTEX_INITIALIZER;
+static bool writing = false;
+
+// -------------------------- Capture --------------------------------
+
+static uint32_t header_crc(const SnapshotHeader* header) {
+    SnapshotHeader copy = *header;
+    copy.header_crc = 0;
+    return crc32(&copy, sizeof(copy));
+}
+
+// Name of the move function of a fish, as given to addFish
+static const char* move_function_name(const Fish* fish) {
+    for (int i = 0; i < table_size; i++) {
+        if (table[i].fonction == fish->move_function) return table[i].nom;
+    }
+    return "RandomWayPoint";
+}
+
+Snapshot* snapshot_capture() {  // Assumes the mutex is locked
+    if (current_aquarium == NULL) return NULL;
+
+    // Fishes marked for deletion are on their way out: leave them behind
+    uint64_t view_count = 0, fish_count_kept = 0, position_count = 0;
+    for (Afficheur* view = current_aquarium->afficheurs; view != NULL; view = view->suivant) {
+        view_count++;
+    }
+    for (Fish* fish = current_aquarium->poissons; fish != NULL; fish = fish->suivant) {
+        if (fish->to_delete) continue;
+        fish_count_kept++;
+        position_count += fish->future_positions->size;
+    }
+
+    size_t views_offset = SNAPSHOT_HEADER_SIZE;
+    size_t fishes_offset = views_offset + view_count * sizeof(SnapshotView);
+    size_t positions_offset = fishes_offset + fish_count_kept * sizeof(SnapshotFish);
+    size_t size = positions_offset + position_count * sizeof(SnapshotPosition);
+
+    Snapshot* snapshot = malloc(sizeof(Snapshot));
+    if (snapshot == NULL) return NULL;
+    snapshot->data = malloc(size);
+    if (snapshot->data == NULL) {
+        log_msg("[ERROR] Not enough memory for a snapshot of %zu bytes\n", size);
+        free(snapshot);
+        return NULL;
+    }
+    snapshot->size = size;
+
+    SnapshotHeader* header = (SnapshotHeader*)snapshot->data;
+    memset(snapshot->data, 0, SNAPSHOT_HEADER_SIZE);
+    memcpy(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic));
+    header->version = SNAPSHOT_VERSION;
+    header->header_size = SNAPSHOT_HEADER_SIZE;
+    header->created_us = sim_clock_now();
+    strncpy(header->aquarium_name, current_aquarium->name, SNAPSHOT_NAME_LEN - 1);
+    header->aquarium_w = current_aquarium->w;
+    header->aquarium_h = current_aquarium->h;
+    header->view_count = view_count;
+    header->fish_count = fish_count_kept;
+    header->position_count = position_count;
+    header->views_offset = views_offset;
+    header->fishes_offset = fishes_offset;
+    header->positions_offset = positions_offset;
+    header->file_size = size;
+
+    SnapshotView* views = (SnapshotView*)(snapshot->data + views_offset);
+    for (Afficheur* view = current_aquarium->afficheurs; view != NULL; view = view->suivant) {
+        strncpy(views->name, view->name, SNAPSHOT_NAME_LEN);  // Pads with '\0'
+        views->x = view->x;
+        views->y = view->y;
+        views->w = view->w;
+        views->h = view->h;
+        views++;
+    }
+
+    SnapshotFish* fishes = (SnapshotFish*)(snapshot->data + fishes_offset);
+    SnapshotPosition* positions = (SnapshotPosition*)(snapshot->data + positions_offset);
+    uint64_t next_position = 0;
+    for (Fish* fish = current_aquarium->poissons; fish != NULL; fish = fish->suivant) {
+        if (fish->to_delete) continue;
+        strncpy(fishes->name, fish->name, SNAPSHOT_NAME_LEN);
+        strncpy(fishes->move_function, move_function_name(fish), SNAPSHOT_FUNCTION_LEN);
+        fishes->move_function[SNAPSHOT_FUNCTION_LEN - 1] = '\0';
+        fishes->w = fish->w;
+        fishes->h = fish->h;
+        fishes->speed = fish->speed;
+        fishes->started = fish->started;
+        fishes->position_count = fish->future_positions->size;
+        fishes->first_position = next_position;
+        fishes->rng = fish->rng;
+
+        for (Node* node = fish->future_positions->head; node != NULL; node = node->next) {
+            positions[next_position].x = node->data.x;
+            positions[next_position].y = node->data.y;
+            positions[next_position].arrival_us = node->data.arrival_time;
+            next_position++;
+        }
+        fishes++;
+    }
+
+    return snapshot;
+}
+
+void snapshot_seal(Snapshot* snapshot) {
+    SnapshotHeader* header = (SnapshotHeader*)snapshot->data;
+    header->payload_crc = crc32(snapshot->data + SNAPSHOT_HEADER_SIZE, snapshot->size - SNAPSHOT_HEADER_SIZE);
+    header->header_crc = header_crc(header);
+}
+
+void snapshot_free(Snapshot* snapshot) {
+    if (snapshot == NULL) return;
+    free(snapshot->data);
+    free(snapshot);
+}
+
+// -------------------------- Write --------------------------------
+
+bool snapshot_write(Snapshot* snapshot, const char* path) {
+    snapshot_seal(snapshot);
+
+    char tmp_path[MAX_PATH_LEN];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        log_msg("[ERROR] Could not open %s\n", tmp_path);
+        return false;
+    }
+
+    const unsigned char* data = snapshot->data;
+    size_t left = snapshot->size;
+    while (left > 0) {
+        ssize_t written = write(fd, data, left);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            log_msg("[ERROR] Could not write %s\n", tmp_path);
+            close(fd);
+            unlink(tmp_path);
+            return false;
+        }
+        data += written;
+        left -= written;
+    }
+
+    // The previous snapshot is only replaced by a complete one
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    if (!ok || rename(tmp_path, path) != 0) {
+        log_msg("[ERROR] Could not replace %s\n", path);
+        unlink(tmp_path);
+        return false;
+    }
+    return true;
+}
+
+typedef struct SaveJob {
+    Snapshot* snapshot;
+    char path[MAX_PATH_LEN];
+} SaveJob;
+
+static void* save_thread(void* arg) {
+    SaveJob* job = (SaveJob*)arg;
+    microseconds_t start = sim_clock_real();
+    const SnapshotHeader* header = (const SnapshotHeader*)job->snapshot->data;
+
+    if (snapshot_write(job->snapshot, job->path)) {
+        journal_drop_old(header->journal_generation);
+        log_msg("[INFO] Snapshot of %llu fishes written to %s (%zu bytes, %.1f ms)\n",
+            (unsigned long long)header->fish_count, job->path, job->snapshot->size,
+            (sim_clock_real() - start) / 1000.0);
+    }
+
+    snapshot_free(job->snapshot);
+    free(job);
+
+    pthread_mutex_lock(&mutex_snapshot);
+    writing = false;
+    pthread_mutex_unlock(&mutex_snapshot);
+    return NULL;
+}
+
+bool snapshot_save_async(const char* path) {  // Assumes the mutex is locked
+    pthread_mutex_lock(&mutex_snapshot);
+    if (writing) {
+        pthread_mutex_unlock(&mutex_snapshot);
+        log_msg("[WARN] Previous snapshot still being written, skipping this one\n");
+        return false;
+    }
+    writing = true;
+    pthread_mutex_unlock(&mutex_snapshot);
+
+    SaveJob* job = malloc(sizeof(SaveJob));
+    if (job != NULL) {
+        job->snapshot = snapshot_capture();
+        snprintf(job->path, sizeof(job->path), "%s", path);
+    }
+
+    // The mutations from now on go to a new journal generation, replayed on top of this snapshot.
+    // Only for the snapshot restored on startup: another file doesn't make the journal shorter
+    if (job != NULL && job->snapshot != NULL && strcmp(path, SNAPSHOT_FILE) == 0 &&
+        selected_aquarium() == default_aquarium_slot()) {
+        SnapshotHeader* header = (SnapshotHeader*)job->snapshot->data;
+        header->journal_generation = journal_rotate();
+    }
+
+    pthread_t thread;
+    if (job == NULL || job->snapshot == NULL || pthread_create(&thread, NULL, save_thread, job) != 0) {
+        if (job != NULL) snapshot_free(job->snapshot);
+        free(job);
+        pthread_mutex_lock(&mutex_snapshot);
+        writing = false;
+        pthread_mutex_unlock(&mutex_snapshot);
+        return false;
+    }
+    pthread_detach(thread);
+    return true;
+}
+
+// -------------------------- Restore --------------------------------
+
+// A section of count records of record_size bytes at offset fits in size bytes
+static bool section_fits(uint64_t offset, uint64_t count, size_t record_size, size_t size) {
+    if (offset < SNAPSHOT_HEADER_SIZE || offset > size || offset % 8 != 0) return false;
+    return count <= (size - offset) / record_size;
+}
+
+// Check everything before touching the current aquarium
+static bool snapshot_valid(const unsigned char* data, size_t size) {
+    if (size < SNAPSHOT_HEADER_SIZE) return false;
+
+    const SnapshotHeader* header = (const SnapshotHeader*)data;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0) {
+        log_msg("[ERROR] Not a snapshot\n");
+        return false;
+    }
+    if (header->version != SNAPSHOT_VERSION || header->header_size != SNAPSHOT_HEADER_SIZE) {
+        log_msg("[ERROR] Unsupported snapshot version %u\n", header->version);
+        return false;
+    }
+    if (header_crc(header) != header->header_crc || header->file_size != size) {
+        log_msg("[ERROR] Snapshot header is corrupted or the file is truncated\n");
+        return false;
+    }
+    if (!section_fits(header->views_offset, header->view_count, sizeof(SnapshotView), size) ||
+        !section_fits(header->fishes_offset, header->fish_count, sizeof(SnapshotFish), size) ||
+        !section_fits(header->positions_offset, header->position_count, sizeof(SnapshotPosition), size)) {
+        log_msg("[ERROR] Snapshot sections out of bounds\n");
+        return false;
+    }
+    if (crc32(data + SNAPSHOT_HEADER_SIZE, size - SNAPSHOT_HEADER_SIZE) != header->payload_crc) {
+        log_msg("[ERROR] Snapshot checksum mismatch\n");
+        return false;
+    }
+
+    const SnapshotFish* fishes = (const SnapshotFish*)(data + header->fishes_offset);
+    for (uint64_t i = 0; i < header->fish_count; i++) {
+        if (fishes[i].first_position > header->position_count ||
+            fishes[i].position_count > header->position_count - fishes[i].first_position) {
+            log_msg("[ERROR] Snapshot fish %llu has invalid positions\n", (unsigned long long)i);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool snapshot_restore(const void* snapshot_data, size_t size) {
+    const unsigned char* data = snapshot_data;
+    if (!snapshot_valid(data, size)) return false;
+
+    const SnapshotHeader* header = (const SnapshotHeader*)data;
+    const SnapshotView* views = (const SnapshotView*)(data + header->views_offset);
+    const SnapshotFish* fishes = (const SnapshotFish*)(data + header->fishes_offset);
+    const SnapshotPosition* positions = (const SnapshotPosition*)(data + header->positions_offset);
+
+    // Trajectories resume where they stopped: the downtime is not swum
+    microseconds_t shift = sim_clock_now() - header->created_us;
+    if (shift < 0) shift = 0;
+
+    char name[MAX_NAME_LEN];
+    snprintf(name, sizeof(name), "%.*s", MAX_NAME_LEN - 1, header->aquarium_name);
+    AquariumSlot* slot = get_aquarium_slot(name, true);
+    if (slot == NULL) return false;
+    select_aquarium(slot);
+    lock_aquarium();
+    if (current_aquarium != NULL) {
+        destroy_aquarium();
+    }
+    create_aquarium(name, header->aquarium_w, header->aquarium_h);
+
+    // The lists are built by prepending: go backwards to keep the saved order
+    for (uint64_t i = header->view_count; i-- > 0;) {
+        snprintf(name, sizeof(name), "%.*s", MAX_NAME_LEN - 1, views[i].name);
+        add_view(name, views[i].x, views[i].y, views[i].w, views[i].h, -1);
+    }
+
+    hash_table_reserve(current_aquarium->fish_index, header->fish_count);
+    for (uint64_t i = header->fish_count; i-- > 0;) {
+        const SnapshotFish* saved = &fishes[i];
+        Fish* fish = create_fish();
+        if (fish == NULL) break;
+
+        snprintf(fish->name, MAX_NAME_LEN, "%.*s", MAX_NAME_LEN - 1, saved->name);
+        if (hash_table_get(current_aquarium->fish_index, fish->name) != NULL) {
+            destroy_fish(fish);  // Duplicate name, keep the first one
+            continue;
+        }
+
+        char move_function[SNAPSHOT_FUNCTION_LEN];
+        snprintf(move_function, sizeof(move_function), "%.*s", SNAPSHOT_FUNCTION_LEN - 1, saved->move_function);
+        int index = fonctionExiste(move_function);
+        if (index == 0) {
+            log_msg("[WARN] Unknown move function %s for %s, using RandomWayPoint\n", move_function, fish->name);
+            index = 1;
+        }
+
+        fish->w = saved->w;
+        fish->h = saved->h;
+        fish->speed = saved->speed;
+        fish->rng = saved->rng;
+        fish->started = saved->started != 0;
+        fish->arrived = false;
+        fish->to_delete = false;
+        fish->peer = -1;
+        fish->move_function = table[index - 1].fonction;
+        fish->future_positions = create_list();
+        for (uint32_t p = 0; p < saved->position_count; p++) {
+            const SnapshotPosition* position = &positions[saved->first_position + p];
+            FishNextPos next_position = { position->x, position->y, position->arrival_us + shift };
+            insert_back(fish->future_positions, next_position);
+        }
+
+        fish->suivant = current_aquarium->poissons;
+        current_aquarium->poissons = fish;
+        hash_table_insert(current_aquarium->fish_index, fish->name, fish);
+        current_aquarium->fish_count++;
+    }
+
+    log_msg("[INFO] Restored aquarium %s: %d views, %d fishes\n",
+        current_aquarium->name, (int)header->view_count, current_aquarium->fish_count);
+    unlock_aquarium();
+    return true;
+}
+
+bool snapshot_load(const char* path, uint64_t* journal_generation) {
+    if (journal_generation != NULL) *journal_generation = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        log_msg("[INFO] No snapshot to restore at %s\n", path);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        log_msg("[ERROR] Could not map %s\n", path);
+        return false;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    microseconds_t start = sim_clock_real();
+    bool ok = snapshot_restore(data, st.st_size);
+    if (ok && journal_generation != NULL) {
+        *journal_generation = ((const SnapshotHeader*)data)->journal_generation;
+    }
+    munmap(data, st.st_size);
+
+    if (ok) {
+        log_msg("[INFO] Snapshot %s restored in %.1f ms\n", path, (sim_clock_real() - start) / 1000.0);
+    } else {
+        log_msg("[ERROR] Snapshot %s could not be restored\n", path);
+    }
+    return ok;
+}
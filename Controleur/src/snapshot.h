@@ -0,0 +1,96 @@
+// Full-state binary snapshot of the aquarium: views, fishes and their future positions.
+// save_aquarium only keeps the aquarium size and the views; a snapshot lets the controller
+// restart where it stopped, without re-seeding the fishes.
+//
+// File layout (native byte order, every record has a fixed size so the file can be
+// read in place with mmap, whatever the number of fishes):
+//     SnapshotHeader        (SNAPSHOT_HEADER_SIZE bytes, see below)
+//     SnapshotView[]        at views_offset
+//     SnapshotFish[]        at fishes_offset
+//     SnapshotPosition[]    at positions_offset. The positions of a fish are
+//                           [first_position, first_position + position_count[
+// header_crc covers the header (with header_crc = 0), payload_crc everything after it.
+//
+// The snapshot is captured under the aquarium mutex (a flat copy, no I/O), then checksummed
+// and written by a background thread, so the tick is not stalled by the disk.
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SNAPSHOT_MAGIC "AQSNAP\0"
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_HEADER_SIZE 256
+#define SNAPSHOT_NAME_LEN 56
+#define SNAPSHOT_FUNCTION_LEN 32
+
+typedef struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    int64_t created_us;  // sim_clock_now() at capture: arrival times are shifted by the downtime on restore
+    char aquarium_name[SNAPSHOT_NAME_LEN];
+    int32_t aquarium_w, aquarium_h;
+    uint64_t view_count, fish_count, position_count;
+    uint64_t views_offset, fishes_offset, positions_offset;
+    uint64_t file_size;
+    uint64_t journal_generation;  // First journal generation not contained in the snapshot (0: no journal)
+    uint32_t payload_crc;
+    uint32_t header_crc;
+} SnapshotHeader;
+
+typedef struct SnapshotView {
+    char name[SNAPSHOT_NAME_LEN];
+    int32_t x, y, w, h;
+} SnapshotView;
+
+typedef struct SnapshotFish {
+    char name[SNAPSHOT_NAME_LEN];
+    char move_function[SNAPSHOT_FUNCTION_LEN];
+    int32_t w, h;
+    double speed;
+    uint32_t started;
+    uint32_t position_count;
+    uint64_t first_position;
+    uint32_t rng;  // rand_r state of the fish: the waypoints after the saved ones go on from it
+    uint32_t reserved;
+} SnapshotFish;
+
+typedef struct SnapshotPosition {
+    int32_t x, y;
+    int64_t arrival_us;
+} SnapshotPosition;
+
+// An in-memory snapshot, laid out exactly like the file
+typedef struct Snapshot {
+    unsigned char* data;
+    size_t size;
+} Snapshot;
+
+// Copy the current aquarium into a new snapshot. NULL if no aquarium is loaded
+Snapshot* snapshot_capture();  // Assumes the mutex is locked
+
+// Compute the checksums of a captured snapshot
+void snapshot_seal(Snapshot* snapshot);
+
+void snapshot_free(Snapshot* snapshot);
+
+// Seal and write a snapshot to path (through path.tmp, then rename). Blocking
+bool snapshot_write(Snapshot* snapshot, const char* path);
+
+// Capture now, write in a background thread. Returns false if a write is still in progress.
+// A snapshot of the default aquarium to the configured snapshot-file also starts a new journal generation
+bool snapshot_save_async(const char* path);  // Assumes the mutex is locked
+
+// Replace the aquarium named in a sealed snapshot (file mapping or buffer), hosting it if
+// needed, and select it. Locks the aquarium itself. Nothing changes if the snapshot is invalid
+bool snapshot_restore(const void* data, size_t size);
+
+// Map a snapshot file and restore it. *journal_generation (if not NULL) gets the
+// journal generation to replay on top of it, 0 if there is no snapshot
+bool snapshot_load(const char* path, uint64_t* journal_generation);
+
+#endif // SNAPSHOT_H
@@ -0,0 +1,393 @@
+#include "takeover.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "aquarium.h"
+#include "connection.h"
+#include "journal.h"
+#include "multicast.h"
+#include "log.h"
+#include "sim_clock.h"
+
+// -------------------------- Messages --------------------------------
+
+// Send one message, with a socket attached if fd >= 0
+static bool send_message(int peer, const void* data, size_t len, int fd) {
+    struct iovec iov = { (void*)data, len };
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    if (fd >= 0) {
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+
+    ssize_t sent;
+    do {
+        sent = sendmsg(peer, &msg, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+    return sent == (ssize_t)len;
+}
+
+// Receive one message of exactly len bytes. *fd (if not NULL) gets the attached socket, -1 if none
+static bool recv_message(int peer, void* data, size_t len, int* fd) {
+    struct iovec iov = { data, len };
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t received;
+    do {
+        received = recvmsg(peer, &msg, 0);
+    } while (received < 0 && errno == EINTR);
+
+    int attached = -1;
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            memcpy(&attached, CMSG_DATA(cmsg), sizeof(int));
+        }
+    }
+    if (fd != NULL) {
+        *fd = attached;
+    } else if (attached >= 0) {
+        close(attached);
+    }
+    return received == (ssize_t)len && !(msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC));
+}
+
+// Send len bytes as TAKEOVER_CHUNK messages
+static bool send_chunks(int peer, const unsigned char* data, size_t len) {
+    while (len > 0) {
+        size_t chunk = len < TAKEOVER_CHUNK ? len : TAKEOVER_CHUNK;
+        if (!send_message(peer, data, chunk, -1)) return false;
+        data += chunk;
+        len -= chunk;
+    }
+    return true;
+}
+
+static bool recv_chunks(int peer, unsigned char* data, size_t len) {
+    while (len > 0) {
+        size_t chunk = len < TAKEOVER_CHUNK ? len : TAKEOVER_CHUNK;
+        if (!recv_message(peer, data, chunk, NULL)) return false;
+        data += chunk;
+        len -= chunk;
+    }
+    return true;
+}
+
+static bool unix_address(const char* path, struct sockaddr_un* address) {
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address->sun_path)) {
+        log_msg("[ERROR] Upgrade socket path too long: %s\n", path);
+        return false;
+    }
+    strcpy(address->sun_path, path);
+    return true;
+}
+
+// -------------------------- Old controller --------------------------------
+
+int takeover_listen(const char* path) {
+    if (path == NULL || path[0] == '\0') return -1;
+
+    struct sockaddr_un address;
+    if (!unix_address(path, &address)) return -1;
+
+    int upgrade_socket = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (upgrade_socket < 0) return -1;
+
+    unlink(path);  // Left by the controller we took over from, or by a crash
+    mode_t previous_mask = umask(0077);  // Only our user can take the controller over
+    int bound = bind(upgrade_socket, (struct sockaddr*)&address, sizeof(address));
+    umask(previous_mask);
+    if (bound < 0 || listen(upgrade_socket, 1) < 0) {
+        log_msg("[ERROR] Could not listen on the upgrade socket %s\n", path);
+        close(upgrade_socket);
+        return -1;
+    }
+
+    log_msg("[INFO] Live upgrade: serveur --takeover connects to %s\n", path);
+    return upgrade_socket;
+}
+
+// Lock (or unlock) every hosted aquarium, in the order of the registry
+static void lock_all_aquariums(bool lock) {
+    for (AquariumSlot* slot = next_aquarium_slot(NULL); slot != NULL; slot = next_aquarium_slot(slot)) {
+        if (lock) {
+            pthread_mutex_lock(&slot->mutex);
+        } else {
+            pthread_mutex_unlock(&slot->mutex);
+        }
+    }
+}
+
+// Send the view bound to socket, then its unread bytes and its unsent output. Assumes every
+// aquarium is locked
+static bool send_client(int peer, Connection* conn) {
+    StringBuilder output;
+    if (!sb_init(&output, 256)) return false;
+    if (!conn_freeze_output(conn, &output)) {
+        sb_free(&output);
+        return false;
+    }
+
+    TakeoverClient client;
+    memset(&client, 0, sizeof(client));
+    client.input_len = conn->in_len;
+    client.output_len = output.len;
+
+    AquariumSlot* slot = conn->aquarium != NULL ? conn->aquarium : next_aquarium_slot(NULL);
+    if (conn->aquarium != NULL) snprintf(client.aquarium, sizeof(client.aquarium), "%s", slot->name);
+
+    if (slot != NULL && slot->aquarium != NULL) {
+        for (Afficheur* view = slot->aquarium->afficheurs; view != NULL; view = view->suivant) {
+            if (view->socket == conn->socket) {
+                snprintf(client.view, sizeof(client.view), "%s", view->name);
+                client.subscribed = view->subscribed;
+                client.multicast = view->multicast;
+                break;
+            }
+        }
+    }
+
+    bool ok = send_message(peer, &client, sizeof(client), conn->socket) &&
+        send_chunks(peer, (const unsigned char*)conn->in_buf, conn->in_len) &&
+        send_chunks(peer, (const unsigned char*)output.data, output.len);
+    sb_free(&output);
+    return ok;
+}
+
+bool takeover_handoff(int upgrade_socket, int server_socket) {
+    int peer = accept(upgrade_socket, NULL, NULL);
+    if (peer < 0) return false;
+    log_msg("[INFO] A new controller is taking over\n");
+    microseconds_t start = sim_clock_real();
+
+    // A new controller that hangs must not freeze this one
+    struct timeval timeout = { TAKEOVER_TIMEOUT, 0 };
+    setsockopt(peer, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(peer, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    // Nothing changes from now on: no tick, no CLI command (the workers are idle)
+    lock_all_aquariums(true);
+
+    // The new controller appends to the journal after our last record
+    journal_flush();
+
+    int aquarium_count = 0;
+    for (AquariumSlot* slot = next_aquarium_slot(NULL); slot != NULL; slot = next_aquarium_slot(slot)) {
+        if (slot->aquarium != NULL) aquarium_count++;
+    }
+
+    int client_count = 0;
+    for (int socket = 0; socket < MAX_CONNECTIONS; socket++) {
+        if (conn_get(socket) != NULL) client_count++;
+    }
+
+    TakeoverHello hello;
+    memset(&hello, 0, sizeof(hello));
+    memcpy(hello.magic, TAKEOVER_MAGIC, sizeof(hello.magic));
+    hello.version = TAKEOVER_VERSION;
+    hello.client_count = client_count;
+    hello.aquarium_count = aquarium_count;
+    hello.multicast_seq = multicast_last_seq();
+
+    bool ok = send_message(peer, &hello, sizeof(hello), server_socket);
+    for (int socket = 0; ok && socket < MAX_CONNECTIONS; socket++) {
+        Connection* conn = conn_get(socket);
+        if (conn != NULL) ok = send_client(peer, conn);
+    }
+
+    // One snapshot per aquarium, captured through the thread's current aquarium
+    for (AquariumSlot* slot = next_aquarium_slot(NULL); ok && slot != NULL; slot = next_aquarium_slot(slot)) {
+        if (slot->aquarium == NULL) continue;
+        current_aquarium = slot->aquarium;
+        Snapshot* snapshot = snapshot_capture();
+        current_aquarium = NULL;
+        if (snapshot == NULL) {
+            ok = false;
+            break;
+        }
+        snapshot_seal(snapshot);
+        uint64_t size = snapshot->size;
+        ok = send_message(peer, &size, sizeof(size), -1) && send_chunks(peer, snapshot->data, snapshot->size);
+        snapshot_free(snapshot);
+    }
+
+    // Wait until the new controller has restored everything
+    char ack = 0;
+    if (ok) ok = recv(peer, &ack, 1, 0) == 1 && ack == TAKEOVER_ACK;
+    close(peer);
+
+    if (!ok) {
+        for (int socket = 0; socket < MAX_CONNECTIONS; socket++) {
+            Connection* conn = conn_get(socket);
+            if (conn != NULL) conn_thaw_output(conn);
+        }
+        lock_all_aquariums(false);
+        log_msg("[ERROR] Live upgrade failed, this controller carries on\n");
+        return false;
+    }
+
+    // Keep the mutexes: the world belongs to the new controller now
+    log_msg("[INFO] Handed over %d connections in %.1f ms\n", client_count, (sim_clock_real() - start) / 1000.0);
+    return true;
+}
+
+// -------------------------- New controller --------------------------------
+
+// Give a restored view its connection back. Assumes the mutex is locked
+static void bind_view(const TakeoverClient* client, int socket) {
+    if (client->view[0] == '\0' || current_aquarium == NULL) return;
+
+    for (Afficheur* view = current_aquarium->afficheurs; view != NULL; view = view->suivant) {
+        if (strncmp(view->name, client->view, SNAPSHOT_NAME_LEN) == 0) {
+            view->socket = socket;
+            view->subscribed = client->subscribed != 0;
+            view->multicast = client->multicast != 0;
+            touch_view(view);  // The timeout starts over
+            return;
+        }
+    }
+}
+
+int takeover_receive(const char* path, int** client_sockets, int* nb_clients) {
+    *client_sockets = NULL;
+    *nb_clients = 0;
+
+    struct sockaddr_un address;
+    if (path == NULL || path[0] == '\0') {
+        log_msg("[ERROR] No upgrade-socket in the configuration\n");
+        return -1;
+    }
+    if (!unix_address(path, &address)) return -1;
+
+    int peer = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (peer < 0 || connect(peer, (struct sockaddr*)&address, sizeof(address)) < 0) {
+        log_msg("[ERROR] No controller to take over at %s\n", path);
+        if (peer >= 0) close(peer);
+        return -1;
+    }
+    microseconds_t start = sim_clock_real();
+
+    TakeoverHello hello;
+    int server_socket = -1;
+    if (!recv_message(peer, &hello, sizeof(hello), &server_socket) || server_socket < 0 ||
+        memcmp(hello.magic, TAKEOVER_MAGIC, sizeof(hello.magic)) != 0 || hello.version != TAKEOVER_VERSION) {
+        log_msg("[ERROR] The controller at %s speaks another handoff protocol\n", path);
+        if (server_socket >= 0) close(server_socket);
+        close(peer);
+        return -1;
+    }
+
+    int* sockets = malloc((hello.client_count + 1) * sizeof(int));
+    TakeoverClient* clients = malloc((hello.client_count + 1) * sizeof(TakeoverClient));
+    StringBuilder* outputs = calloc(hello.client_count + 1, sizeof(StringBuilder));
+    bool ok = sockets != NULL && clients != NULL && outputs != NULL;
+
+    // The connections, with what they sent that was not handled yet and what they did not receive
+    int received = 0;
+    char chunk[TAKEOVER_CHUNK];
+    while (ok && received < (int)hello.client_count) {
+        int socket = -1;
+        ok = recv_message(peer, &clients[received], sizeof(TakeoverClient), &socket) && socket >= 0;
+        if (!ok) break;
+        sockets[received++] = socket;
+
+        Connection* conn = conn_open(socket);
+        ok = conn != NULL;
+        for (uint64_t left = clients[received - 1].input_len; ok && left > 0;) {
+            size_t len = left < TAKEOVER_CHUNK ? left : TAKEOVER_CHUNK;
+            ok = recv_message(peer, chunk, len, NULL) && conn_feed(conn, chunk, len);
+            left -= len;
+        }
+        // Kept aside: it is only ours to send once the old controller has the ack
+        ok = ok && sb_init(&outputs[received - 1], clients[received - 1].output_len + 1);
+        for (uint64_t left = clients[received - 1].output_len; ok && left > 0;) {
+            size_t len = left < TAKEOVER_CHUNK ? left : TAKEOVER_CHUNK;
+            ok = recv_message(peer, chunk, len, NULL) && sb_append(&outputs[received - 1], chunk, len);
+            left -= len;
+        }
+    }
+
+    // The aquariums, default one first so that it stays the default one
+    for (uint32_t i = 0; ok && i < hello.aquarium_count; i++) {
+        uint64_t size = 0;
+        ok = recv_message(peer, &size, sizeof(size), NULL) && size > 0;
+        unsigned char* snapshot = ok ? malloc(size) : NULL;
+        ok = snapshot != NULL && recv_chunks(peer, snapshot, size) && snapshot_restore(snapshot, size);
+        free(snapshot);
+    }
+
+    for (int i = 0; ok && i < received; i++) {
+        AquariumSlot* slot = NULL;
+        if (clients[i].aquarium[0] != '\0') {
+            char name[MAX_NAME_LEN];
+            snprintf(name, sizeof(name), "%.*s", MAX_NAME_LEN - 1, clients[i].aquarium);
+            slot = get_aquarium_slot(name, false);
+        }
+        select_aquarium(slot);
+        lock_aquarium();
+        bind_view(&clients[i], sockets[i]);
+        unlock_aquarium();
+        conn_get(sockets[i])->aquarium = slot;
+    }
+    select_aquarium(NULL);
+    free(clients);
+
+    // From here the old controller exits: the sockets are ours
+    char ack = TAKEOVER_ACK;
+    if (ok) ok = send(peer, &ack, 1, MSG_NOSIGNAL) == 1;
+    close(peer);
+
+    if (!ok) {
+        log_msg("[ERROR] Could not take over from the controller at %s\n", path);
+        for (int i = 0; i < received; i++) {
+            conn_close(sockets[i]);  // Nothing queued: only our copy of the socket is closed
+            sb_free(&outputs[i]);
+        }
+        free(outputs);
+        free(sockets);
+        close(server_socket);
+        return -1;
+    }
+
+    // What the old controller had not sent goes first, a list it had started included
+    for (int i = 0; i < received; i++) {
+        if (outputs[i].len > 0) conn_send(sockets[i], outputs[i].data, outputs[i].len);
+        sb_free(&outputs[i]);
+    }
+    free(outputs);
+
+    multicast_resume_seq(hello.multicast_seq);
+    log_msg("[INFO] Took over %d connections in %.1f ms\n", received, (sim_clock_real() - start) / 1000.0);
+    *client_sockets = sockets;
+    *nb_clients = received;
+    return server_socket;
+}
@@ -0,0 +1,59 @@
+// Live upgrade: a new controller binary takes over from the running one without dropping
+// the displays or resetting the fishes. The running controller listens on a Unix socket
+// (upgrade-socket); "serveur --takeover" connects to it and receives, in this order:
+//     TakeoverHello      + the listening TCP socket
+//     TakeoverClient     + the client socket, then its unread bytes and the bytes queued for it
+//                          but not sent yet, for every connection
+//     for every hosted aquarium, default one first: its snapshot size (uint64_t), then
+//     the snapshot (see snapshot.h) in chunks
+// then answers TAKEOVER_ACK once everything is restored. The old controller exits on the
+// ack and carries on serving otherwise. Sockets travel as SCM_RIGHTS ancillary data;
+// SOCK_SEQPACKET keeps every message, and the socket attached to it, separate.
+//
+// The old controller stops handling requests and ticking during the handoff, so the
+// displays see one late update rather than a reconnection. It stops sending too: a list it
+// had started sending is finished by the new controller, before anything of its own.
+
+#ifndef TAKEOVER_H
+#define TAKEOVER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "snapshot.h"
+
+#define TAKEOVER_MAGIC "AQTKOV\0"
+#define TAKEOVER_VERSION 3
+#define TAKEOVER_CHUNK 65536  // Bytes of snapshot or unread input per message
+#define TAKEOVER_ACK 'K'
+#define TAKEOVER_TIMEOUT 10   // s, the old controller gives up if the new one stays silent
+
+typedef struct TakeoverHello {
+    char magic[8];
+    uint32_t version;
+    uint32_t client_count;
+    uint32_t aquarium_count;  // 0: no aquarium loaded
+    uint32_t multicast_seq;   // Numbering of the multicast datagrams to continue
+} TakeoverHello;
+
+typedef struct TakeoverClient {
+    char view[SNAPSHOT_NAME_LEN];      // View bound to the connection, "" if none
+    char aquarium[SNAPSHOT_NAME_LEN];  // Aquarium the connection greeted into, "" for the default one
+    uint32_t subscribed;
+    uint32_t multicast;
+    uint64_t input_len;   // Bytes received but not handled yet (an incomplete request)
+    uint64_t output_len;  // Bytes queued for the client but not sent yet, sent first by the new controller
+} TakeoverClient;
+
+// Listen for a new controller on the Unix socket path. Returns the socket, -1 if disabled or on error
+int takeover_listen(const char* path);
+
+// Accept a new controller on upgrade_socket and hand it server_socket, the connections
+// and the world. The workers must be idle. Returns true if the new controller took over:
+// this one must exit without touching the connections
+bool takeover_handoff(int upgrade_socket, int server_socket);
+
+// Take over from the controller listening on path: restore its world and its connections.
+// *client_sockets (to free) gets the sockets to watch. Returns the listening TCP socket, -1 on error
+int takeover_receive(const char* path, int** client_sockets, int* nb_clients);
+
+#endif // TAKEOVER_H
@@ -0,0 +1,101 @@
+#include "tick_scheduler.h"
+#include <stdio.h>
+#include <string.h>
+#include "metrics.h"
+#include "read_cfg.h"
+#include "sim_clock.h"
+#include "log.h"
+
+#define TICK_SKIP_PREFILL  1
+#define TICK_COALESCE      2
+#define TICK_SHED_COSMETIC 4
+
+#define OVERRUN_WARNING_INTERVAL 1000000  // µs between two overrun warnings of an aquarium
+
+static int policy = 0;
+static Metric* lateness = NULL;
+static Metric* overruns = NULL;
+static Metric* coalesced = NULL;
+static Metric* shed_prefill = NULL;
+static Metric* shed_cosmetic = NULL;
+static _Thread_local bool behind = false;  // The tick of the calling thread runs behind
+
+void init_tick_scheduler(const char* policy_names) {
+    char names[BUFFER_SIZE_CFG];
+    snprintf(names, sizeof(names), "%s", policy_names);
+    char* save = NULL;
+    for (char* name = strtok_r(names, ", ", &save); name != NULL; name = strtok_r(NULL, ", ", &save)) {
+        if (strcmp(name, "skip-prefill") == 0) policy |= TICK_SKIP_PREFILL;
+        else if (strcmp(name, "coalesce") == 0) policy |= TICK_COALESCE;
+        else if (strcmp(name, "shed") == 0) policy |= TICK_SHED_COSMETIC;
+        else if (strcmp(name, "all") == 0) policy = TICK_SKIP_PREFILL | TICK_COALESCE | TICK_SHED_COSMETIC;
+        else if (strcmp(name, "none") != 0) log_msg("[WARN] Unknown tick-overrun-policy '%s', ignored\n", name);
+    }
+
+    lateness = metrics_histogram("aquarium_tick_lateness_us", "Time from the deadline of a tick to its start", "");
+    overruns = metrics_counter("aquarium_tick_overruns_total", "Ticks that ended past the next deadline", "");
+    coalesced = metrics_counter("aquarium_tick_coalesced_total", "Missed deadlines dropped by tick-overrun-policy coalesce", "");
+    shed_prefill = metrics_counter("aquarium_tick_shed_total", "Work given up by the ticks running behind", "work=\"prefill\"");
+    shed_cosmetic = metrics_counter("aquarium_tick_shed_total", "Work given up by the ticks running behind", "work=\"cosmetic\"");
+}
+
+void tick_schedule_init(TickSchedule* schedule, const char* name, microseconds_t interval) {
+    schedule->name = name;
+    schedule->interval = interval;
+    schedule->deadline = sim_clock_real();
+    schedule->overran = false;
+    schedule->last_warning = 0;
+}
+
+void tick_wait(TickSchedule* schedule, bool drives_clock) {
+    // With the virtual clock, a tick takes no simulation time: it is never late
+    if (sim_clock_is_virtual()) {
+        if (drives_clock) sim_clock_pace(schedule->interval);
+        else sim_clock_sleep(schedule->interval);
+        behind = false;
+        return;
+    }
+
+    schedule->deadline += schedule->interval;
+    microseconds_t now = sim_clock_real();
+    if (schedule->deadline > now) {
+        sim_clock_sleep(schedule->deadline - now);
+        now = sim_clock_real();
+    }
+    microseconds_t late = now - schedule->deadline;
+    metrics_record(lateness, late);
+    behind = schedule->overran || late >= schedule->interval;
+}
+
+void tick_done(TickSchedule* schedule) {
+    if (sim_clock_is_virtual()) return;
+
+    microseconds_t now = sim_clock_real();
+    microseconds_t next_deadline = schedule->deadline + schedule->interval;
+    schedule->overran = now > next_deadline;
+    if (!schedule->overran) return;
+
+    metrics_add(overruns, 1);
+    long long missed = (now - schedule->deadline) / schedule->interval - 1;  // Deadlines already past
+    if ((policy & TICK_COALESCE) && missed > 0) {
+        schedule->deadline += missed * schedule->interval;
+        metrics_add(coalesced, missed);
+    }
+    if (now - schedule->last_warning >= OVERRUN_WARNING_INTERVAL) {
+        schedule->last_warning = now;
+        log_msg("[WARN] Tick of %s overran: ended %.1f ms past its next deadline\n",
+            schedule->name, (now - next_deadline) / 1000.0);
+    }
+}
+
+bool tick_skip_prefill() {
+    if (!behind || !(policy & TICK_SKIP_PREFILL)) return false;
+    metrics_add(shed_prefill, 1);
+    return true;
+}
+
+bool tick_shed_cosmetic() {
+    if (!behind || !(policy & TICK_SHED_COSMETIC)) return false;
+    metrics_add(shed_cosmetic, 1);
+    return true;
+}
@@ -0,0 +1,50 @@
+// Deadlines of the aquarium ticks. Each tick is due one interval after the previous deadline,
+// whatever the tick itself took: a slow tick no longer pushes all the following ones back.
+// A tick that ends past the next deadline is an overrun, and the ticks after it run behind.
+//
+// tick-overrun-policy in controller.cfg picks what is given up while behind, comma separated:
+//   skip-prefill  refill the waypoints of the arrived fishes one target ahead instead of the
+//                 whole horizon, the next ticks on time complete it
+//   coalesce      drop the deadlines already missed: one tick covers them instead of a burst
+//                 of back-to-back ticks holding the aquarium
+//   shed          skip the lists only sent for the federation ghosts' progress, the next list
+//                 carries it
+//   none, all
+// Arrivals and deletes of the local fishes are always sent by the tick that sees them.
+//
+// Only the real clock has deadlines: a virtual tick takes no simulation time (see sim_clock.h).
+// Exported in the metrics (stats, metrics-port): aquarium_tick_lateness_us,
+// aquarium_tick_overruns_total, aquarium_tick_coalesced_total and aquarium_tick_shed_total.
+
+#ifndef TICK_SCHEDULER_H
+#define TICK_SCHEDULER_H
+
+#include <stdbool.h>
+#include "utils.h"
+
+typedef struct TickSchedule {
+    const char* name;         // Of the aquarium, for the log
+    microseconds_t interval;
+    microseconds_t deadline;  // Real time the current tick is due
+    bool overran;             // The last tick ended past the next deadline
+    microseconds_t last_warning;
+} TickSchedule;
+
+// Parse policy (tick-overrun-policy) and export the counters in the metrics (see metrics.h)
+void init_tick_scheduler(const char* policy);
+
+// First deadline one interval from now
+void tick_schedule_init(TickSchedule* schedule, const char* name, microseconds_t interval);
+
+// Wait for the next deadline. drives_clock: this tick paces the virtual clock (sim_clock_pace)
+void tick_wait(TickSchedule* schedule, bool drives_clock);
+
+// The tick is over: measure it against the next deadline
+void tick_done(TickSchedule* schedule);
+
+// Should the tick of the calling thread skip a horizon prefill / a list only moving ghosts?
+// true (and counted as shed) if it runs behind and the policy allows it
+bool tick_skip_prefill();
+bool tick_shed_cosmetic();
+
+#endif // TICK_SCHEDULER_H
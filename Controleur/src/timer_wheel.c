@@ -0,0 +1,157 @@
+#include "timer_wheel.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "utils.h"
+#include "log.h"
+#include "sim_clock.h"
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+#define WHEEL_SPAN (1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))  // Ticks covered by the whole wheel
+
+typedef struct Timer {
+    int prev, next;  // In the list of its slot, -1 at the ends
+    int level;       // -1 while disarmed
+    int slot;
+    uint64_t expiry;  // Tick
+} Timer;
+
+static Timer* timers = NULL;
+static int nb_timers = 0;
+static int wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];  // First timer of each slot, -1 if empty
+static uint64_t current_tick = 0;  // Last tick processed
+static microseconds_t start_us = 0;
+static pthread_mutex_t mutex_timers = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t now_tick() {
+    return (uint64_t)(sim_clock_real() - start_us) / (TIMER_WHEEL_RESOLUTION * 1000);
+}
+
+static void unlink_timer(int id) {  // Assumes mutex_timers is locked
+    Timer* timer = &timers[id];
+    if (timer->prev >= 0) {
+        timers[timer->prev].next = timer->next;
+    } else {
+        wheel[timer->level][timer->slot] = timer->next;
+    }
+    if (timer->next >= 0) timers[timer->next].prev = timer->prev;
+    timer->level = -1;
+}
+
+// Put a timer in the slot of its expiry: the lowest level whose turn reaches it
+static void link_timer(int id) {  // Assumes mutex_timers is locked
+    Timer* timer = &timers[id];
+    uint64_t due = timer->expiry > current_tick ? timer->expiry : current_tick;
+    if (due - current_tick >= WHEEL_SPAN) due = current_tick + WHEEL_SPAN - 1;  // Parked, cascaded again later
+
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && due - current_tick >= 1ULL << (TIMER_WHEEL_BITS * (level + 1))) {
+        level++;
+    }
+    int slot = (due >> (TIMER_WHEEL_BITS * level)) & SLOT_MASK;
+
+    timer->level = level;
+    timer->slot = slot;
+    timer->prev = -1;
+    timer->next = wheel[level][slot];
+    if (timer->next >= 0) timers[timer->next].prev = id;
+    wheel[level][slot] = id;
+}
+
+// Move the timers of a slot down to the levels that now reach them
+static void cascade(int level, int slot) {  // Assumes mutex_timers is locked
+    int id = wheel[level][slot];
+    wheel[level][slot] = -1;
+    while (id >= 0) {
+        int next = timers[id].next;
+        link_timer(id);
+        id = next;
+    }
+}
+
+void timer_wheel_init(int capacity) {
+    pthread_mutex_lock(&mutex_timers);
+    timers = (Timer*)malloc(capacity * sizeof(Timer));
+    nb_timers = timers != NULL ? capacity : 0;
+    for (int i = 0; i < nb_timers; i++) {
+        timers[i].level = -1;
+    }
+    for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+            wheel[level][slot] = -1;
+        }
+    }
+    start_us = sim_clock_real();
+    current_tick = 0;
+    pthread_mutex_unlock(&mutex_timers);
+
+    if (timers == NULL) log_msg("[ERROR] Could not allocate the connection timers\n");
+}
+
+static void arm_locked(int id, int timeout_ms) {  // Assumes mutex_timers is locked
+    uint64_t ticks = timeout_ms > 0 ? (timeout_ms + TIMER_WHEEL_RESOLUTION - 1) / TIMER_WHEEL_RESOLUTION : 1;
+    if (timers[id].level >= 0) unlink_timer(id);
+    timers[id].expiry = now_tick() + ticks + 1;  // Never early: the current tick has already begun
+    if (timers[id].expiry <= current_tick) timers[id].expiry = current_tick + 1;  // Its slot was processed
+    link_timer(id);
+}
+
+void timer_wheel_arm(int id, int timeout_ms) {
+    if (id < 0 || id >= nb_timers) return;
+    pthread_mutex_lock(&mutex_timers);
+    arm_locked(id, timeout_ms);
+    pthread_mutex_unlock(&mutex_timers);
+}
+
+bool timer_wheel_refresh(int id, int timeout_ms) {
+    if (id < 0 || id >= nb_timers) return false;
+    pthread_mutex_lock(&mutex_timers);
+    bool armed = timers[id].level >= 0;
+    if (armed) arm_locked(id, timeout_ms);
+    pthread_mutex_unlock(&mutex_timers);
+    return armed;
+}
+
+void timer_wheel_cancel(int id) {
+    if (id < 0 || id >= nb_timers) return;
+    pthread_mutex_lock(&mutex_timers);
+    if (timers[id].level >= 0) unlink_timer(id);
+    pthread_mutex_unlock(&mutex_timers);
+}
+
+int timer_wheel_expire(int* expired) {
+    int count = 0;
+    pthread_mutex_lock(&mutex_timers);
+    uint64_t target = now_tick();
+    while (current_tick < target) {
+        current_tick++;
+
+        // A level wrapped: the next slot of the level above comes down first
+        for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+            if ((current_tick & ((1ULL << (TIMER_WHEEL_BITS * level)) - 1)) != 0) break;
+            cascade(level, (current_tick >> (TIMER_WHEEL_BITS * level)) & SLOT_MASK);
+        }
+
+        int slot = current_tick & SLOT_MASK;
+        int id = wheel[0][slot];
+        wheel[0][slot] = -1;
+        while (id >= 0) {
+            int next = timers[id].next;
+            if (timers[id].expiry <= current_tick) {
+                timers[id].level = -1;
+                expired[count++] = id;
+            } else {
+                link_timer(id);  // Parked: not due yet
+            }
+            id = next;
+        }
+    }
+    pthread_mutex_unlock(&mutex_timers);
+    return count;
+}
+
+int timer_wheel_next_timeout() {
+    microseconds_t tick_us = TIMER_WHEEL_RESOLUTION * 1000;
+    microseconds_t elapsed = (sim_clock_real() - start_us) % tick_us;
+    return (int)((tick_us - elapsed + 999) / 1000);
+}
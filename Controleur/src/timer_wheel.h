@@ -0,0 +1,43 @@
+// Hierarchical timing wheel for the connection deadlines (display-timeout-value).
+// Timers are identified by a small integer (the socket fd) and live in intrusive lists,
+// so arming, re-arming (ping) and cancelling are O(1) whatever the number of timers.
+//
+// Level 0 has one slot per TIMER_WHEEL_RESOLUTION ms; a slot of level n covers a whole
+// turn of level n - 1. When a lower level wraps, the next slot of the level above is
+// cascaded down. Each level holds TIMER_WHEEL_SLOTS slots:
+//     level 0: 6.4 s, level 1: 6.8 min, level 2: 7.3 h, level 3: 19.4 days
+// Longer deadlines are parked in the last level and cascaded again until they are due.
+//
+// Expired timers are collected by timer_wheel_expire() and handled by the caller,
+// outside of the wheel's lock.
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdbool.h>
+
+#define TIMER_WHEEL_RESOLUTION 100  // ms per slot of the first level
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+// Allocate timers 0 to capacity - 1, all disarmed. Call once before arming
+void timer_wheel_init(int capacity);
+
+// (Re)arm a timer to expire in timeout_ms
+void timer_wheel_arm(int id, int timeout_ms);
+
+// Re-arm a timer only if it is armed. Returns false if it was not
+bool timer_wheel_refresh(int id, int timeout_ms);
+
+// Disarm a timer. Nothing if it is not armed
+void timer_wheel_cancel(int id);
+
+// Advance the wheel to now and disarm the timers that are due. expired (room for
+// capacity ids) gets them. Returns their number
+int timer_wheel_expire(int* expired);
+
+// ms until the wheel has to be advanced again, for a poll timeout
+int timer_wheel_next_timeout();
+
+#endif // TIMER_WHEEL_H
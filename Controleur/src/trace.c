@@ -0,0 +1,184 @@
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+typedef struct TraceEvent {
+    uint64_t start_ns, duration_ns;
+    const char* category;
+    const char* name;
+    const char* detail;
+} TraceEvent;
+
+// Ring of one thread: only its owner writes, trace_dump reads behind it
+typedef struct TraceRing {
+    int tid;  // Thread id in the dump
+    char thread_name[32];
+    atomic_bool in_use;  // Owned by a running thread. Once it ends, the next new thread takes it over
+    atomic_ullong head;  // Spans written since the ring was created
+    size_t capacity;
+    TraceEvent* events;
+    struct TraceRing* suivant;
+} TraceRing;
+
+static atomic_bool enabled = false;
+static atomic_int ring_events = TRACE_DEFAULT_EVENTS;
+static TraceRing* rings = NULL;  // In creation order, never freed
+static int nb_rings = 0;
+static pthread_mutex_t mutex_rings = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;  // Frees the ring of a thread that ends
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static _Thread_local TraceRing* thread_ring = NULL;
+static _Thread_local char thread_name[32] = "";
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void release_ring(void* ring) {
+    atomic_store(&((TraceRing*)ring)->in_use, false);
+}
+
+static void create_ring_key() {
+    pthread_key_create(&ring_key, release_ring);
+}
+
+// Ring of the calling thread: a ring left by a thread that ended, or a new one. NULL if out of memory
+static TraceRing* get_thread_ring() {
+    if (thread_ring != NULL) return thread_ring;
+    pthread_once(&ring_key_once, create_ring_key);
+
+    pthread_mutex_lock(&mutex_rings);
+    TraceRing* ring = NULL;
+    TraceRing** last = &rings;
+    for (TraceRing* r = rings; r != NULL; r = r->suivant) {
+        bool free_ring = false;
+        if (atomic_compare_exchange_strong(&r->in_use, &free_ring, true)) {
+            ring = r;
+            break;
+        }
+        last = &r->suivant;
+    }
+    if (ring == NULL) {
+        size_t capacity = atomic_load(&ring_events);
+        ring = (TraceRing*)calloc(1, sizeof(TraceRing));
+        TraceEvent* events = ring != NULL ? (TraceEvent*)calloc(capacity, sizeof(TraceEvent)) : NULL;
+        if (events == NULL) {
+            free(ring);
+            pthread_mutex_unlock(&mutex_rings);
+            return NULL;
+        }
+        ring->tid = ++nb_rings;
+        ring->capacity = capacity;
+        ring->events = events;
+        atomic_store(&ring->in_use, true);
+        *last = ring;
+    }
+    if (thread_name[0] != '\0') {
+        snprintf(ring->thread_name, sizeof(ring->thread_name), "%s", thread_name);
+    } else {
+        snprintf(ring->thread_name, sizeof(ring->thread_name), "thread %d", ring->tid);
+    }
+    pthread_mutex_unlock(&mutex_rings);
+
+    pthread_setspecific(ring_key, ring);
+    thread_ring = ring;
+    return ring;
+}
+
+void trace_configure(int events_per_thread) {
+    if (events_per_thread > 0) atomic_store(&ring_events, events_per_thread);
+}
+
+void trace_enable(bool enable) {
+    atomic_store(&enabled, enable);
+}
+
+bool trace_enabled() {
+    return atomic_load(&enabled);
+}
+
+void trace_thread_name(const char* name) {
+    snprintf(thread_name, sizeof(thread_name), "%s", name);
+    if (thread_ring == NULL) return;
+    pthread_mutex_lock(&mutex_rings);
+    snprintf(thread_ring->thread_name, sizeof(thread_ring->thread_name), "%s", name);
+    pthread_mutex_unlock(&mutex_rings);
+}
+
+TraceSpan trace_begin(const char* category, const char* name, const char* detail) {
+    if (!atomic_load_explicit(&enabled, memory_order_relaxed)) return (TraceSpan){NULL, NULL, NULL, 0};
+    return (TraceSpan){category, name, detail, now_ns()};
+}
+
+void trace_end(TraceSpan* span) {
+    if (span->category == NULL) return;
+    TraceRing* ring = get_thread_ring();
+    if (ring == NULL) return;
+
+    unsigned long long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    TraceEvent* event = &ring->events[head % ring->capacity];
+    event->start_ns = span->start_ns;
+    event->duration_ns = now_ns() - span->start_ns;
+    event->category = span->category;
+    event->name = span->name;
+    event->detail = span->detail;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);  // Published
+}
+
+// -------------------------- Dump --------------------------------
+
+// Write the spans still in a ring. The owner keeps writing: the spans it may have overwritten
+// during the copy are dropped
+static int dump_ring(FILE* file, TraceRing* ring) {  // Assumes mutex_rings is locked
+    unsigned long long end = atomic_load_explicit(&ring->head, memory_order_acquire);
+    unsigned long long start = end > ring->capacity ? end - ring->capacity : 0;
+    TraceEvent* copy = (TraceEvent*)malloc((end - start + 1) * sizeof(TraceEvent));
+    if (copy == NULL) return 0;
+    for (unsigned long long i = start; i < end; i++) {
+        copy[i - start] = ring->events[i % ring->capacity];
+    }
+    unsigned long long after = atomic_load_explicit(&ring->head, memory_order_acquire);
+    unsigned long long valid = after >= ring->capacity ? after - ring->capacity + 1 : 0;
+
+    int written = 0;
+    for (unsigned long long i = start > valid ? start : valid; i < end; i++) {
+        TraceEvent* event = &copy[i - start];
+        fprintf(file, ",\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f",
+                event->name, event->category, ring->tid, event->start_ns / 1000.0, event->duration_ns / 1000.0);
+        if (event->detail != NULL) {
+            fprintf(file, ", \"args\": {\"detail\": \"%s\"}", event->detail);
+        }
+        fprintf(file, "}");
+        written++;
+    }
+    free(copy);
+    return written;
+}
+
+int trace_dump(const char* path) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL) return -1;
+
+    fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    fprintf(file, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": \"controleur\"}}");
+    int written = 0;
+    pthread_mutex_lock(&mutex_rings);
+    for (TraceRing* ring = rings; ring != NULL; ring = ring->suivant) {
+        fprintf(file, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+                ring->tid, ring->thread_name);
+        written += dump_ring(file, ring);
+    }
+    pthread_mutex_unlock(&mutex_rings);
+    fprintf(file, "\n]}\n");
+
+    bool ok = !ferror(file);
+    if (fclose(file) != 0) ok = false;
+    return ok ? written : -1;
+}
@@ -0,0 +1,44 @@
+// Span tracing for deep investigations. Every thread (workers, aquarium ticks, CLI...) writes
+// its spans into its own ring buffer, without any lock: request handling, lock waits, tick
+// phases, sends and CLI commands. The ring keeps the last trace-buffer spans of its thread.
+//
+// Started with trace = 1 in controller.cfg or the CLI command "trace on". "trace dump <file>"
+// writes the spans still in the rings in the Chrome trace format, to open in chrome://tracing
+// or ui.perfetto.dev. Disabled, a span costs a branch, so the calls stay in production builds.
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define TRACE_DEFAULT_EVENTS 16384  // Spans kept per thread without trace-buffer
+
+// A span being measured. The strings are never copied: they must be static (literals, __func__...)
+typedef struct TraceSpan {
+    const char* category;  // NULL while tracing is disabled
+    const char* name;
+    const char* detail;    // Optional, shown in the span's arguments
+    uint64_t start_ns;
+} TraceSpan;
+
+// Spans kept per thread, for the rings created from now on
+void trace_configure(int events_per_thread);
+
+// Start or stop recording. The rings keep their spans until they are overwritten
+void trace_enable(bool enabled);
+bool trace_enabled();
+
+// Name of the calling thread in the dump (e.g. "worker 3"). Can be called before tracing starts
+void trace_thread_name(const char* name);
+
+// Start a span in the calling thread
+TraceSpan trace_begin(const char* category, const char* name, const char* detail);
+
+// End it and write it in the ring of the calling thread
+void trace_end(TraceSpan* span);
+
+// Write the spans of every thread to path as Chrome trace JSON. Returns the number of spans, -1 on error
+int trace_dump(const char* path);
+
+#endif // TRACE_H
@@ -3,6 +3,7 @@
 #include <string.h>
 #include <ctype.h>
 #include <sys/time.h>
+#include <pthread.h>
 
 // Function to trim leading and trailing whitespaces and '\n' from a string
 void trim(char* str) {
@@ -44,3 +45,26 @@ microseconds_t get_time_usec() {
     gettimeofday(&tv, NULL);
     return (microseconds_t)tv.tv_sec * 1000000LL + tv.tv_usec;
 }
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void init_crc_table() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        crc_table[i] = c;
+    }
+}
+
+uint32_t crc32(const void* data, size_t len) {
+    pthread_once(&crc_once, init_crc_table);
+    const unsigned char* bytes = data;
+    uint32_t c = 0xFFFFFFFFu;
+    for (size_t i = 0; i < len; i++) {
+        c = crc_table[(c ^ bytes[i]) & 0xFF] ^ (c >> 8);
+    }
+    return c ^ 0xFFFFFFFFu;
+}
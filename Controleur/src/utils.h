@@ -1,6 +1,9 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 typedef long long microseconds_t;
 
 typedef struct {
@@ -16,4 +19,7 @@ void rm_comma(char* str);
 // Gets current time in microseconds
 microseconds_t get_time_usec();
 
+// CRC-32 (IEEE) of a buffer, for the snapshot and journal files
+uint32_t crc32(const void* data, size_t len);
+
 #endif // UTILS_H
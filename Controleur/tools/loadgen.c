@@ -0,0 +1,513 @@
+// Load generator: simulates display clients against a running controller, so that production
+// scale can be reproduced on one machine without JavaFX windows.
+// Usage: loadgen [-H host] [-p port] [-c clients] [-d seconds] [-i ping interval] [-r requests/s]
+//                [-m getFishes,ls,addFish] [-n ls depth] [-v view prefix] [-t]
+//        loadgen -w <file> <views>   (writes an aquarium with that many views, to load first)
+//
+// Every client greets ("hello", or "hello in as <prefix><i>" with -v), subscribes with
+// getFishesContinuously, pings every -i seconds like a display, and sends -r requests per second
+// picked from the -m mix: getFishes, "ls <n>", and addFish/delFish of its own fishes in turn.
+// Clients left without a view ("no greeting") only send ls and the fish mutations.
+//
+// Replies are matched with the requests in order. The frames pushed by the subscription look
+// like the replies of getFishes and ls: a list line arriving while such a request is pending
+// is taken as its reply, so under heavy load a few updates may be counted as replies.
+//
+// With -t, the clients subscribe with "getFishesContinuously trace" and ack every update, so the
+// controller measures the fan-out latency of each view; the report adds the time from the
+// detection of an arrival to the receipt of its update (same clock: run on the controller host).
+//
+// The report gives the throughput, the latency percentiles of each request and the
+// inter-arrival of the pushed updates.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define MAX_PENDING 64        // Requests in flight per client
+#define MAX_EVENTS 256
+#define LOOP_INTERVAL_MS 5    // Granularity of the request schedule
+
+typedef enum {
+    REQ_HELLO,
+    REQ_SUBSCRIBE,
+    REQ_PING,
+    REQ_GETFISHES,
+    REQ_LS,
+    REQ_ADDFISH,
+    REQ_DELFISH,
+    NB_KINDS
+} RequestKind;
+
+static const char* kind_names[NB_KINDS] = {
+    "hello", "getFishesContinuously", "ping", "getFishes", "ls", "addFish", "delFish"
+};
+
+typedef struct Pending {
+    RequestKind kind;
+    int lines;  // Reply lines still expected
+    long long sent_us;
+} Pending;
+
+typedef struct Client {
+    int fd;
+    int index;
+    bool connected;
+    bool answered;  // Got the reply to hello: the traffic can start
+    bool greeted;   // Has a view
+    bool closed;
+    char* in;
+    size_t in_len, in_cap;
+    Pending pending[MAX_PENDING];
+    int head, count;
+    long long next_ping, next_request;
+    long long last_update;  // Last pushed list frame, 0: none yet
+    int next_fish;          // Fishes are named lg<index>_<k>
+    int live_fishes;        // Added and not deleted yet, the oldest is deleted first
+    int first_live;
+} Client;
+
+// Samples kept whole: percentiles are exact, and a run of a few million requests fits easily
+typedef struct Samples {
+    long long* values;
+    size_t count, cap;
+} Samples;
+
+typedef struct Options {
+    const char* host;
+    int port;
+    int clients;
+    int duration;        // s
+    double ping_interval;  // s
+    double rate;         // Requests per client and per second, besides ping
+    int mix[3];          // getFishes, ls, addFish/delFish
+    int ls_depth;
+    const char* view_prefix;
+    bool trace;          // Traced subscription, updates acked
+} Options;
+
+static Samples latency[NB_KINDS];
+static Samples inter_arrival;
+static Samples fanout;  // Detection of an arrival to receipt of its update, with -t
+static bool trace_updates;
+static unsigned long long sent_requests, replies, updates, noks, rate_limited, no_greeting;
+static unsigned long long bytes_received, send_failures, connect_failures, disconnects;
+
+static long long now_usec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// Clock of the controller's timestamps
+static long long wall_usec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void add_sample(Samples* samples, long long value) {
+    if (samples->count == samples->cap) {
+        size_t cap = samples->cap ? samples->cap * 2 : 1024;
+        long long* bigger = realloc(samples->values, cap * sizeof(long long));
+        if (bigger == NULL) return;
+        samples->values = bigger;
+        samples->cap = cap;
+    }
+    samples->values[samples->count++] = value;
+}
+
+static int compare_ll(const void* a, const void* b) {
+    long long x = *(const long long*)a, y = *(const long long*)b;
+    return x < y ? -1 : x > y;
+}
+
+static long long percentile(const Samples* samples, double q) {
+    if (samples->count == 0) return 0;
+    size_t rank = (size_t)(q * (samples->count - 1) + 0.5);
+    return samples->values[rank];
+}
+
+// Random duration around mean_us, so that the clients don't all fire at once
+static long long jitter(double mean_us) {
+    return (long long)(mean_us * (0.5 + (double)rand() / RAND_MAX));
+}
+
+// -------------------------- Connections --------------------------------
+
+static void close_client(Client* client, int epoll_fd) {
+    if (client->closed) return;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+    close(client->fd);
+    client->closed = true;
+    disconnects++;
+}
+
+static bool send_request(Client* client, RequestKind kind, int lines, const char* format, ...)
+    __attribute__((format(printf, 4, 5)));
+
+static bool send_request(Client* client, RequestKind kind, int lines, const char* format, ...) {
+    if (client->closed || client->count == MAX_PENDING) return false;
+
+    char line[256];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+
+    // The requests are tiny: a full socket buffer means the controller stopped reading
+    ssize_t sent = send(client->fd, line, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (sent != len) {
+        send_failures++;
+        return false;
+    }
+    Pending* pending = &client->pending[(client->head + client->count) % MAX_PENDING];
+    pending->kind = kind;
+    pending->lines = lines;
+    pending->sent_us = now_usec();
+    client->count++;
+    sent_requests++;
+    return true;
+}
+
+static Client* open_clients(const Options* options, int epoll_fd) {
+    struct addrinfo hints = {0}, *address = NULL;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    char port[16];
+    snprintf(port, sizeof(port), "%d", options->port);
+    if (getaddrinfo(options->host, port, &hints, &address) != 0) {
+        fprintf(stderr, "Unknown host %s\n", options->host);
+        return NULL;
+    }
+
+    Client* clients = calloc(options->clients, sizeof(Client));
+    if (clients == NULL) {
+        freeaddrinfo(address);
+        return NULL;
+    }
+    for (int i = 0; i < options->clients; i++) {
+        Client* client = &clients[i];
+        client->index = i;
+        client->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (client->fd < 0) {
+            fprintf(stderr, "Only %d sockets could be opened (ulimit -n?)\n", i);
+            for (int j = i; j < options->clients; j++) {
+                clients[j].closed = true;
+                connect_failures++;
+            }
+            break;
+        }
+        int opt = 1;
+        setsockopt(client->fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+        if (connect(client->fd, address->ai_addr, address->ai_addrlen) < 0 && errno != EINPROGRESS) {
+            close(client->fd);
+            client->closed = true;
+            connect_failures++;
+            continue;
+        }
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP, .data.ptr = client };
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client->fd, &ev);
+    }
+    freeaddrinfo(address);
+    return clients;
+}
+
+// The connection is up: greet, and only wait for replies from now on
+static void on_connected(Client* client, const Options* options, int epoll_fd) {
+    int error = 0;
+    socklen_t len = sizeof(error);
+    getsockopt(client->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+    if (error != 0) {
+        connect_failures++;
+        close_client(client, epoll_fd);
+        return;
+    }
+    client->connected = true;
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = client };
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->fd, &ev);
+
+    if (options->view_prefix != NULL) {
+        send_request(client, REQ_HELLO, 1, "hello in as %s%d\n", options->view_prefix, client->index + 1);
+    } else {
+        send_request(client, REQ_HELLO, 1, "hello\n");
+    }
+}
+
+// -------------------------- Replies --------------------------------
+
+static void handle_line(Client* client, const char* line) {
+    long long now = now_usec();
+    bool list = strncmp(line, "list", 4) == 0;
+
+    // Timestamps of the update just received: ack it, no reply to wait for
+    unsigned int seq;
+    long long detected;
+    if (trace_updates && sscanf(line, "update %u %lld", &seq, &detected) == 2) {
+        add_sample(&fanout, wall_usec() - detected);
+        char ack[32];
+        int len = snprintf(ack, sizeof(ack), "ack %u\n", seq);
+        if (send(client->fd, ack, len, MSG_NOSIGNAL | MSG_DONTWAIT) != len) send_failures++;
+        return;
+    }
+
+    if (client->count > 0) {
+        Pending* pending = &client->pending[client->head];
+        bool expects_list = pending->kind == REQ_GETFISHES || pending->kind == REQ_LS;
+        if (!list || expects_list) {
+            if (strncmp(line, "NOK rate limited", 16) == 0) rate_limited++;
+            else if (strncmp(line, "NOK", 3) == 0) noks++;
+
+            if (pending->kind == REQ_HELLO) {
+                client->answered = true;
+                client->greeted = strncmp(line, "greeting", 8) == 0;
+                if (!client->greeted) no_greeting++;
+                if (client->greeted) {
+                    send_request(client, REQ_SUBSCRIBE, 1, trace_updates ? "getFishesContinuously trace\n" : "getFishesContinuously\n");
+                }
+            }
+
+            // A NOK ends the reply whatever the number of lines expected
+            if (--pending->lines > 0 && list) return;
+            add_sample(&latency[pending->kind], now - pending->sent_us);
+            replies++;
+            client->head = (client->head + 1) % MAX_PENDING;
+            client->count--;
+            return;
+        }
+    }
+
+    if (list) {
+        updates++;
+        if (client->last_update > 0) add_sample(&inter_arrival, now - client->last_update);
+        client->last_update = now;
+    }
+}
+
+static void on_readable(Client* client, int epoll_fd) {
+    while (1) {
+        if (client->in_cap - client->in_len < 4096) {
+            size_t cap = client->in_cap ? client->in_cap * 2 : 16384;
+            char* bigger = realloc(client->in, cap);
+            if (bigger == NULL) return;
+            client->in = bigger;
+            client->in_cap = cap;
+        }
+        ssize_t received = recv(client->fd, client->in + client->in_len, client->in_cap - client->in_len, MSG_DONTWAIT);
+        if (received < 0 && errno == EINTR) continue;
+        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (received <= 0) {
+            close_client(client, epoll_fd);
+            return;
+        }
+        bytes_received += received;
+        client->in_len += received;
+    }
+
+    size_t start = 0;
+    for (size_t i = 0; i < client->in_len; i++) {
+        if (client->in[i] != '\n') continue;
+        client->in[i] = '\0';
+        if (i > start) handle_line(client, client->in + start);
+        start = i + 1;
+    }
+    memmove(client->in, client->in + start, client->in_len - start);
+    client->in_len -= start;
+}
+
+// -------------------------- Schedule --------------------------------
+
+static void send_mixed_request(Client* client, const Options* options) {
+    int total = options->mix[0] + options->mix[1] + options->mix[2];
+    if (total <= 0) return;
+    int pick = rand() % total;
+
+    if (pick < options->mix[0] && client->greeted) {
+        send_request(client, REQ_GETFISHES, 1, "getFishes\n");
+    } else if (pick < options->mix[0] + options->mix[1] || (pick < options->mix[0] && !client->greeted)) {
+        send_request(client, REQ_LS, options->ls_depth, "ls %d\n", options->ls_depth);
+    } else if (client->live_fishes > 0 && rand() % 2 == 0) {
+        send_request(client, REQ_DELFISH, 1, "delFish lg%d_%d\n", client->index, client->first_live);
+        client->first_live++;
+        client->live_fishes--;
+    } else {
+        send_request(client, REQ_ADDFISH, 1, "addFish lg%d_%d at %dx%d, 4x3, RandomWayPoint\n",
+                     client->index, client->next_fish, rand() % 100, rand() % 100);
+        client->next_fish++;
+        client->live_fishes++;
+    }
+}
+
+static void run_schedule(Client* clients, const Options* options) {
+    long long now = now_usec();
+    for (int i = 0; i < options->clients; i++) {
+        Client* client = &clients[i];
+        if (client->closed || !client->answered) continue;
+
+        if (client->greeted && now >= client->next_ping) {
+            send_request(client, REQ_PING, 1, "ping %d\n", client->index);
+            client->next_ping = now + (long long)(options->ping_interval * 1e6);
+        }
+        if (options->rate > 0 && now >= client->next_request) {
+            send_mixed_request(client, options);
+            client->next_request = now + jitter(1e6 / options->rate);
+        }
+    }
+}
+
+// -------------------------- Report --------------------------------
+
+static void print_samples(const char* name, Samples* samples) {
+    if (samples->count == 0) return;
+    qsort(samples->values, samples->count, sizeof(long long), compare_ll);
+    printf("  %-22s %9zu %10.3f %10.3f %10.3f %10.3f %10.3f\n", name, samples->count,
+           percentile(samples, 0.5) / 1000.0, percentile(samples, 0.9) / 1000.0,
+           percentile(samples, 0.99) / 1000.0, percentile(samples, 0.999) / 1000.0,
+           samples->values[samples->count - 1] / 1000.0);
+}
+
+static void report(const Options* options, Client* clients, double elapsed_s) {
+    int open = 0, greeted = 0;
+    for (int i = 0; i < options->clients; i++) {
+        if (!clients[i].closed && clients[i].connected) open++;
+        if (clients[i].greeted) greeted++;
+    }
+
+    printf("%d clients (%d connected at the end, %d with a view) for %.1f s\n", options->clients, open, greeted, elapsed_s);
+    printf("  %llu requests (%.0f/s), %llu replies, %llu updates pushed (%.0f/s), %.1f MB received\n",
+           sent_requests, sent_requests / elapsed_s, replies, updates, updates / elapsed_s, bytes_received / 1e6);
+    printf("  %llu NOK, %llu rate limited, %llu no greeting, %llu failed sends, %llu failed connects, %llu disconnects\n",
+           noks, rate_limited, no_greeting, send_failures, connect_failures, disconnects);
+    printf("  %-22s %9s %10s %10s %10s %10s %10s\n", "latency (ms)", "count", "p50", "p90", "p99", "p99.9", "max");
+    for (int kind = 0; kind < NB_KINDS; kind++) {
+        print_samples(kind_names[kind], &latency[kind]);
+    }
+    print_samples("update inter-arrival", &inter_arrival);
+    print_samples("arrival to receipt", &fanout);
+}
+
+// Aquarium of 1000x1000 tiled with views named V1, V2...: "loadgen -v V" greets into them
+static int write_aquarium(const char* path, int views) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        perror(path);
+        return 1;
+    }
+    int columns = (int)ceil(sqrt(views));
+    int rows = (views + columns - 1) / columns;
+    int w = 1000 / columns, h = 1000 / rows;
+    fprintf(file, "1000x1000\n");
+    for (int i = 0; i < views; i++) {
+        fprintf(file, "V%d %dx%d+%d+%d\n", i + 1, (i % columns) * w, (i / columns) * h, w, h);
+    }
+    fclose(file);
+    printf("%s: %d views of %dx%d. Load it, then run loadgen -v V\n", path, views, w, h);
+    return 0;
+}
+
+static void usage() {
+    fprintf(stderr,
+        "Usage: loadgen [-H host] [-p port] [-c clients] [-d seconds] [-i ping interval]\n"
+        "               [-r requests/s] [-m getFishes,ls,addFish] [-n ls depth] [-v view prefix] [-t]\n"
+        "       loadgen -w <file> <views>\n");
+}
+
+int main(int argc, char** argv) {
+    Options options = {
+        .host = "127.0.0.1", .port = 50000, .clients = 100, .duration = 10,
+        .ping_interval = 3, .rate = 1, .mix = {4, 2, 1}, .ls_depth = 3, .view_prefix = NULL, .trace = false,
+    };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "H:p:c:d:i:r:m:n:v:w:t")) != -1) {
+        switch (opt) {
+            case 'H': options.host = optarg; break;
+            case 'p': options.port = atoi(optarg); break;
+            case 'c': options.clients = atoi(optarg); break;
+            case 'd': options.duration = atoi(optarg); break;
+            case 'i': options.ping_interval = atof(optarg); break;
+            case 'r': options.rate = atof(optarg); break;
+            case 'm':
+                if (sscanf(optarg, "%d,%d,%d", &options.mix[0], &options.mix[1], &options.mix[2]) != 3) {
+                    usage();
+                    return 1;
+                }
+                break;
+            case 'n': options.ls_depth = atoi(optarg); break;
+            case 'v': options.view_prefix = optarg; break;
+            case 't': options.trace = true; break;
+            case 'w':
+                if (optind >= argc) {
+                    usage();
+                    return 1;
+                }
+                return write_aquarium(optarg, atoi(argv[optind]));
+            default:
+                usage();
+                return 1;
+        }
+    }
+    if (options.clients <= 0 || options.duration <= 0 || options.ping_interval <= 0 || options.ls_depth <= 0) {
+        usage();
+        return 1;
+    }
+
+    trace_updates = options.trace;
+
+    // One socket per client
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < (rlim_t)options.clients + 16) {
+        limit.rlim_cur = limit.rlim_max < (rlim_t)options.clients + 16 ? limit.rlim_max : (rlim_t)options.clients + 16;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    srand((unsigned int)now_usec());
+    int epoll_fd = epoll_create1(0);
+    Client* clients = epoll_fd >= 0 ? open_clients(&options, epoll_fd) : NULL;
+    if (clients == NULL) return 1;
+
+    long long start = now_usec();
+    for (int i = 0; i < options.clients; i++) {
+        clients[i].next_ping = start + jitter(options.ping_interval * 1e6);
+        clients[i].next_request = start + (options.rate > 0 ? jitter(1e6 / options.rate) : 0);
+    }
+
+    long long end = start + (long long)options.duration * 1000000LL;
+    struct epoll_event events[MAX_EVENTS];
+    while (now_usec() < end) {
+        int nb_events = epoll_wait(epoll_fd, events, MAX_EVENTS, LOOP_INTERVAL_MS);
+        for (int i = 0; i < nb_events; i++) {
+            Client* client = events[i].data.ptr;
+            if (client->closed) continue;
+            if (!client->connected && (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+                on_connected(client, &options, epoll_fd);
+                if (client->closed) continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) {
+                on_readable(client, epoll_fd);
+            }
+        }
+        run_schedule(clients, &options);
+    }
+
+    report(&options, clients, (now_usec() - start) / 1e6);
+    for (int i = 0; i < options.clients; i++) {
+        if (!clients[i].closed) close(clients[i].fd);
+        free(clients[i].in);
+    }
+    free(clients);
+    close(epoll_fd);
+    return 0;
+}
@@ -0,0 +1,581 @@
+// Replay of a capture (see src/capture.h): re-drives a controller with the traffic recorded
+// from its clients, and reports the latency and the throughput it got.
+// Usage: replay [-H host] [-p port] [-x speed] [-o replies] <capture>
+//        replay -i <capture>             (seed, aquariums and traffic of the capture)
+//        replay -w <dir> <capture>       (writes the captured aquariums into dir)
+//
+// Prepare the controller like the captured one: the same random-seed in controller.cfg, and the
+// aquariums of the capture ("replay -w aquariums", then load them in the order -i gives, the
+// default one first). Fishes are then added in the same order and draw the same waypoints.
+//
+// Each captured connection gets its own connection, opened at its first line. With -x 1 (the
+// default) the lines are sent at their captured times, -x N runs N times faster. With -x 0 a
+// line is sent as soon as the replies to the previous ones are in, whatever their connection:
+// the controller gets the requests as fast as it answers, in the captured order.
+//
+// Replies are matched with the requests in order, like loadgen does. -o writes them, prefixed
+// with their connection, so that two replays can be compared (sort -s -n -k1,1 groups them by
+// connection); the lists pushed by the subscriptions are left out, their timing depends on the
+// ticks. The arrival times in the lists follow the clock of the controller, so a list is only
+// identical to the captured one at -x 1 and when the ticks fall the same way: compare the
+// positions.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define CAPTURE_MAGIC "AQCAP001"  // Same as src/capture.h
+#define CAPTURE_OPEN 1
+#define CAPTURE_LINE 2
+#define CAPTURE_CLOSE 3
+#define CAPTURE_AQUARIUM 4
+
+#define MAX_PENDING 256       // Requests in flight per connection
+#define MAX_EVENTS 256
+#define LOOP_INTERVAL_MS 1    // Granularity of the schedule
+#define STALL_TIMEOUT_US 5000000  // Replies given up after this long without any byte received
+
+// A captured record, times in µs from the start of the capture
+typedef struct Record {
+    int type;
+    unsigned long long at;
+    unsigned int connection;
+    char* data;  // The line, or the aquarium's name
+    size_t len;
+    char* file;  // CAPTURE_AQUARIUM: its file
+    size_t file_len;
+} Record;
+
+typedef struct Capture {
+    unsigned int seed;
+    unsigned long long started;  // µs since the epoch
+    Record* records;
+    size_t count;
+    unsigned int connections;
+} Capture;
+
+typedef enum {
+    VERB_HELLO, VERB_CONTINUOUS, VERB_GETFISHES, VERB_LS, VERB_PING, VERB_ADDFISH, VERB_DELFISH,
+    VERB_STARTFISH, VERB_STATS, VERB_OTHER, NB_VERBS
+} Verb;
+
+static const char* verb_names[NB_VERBS] = {
+    "hello", "getFishesContinuously", "getFishes", "ls", "ping", "addFish", "delFish",
+    "startFish", "stats", "other"
+};
+
+typedef struct Pending {
+    Verb verb;
+    int lines;  // Reply lines still expected, -1: the "stats <n>" header first
+    long long sent_us;
+} Pending;
+
+typedef struct Conn {
+    int fd;
+    bool closed;
+    bool closing;  // Captured closed: hang up once the replies are in
+    char* in;
+    size_t in_len, in_cap;
+    char* out;  // Not sent yet, the socket was full
+    size_t out_len, out_cap;
+    Pending pending[MAX_PENDING];
+    int head, count;
+} Conn;
+
+// Samples kept whole: percentiles are exact
+typedef struct Samples {
+    long long* values;
+    size_t count, cap;
+} Samples;
+
+static Samples latency[NB_VERBS];
+static Samples lag;  // Sent later than scheduled
+static unsigned long long sent_lines, replies, pushed, noks, bytes_received, disconnects, unmatched;
+static long long last_receipt;
+static FILE* replies_file = NULL;
+
+static long long now_usec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void add_sample(Samples* samples, long long value) {
+    if (samples->count == samples->cap) {
+        size_t cap = samples->cap ? samples->cap * 2 : 1024;
+        long long* bigger = realloc(samples->values, cap * sizeof(long long));
+        if (bigger == NULL) return;
+        samples->values = bigger;
+        samples->cap = cap;
+    }
+    samples->values[samples->count++] = value;
+}
+
+static int compare_ll(const void* a, const void* b) {
+    long long x = *(const long long*)a, y = *(const long long*)b;
+    return x < y ? -1 : x > y;
+}
+
+static long long percentile(const Samples* samples, double q) {
+    if (samples->count == 0) return 0;
+    size_t rank = (size_t)(q * (samples->count - 1) + 0.5);
+    return samples->values[rank];
+}
+
+// -------------------------- Capture --------------------------------
+
+static bool read_varint(FILE* file, unsigned long long* value) {
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int byte = fgetc(file);
+        if (byte == EOF) return false;
+        *value |= (unsigned long long)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) return true;
+    }
+    return false;
+}
+
+static bool read_le(FILE* file, int bytes, unsigned long long* value) {
+    *value = 0;
+    for (int i = 0; i < bytes; i++) {
+        int byte = fgetc(file);
+        if (byte == EOF) return false;
+        *value |= (unsigned long long)byte << (8 * i);
+    }
+    return true;
+}
+
+// Bytes of a length-prefixed field, NUL-terminated
+static char* read_bytes(FILE* file, size_t* len) {
+    unsigned long long n;
+    if (!read_varint(file, &n) || n > (1ULL << 30)) return NULL;
+    char* data = malloc(n + 1);
+    if (data == NULL) return NULL;
+    if (fread(data, 1, n, file) != n) {
+        free(data);
+        return NULL;
+    }
+    data[n] = '\0';
+    *len = n;
+    return data;
+}
+
+// Load a whole capture. A capture cut short (the controller crashed) keeps its complete records
+static bool load_capture(const char* path, Capture* capture) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        perror(path);
+        return false;
+    }
+    char magic[8];
+    unsigned long long seed, started;
+    if (fread(magic, 1, 8, file) != 8 || memcmp(magic, CAPTURE_MAGIC, 8) != 0 ||
+        !read_le(file, 4, &seed) || !read_le(file, 8, &started)) {
+        fprintf(stderr, "%s is not a capture\n", path);
+        fclose(file);
+        return false;
+    }
+    memset(capture, 0, sizeof(Capture));
+    capture->seed = (unsigned int)seed;
+    capture->started = started;
+
+    size_t cap = 0;
+    unsigned long long at = 0;
+    int type;
+    while ((type = fgetc(file)) != EOF) {
+        Record record = { .type = type };
+        unsigned long long delta, connection = 0;
+        if (!read_varint(file, &delta)) break;
+        at += delta;
+        record.at = at;
+
+        bool complete;
+        if (type == CAPTURE_OPEN || type == CAPTURE_CLOSE) {
+            complete = read_varint(file, &connection);
+        } else if (type == CAPTURE_LINE) {
+            complete = read_varint(file, &connection) && (record.data = read_bytes(file, &record.len)) != NULL;
+        } else if (type == CAPTURE_AQUARIUM) {
+            complete = (record.data = read_bytes(file, &record.len)) != NULL &&
+                       (record.file = read_bytes(file, &record.file_len)) != NULL;
+        } else {
+            fprintf(stderr, "Unknown record %d: the rest of the capture is ignored\n", type);
+            break;
+        }
+        if (!complete) {
+            free(record.data);
+            break;
+        }
+        record.connection = (unsigned int)connection;
+        if (record.connection > capture->connections) capture->connections = record.connection;
+
+        if (capture->count == cap) {
+            cap = cap ? cap * 2 : 4096;
+            Record* bigger = realloc(capture->records, cap * sizeof(Record));
+            if (bigger == NULL) break;
+            capture->records = bigger;
+        }
+        capture->records[capture->count++] = record;
+    }
+    fclose(file);
+    return true;
+}
+
+static void print_capture(const Capture* capture) {
+    unsigned long long lines = 0;
+    printf("random-seed = %u\n", capture->seed);
+    for (size_t i = 0; i < capture->count; i++) {
+        const Record* record = &capture->records[i];
+        if (record->type == CAPTURE_LINE) lines++;
+        if (record->type == CAPTURE_AQUARIUM) {
+            printf("at %.3f s: load %s\n%s", record->at / 1e6, record->data, record->file);
+        }
+    }
+    double duration = capture->count > 0 ? capture->records[capture->count - 1].at / 1e6 : 0;
+    printf("%llu lines from %u connections over %.1f s\n", lines, capture->connections, duration);
+}
+
+static int write_aquariums(const Capture* capture, const char* dir) {
+    for (size_t i = 0; i < capture->count; i++) {
+        const Record* record = &capture->records[i];
+        if (record->type != CAPTURE_AQUARIUM) continue;
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", dir, record->data);
+        FILE* file = fopen(path, "w");
+        if (file == NULL || fwrite(record->file, 1, record->file_len, file) != record->file_len) {
+            perror(path);
+            if (file != NULL) fclose(file);
+            return 1;
+        }
+        fclose(file);
+        printf("%s written\n", path);  // The last state of an aquarium loaded several times wins
+    }
+    printf("Set random-seed = %u in controller.cfg and load the aquariums in this order\n", capture->seed);
+    return 0;
+}
+
+// -------------------------- Connections --------------------------------
+
+static struct addrinfo* server = NULL;
+
+static bool open_conn(Conn* conn, int epoll_fd) {
+    conn->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (conn->fd < 0 || connect(conn->fd, server->ai_addr, server->ai_addrlen) < 0) {
+        if (conn->fd >= 0) close(conn->fd);
+        conn->closed = true;
+        return false;
+    }
+    int opt = 1;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = conn };
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->fd, &ev);
+    return true;
+}
+
+static void close_conn(Conn* conn, int epoll_fd) {
+    if (conn->closed || conn->fd <= 0) return;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    conn->closed = true;
+    conn->count = 0;
+}
+
+static void flush_out(Conn* conn, int epoll_fd) {
+    size_t done = 0;
+    while (done < conn->out_len) {
+        ssize_t sent = send(conn->fd, conn->out + done, conn->out_len - done, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (sent <= 0) {
+            close_conn(conn, epoll_fd);
+            return;
+        }
+        done += sent;
+    }
+    memmove(conn->out, conn->out + done, conn->out_len - done);
+    conn->out_len -= done;
+
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP | (conn->out_len > 0 ? EPOLLOUT : 0), .data.ptr = conn };
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+static Verb line_verb(const char* line, int* lines) {
+    static const struct { const char* word; Verb verb; } words[] = {
+        {"hello", VERB_HELLO}, {"getFishesContinuously", VERB_CONTINUOUS}, {"getFishes", VERB_GETFISHES},
+        {"ls", VERB_LS}, {"ping", VERB_PING}, {"addFish", VERB_ADDFISH}, {"delFish", VERB_DELFISH},
+        {"startFish", VERB_STARTFISH}, {"stats", VERB_STATS},
+    };
+    *lines = 1;
+    size_t word_len = strcspn(line, " ");
+    if (word_len == 3 && strncmp(line, "ack", 3) == 0) *lines = 0;  // Only a NOK answers an ack
+    for (size_t i = 0; i < sizeof(words) / sizeof(words[0]); i++) {
+        if (strlen(words[i].word) != word_len || strncmp(line, words[i].word, word_len) != 0) continue;
+        if (words[i].verb == VERB_LS) {
+            int n = 3;
+            if (sscanf(line, "ls %d", &n) == 1 && n > 0) *lines = n;
+        } else if (words[i].verb == VERB_STATS) {
+            *lines = -1;
+        }
+        return words[i].verb;
+    }
+    return VERB_OTHER;
+}
+
+static void send_line(Conn* conn, const char* line, size_t len, int epoll_fd) {
+    if (conn->closed || conn->fd <= 0) return;
+    int lines;
+    Verb verb = line_verb(line, &lines);
+    if (lines != 0) {
+        if (conn->count == MAX_PENDING) {
+            unmatched += conn->count;  // Replies can't be matched any more: measure the next ones only
+            conn->count = 0;
+        }
+        Pending* pending = &conn->pending[(conn->head + conn->count) % MAX_PENDING];
+        *pending = (Pending){verb, lines, now_usec()};
+        conn->count++;
+    }
+
+    if (conn->out_cap < conn->out_len + len + 1) {
+        size_t cap = (conn->out_len + len + 1) * 2;
+        char* bigger = realloc(conn->out, cap);
+        if (bigger == NULL) return;
+        conn->out = bigger;
+        conn->out_cap = cap;
+    }
+    memcpy(conn->out + conn->out_len, line, len);
+    conn->out[conn->out_len + len] = '\n';
+    conn->out_len += len + 1;
+    sent_lines++;
+    flush_out(conn, epoll_fd);
+}
+
+// -------------------------- Replies --------------------------------
+
+static void handle_line(Conn* conn, unsigned int id, const char* line, int epoll_fd) {
+    bool list = strncmp(line, "list", 4) == 0;
+    if (strncmp(line, "update ", 7) == 0) return;  // Stamp of a traced subscription
+
+    if (conn->count > 0) {
+        Pending* pending = &conn->pending[conn->head];
+        bool expects_list = pending->verb == VERB_GETFISHES || pending->verb == VERB_LS;
+        if (!list || expects_list) {
+            bool nok = strncmp(line, "NOK", 3) == 0;
+            if (nok) noks++;
+            if (replies_file != NULL) fprintf(replies_file, "%u %s\n", id, line);
+
+            int n;
+            if (pending->lines == -1 && sscanf(line, "stats %d", &n) == 1) {
+                pending->lines = n + 1;
+            }
+            // A NOK ends the reply whatever the number of lines expected
+            if (!nok && --pending->lines > 0) return;
+            add_sample(&latency[pending->verb], now_usec() - pending->sent_us);
+            replies++;
+            conn->head = (conn->head + 1) % MAX_PENDING;
+            conn->count--;
+            if (conn->closing && conn->count == 0 && conn->out_len == 0) close_conn(conn, epoll_fd);
+            return;
+        }
+    }
+    if (list) pushed++;
+}
+
+static void on_readable(Conn* conn, unsigned int id, int epoll_fd) {
+    while (1) {
+        if (conn->in_cap - conn->in_len < 4096) {
+            size_t cap = conn->in_cap ? conn->in_cap * 2 : 16384;
+            char* bigger = realloc(conn->in, cap);
+            if (bigger == NULL) return;
+            conn->in = bigger;
+            conn->in_cap = cap;
+        }
+        ssize_t received = recv(conn->fd, conn->in + conn->in_len, conn->in_cap - conn->in_len, MSG_DONTWAIT);
+        if (received < 0 && errno == EINTR) continue;
+        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (received <= 0) {
+            close_conn(conn, epoll_fd);
+            disconnects++;
+            break;
+        }
+        bytes_received += received;
+        conn->in_len += received;
+        last_receipt = now_usec();
+    }
+
+    size_t start = 0;
+    for (size_t i = 0; i < conn->in_len; i++) {
+        if (conn->in[i] != '\n') continue;
+        conn->in[i] = '\0';
+        if (i > start && !conn->closed) handle_line(conn, id, conn->in + start, epoll_fd);
+        start = i + 1;
+    }
+    memmove(conn->in, conn->in + start, conn->in_len - start);
+    conn->in_len -= start;
+}
+
+// Replies still expected. The controller stays silent for too long: they are given up
+static bool awaiting_replies(Conn* conns, unsigned int nb_conns, int epoll_fd) {
+    bool stalled = now_usec() - last_receipt > STALL_TIMEOUT_US;
+    bool awaiting = false;
+    for (unsigned int i = 1; i <= nb_conns; i++) {
+        Conn* conn = &conns[i];
+        if (conn->closed || conn->fd <= 0 || (conn->count == 0 && conn->out_len == 0)) continue;
+        if (stalled) {
+            unmatched += conn->count;
+            conn->count = 0;
+            if (conn->closing) close_conn(conn, epoll_fd);
+        } else {
+            awaiting = true;
+        }
+    }
+    return awaiting;
+}
+
+// -------------------------- Report --------------------------------
+
+static void print_samples(const char* name, Samples* samples) {
+    if (samples->count == 0) return;
+    qsort(samples->values, samples->count, sizeof(long long), compare_ll);
+    printf("  %-22s %9zu %10.3f %10.3f %10.3f %10.3f %10.3f\n", name, samples->count,
+           percentile(samples, 0.5) / 1000.0, percentile(samples, 0.9) / 1000.0,
+           percentile(samples, 0.99) / 1000.0, percentile(samples, 0.999) / 1000.0,
+           samples->values[samples->count - 1] / 1000.0);
+}
+
+static void report(const Capture* capture, double speed, double elapsed_s) {
+    double captured_s = capture->count > 0 ? capture->records[capture->count - 1].at / 1e6 : 0;
+    if (speed > 0) {
+        printf("Replayed %.1f s of capture at %gx in %.1f s, %u connections\n", captured_s, speed, elapsed_s, capture->connections);
+    } else {
+        printf("Replayed %.1f s of capture as fast as possible in %.1f s, %u connections\n", captured_s, elapsed_s, capture->connections);
+    }
+    printf("  %llu lines (%.0f/s), %llu replies (%.0f/s), %llu lists pushed, %.1f MB received\n",
+           sent_lines, sent_lines / elapsed_s, replies, replies / elapsed_s, pushed, bytes_received / 1e6);
+    printf("  %llu NOK, %llu disconnects, %llu requests left unanswered\n", noks, disconnects, unmatched);
+    printf("  %-22s %9s %10s %10s %10s %10s %10s\n", "latency (ms)", "count", "p50", "p90", "p99", "p99.9", "max");
+    for (int verb = 0; verb < NB_VERBS; verb++) {
+        print_samples(verb_names[verb], &latency[verb]);
+    }
+    print_samples("schedule lag", &lag);
+}
+
+static void usage() {
+    fprintf(stderr,
+        "Usage: replay [-H host] [-p port] [-x speed] [-o replies] <capture>\n"
+        "       replay -i <capture>\n"
+        "       replay -w <dir> <capture>\n");
+}
+
+int main(int argc, char** argv) {
+    const char* host = "127.0.0.1";
+    int port = 50000;
+    double speed = 1;
+    const char* replies_path = NULL;
+    const char* aquarium_dir = NULL;
+    bool info = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "H:p:x:o:w:i")) != -1) {
+        switch (opt) {
+            case 'H': host = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'x': speed = atof(optarg); break;
+            case 'o': replies_path = optarg; break;
+            case 'w': aquarium_dir = optarg; break;
+            case 'i': info = true; break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+    if (optind != argc - 1 || speed < 0) {
+        usage();
+        return 1;
+    }
+
+    Capture capture;
+    if (!load_capture(argv[optind], &capture)) return 1;
+    if (info) {
+        print_capture(&capture);
+        return 0;
+    }
+    if (aquarium_dir != NULL) return write_aquariums(&capture, aquarium_dir);
+
+    struct addrinfo hints = {0};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    char port_text[16];
+    snprintf(port_text, sizeof(port_text), "%d", port);
+    if (getaddrinfo(host, port_text, &hints, &server) != 0) {
+        fprintf(stderr, "Unknown host %s\n", host);
+        return 1;
+    }
+    if (replies_path != NULL && (replies_file = fopen(replies_path, "w")) == NULL) {
+        perror(replies_path);
+        return 1;
+    }
+
+    // Captured connections are numbered from 1
+    Conn* conns = calloc(capture.connections + 1, sizeof(Conn));
+    int epoll_fd = epoll_create1(0);
+    if (conns == NULL || epoll_fd < 0) return 1;
+
+    long long start = now_usec();
+    last_receipt = start;
+    size_t next = 0;
+    struct epoll_event events[MAX_EVENTS];
+    while (next < capture.count || awaiting_replies(conns, capture.connections, epoll_fd)) {
+        // Send what is due
+        long long now = now_usec();
+        while (next < capture.count) {
+            const Record* record = &capture.records[next];
+            long long due = speed > 0 ? start + (long long)(record->at / speed) : now;
+            if (due > now) break;
+            if (speed == 0 && record->type == CAPTURE_LINE && awaiting_replies(conns, capture.connections, epoll_fd)) break;
+            if (speed == 0) last_receipt = now;  // The silence counts from the last request
+
+            Conn* conn = record->connection <= capture.connections ? &conns[record->connection] : NULL;
+            if (record->type == CAPTURE_OPEN && conn != NULL) {
+                if (!open_conn(conn, epoll_fd)) fprintf(stderr, "Could not connect connection %u\n", record->connection);
+            } else if (record->type == CAPTURE_LINE && conn != NULL) {
+                if (speed > 0) add_sample(&lag, now - due);
+                send_line(conn, record->data, record->len, epoll_fd);
+            } else if (record->type == CAPTURE_CLOSE && conn != NULL) {
+                if (conn->count == 0 && conn->out_len == 0) close_conn(conn, epoll_fd);
+                else conn->closing = true;
+            }
+            next++;
+        }
+
+        int nb_events = epoll_wait(epoll_fd, events, MAX_EVENTS, LOOP_INTERVAL_MS);
+        for (int i = 0; i < nb_events; i++) {
+            Conn* conn = events[i].data.ptr;
+            if (conn->closed) continue;
+            unsigned int id = (unsigned int)(conn - conns);
+            if (events[i].events & EPOLLOUT) flush_out(conn, epoll_fd);
+            if (!conn->closed && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))) {
+                on_readable(conn, id, epoll_fd);
+            }
+        }
+    }
+
+    report(&capture, speed, (now_usec() - start) / 1e6);
+    for (unsigned int i = 1; i <= capture.connections; i++) {
+        if (!conns[i].closed && conns[i].fd > 0) close(conns[i].fd);
+        free(conns[i].in);
+        free(conns[i].out);
+    }
+    if (replies_file != NULL) fclose(replies_file);
+    freeaddrinfo(server);
+    close(epoll_fd);
+    return 0;
+}
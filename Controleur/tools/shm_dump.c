@@ -0,0 +1,70 @@
+// Prints the shared-memory snapshot of a running controller.
+// Usage: shm_dump [name] [-f]   (default name /aquarium_world, -f: follow, once per second)
+// Example of a C reader: no socket, the fishes are read in place.
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "shm_world.h"
+
+static long long now_usec() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (long long)tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+// Print one consistent table. Returns false if the controller kept overwriting it
+static bool dump(const ShmWorldReader* reader) {
+    for (int attempt = 0; attempt < 100; attempt++) {
+        ShmWorldView view;
+        if (!shm_world_begin_read(reader, &view)) {
+            printf("Nothing published yet\n");
+            return true;
+        }
+
+        // Sum before printing: printing is slow and would keep the table busy
+        long long sum_x = 0, sum_y = 0;
+        for (int i = 0; i < view.count; i++) {
+            sum_x += view.fishes[i].x;
+            sum_y += view.fishes[i].y;
+        }
+        ShmFish first = view.count > 0 ? view.fishes[0] : (ShmFish){0};
+        if (!shm_world_end_read(reader, &view)) continue;
+
+        printf("seq %llu, aquarium %dx%d, %d fishes%s, published %.1f ms ago\n",
+            (unsigned long long)view.seq, view.aquarium_w, view.aquarium_h, view.count,
+            view.truncated ? " (truncated)" : "", (now_usec() - view.published_us) / 1000.0);
+        if (view.count > 0) {
+            first.name[SHM_NAME_LEN - 1] = '\0';
+            printf("  mean target %lldx%lld, first: \"%s\" to %dx%d in %.1f s\n",
+                sum_x / view.count, sum_y / view.count, first.name, first.x, first.y,
+                (first.arrival_us - now_usec()) / 1000000.0);
+        }
+        return true;
+    }
+    return false;
+}
+
+int main(int argc, char** argv) {
+    const char* name = "/aquarium_world";
+    bool follow = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-f") == 0) follow = true;
+        else name = argv[i];
+    }
+
+    ShmWorldReader* reader = shm_world_attach(name);
+    if (reader == NULL) {
+        fprintf(stderr, "No snapshot %s (is the controller running with shm-name set?)\n", name);
+        return 1;
+    }
+
+    do {
+        if (!dump(reader)) fprintf(stderr, "Could not get a consistent table\n");
+        if (follow) sleep(1);
+    } while (follow);
+
+    shm_world_detach(reader);
+    return 0;
+}